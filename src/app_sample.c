@@ -123,7 +123,7 @@ void send_request(int sockfd, short snoop_command, snoop_reply_t* reply) {
   if (n < 0) {
     logging(LOG_CODE_FATAL, "Error writing to socket.\n");
   }
-  n = read(sockfd, (char *)&reply, sizeof(snoop_reply_t));
+  n = read(sockfd, (char *)reply, sizeof(snoop_reply_t));
   if (n < 0) {
     logging(LOG_CODE_FATAL, "Error reading from socket.\n");
   }
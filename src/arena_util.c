@@ -0,0 +1,113 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "arena_util.h"
+
+#include "log_util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The data of a chunk starts right after its header
+#define ARENA_HEADER_SIZE                                                   \
+  ((sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) &                          \
+   ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static size_t align_size(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static arena_chunk_t* new_chunk(size_t size) {
+  void* memory;
+  if (posix_memalign(&memory, ARENA_ALIGNMENT, ARENA_HEADER_SIZE + size) !=
+      0) {
+    logging(LOG_CODE_FATAL, "Cannot allocate an arena chunk of %zu bytes.\n",
+            size);
+    return NULL;
+  }
+  arena_chunk_t* chunk = memory;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+void init_arena(arena_t* arena) {
+  arena->chunk = new_chunk(ARENA_CHUNK_SIZE);
+  arena->last = NULL;
+  arena->last_size = 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+  size = align_size(size);
+
+  // Start a new chunk, at least twice as large as the current one
+  if (arena->chunk->used + size > arena->chunk->size) {
+    size_t chunk_size = 2 * arena->chunk->size;
+    if (chunk_size < size) {
+      chunk_size = size;
+    }
+    arena_chunk_t* chunk = new_chunk(chunk_size);
+    chunk->next = arena->chunk;
+    arena->chunk = chunk;
+  }
+
+  char* data = (char*)arena->chunk + ARENA_HEADER_SIZE + arena->chunk->used;
+  arena->chunk->used += size;
+  arena->last = data;
+  arena->last_size = size;
+  return data;
+}
+
+void* arena_grow(arena_t* arena, void* data, size_t size, size_t new_size) {
+  new_size = align_size(new_size);
+
+  // The last allocation can simply be extended if the chunk has room left
+  if (data != NULL && data == arena->last &&
+      arena->chunk->used - arena->last_size + new_size <= arena->chunk->size) {
+    arena->chunk->used += new_size - arena->last_size;
+    arena->last_size = new_size;
+    return data;
+  }
+
+  void* new_data = arena_alloc(arena, new_size);
+  if (data != NULL) {
+    memcpy(new_data, data, size);
+  }
+  return new_data;
+}
+
+void reset_arena(arena_t* arena) {
+  // Merge all the chunks into one that holds everything at once
+  if (arena->chunk->next != NULL) {
+    size_t total_size = 0;
+    while (arena->chunk != NULL) {
+      arena_chunk_t* next = arena->chunk->next;
+      total_size += arena->chunk->size;
+      free(arena->chunk);
+      arena->chunk = next;
+    }
+    arena->chunk = new_chunk(total_size);
+  }
+
+  arena->chunk->used = 0;
+  arena->last = NULL;
+  arena->last_size = 0;
+}
+
+void clean_arena(arena_t* arena) {
+  while (arena->chunk != NULL) {
+    arena_chunk_t* next = arena->chunk->next;
+    free(arena->chunk);
+    arena->chunk = next;
+  }
+  arena->last = NULL;
+  arena->last_size = 0;
+}
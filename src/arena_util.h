@@ -0,0 +1,54 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __ARENA_UTIL__
+#define __ARENA_UTIL__
+
+#include <stddef.h>
+
+// Alignment of every allocation from an arena
+#define ARENA_ALIGNMENT 16
+
+// Size of the first chunk of an arena
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+typedef struct arena_chunk {
+  struct arena_chunk* next;
+  size_t size;
+  size_t used;
+} arena_chunk_t;
+
+/*
+ * A bump allocator for data that all goes away at the same time. Nothing is
+ * freed individually; reset_arena() releases everything at once. When an
+ * interval has outgrown the arena, the chunks are merged into a single one on
+ * reset, so that the following intervals do not need to allocate at all.
+ */
+typedef struct arena {
+  // The chunk being allocated from, followed by the older ones
+  arena_chunk_t* chunk;
+  // Start and size of the last allocation, which can be grown in place
+  char* last;
+  size_t last_size;
+} arena_t;
+
+void init_arena(arena_t* arena);
+
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Grows an allocation to the new size and keeps its contents. The data may be
+// moved, and the old copy is only reclaimed on reset.
+void* arena_grow(arena_t* arena, void* data, size_t size, size_t new_size);
+
+void reset_arena(arena_t* arena);
+
+void clean_arena(arena_t* arena);
+
+#endif
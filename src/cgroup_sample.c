@@ -0,0 +1,360 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "cgroup_sample.h"
+
+#include "log_util.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MICROSECONDS 1000000.0
+
+// A cgroup that some of the processes are in, whose files are kept open for
+// as long as it has processes
+typedef struct cgroup {
+  unsigned long long cgroup_id;
+  char* path;
+  cgroup_files_t files;
+  // The counters of the last interval, if the cgroup was there
+  cgroup_stat_t stat;
+  bool has_stat;
+  unsigned int num_of_processes;
+} cgroup_t;
+
+// A process in a cgroup, sorted to group the processes by cgroup
+typedef struct cgroup_process {
+  unsigned long long cgroup_id;
+  int pid;
+} cgroup_process_t;
+
+// Where the cgroup2 hierarchy is mounted
+char cgroup_root[PATH_MAX];
+int max_cgroups;
+long cgroup_num_of_cores;
+
+// The cgroups of the current and the last interval, sorted by ID
+cgroup_t* cgroups;
+size_t num_of_cgroups;
+size_t cgroups_capacity;
+cgroup_t* prev_cgroups;
+size_t num_of_prev_cgroups;
+size_t prev_cgroups_capacity;
+
+// Scratch space that grows with the number of processes
+cgroup_process_t* cgroup_processes;
+size_t cgroup_processes_capacity;
+
+// The recorded cgroups, which grow along with the cgroups
+cgroup_external_t* cgroups_e;
+int* cgroup_dir_fds;
+size_t cgroups_e_capacity;
+
+// Timestamp of the last read (CLOCK_MONOTONIC)
+unsigned long long cgroup_read_ns;
+
+static unsigned long long get_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Grows an array to hold at least the given number of elements
+static void* reserve_array(void* array, size_t* capacity, size_t size,
+                           size_t element_size) {
+  if (size <= *capacity) {
+    return array;
+  }
+  *capacity = 2 * size;
+  array = realloc(array, *capacity * element_size);
+  if (array == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  return array;
+}
+
+void init_cgroup_sample(cgroup_filter_t* cgroup_filter) {
+  max_cgroups = cgroup_filter->max_cgroups;
+  cgroups = NULL;
+  num_of_cgroups = 0;
+  cgroups_capacity = 0;
+  prev_cgroups = NULL;
+  num_of_prev_cgroups = 0;
+  prev_cgroups_capacity = 0;
+  cgroup_processes = NULL;
+  cgroup_processes_capacity = 0;
+  cgroups_e = NULL;
+  cgroup_dir_fds = NULL;
+  cgroups_e_capacity = 0;
+  cgroup_read_ns = get_monotonic_ns();
+  cgroup_num_of_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (max_cgroups > 0 &&
+      find_cgroup_root(cgroup_root, sizeof(cgroup_root)) == -1) {
+    logging(LOG_CODE_WARNING,
+            "cgroup2 is not mounted, no cgroups will be recorded.\n");
+    max_cgroups = 0;
+    cgroup_filter->max_cgroups = 0;
+  }
+}
+
+const char* get_cgroup_root(void) {
+  return max_cgroups > 0 ? cgroup_root : NULL;
+}
+
+static int compare_cgroup_processes(const void* a, const void* b) {
+  const cgroup_process_t* process_a = (const cgroup_process_t*)a;
+  const cgroup_process_t* process_b = (const cgroup_process_t*)b;
+  if (process_a->cgroup_id != process_b->cgroup_id) {
+    return process_a->cgroup_id < process_b->cgroup_id ? -1 : 1;
+  }
+  return process_a->pid - process_b->pid;
+}
+
+static int compare_cgroups_e(const void* a, const void* b) {
+  float utilization_a = ((const cgroup_external_t*)a)->cpu_utilization;
+  float utilization_b = ((const cgroup_external_t*)b)->cpu_utilization;
+  return utilization_a < utilization_b ? 1 :
+         utilization_a > utilization_b ? -1 : 0;
+}
+
+// Sets up a cgroup that was not there in the last interval, by the path of
+// one of its processes. Returns -1 if neither is there anymore.
+static int open_cgroup(cgroup_t* cgroup, int pid) {
+  char path[PATH_MAX];
+  if (read_proc_cgroup(pid, path, sizeof(path)) == -1 ||
+      get_cgroup_id(cgroup_root, path) != cgroup->cgroup_id ||
+      open_cgroup_files(cgroup_root, path, &cgroup->files) == -1) {
+    return -1;
+  }
+  cgroup->path = strdup(path);
+  if (cgroup->path == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  cgroup->has_stat = false;
+  return 0;
+}
+
+static void close_cgroup(cgroup_t* cgroup) {
+  close_cgroup_files(&cgroup->files);
+  free(cgroup->path);
+  cgroup->path = NULL;
+}
+
+// Groups the processes of the list by cgroup, and carries the cgroups that
+// were there in the last interval over
+static void update_cgroups(process_list_t* process_list) {
+  size_t num_of_processes = 0;
+  size_t i;
+
+  cgroup_processes =
+      reserve_array(cgroup_processes, &cgroup_processes_capacity,
+                    process_list->size, sizeof(cgroup_process_t));
+  for (i = 0; i < process_list->size; i++) {
+    if (process_list->processes_e[i].cgroup_id != 0) {
+      cgroup_processes[num_of_processes].cgroup_id =
+          process_list->processes_e[i].cgroup_id;
+      cgroup_processes[num_of_processes].pid =
+          process_list->processes_e[i].process_id;
+      num_of_processes++;
+    }
+  }
+  qsort(cgroup_processes, num_of_processes, sizeof(cgroup_process_t),
+        compare_cgroup_processes);
+
+  // The last interval becomes the previous one
+  cgroup_t* temp_cgroups = prev_cgroups;
+  size_t temp_capacity = prev_cgroups_capacity;
+  prev_cgroups = cgroups;
+  num_of_prev_cgroups = num_of_cgroups;
+  prev_cgroups_capacity = cgroups_capacity;
+  cgroups = temp_cgroups;
+  cgroups_capacity = temp_capacity;
+  num_of_cgroups = 0;
+
+  // Both are sorted by ID, so they are merged in a single pass
+  size_t prev_index = 0;
+  size_t first = 0;
+  while (first < num_of_processes) {
+    size_t last = first + 1;
+    while (last < num_of_processes &&
+           cgroup_processes[last].cgroup_id ==
+               cgroup_processes[first].cgroup_id) {
+      last++;
+    }
+
+    unsigned long long cgroup_id = cgroup_processes[first].cgroup_id;
+    while (prev_index < num_of_prev_cgroups &&
+           prev_cgroups[prev_index].cgroup_id < cgroup_id) {
+      close_cgroup(&prev_cgroups[prev_index++]);
+    }
+
+    cgroups = reserve_array(cgroups, &cgroups_capacity, num_of_cgroups + 1,
+                            sizeof(cgroup_t));
+    cgroup_t* cgroup = &cgroups[num_of_cgroups];
+    cgroup->cgroup_id = cgroup_id;
+    if (prev_index < num_of_prev_cgroups &&
+        prev_cgroups[prev_index].cgroup_id == cgroup_id) {
+      *cgroup = prev_cgroups[prev_index++];
+    } else {
+      // Any process of the cgroup tells its path
+      for (i = first; i < last; i++) {
+        if (open_cgroup(cgroup, cgroup_processes[i].pid) == 0) {
+          break;
+        }
+      }
+      if (i == last) {
+        first = last;
+        continue;
+      }
+    }
+    cgroup->num_of_processes = last - first;
+    num_of_cgroups++;
+    first = last;
+  }
+
+  // Close the cgroups that have no processes left
+  while (prev_index < num_of_prev_cgroups) {
+    close_cgroup(&prev_cgroups[prev_index++]);
+  }
+  num_of_prev_cgroups = 0;
+}
+
+void get_cgroup_sample(process_list_t* process_list,
+                       cgroup_list_t* cgroup_list) {
+  size_t i;
+
+  cgroup_list->cgroups_e = NULL;
+  cgroup_list->dir_fds = NULL;
+  cgroup_list->size = 0;
+  if (max_cgroups == 0) {
+    return;
+  }
+
+  update_cgroups(process_list);
+
+  unsigned long long read_ns = get_monotonic_ns();
+  double seconds = (read_ns - cgroup_read_ns) / 1000000000.0;
+  double cpu_usec = seconds * MICROSECONDS * cgroup_num_of_cores;
+  double window_usec = seconds * MICROSECONDS;
+  cgroup_read_ns = read_ns;
+
+  if (num_of_cgroups > cgroups_e_capacity) {
+    cgroups_e_capacity = 2 * num_of_cgroups;
+    cgroups_e = realloc(cgroups_e,
+                        cgroups_e_capacity * sizeof(cgroup_external_t));
+    cgroup_dir_fds = realloc(cgroup_dir_fds, cgroups_e_capacity * sizeof(int));
+    if (cgroups_e == NULL || cgroup_dir_fds == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+  }
+  size_t num_of_cgroups_e = 0;
+  for (i = 0; i < num_of_cgroups; i++) {
+    cgroup_t* cgroup = &cgroups[i];
+    cgroup_stat_t stat;
+    read_cgroup_stat(&cgroup->files, &stat);
+
+    // The root cgroup is left out, since its files describe the whole
+    // system rather than the processes in it
+    if (strcmp(cgroup->path, "/") == 0) {
+      continue;
+    }
+
+    cgroup_external_t* cgroup_e = &cgroups_e[num_of_cgroups_e++];
+    memset(cgroup_e, 0, sizeof(cgroup_external_t));
+    cgroup_e->cgroup_id = cgroup->cgroup_id;
+    strncpy(cgroup_e->path, cgroup->path, CGROUP_PATH_LENGTH - 1);
+    cgroup_e->num_of_processes = cgroup->num_of_processes;
+    cgroup_e->memory_current = stat.memory_current;
+    cgroup_e->memory_anon = stat.anon;
+    cgroup_e->memory_file = stat.file;
+    // The rates need the counters of the last interval
+    if (cgroup->has_stat && seconds > 0.0) {
+      cgroup_stat_t* prev = &cgroup->stat;
+      cgroup_e->cpu_utilization =
+          (stat.usage_usec - prev->usage_usec) / cpu_usec;
+      cgroup_e->cpu_user_utilization =
+          (stat.user_usec - prev->user_usec) / cpu_usec;
+      cgroup_e->cpu_system_utilization =
+          (stat.system_usec - prev->system_usec) / cpu_usec;
+      cgroup_e->cpu_throttled_rate =
+          (stat.nr_throttled - prev->nr_throttled) / seconds;
+      cgroup_e->cpu_throttled_utilization =
+          (stat.throttled_usec - prev->throttled_usec) / window_usec;
+      cgroup_e->cpu_pressure_some =
+          (stat.cpu_some_usec - prev->cpu_some_usec) / window_usec;
+      cgroup_e->cpu_pressure_full =
+          (stat.cpu_full_usec - prev->cpu_full_usec) / window_usec;
+      cgroup_e->page_fault_rate = (stat.pgfault - prev->pgfault) / seconds;
+      cgroup_e->major_page_fault_rate =
+          (stat.pgmajfault - prev->pgmajfault) / seconds;
+      cgroup_e->io_read_rate = (stat.rbytes - prev->rbytes) / seconds;
+      cgroup_e->io_write_rate = (stat.wbytes - prev->wbytes) / seconds;
+      cgroup_e->io_read_ops_rate = (stat.rios - prev->rios) / seconds;
+      cgroup_e->io_write_ops_rate = (stat.wios - prev->wios) / seconds;
+    }
+    cgroup->stat = stat;
+    cgroup->has_stat = true;
+  }
+
+  // Keep the busiest cgroups
+  qsort(cgroups_e, num_of_cgroups_e, sizeof(cgroup_external_t),
+        compare_cgroups_e);
+  if (num_of_cgroups_e > (size_t)max_cgroups) {
+    num_of_cgroups_e = max_cgroups;
+  }
+
+  // Along with their directories, which are looked up by ID since the order
+  // has changed
+  for (i = 0; i < num_of_cgroups_e; i++) {
+    size_t low = 0;
+    size_t high = num_of_cgroups;
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (cgroups[middle].cgroup_id < cgroups_e[i].cgroup_id) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    cgroup_dir_fds[i] = cgroups[low].files.dir_fd;
+  }
+
+  cgroup_list->cgroups_e = cgroups_e;
+  cgroup_list->dir_fds = cgroup_dir_fds;
+  cgroup_list->size = num_of_cgroups_e;
+}
+
+void clean_cgroup_sample(void) {
+  size_t i;
+  for (i = 0; i < num_of_cgroups; i++) {
+    close_cgroup(&cgroups[i]);
+  }
+  num_of_cgroups = 0;
+  free(cgroups);
+  cgroups = NULL;
+  cgroups_capacity = 0;
+  free(prev_cgroups);
+  prev_cgroups = NULL;
+  prev_cgroups_capacity = 0;
+  free(cgroup_processes);
+  cgroup_processes = NULL;
+  cgroup_processes_capacity = 0;
+  free(cgroups_e);
+  cgroups_e = NULL;
+  free(cgroup_dir_fds);
+  cgroup_dir_fds = NULL;
+  cgroups_e_capacity = 0;
+  max_cgroups = 0;
+}
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __CGROUP_SAMPLE_H__
+#define __CGROUP_SAMPLE_H__
+
+#include "cgroup_util.h"
+#include "proc_sample.h"
+
+#include <stddef.h>
+
+// Which cgroups are recorded. Only the busiest ones are kept, so that the
+// records stay bounded.
+typedef struct cgroup_filter {
+  // Max number of cgroups recorded per interval, or 0 to record none
+  int max_cgroups;
+} cgroup_filter_t;
+
+// The cgroups are only known through the processes in them, so the cgroups
+// with no processes of their own, e.g., the parents of other cgroups, are not
+// recorded. The rates are per second, and the utilizations are fractions of
+// all the CPUs or of the sample interval.
+typedef struct cgroup_external {
+  unsigned long long cgroup_id;
+  // Relative to the cgroup2 mount, and cut short if it is too long
+  char path[CGROUP_PATH_LENGTH];
+  unsigned int num_of_processes;
+  float cpu_utilization;
+  float cpu_user_utilization;
+  float cpu_system_utilization;
+  float cpu_throttled_rate;
+  float cpu_throttled_utilization;
+  // Share of the time some or all the tasks were stalled waiting for a CPU
+  float cpu_pressure_some;
+  float cpu_pressure_full;
+  float page_fault_rate;
+  float major_page_fault_rate;
+  float io_read_rate;
+  float io_write_rate;
+  float io_read_ops_rate;
+  float io_write_ops_rate;
+  unsigned long long memory_current;
+  unsigned long long memory_anon;
+  unsigned long long memory_file;
+} cgroup_external_t;
+
+// The recorded cgroups of an interval, from the busiest down
+typedef struct cgroup_list {
+  cgroup_external_t* cgroups_e;
+  // Directory of each cgroup, e.g., to count PMU events per cgroup
+  int* dir_fds;
+  size_t size;
+} cgroup_list_t;
+
+void init_cgroup_sample(cgroup_filter_t* cgroup_filter);
+
+// The cgroup2 mount the processes are mapped against, or NULL if no cgroups
+// are recorded
+const char* get_cgroup_root(void);
+
+// Reads the cgroups of all the processes in the list, which have to be
+// sampled with their cgroup_id. The list points to memory owned by this
+// module, which stays valid until the next call.
+void get_cgroup_sample(process_list_t* process_list,
+                       cgroup_list_t* cgroup_list);
+
+void clean_cgroup_sample(void);
+
+#endif
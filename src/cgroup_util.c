@@ -0,0 +1,233 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "cgroup_util.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char* cgroup_file_names[NUM_OF_CGROUP_FILES] = {
+  "cpu.stat", "cpu.pressure", "memory.current", "memory.stat", "io.stat",
+};
+
+int find_cgroup_root(char* root, size_t size) {
+  FILE* fp = fopen("/proc/self/mounts", "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  // Each line is: device mount_point type options dump pass
+  char line[PATH_MAX];
+  int ret = -1;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char mount_point[PATH_MAX];
+    char type[32];
+    if (sscanf(line, "%*s %s %31s", mount_point, type) == 2 &&
+        strcmp(type, "cgroup2") == 0 && strlen(mount_point) < size) {
+      strcpy(root, mount_point);
+      ret = 0;
+      break;
+    }
+  }
+
+  fclose(fp);
+  return ret;
+}
+
+/*
+ * Each line of /proc/<pid>/cgroup is hierarchy-ID:controllers:path, where the
+ * cgroup2 hierarchy has the ID 0 and no controllers, e.g.,
+ * 0::/system.slice/memcached.service
+ */
+int read_proc_cgroup(int pid, char* path, size_t size) {
+  char cgroup_location[32];
+  sprintf(cgroup_location, "/proc/%d/cgroup", pid);
+  FILE* fp = fopen(cgroup_location, "r");
+  if (fp == NULL) {
+    // This means the process has gone shortly after we list the directory
+    return -1;
+  }
+
+  char line[PATH_MAX];
+  int ret = -1;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "0::", 3) == 0) {
+      size_t length = strcspn(line + 3, "\n");
+      if (length < size) {
+        memcpy(path, line + 3, length);
+        path[length] = '\0';
+        ret = 0;
+      }
+      break;
+    }
+  }
+
+  fclose(fp);
+  return ret;
+}
+
+unsigned long long get_cgroup_id(const char* root, const char* path) {
+  char cgroup_location[PATH_MAX];
+  struct stat cgroup_stat;
+  if (snprintf(cgroup_location, sizeof(cgroup_location), "%s%s", root,
+               path) >= sizeof(cgroup_location) ||
+      stat(cgroup_location, &cgroup_stat) == -1) {
+    return 0ULL;
+  }
+  return cgroup_stat.st_ino;
+}
+
+int open_cgroup_files(const char* root, const char* path,
+                      cgroup_files_t* files) {
+  char cgroup_location[PATH_MAX];
+  int i;
+
+  for (i = 0; i < NUM_OF_CGROUP_FILES; i++) {
+    files->fds[i] = -1;
+  }
+  files->dir_fd = -1;
+  if (snprintf(cgroup_location, sizeof(cgroup_location), "%s%s", root,
+               path) >= sizeof(cgroup_location)) {
+    return -1;
+  }
+  files->dir_fd = open(cgroup_location, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (files->dir_fd == -1) {
+    return -1;
+  }
+
+  // The files of the controllers that are not enabled are missing
+  for (i = 0; i < NUM_OF_CGROUP_FILES; i++) {
+    files->fds[i] = openat(files->dir_fd, cgroup_file_names[i],
+                           O_RDONLY | O_CLOEXEC);
+  }
+  return 0;
+}
+
+// Reads a whole interface file from the beginning, returning an empty string
+// if it is missing
+static void read_cgroup_file(int fd, char buffer[CGROUP_BUFFER_SIZE]) {
+  ssize_t size = fd == -1 ? -1 : pread(fd, buffer, CGROUP_BUFFER_SIZE - 1, 0);
+  buffer[size > 0 ? size : 0] = '\0';
+}
+
+// Returns the value of a line in the flat keyed format, i.e., "key value"
+static unsigned long long get_keyed_value(const char* buffer,
+                                          const char* key) {
+  size_t length = strlen(key);
+  const char* line = buffer;
+  while (*line != '\0') {
+    if (strncmp(line, key, length) == 0 && line[length] == ' ') {
+      return strtoull(line + length + 1, NULL, 10);
+    }
+    line = strchr(line, '\n');
+    if (line == NULL) {
+      break;
+    }
+    line++;
+  }
+  return 0ULL;
+}
+
+// Returns the value of "key=value" in a line of the nested keyed format,
+// i.e., "name key=value key=value ..."
+static unsigned long long get_nested_value(const char* line,
+                                           const char* key) {
+  size_t length = strlen(key);
+  const char* end = strchr(line, '\n');
+  const char* field = strchr(line, ' ');
+  while (field != NULL && (end == NULL || field < end)) {
+    field++;
+    if (strncmp(field, key, length) == 0 && field[length] == '=') {
+      return strtoull(field + length + 1, NULL, 10);
+    }
+    field = strchr(field, ' ');
+  }
+  return 0ULL;
+}
+
+/*
+ * file formats: https://docs.kernel.org/admin-guide/cgroup-v2.html
+ * cpu.stat:       usage_usec 1234
+ * cpu.pressure:   some avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+ *                 full avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+ * memory.current: 1234
+ * memory.stat:    anon 1234
+ * io.stat:        8:0 rbytes=1234 wbytes=1234 rios=12 wios=12 ...
+ */
+void read_cgroup_stat(const cgroup_files_t* files, cgroup_stat_t* stat) {
+  char buffer[CGROUP_BUFFER_SIZE];
+  const char* line;
+
+  read_cgroup_file(files->fds[CGROUP_FILE_CPU_STAT], buffer);
+  stat->usage_usec = get_keyed_value(buffer, "usage_usec");
+  stat->user_usec = get_keyed_value(buffer, "user_usec");
+  stat->system_usec = get_keyed_value(buffer, "system_usec");
+  stat->nr_throttled = get_keyed_value(buffer, "nr_throttled");
+  stat->throttled_usec = get_keyed_value(buffer, "throttled_usec");
+
+  read_cgroup_file(files->fds[CGROUP_FILE_CPU_PRESSURE], buffer);
+  stat->cpu_some_usec = 0ULL;
+  stat->cpu_full_usec = 0ULL;
+  for (line = buffer; *line != '\0'; line++) {
+    if (strncmp(line, "some ", 5) == 0) {
+      stat->cpu_some_usec = get_nested_value(line, "total");
+    } else if (strncmp(line, "full ", 5) == 0) {
+      stat->cpu_full_usec = get_nested_value(line, "total");
+    }
+    line = strchr(line, '\n');
+    if (line == NULL) {
+      break;
+    }
+  }
+
+  read_cgroup_file(files->fds[CGROUP_FILE_MEMORY_CURRENT], buffer);
+  stat->memory_current = strtoull(buffer, NULL, 10);
+
+  read_cgroup_file(files->fds[CGROUP_FILE_MEMORY_STAT], buffer);
+  stat->anon = get_keyed_value(buffer, "anon");
+  stat->file = get_keyed_value(buffer, "file");
+  stat->pgfault = get_keyed_value(buffer, "pgfault");
+  stat->pgmajfault = get_keyed_value(buffer, "pgmajfault");
+
+  read_cgroup_file(files->fds[CGROUP_FILE_IO_STAT], buffer);
+  stat->rbytes = 0ULL;
+  stat->wbytes = 0ULL;
+  stat->rios = 0ULL;
+  stat->wios = 0ULL;
+  for (line = buffer; *line != '\0'; line++) {
+    stat->rbytes += get_nested_value(line, "rbytes");
+    stat->wbytes += get_nested_value(line, "wbytes");
+    stat->rios += get_nested_value(line, "rios");
+    stat->wios += get_nested_value(line, "wios");
+    line = strchr(line, '\n');
+    if (line == NULL) {
+      break;
+    }
+  }
+}
+
+void close_cgroup_files(cgroup_files_t* files) {
+  int i;
+  for (i = 0; i < NUM_OF_CGROUP_FILES; i++) {
+    if (files->fds[i] != -1) {
+      close(files->fds[i]);
+    }
+    files->fds[i] = -1;
+  }
+  if (files->dir_fd != -1) {
+    close(files->dir_fd);
+  }
+  files->dir_fd = -1;
+}
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __CGROUP_UTIL__
+#define __CGROUP_UTIL__
+
+#include <stddef.h>
+
+// Size of the buffer an interface file is read into. Only io.stat grows with
+// the number of devices, and the devices beyond that are left out.
+#define CGROUP_BUFFER_SIZE 4096
+
+// Max length of the path of a cgroup, relative to the cgroup2 mount
+#define CGROUP_PATH_LENGTH 128
+
+// The interface files of a cgroup we read
+typedef enum {
+  CGROUP_FILE_CPU_STAT = 0x00,
+  CGROUP_FILE_CPU_PRESSURE = 0x01,
+  CGROUP_FILE_MEMORY_CURRENT = 0x02,
+  CGROUP_FILE_MEMORY_STAT = 0x03,
+  CGROUP_FILE_IO_STAT = 0x04,
+  NUM_OF_CGROUP_FILES = 0x05,
+} cgroup_file_t;
+
+// The fields of the interface files we use. The files of the controllers
+// that are not enabled for the cgroup are missing, and their fields are 0.
+typedef struct cgroup_stat {
+  // cpu.stat, in microseconds
+  unsigned long long usage_usec;
+  unsigned long long user_usec;
+  unsigned long long system_usec;
+  unsigned long long nr_throttled;
+  unsigned long long throttled_usec;
+  // cpu.pressure, total stall time in microseconds
+  unsigned long long cpu_some_usec;
+  unsigned long long cpu_full_usec;
+  // memory.current and memory.stat, in bytes except for the page faults
+  unsigned long long memory_current;
+  unsigned long long anon;
+  unsigned long long file;
+  unsigned long long pgfault;
+  unsigned long long pgmajfault;
+  // io.stat, summed up over all the devices
+  unsigned long long rbytes;
+  unsigned long long wbytes;
+  unsigned long long rios;
+  unsigned long long wios;
+} cgroup_stat_t;
+
+// The directory and the interface files of a cgroup, which are kept open for
+// as long as the cgroup is monitored. A file that is missing is -1.
+typedef struct cgroup_files {
+  int dir_fd;
+  int fds[NUM_OF_CGROUP_FILES];
+} cgroup_files_t;
+
+// Finds where the cgroup2 hierarchy is mounted, which is /sys/fs/cgroup/ on
+// most systems, or /sys/fs/cgroup/unified/ in the hybrid mode. Returns -1 if
+// it is not mounted.
+int find_cgroup_root(char* root, size_t size);
+
+// Reads the cgroup2 path of a process from /proc/<pid>/cgroup. Returns -1 if
+// the process has gone, or is not in the cgroup2 hierarchy.
+int read_proc_cgroup(int pid, char* path, size_t size);
+
+// Returns the ID of a cgroup, which is the inode number of its directory as
+// used by the kernel, or 0 if it has gone
+unsigned long long get_cgroup_id(const char* root, const char* path);
+
+// Returns -1 if the cgroup has gone
+int open_cgroup_files(const char* root, const char* path,
+                      cgroup_files_t* files);
+
+void read_cgroup_stat(const cgroup_files_t* files, cgroup_stat_t* stat);
+
+void close_cgroup_files(cgroup_files_t* files);
+
+#endif
@@ -12,8 +12,124 @@
 #include <string.h>
 
 #include "config_util.h"
+#include "event_util.h"
 #include "log_util.h"
 
+// Adds a key to rank the processes by, which is one of "cpu", "rss",
+// "page_faults", "io", or "pmu:" followed by one of the PMU events
+static void add_rank_key(options_t* options, hardware_info_t* hardware_info,
+                         const char* name, double weight) {
+  rank_t* rank = &options->rank;
+  if (rank->num_of_keys >= MAX_RANK_KEYS) {
+    logging(LOG_CODE_FATAL, "Too many keys to rank by (max is %d).\n",
+            MAX_RANK_KEYS);
+  }
+
+  int key_index = rank->num_of_keys;
+  rank->weights[key_index] = weight;
+  rank->events[key_index] = -1;
+  if (strcmp(name, "cpu") == 0) {
+    rank->keys[key_index] = RANK_KEY_CPU;
+  } else if (strcmp(name, "rss") == 0) {
+    rank->keys[key_index] = RANK_KEY_RSS;
+  } else if (strcmp(name, "page_faults") == 0) {
+    rank->keys[key_index] = RANK_KEY_PAGE_FAULTS;
+  } else if (strcmp(name, "io") == 0) {
+    rank->keys[key_index] = RANK_KEY_IO;
+  } else if (strncmp(name, "pmu:", 4) == 0) {
+    int i;
+    for (i = 0; i < options->num_of_dropped_events; i++) {
+      if (strcmp(options->dropped_events[i], name + 4) == 0) {
+        logging(LOG_CODE_WARNING,
+                "Cannot rank by unsupported PMU event %s, skipping it.\n",
+                name + 4);
+        return;
+      }
+    }
+    for (i = 0; i < hardware_info->num_of_events; i++) {
+      if (strcmp(options->event_names[i], name + 4) == 0) {
+        break;
+      }
+    }
+    if (i == hardware_info->num_of_events) {
+      logging(LOG_CODE_FATAL, "Cannot rank by unknown PMU event %s.\n",
+              name + 4);
+    }
+    if (hardware_info->pmu_mode != PMU_MODE_PER_THREAD) {
+      logging(LOG_CODE_FATAL,
+              "Ranking by PMU events requires the per-thread PMU mode.\n");
+    }
+    // With the rotation, an event reads 0 in the intervals its set is not
+    // counting, which would move the processes in and out of the top ones
+    if (hardware_info->pmu_rotation) {
+      logging(LOG_CODE_FATAL,
+              "Ranking by PMU events does not work with pmu_rotation.\n");
+    }
+    rank->keys[key_index] = RANK_KEY_PMU;
+    rank->events[key_index] = i;
+  } else {
+    logging(LOG_CODE_FATAL,
+            "Unknown key %s to rank by (cpu, rss, page_faults, io or "
+            "pmu:<event>).\n", name);
+  }
+  rank->num_of_keys++;
+
+  logging(LOG_CODE_INFO, "Ranking processes by %s with weight %g.\n", name,
+          weight);
+}
+
+// Whether the derived metric uses any of the events that are not supported,
+// which follow the supported ones
+static bool uses_dropped_event(const derived_metric_t* metric,
+                               int num_of_events) {
+  int i;
+  for (i = 0; i < metric->num_of_ops; i++) {
+    if (metric->ops[i].code == DERIVED_OP_EVENT &&
+        metric->ops[i].event >= num_of_events) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses one kind of patterns of the always-watch list, which is a list of
+// strings
+static void add_watch_patterns(json_t* watch_dict, const char* name,
+                               char patterns[][MAX_WATCH_PATTERN_LENGTH],
+                               int* num_of_patterns) {
+  json_t* pattern_list = json_object_get(watch_dict, name);
+  size_t pattern_index;
+  json_t* pattern_value;
+
+  *num_of_patterns = 0;
+  if (pattern_list == NULL) {
+    return;
+  }
+  if (!json_is_array(pattern_list)) {
+    logging(LOG_CODE_FATAL, "The watch list of %s is not an array.\n", name);
+  }
+  json_array_foreach (pattern_list, pattern_index, pattern_value) {
+    if (*num_of_patterns >= MAX_WATCH_PATTERNS) {
+      logging(LOG_CODE_FATAL, "Too many %s patterns to watch (max is %d)\n",
+              name, MAX_WATCH_PATTERNS);
+    }
+    if (!json_is_string(pattern_value)) {
+      logging(LOG_CODE_FATAL, "A %s pattern to watch is not a string.\n",
+              name);
+    }
+    if (strlen(json_string_value(pattern_value)) >=
+        MAX_WATCH_PATTERN_LENGTH) {
+      logging(LOG_CODE_FATAL, "The %s pattern %s is too long (max is %d)\n",
+              name, json_string_value(pattern_value),
+              MAX_WATCH_PATTERN_LENGTH - 1);
+    }
+    strcpy(patterns[*num_of_patterns], json_string_value(pattern_value));
+    logging(LOG_CODE_INFO, "Always monitoring the processes with %s %s.\n",
+            name, patterns[*num_of_patterns]);
+    (*num_of_patterns)++;
+  }
+}
+
 void parse_config(char* config, options_t* options,
                   hardware_info_t* hardware_info) {
   json_t* json_root;
@@ -75,43 +191,247 @@ void parse_config(char* config, options_t* options,
     options->num_of_applications++;
   }
 
-  // PMU counters
+  // PMU counters, either from the event catalog or encoded by libpfm as they
+  // are. The ones that are not supported on this machine are dropped.
   int num_of_events = 0;
   json_t* pmu_list = json_object_get(json_root, "pmu");
   size_t pmu_index;
   json_t* pmu_value;
 
   memset(options->events, 0, sizeof(options->events));
+  memset(options->event_names, 0, sizeof(options->event_names));
+  options->num_of_dropped_events = 0;
+  init_event_catalog();
 
   json_array_foreach (pmu_list, pmu_index, pmu_value) {
     if (!json_is_string(pmu_value)) {
       logging(LOG_CODE_FATAL,
               "The %zuth PMU event is not an integer.\n", pmu_index + 1);
     }
+    const char* pmu_name = json_string_value(pmu_value);
+    if (strlen(pmu_name) >= PMU_EVENTS_NAME_LENGTH) {
+      logging(LOG_CODE_FATAL, "PMU event %s is too long (max is %d).\n",
+              pmu_name, PMU_EVENTS_NAME_LENGTH - 1);
+    }
+    if (num_of_events + options->num_of_dropped_events == MAX_EVENTS) {
+      logging(LOG_CODE_FATAL, "Too many PMU events (max is %d).\n",
+              MAX_EVENTS);
+    }
+    if (resolve_event(pmu_name, options->events_buffer[num_of_events],
+                      PMU_EVENTS_NAME_LENGTH) == -1) {
+      logging(LOG_CODE_WARNING,
+              "PMU event %s is not supported on this machine, dropping "
+              "it.\n", pmu_name);
+      strcpy(options->dropped_events[options->num_of_dropped_events++],
+             pmu_name);
+      continue;
+    }
     options->events[num_of_events] =
         (const char*)&options->events_buffer[num_of_events];
-    const char* pmu_name = json_string_value(pmu_value);
-    strcpy(options->events_buffer[num_of_events], pmu_name);
+    // The events are recorded under their names in the configuration, which
+    // are the same on every machine
+    strcpy(options->event_names_buffer[num_of_events], pmu_name);
+    options->event_names[num_of_events] =
+        (const char*)&options->event_names_buffer[num_of_events];
     num_of_events++;
 
-    logging(LOG_CODE_INFO, "PMU event %s registered.\n", pmu_name);
+    if (strcmp(pmu_name, options->events[num_of_events - 1]) == 0) {
+      logging(LOG_CODE_INFO, "PMU event %s registered.\n", pmu_name);
+    } else {
+      logging(LOG_CODE_INFO, "PMU event %s registered as %s.\n", pmu_name,
+              options->events[num_of_events - 1]);
+    }
+  }
+
+  hardware_info->num_of_events = num_of_events;
+
+  // Attribution of the PMU events, either per thread of the monitored
+  // processes (default), per CPU, or per recorded cgroup
+  json_t* pmu_mode = json_object_get(json_root, "pmu_mode");
+  hardware_info->pmu_mode = PMU_MODE_PER_THREAD;
+  if (pmu_mode != NULL) {
+    if (!json_is_string(pmu_mode)) {
+      logging(LOG_CODE_FATAL, "The PMU mode is not a string.\n");
+    }
+    if (strcmp(json_string_value(pmu_mode), "per-cpu") == 0) {
+      hardware_info->pmu_mode = PMU_MODE_PER_CPU;
+    } else if (strcmp(json_string_value(pmu_mode), "per-cgroup") == 0) {
+      hardware_info->pmu_mode = PMU_MODE_PER_CGROUP;
+    } else if (strcmp(json_string_value(pmu_mode), "per-thread") != 0) {
+      logging(LOG_CODE_FATAL,
+              "Unknown PMU mode %s (per-thread, per-cpu or per-cgroup).\n",
+              json_string_value(pmu_mode));
+    }
+  }
+  // Whether the events are split into sets that fit in the counters and take
+  // turns counting, rather than being multiplexed by the kernel, and how many
+  // counters there are if libpfm cannot tell
+  json_t* pmu_rotation = json_object_get(json_root, "pmu_rotation");
+  hardware_info->pmu_rotation = false;
+  if (pmu_rotation != NULL) {
+    if (!json_is_boolean(pmu_rotation)) {
+      logging(LOG_CODE_FATAL, "The PMU rotation flag is not a boolean.\n");
+    }
+    hardware_info->pmu_rotation = json_is_true(pmu_rotation);
+  }
+  json_t* pmu_counters = json_object_get(json_root, "pmu_counters");
+  hardware_info->pmu_counters = 0;
+  if (pmu_counters != NULL) {
+    if (!json_is_integer(pmu_counters) ||
+        json_integer_value(pmu_counters) <= 0) {
+      logging(LOG_CODE_FATAL,
+              "The number of PMU counters is not a positive integer.\n");
+    }
+    hardware_info->pmu_counters = json_integer_value(pmu_counters);
+  }
+  // Whether the per-CPU events are read in userspace with rdpmc
+  json_t* pmu_fast_read = json_object_get(json_root, "pmu_fast_read");
+  hardware_info->pmu_fast_read = false;
+  if (pmu_fast_read != NULL) {
+    if (!json_is_boolean(pmu_fast_read)) {
+      logging(LOG_CODE_FATAL, "The PMU fast read flag is not a boolean.\n");
+    }
+    hardware_info->pmu_fast_read = json_is_true(pmu_fast_read);
+    if (hardware_info->pmu_fast_read &&
+        hardware_info->pmu_mode != PMU_MODE_PER_CPU) {
+      logging(LOG_CODE_WARNING,
+              "Reading PMU events with rdpmc requires the per-cpu PMU mode, "
+              "using read() instead.\n");
+      hardware_info->pmu_fast_read = false;
+    }
   }
+  logging(LOG_CODE_INFO, "Counting PMU events %s.\n",
+          hardware_info->pmu_mode == PMU_MODE_PER_CPU    ? "per CPU" :
+          hardware_info->pmu_mode == PMU_MODE_PER_CGROUP ? "per cgroup" :
+                                                           "per thread");
 
-  // Add PMU counters for NUMA events (local memory access)
-  options->events[num_of_events] =
-      (const char*)&options->events_buffer[num_of_events];
-  strcpy(options->events_buffer[num_of_events], PMU_NUMA_LMA);
-  num_of_events++;
-  logging(LOG_CODE_INFO, "PMU event %s registered.\n", PMU_NUMA_LMA);
+  // Metrics derived from the PMU events, which are stored after their counts
+  options->num_of_derived_metrics = 0;
+  json_t* derived_dict = json_object_get(json_root, "derived");
+  if (derived_dict != NULL) {
+    if (!json_is_object(derived_dict)) {
+      logging(LOG_CODE_FATAL, "The derived metrics are not an object.\n");
+    }
+    // The events are named as in the configuration, or by their encodings,
+    // followed by the dropped ones, so that the metrics using them can be
+    // told apart from the invalid ones
+    const char* metric_events[2 * MAX_EVENTS];
+    const char* aliases[2 * MAX_EVENTS];
+    int i;
+    for (i = 0; i < num_of_events; i++) {
+      metric_events[i] = options->event_names[i];
+      aliases[i] = options->events[i];
+    }
+    for (i = 0; i < options->num_of_dropped_events; i++) {
+      metric_events[num_of_events + i] = options->dropped_events[i];
+      aliases[num_of_events + i] = NULL;
+    }
+    const char* derived_key;
+    json_t* derived_value;
+    json_object_foreach (derived_dict, derived_key, derived_value) {
+      if (!json_is_string(derived_value)) {
+        logging(LOG_CODE_FATAL,
+                "The derived metric %s is not a string.\n", derived_key);
+      }
+      if (options->num_of_derived_metrics == MAX_DERIVED_METRICS) {
+        logging(LOG_CODE_FATAL, "Too many derived metrics (max is %d).\n",
+                MAX_DERIVED_METRICS);
+      }
+      char error[256];
+      derived_metric_t* metric =
+          &options->derived_metrics[options->num_of_derived_metrics];
+      if (compile_derived_metric(
+              derived_key, json_string_value(derived_value), metric_events,
+              aliases, num_of_events + options->num_of_dropped_events,
+              metric, error, sizeof(error)) != 0) {
+        logging(LOG_CODE_FATAL, "The derived metric %s is invalid: %s.\n",
+                derived_key, error);
+      }
+      if (uses_dropped_event(metric, num_of_events)) {
+        logging(LOG_CODE_WARNING,
+                "The derived metric %s uses unsupported PMU events, dropping "
+                "it.\n", derived_key);
+        continue;
+      }
+      options->num_of_derived_metrics++;
+      logging(LOG_CODE_INFO, "Deriving %s = %s.\n", derived_key,
+              json_string_value(derived_value));
+    }
+  }
+  hardware_info->num_of_derived_metrics = options->num_of_derived_metrics;
 
-  // Add PMU counters for NUMA events (remote memory access)
-  options->events[num_of_events] =
-      (const char*)&options->events_buffer[num_of_events];
-  strcpy(options->events_buffer[num_of_events], PMU_NUMA_RMA);
-  num_of_events++;
-  logging(LOG_CODE_INFO, "PMU event %s registered.\n", PMU_NUMA_RMA);
+  // Output buffering, all of which are optional
+  options->output_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+  options->output_flush_interval_ms = DEFAULT_OUTPUT_FLUSH_INTERVAL_MS;
+  options->output_fsync_policy = FSYNC_NEVER;
+  json_t* output_dict = json_object_get(json_root, "output");
+  if (output_dict != NULL) {
+    json_t* buffer_size = json_object_get(output_dict, "buffer_size");
+    if (buffer_size != NULL) {
+      if (!json_is_integer(buffer_size) ||
+          json_integer_value(buffer_size) <= 0) {
+        logging(LOG_CODE_FATAL,
+                "The output buffer size is not a positive integer.\n");
+      }
+      options->output_buffer_size = json_integer_value(buffer_size);
+    }
+    json_t* flush_interval = json_object_get(output_dict, "flush_interval_ms");
+    if (flush_interval != NULL) {
+      if (!json_is_integer(flush_interval) ||
+          json_integer_value(flush_interval) < 0) {
+        logging(LOG_CODE_FATAL,
+                "The output flush interval is not a non-negative integer.\n");
+      }
+      options->output_flush_interval_ms = json_integer_value(flush_interval);
+    }
+    json_t* fsync_policy = json_object_get(output_dict, "fsync");
+    if (fsync_policy != NULL) {
+      if (!json_is_string(fsync_policy)) {
+        logging(LOG_CODE_FATAL, "The output fsync policy is not a string.\n");
+      }
+      if (strcmp(json_string_value(fsync_policy), "never") == 0) {
+        options->output_fsync_policy = FSYNC_NEVER;
+      } else if (strcmp(json_string_value(fsync_policy), "flush") == 0) {
+        options->output_fsync_policy = FSYNC_ON_FLUSH;
+      } else if (strcmp(json_string_value(fsync_policy), "close") == 0) {
+        options->output_fsync_policy = FSYNC_ON_CLOSE;
+      } else {
+        logging(LOG_CODE_FATAL,
+                "Unknown output fsync policy %s (never, flush or close).\n",
+                json_string_value(fsync_policy));
+      }
+    }
+  }
+  logging(LOG_CODE_INFO,
+          "Buffering up to %zu bytes of output for up to %u ms.\n",
+          options->output_buffer_size, options->output_flush_interval_ms);
 
-  hardware_info->num_of_events = num_of_events;
+  // How the processes are ranked, either by a single key, e.g., "rss", or by
+  // the weights of several keys, e.g., {"cpu": 1.0, "io": 0.5}. By default,
+  // only CPU utilization is used.
+  json_t* rank_by = json_object_get(json_root, "rank_by");
+  options->rank.num_of_keys = 0;
+  if (rank_by == NULL) {
+    add_rank_key(options, hardware_info, "cpu", 1.0);
+  } else if (json_is_string(rank_by)) {
+    add_rank_key(options, hardware_info, json_string_value(rank_by), 1.0);
+  } else if (json_is_object(rank_by)) {
+    const char* rank_key;
+    json_t* rank_weight;
+    json_object_foreach (rank_by, rank_key, rank_weight) {
+      if (!json_is_number(rank_weight)) {
+        logging(LOG_CODE_FATAL, "The weight of %s is not a number.\n",
+                rank_key);
+      }
+      add_rank_key(options, hardware_info, rank_key,
+                   json_number_value(rank_weight));
+    }
+    if (options->rank.num_of_keys == 0) {
+      logging(LOG_CODE_FATAL, "No keys to rank the processes by.\n");
+    }
+  } else {
+    logging(LOG_CODE_FATAL, "rank_by is neither a string nor an object.\n");
+  }
 
   // Number of processes to monitor that are utilizing the most resources
   json_t* num_of_processes = json_object_get(json_root, "num_of_processes");
@@ -119,6 +439,169 @@ void parse_config(char* config, options_t* options,
   logging(LOG_CODE_INFO, "Monitoring the top %d processes.\n",
           options->num_of_processes);
 
+  // Processes that are always monitored on top of the top ones, by command
+  // name, command line pattern or pidfile, e.g.,
+  // {"comm": ["memcached"], "cmdline": ["java .*Server"], "max_processes": 8}
+  json_t* watch_dict = json_object_get(json_root, "watch");
+  add_watch_patterns(watch_dict, "comm", options->watch.comms,
+                     &options->watch.num_of_comms);
+  add_watch_patterns(watch_dict, "cmdline", options->watch.cmdlines,
+                     &options->watch.num_of_cmdlines);
+  add_watch_patterns(watch_dict, "pidfile", options->watch.pidfiles,
+                     &options->watch.num_of_pidfiles);
+  options->watch.max_processes = 0;
+  if (watch_dict != NULL) {
+    options->watch.max_processes = DEFAULT_MAX_WATCHED_PROCESSES;
+    json_t* max_processes = json_object_get(watch_dict, "max_processes");
+    if (max_processes != NULL) {
+      if (!json_is_integer(max_processes) ||
+          json_integer_value(max_processes) < 0) {
+        logging(LOG_CODE_FATAL,
+                "The max number of watched processes is not a non-negative "
+                "integer.\n");
+      }
+      options->watch.max_processes = json_integer_value(max_processes);
+    }
+    logging(LOG_CODE_INFO, "Monitoring up to %d watched processes.\n",
+            options->watch.max_processes);
+  }
+
+  // The busiest threads of the monitored processes that are recorded on their
+  // own, e.g., {"max_threads": 16, "min_cpu_utilization": 0.01}
+  options->threads.max_threads = 0;
+  options->threads.min_cpu_utilization = 0.0;
+  json_t* threads_dict = json_object_get(json_root, "threads");
+  if (threads_dict != NULL) {
+    json_t* max_threads = json_object_get(threads_dict, "max_threads");
+    if (!json_is_integer(max_threads) ||
+        json_integer_value(max_threads) < 0) {
+      logging(LOG_CODE_FATAL,
+              "The max number of threads is not a non-negative integer.\n");
+    }
+    options->threads.max_threads = json_integer_value(max_threads);
+    json_t* min_cpu_utilization =
+        json_object_get(threads_dict, "min_cpu_utilization");
+    if (min_cpu_utilization != NULL) {
+      if (!json_is_number(min_cpu_utilization)) {
+        logging(LOG_CODE_FATAL,
+                "The min CPU utilization of threads is not a number.\n");
+      }
+      options->threads.min_cpu_utilization =
+          json_number_value(min_cpu_utilization);
+    }
+    logging(LOG_CODE_INFO, "Recording up to %d threads.\n",
+            options->threads.max_threads);
+  }
+
+  // The busiest cgroups of all the processes that are recorded, e.g.,
+  // {"max_cgroups": 32}
+  options->cgroups.max_cgroups = 0;
+  json_t* cgroups_dict = json_object_get(json_root, "cgroups");
+  if (cgroups_dict != NULL) {
+    json_t* max_cgroups = json_object_get(cgroups_dict, "max_cgroups");
+    if (!json_is_integer(max_cgroups) ||
+        json_integer_value(max_cgroups) < 0) {
+      logging(LOG_CODE_FATAL,
+              "The max number of cgroups is not a non-negative integer.\n");
+    }
+    options->cgroups.max_cgroups = json_integer_value(max_cgroups);
+    logging(LOG_CODE_INFO, "Recording up to %d cgroups.\n",
+            options->cgroups.max_cgroups);
+  }
+  if (hardware_info->pmu_mode == PMU_MODE_PER_CGROUP &&
+      options->cgroups.max_cgroups == 0) {
+    logging(LOG_CODE_FATAL,
+            "The per-cgroup PMU mode requires cgroups to be recorded.\n");
+  }
+
+  // The stacks of the monitored processes that are sampled, e.g.,
+  // {"event": "cycles", "frequency": 99, "callchain": true,
+  //  "max_entries": 256}, or {"period": 1000000, ...} to sample every so many
+  // events rather than so many times per second
+  options->profile.max_entries = 0;
+  json_t* profile_dict = json_object_get(json_root, "profile");
+  if (profile_dict != NULL) {
+    json_t* max_entries = json_object_get(profile_dict, "max_entries");
+    if (!json_is_integer(max_entries) ||
+        json_integer_value(max_entries) < 0) {
+      logging(LOG_CODE_FATAL,
+              "The max number of sampled stacks is not a non-negative "
+              "integer.\n");
+    }
+    options->profile.max_entries = json_integer_value(max_entries);
+    json_t* event = json_object_get(profile_dict, "event");
+    if (!json_is_string(event) ||
+        strlen(json_string_value(event)) >= PROFILE_EVENT_NAME_LENGTH) {
+      logging(LOG_CODE_FATAL,
+              "The sampling event is not a string of at most %d "
+              "characters.\n", PROFILE_EVENT_NAME_LENGTH - 1);
+    }
+    strcpy(options->profile.event, json_string_value(event));
+    options->profile.frequency = DEFAULT_PROFILE_FREQUENCY;
+    options->profile.period = 0;
+    json_t* frequency = json_object_get(profile_dict, "frequency");
+    json_t* period = json_object_get(profile_dict, "period");
+    if (frequency != NULL && period != NULL) {
+      logging(LOG_CODE_FATAL,
+              "Only one of the sampling frequency and period can be set.\n");
+    } else if (frequency != NULL) {
+      if (!json_is_integer(frequency) || json_integer_value(frequency) < 1) {
+        logging(LOG_CODE_FATAL,
+                "The sampling frequency is not a positive integer.\n");
+      }
+      options->profile.frequency = json_integer_value(frequency);
+    } else if (period != NULL) {
+      if (!json_is_integer(period) || json_integer_value(period) < 1) {
+        logging(LOG_CODE_FATAL,
+                "The sampling period is not a positive integer.\n");
+      }
+      options->profile.frequency = 0;
+      options->profile.period = json_integer_value(period);
+    }
+    options->profile.callchain = true;
+    json_t* callchain = json_object_get(profile_dict, "callchain");
+    if (callchain != NULL) {
+      if (!json_is_boolean(callchain)) {
+        logging(LOG_CODE_FATAL, "The callchain flag is not a boolean.\n");
+      }
+      options->profile.callchain = json_is_true(callchain);
+    }
+    logging(LOG_CODE_INFO, "Recording up to %d sampled %s per interval.\n",
+            options->profile.max_entries,
+            options->profile.callchain ? "callchains" : "IPs");
+  }
+
+  // Number of workers reading /proc/ in parallel
+  options->num_of_workers = DEFAULT_NUM_OF_WORKERS;
+  json_t* num_of_workers = json_object_get(json_root, "num_of_workers");
+  if (num_of_workers != NULL) {
+    if (!json_is_integer(num_of_workers) ||
+        json_integer_value(num_of_workers) < 1) {
+      logging(LOG_CODE_FATAL,
+              "The number of workers is not a positive integer.\n");
+    }
+    options->num_of_workers = json_integer_value(num_of_workers);
+  }
+  logging(LOG_CODE_INFO, "Reading /proc/ with %d worker(s).\n",
+          options->num_of_workers);
+
+  // Number of intervals between the full scans of /proc/. The processes
+  // created in between are found through the process lifecycle events.
+  options->proc_rescan_intervals = DEFAULT_PROC_RESCAN_INTERVALS;
+  json_t* rescan_intervals =
+      json_object_get(json_root, "proc_rescan_intervals");
+  if (rescan_intervals != NULL) {
+    if (!json_is_integer(rescan_intervals) ||
+        json_integer_value(rescan_intervals) < 1) {
+      logging(LOG_CODE_FATAL,
+              "The number of intervals between /proc/ scans is not a "
+              "positive integer.\n");
+    }
+    options->proc_rescan_intervals = json_integer_value(rescan_intervals);
+  }
+  logging(LOG_CODE_INFO, "Scanning /proc/ every %d interval(s).\n",
+          options->proc_rescan_intervals);
+
   // Clean up
   json_decref(json_root);
 }
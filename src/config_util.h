@@ -12,19 +12,57 @@
 #define __CONFIG_UTIL_H__
 
 #include "app_sample.h"
+#include "derived_util.h"
+#include "file_util.h"
 #include "pmu_sample.h"
+#include "profile_sample.h"
+
+#include <stddef.h>
+
+// Default size of the output buffer
+#define DEFAULT_OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+// Default max time a record can stay in the output buffer
+#define DEFAULT_OUTPUT_FLUSH_INTERVAL_MS 1000
+
+// Default number of workers reading /proc/ in parallel
+#define DEFAULT_NUM_OF_WORKERS 1
+
+// Default number of intervals between the full scans of /proc/, which means
+// no process lifecycle events are used
+#define DEFAULT_PROC_RESCAN_INTERVALS 1
 
 typedef struct {
+  // The encodings of the PMU events used on this machine
   const char* events[MAX_EVENTS];
   char events_buffer[MAX_EVENTS][PMU_EVENTS_NAME_LENGTH];
+  // And their names in the configuration, which are recorded
+  const char* event_names[MAX_EVENTS];
+  char event_names_buffer[MAX_EVENTS][PMU_EVENTS_NAME_LENGTH];
+  // The PMU events of the configuration that are not supported on this
+  // machine
+  char dropped_events[MAX_EVENTS][PMU_EVENTS_NAME_LENGTH];
+  int num_of_dropped_events;
+  derived_metric_t derived_metrics[MAX_DERIVED_METRICS];
+  int num_of_derived_metrics;
   char* config_file;
   char applications[MAX_NUM_APPLICATIONS][MAX_APP_NAME_LENGTH];
   char hostnames[MAX_NUM_APPLICATIONS][MAX_HOSTNAME_LENGTH];
   unsigned int ports[MAX_NUM_APPLICATIONS];
   int num_of_applications;
   int num_of_processes;
+  rank_t rank;
+  watch_t watch;
+  thread_filter_t threads;
+  cgroup_filter_t cgroups;
+  profile_config_t profile;
+  int num_of_workers;
+  int proc_rescan_intervals;
   int interval_us;
   char* output_file;
+  size_t output_buffer_size;
+  unsigned int output_flush_interval_ms;
+  short output_fsync_policy;
 } options_t;
 
 void parse_config(char* config, options_t* options,
@@ -0,0 +1,254 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "derived_util.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The state of parsing an expression, which stops at the first error
+typedef struct derived_parser {
+  const char* next;
+  const char** events;
+  const char** aliases;
+  int num_of_events;
+  derived_metric_t* metric;
+  int failed;
+  char* error;
+  size_t error_size;
+} derived_parser_t;
+
+static void parse_expression(derived_parser_t* parser);
+
+static void fail(derived_parser_t* parser, const char* format, ...) {
+  if (parser->failed) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf(parser->error, parser->error_size, format, args);
+  va_end(args);
+  parser->failed = 1;
+}
+
+static void skip_spaces(derived_parser_t* parser) {
+  while (isspace((unsigned char)*parser->next)) {
+    parser->next++;
+  }
+}
+
+static void emit(derived_parser_t* parser, short code, int event,
+                 double constant) {
+  derived_metric_t* metric = parser->metric;
+  if (metric->num_of_ops >= MAX_DERIVED_OPS) {
+    fail(parser, "too long (max is %d operations)", MAX_DERIVED_OPS);
+    return;
+  }
+  metric->ops[metric->num_of_ops].code = code;
+  metric->ops[metric->num_of_ops].event = event;
+  metric->ops[metric->num_of_ops].constant = constant;
+  metric->num_of_ops++;
+}
+
+// Finds the event by its whole name or alias, or else by its name without
+// the PMU prefix, e.g., "ivb_ep::"
+static int find_event(derived_parser_t* parser, const char* name,
+                      size_t length) {
+  int found = -1;
+  int i;
+  for (i = 0; i < parser->num_of_events; i++) {
+    const char* alias = parser->aliases != NULL ? parser->aliases[i] : NULL;
+    if ((strlen(parser->events[i]) == length &&
+         strncmp(parser->events[i], name, length) == 0) ||
+        (alias != NULL && strlen(alias) == length &&
+         strncmp(alias, name, length) == 0)) {
+      return i;
+    }
+  }
+  for (i = 0; i < parser->num_of_events; i++) {
+    const char* prefix_end = strstr(parser->events[i], "::");
+    const char* short_name =
+        prefix_end != NULL ? prefix_end + 2 : parser->events[i];
+    if (strlen(short_name) == length &&
+        strncmp(short_name, name, length) == 0) {
+      if (found != -1) {
+        fail(parser, "event %.*s is ambiguous", (int)length, name);
+        return -1;
+      }
+      found = i;
+    }
+  }
+  if (found == -1) {
+    fail(parser, "unknown event %.*s", (int)length, name);
+  }
+  return found;
+}
+
+// primary := number | name | '{' name '}' | '(' expression ')'
+static void parse_primary(derived_parser_t* parser) {
+  skip_spaces(parser);
+  char c = *parser->next;
+
+  if (isdigit((unsigned char)c) || c == '.') {
+    char* end;
+    double constant = strtod(parser->next, &end);
+    if (end == parser->next) {
+      fail(parser, "bad number at \"%s\"", parser->next);
+      return;
+    }
+    parser->next = end;
+    emit(parser, DERIVED_OP_CONSTANT, -1, constant);
+  } else if (isalpha((unsigned char)c) || c == '_') {
+    const char* name = parser->next;
+    while (isalnum((unsigned char)*parser->next) || *parser->next == '_' ||
+           *parser->next == ':' || *parser->next == '.') {
+      parser->next++;
+    }
+    int event = find_event(parser, name, parser->next - name);
+    emit(parser, DERIVED_OP_EVENT, event, 0.0);
+  } else if (c == '{') {
+    const char* name = parser->next + 1;
+    const char* end = strchr(name, '}');
+    if (end == NULL) {
+      fail(parser, "missing }");
+      return;
+    }
+    parser->next = end + 1;
+    int event = find_event(parser, name, end - name);
+    emit(parser, DERIVED_OP_EVENT, event, 0.0);
+  } else if (c == '(') {
+    parser->next++;
+    parse_expression(parser);
+    skip_spaces(parser);
+    if (*parser->next != ')') {
+      fail(parser, "missing )");
+      return;
+    }
+    parser->next++;
+  } else if (c == '\0') {
+    fail(parser, "unexpected end");
+  } else {
+    fail(parser, "unexpected \"%s\"", parser->next);
+  }
+}
+
+// unary := '-' unary | primary
+static void parse_unary(derived_parser_t* parser) {
+  skip_spaces(parser);
+  if (*parser->next == '-') {
+    parser->next++;
+    parse_unary(parser);
+    emit(parser, DERIVED_OP_NEGATE, -1, 0.0);
+  } else {
+    parse_primary(parser);
+  }
+}
+
+// term := unary (('*' | '/') unary)*
+static void parse_term(derived_parser_t* parser) {
+  parse_unary(parser);
+  while (!parser->failed) {
+    skip_spaces(parser);
+    char c = *parser->next;
+    if (c != '*' && c != '/') {
+      break;
+    }
+    parser->next++;
+    parse_unary(parser);
+    emit(parser, c == '*' ? DERIVED_OP_MULTIPLY : DERIVED_OP_DIVIDE, -1, 0.0);
+  }
+}
+
+// expression := term (('+' | '-') term)*
+static void parse_expression(derived_parser_t* parser) {
+  parse_term(parser);
+  while (!parser->failed) {
+    skip_spaces(parser);
+    char c = *parser->next;
+    if (c != '+' && c != '-') {
+      break;
+    }
+    parser->next++;
+    parse_term(parser);
+    emit(parser, c == '+' ? DERIVED_OP_ADD : DERIVED_OP_SUBTRACT, -1, 0.0);
+  }
+}
+
+int compile_derived_metric(const char* name, const char* expression,
+                           const char** events, const char** aliases,
+                           int num_of_events, derived_metric_t* metric,
+                           char* error, size_t error_size) {
+  derived_parser_t parser;
+  parser.next = expression;
+  parser.events = events;
+  parser.aliases = aliases;
+  parser.num_of_events = num_of_events;
+  parser.metric = metric;
+  parser.failed = 0;
+  parser.error = error;
+  parser.error_size = error_size;
+
+  memset(metric, 0, sizeof(derived_metric_t));
+  if (strlen(name) >= DERIVED_NAME_LENGTH) {
+    fail(&parser, "name too long (max is %d)", DERIVED_NAME_LENGTH - 1);
+    return -1;
+  }
+  strcpy(metric->name, name);
+
+  parse_expression(&parser);
+  skip_spaces(&parser);
+  if (*parser.next != '\0') {
+    fail(&parser, "unexpected \"%s\"", parser.next);
+  }
+  return parser.failed ? -1 : 0;
+}
+
+double evaluate_derived_metric(const derived_metric_t* metric,
+                               const unsigned long long* counts) {
+  // A valid metric never needs more than one slot per operation
+  double stack[MAX_DERIVED_OPS];
+  int depth = 0;
+  int i;
+  for (i = 0; i < metric->num_of_ops; i++) {
+    const derived_op_t* op = &metric->ops[i];
+    switch (op->code) {
+      case DERIVED_OP_EVENT:
+        stack[depth++] = counts[op->event];
+        break;
+      case DERIVED_OP_CONSTANT:
+        stack[depth++] = op->constant;
+        break;
+      case DERIVED_OP_ADD:
+        depth--;
+        stack[depth - 1] += stack[depth];
+        break;
+      case DERIVED_OP_SUBTRACT:
+        depth--;
+        stack[depth - 1] -= stack[depth];
+        break;
+      case DERIVED_OP_MULTIPLY:
+        depth--;
+        stack[depth - 1] *= stack[depth];
+        break;
+      case DERIVED_OP_DIVIDE:
+        depth--;
+        stack[depth - 1] =
+            stack[depth] != 0.0 ? stack[depth - 1] / stack[depth] : 0.0;
+        break;
+      case DERIVED_OP_NEGATE:
+        stack[depth - 1] = -stack[depth - 1];
+        break;
+    }
+  }
+  return depth == 1 ? stack[0] : 0.0;
+}
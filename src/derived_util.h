@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __DERIVED_UTIL__
+#define __DERIVED_UTIL__
+
+#include <stddef.h>
+
+// Max number of derived metrics
+#define MAX_DERIVED_METRICS 16
+
+// Max length of the name of a derived metric
+#define DERIVED_NAME_LENGTH 128
+
+// Max number of operations a metric compiles to
+#define MAX_DERIVED_OPS 64
+
+// Operations of the compiled metrics, which run on a stack
+typedef enum {
+  // Pushes the count of an event
+  DERIVED_OP_EVENT = 0x00,
+  // Pushes a constant
+  DERIVED_OP_CONSTANT = 0x01,
+  // Pop two values, and push the result
+  DERIVED_OP_ADD = 0x02,
+  DERIVED_OP_SUBTRACT = 0x03,
+  DERIVED_OP_MULTIPLY = 0x04,
+  DERIVED_OP_DIVIDE = 0x05,
+  // Pops one value, and pushes its negation
+  DERIVED_OP_NEGATE = 0x06,
+} derived_op_code_t;
+
+typedef struct derived_op {
+  short code;
+  // Index of the event for DERIVED_OP_EVENT
+  int event;
+  // Value for DERIVED_OP_CONSTANT
+  double constant;
+} derived_op_t;
+
+/*
+ * A metric computed from the counts of the PMU events of an interval, e.g.,
+ * "instructions/cycles" or "1000*llc_miss/instructions". The
+ * expression can use numbers, + - * /, parentheses, and the events, which are
+ * named by
+ * (1) their whole name, e.g., perf::PERF_COUNT_HW_BRANCH_MISSES,
+ * (2) their name without the PMU prefix, e.g., PERF_COUNT_HW_BRANCH_MISSES,
+ *     if only one event has that name,
+ * (3) their alias, if they have one, e.g., skx::LONGEST_LAT_CACHE:MISS for
+ *     llc_miss from the event catalog, or
+ * (4) their whole name in braces if it has any other characters, e.g.,
+ *     {perf::CONTEXT-SWITCHES}.
+ * It is parsed once at startup into postfix operations, so that evaluating
+ * it for every row is a single pass without any lookups.
+ */
+typedef struct derived_metric {
+  char name[DERIVED_NAME_LENGTH];
+  derived_op_t ops[MAX_DERIVED_OPS];
+  int num_of_ops;
+} derived_metric_t;
+
+// Compiles the expression against the list of events, and their aliases,
+// which may be NULL. Returns 0 on success, or -1 with the reason written into
+// error.
+int compile_derived_metric(const char* name, const char* expression,
+                           const char** events, const char** aliases,
+                           int num_of_events, derived_metric_t* metric,
+                           char* error, size_t error_size);
+
+// The value of the metric for the counts of one row of events, where a
+// division by zero gives 0
+double evaluate_derived_metric(const derived_metric_t* metric,
+                               const unsigned long long* counts);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "event_util.h"
+
+#include "log_util.h"
+
+#include <perfmon/pfmlib_perf_event.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Max length of the name of a PMU model
+#define PMU_MODEL_NAME_LENGTH 64
+
+// Max length of an encoding in the catalog
+#define CATALOG_ENCODING_LENGTH 256
+
+typedef struct catalog_entry {
+  // Name of the event in the configuration
+  const char* name;
+  // Name of the core PMU model as detected by libpfm, or NULL for a generic
+  // perf event, which any model falls back to
+  const char* pmu;
+  const char* event;
+} catalog_entry_t;
+
+// The encodings of every event, which are tried in order
+static const catalog_entry_t catalog[] = {
+  // Misses of the last level cache
+  {"llc_miss", "ivb_ep", "LAST_LEVEL_CACHE_MISSES"},
+  {"llc_miss", "hsw_ep", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", "bdw_ep", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", "skl", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", "skx", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", "icl", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", "icx", "LONGEST_LAT_CACHE:MISS"},
+  {"llc_miss", NULL, "perf::PERF_COUNT_HW_CACHE_MISSES"},
+
+  // Instruction fetches that miss the L2 cache
+  {"l2_code_miss", "ivb_ep", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "hsw_ep", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "bdw_ep", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "skl", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "skx", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "icl", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "icx", "L2_RQSTS:CODE_RD_MISS"},
+  {"l2_code_miss", "amd64_fam17h_zen1",
+   "CORE_TO_L2_CACHEABLE_REQUEST_ACCESS_STATUS:IC_FILL_MISS"},
+  {"l2_code_miss", "amd64_fam17h_zen2",
+   "CORE_TO_L2_CACHEABLE_REQUEST_ACCESS_STATUS:IC_FILL_MISS"},
+  {"l2_code_miss", "amd64_fam19h_zen3",
+   "CORE_TO_L2_CACHEABLE_REQUEST_ACCESS_STATUS:IC_FILL_MISS"},
+  {"l2_code_miss", "amd64_fam19h_zen4",
+   "CORE_TO_L2_CACHEABLE_REQUEST_ACCESS_STATUS:IC_FILL_MISS"},
+
+  // Demand data reads served by the memory of the local NUMA node. The
+  // client models, e.g., skl and icl, have no remote counterpart, and use
+  // the generic pair instead.
+  {"numa_local", "ivb_ep",
+   "OFFCORE_RESPONSE_1:DMND_DATA_RD:LLC_MISS_LOCAL:SNP_MISS:SNP_NO_FWD"},
+  {"numa_local", "hsw_ep", "MEM_LOAD_UOPS_L3_MISS_RETIRED:LOCAL_DRAM"},
+  {"numa_local", "bdw_ep", "MEM_LOAD_UOPS_L3_MISS_RETIRED:LOCAL_DRAM"},
+  {"numa_local", "skx", "MEM_LOAD_L3_MISS_RETIRED:LOCAL_DRAM"},
+  {"numa_local", "icx", "MEM_LOAD_L3_MISS_RETIRED:LOCAL_DRAM"},
+  {"numa_local", "amd64_fam17h_zen2",
+   "DATA_CACHE_REFILLS_FROM_SYSTEM:LS_MABRESP_LCL_DRAM"},
+  {"numa_local", "amd64_fam19h_zen3",
+   "DEMAND_DATA_CACHE_FILLS_FROM_SYSTEM:MEM_IO_LCL"},
+  {"numa_local", "amd64_fam19h_zen4",
+   "DEMAND_DATA_CACHE_FILLS_FROM_SYSTEM:DRAM_IO_NEAR"},
+  {"numa_local", NULL, "perf::PERF_COUNT_HW_CACHE_NODE:ACCESS"},
+
+  // And by the memory of a remote NUMA node
+  {"numa_remote", "ivb_ep",
+   "OFFCORE_RESPONSE_0:DMND_DATA_RD:LLC_MISS_REMOTE:SNP_MISS:SNP_NO_FWD"},
+  {"numa_remote", "hsw_ep", "MEM_LOAD_UOPS_L3_MISS_RETIRED:REMOTE_DRAM"},
+  {"numa_remote", "bdw_ep", "MEM_LOAD_UOPS_L3_MISS_RETIRED:REMOTE_DRAM"},
+  {"numa_remote", "skx", "MEM_LOAD_L3_MISS_RETIRED:REMOTE_DRAM"},
+  {"numa_remote", "icx", "MEM_LOAD_L3_MISS_RETIRED:REMOTE_DRAM"},
+  {"numa_remote", "amd64_fam17h_zen2",
+   "DATA_CACHE_REFILLS_FROM_SYSTEM:LS_MABRESP_RMT_DRAM"},
+  {"numa_remote", "amd64_fam19h_zen3",
+   "DEMAND_DATA_CACHE_FILLS_FROM_SYSTEM:MEM_IO_RMT"},
+  {"numa_remote", "amd64_fam19h_zen4",
+   "DEMAND_DATA_CACHE_FILLS_FROM_SYSTEM:DRAM_IO_FAR"},
+  {"numa_remote", NULL, "perf::PERF_COUNT_HW_CACHE_NODE:MISS"},
+};
+
+#define CATALOG_SIZE (sizeof(catalog) / sizeof(catalog[0]))
+
+// Events that are only meaningful together, e.g., in a ratio, and are always
+// resolved from the same PMU model, or both from the generic events
+static const char* catalog_pairs[][2] = {
+  {"numa_local", "numa_remote"},
+};
+
+#define CATALOG_PAIRS_SIZE (sizeof(catalog_pairs) / sizeof(catalog_pairs[0]))
+
+// The core PMUs present on this machine
+static char pmu_models[MAX_PMU_MODELS][PMU_MODEL_NAME_LENGTH];
+static int num_of_pmu_models;
+
+void init_event_catalog(void) {
+  int ret = pfm_initialize();
+  if (ret != PFM_SUCCESS) {
+    logging(LOG_CODE_FATAL, "Cannot initialize library: %s", pfm_strerror(ret));
+  }
+
+  num_of_pmu_models = 0;
+  pfm_pmu_t pmu;
+  pfm_for_all_pmus(pmu) {
+    pfm_pmu_info_t pmu_info;
+    memset(&pmu_info, 0, sizeof(pmu_info));
+    pmu_info.size = sizeof(pmu_info);
+    if (pfm_get_pmu_info(pmu, &pmu_info) != PFM_SUCCESS ||
+        !pmu_info.is_present || pmu_info.type != PFM_PMU_TYPE_CORE ||
+        num_of_pmu_models == MAX_PMU_MODELS) {
+      continue;
+    }
+    snprintf(pmu_models[num_of_pmu_models], PMU_MODEL_NAME_LENGTH, "%s",
+             pmu_info.name);
+    num_of_pmu_models++;
+    logging(LOG_CODE_INFO, "Detected PMU %s (%s).\n", pmu_info.name,
+            pmu_info.desc);
+  }
+  if (num_of_pmu_models == 0) {
+    logging(LOG_CODE_WARNING,
+            "No core PMU detected, only generic events are available.\n");
+  }
+}
+
+static bool is_pmu_present(const char* pmu) {
+  int i;
+  for (i = 0; i < num_of_pmu_models; i++) {
+    if (strcmp(pmu_models[i], pmu) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether libpfm can encode the event on this machine, in the same way as
+// perf_setup_argv_events() does, and the kernel accepts it. The event is
+// opened for this thread and closed again. If we are not allowed to open it
+// here, it is kept, and its descriptors may still be opened elsewhere.
+static bool is_supported_event(const char* event) {
+  struct perf_event_attr attr;
+  pfm_perf_encode_arg_t arg;
+  memset(&attr, 0, sizeof(attr));
+  memset(&arg, 0, sizeof(arg));
+  attr.size = sizeof(attr);
+  arg.attr = &attr;
+  arg.size = sizeof(arg);
+  if (pfm_get_os_event_encoding(event, PFM_PLM0 | PFM_PLM3,
+                                PFM_OS_PERF_EVENT_EXT, &arg) != PFM_SUCCESS) {
+    return false;
+  }
+
+  attr.disabled = 1;
+  int fd = perf_event_open(&attr, 0, -1, -1, 0);
+  if (fd == -1) {
+    if (errno == EACCES || errno == EPERM) {
+      return true;
+    }
+    logging(LOG_CODE_INFO, "The kernel refuses PMU event %s: %s.\n", event,
+            strerror(errno));
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Writes the encoding of a catalog entry, and returns whether its PMU model is
+// present
+static bool format_entry(const catalog_entry_t* entry, char* encoding,
+                         size_t size) {
+  if (entry->pmu == NULL) {
+    snprintf(encoding, size, "%s", entry->event);
+  } else if (is_pmu_present(entry->pmu)) {
+    snprintf(encoding, size, "%s::%s", entry->pmu, entry->event);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// The event that has to be resolved along with the given one, or NULL
+static const char* find_pair(const char* name) {
+  size_t i;
+  for (i = 0; i < CATALOG_PAIRS_SIZE; i++) {
+    if (strcmp(catalog_pairs[i][0], name) == 0) {
+      return catalog_pairs[i][1];
+    }
+    if (strcmp(catalog_pairs[i][1], name) == 0) {
+      return catalog_pairs[i][0];
+    }
+  }
+  return NULL;
+}
+
+// Whether the paired event has a supported encoding for the same PMU model
+static bool is_pair_supported(const char* pair, const char* pmu) {
+  char candidate[CATALOG_ENCODING_LENGTH];
+  size_t i;
+  for (i = 0; i < CATALOG_SIZE; i++) {
+    if (strcmp(catalog[i].name, pair) == 0 &&
+        (pmu == NULL ? catalog[i].pmu == NULL
+                     : catalog[i].pmu != NULL &&
+                           strcmp(catalog[i].pmu, pmu) == 0) &&
+        format_entry(&catalog[i], candidate, sizeof(candidate)) &&
+        is_supported_event(candidate)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int resolve_event(const char* name, char* encoding, size_t size) {
+  char candidate[CATALOG_ENCODING_LENGTH];
+  const char* pair = find_pair(name);
+  bool in_catalog = false;
+  size_t i;
+  for (i = 0; i < CATALOG_SIZE; i++) {
+    if (strcmp(catalog[i].name, name) != 0) {
+      continue;
+    }
+    in_catalog = true;
+    if (!format_entry(&catalog[i], candidate, sizeof(candidate))) {
+      continue;
+    }
+    if (strlen(candidate) < size && is_supported_event(candidate) &&
+        (pair == NULL || is_pair_supported(pair, catalog[i].pmu))) {
+      strcpy(encoding, candidate);
+      return 0;
+    }
+  }
+
+  // Any other event is used as it is
+  if (!in_catalog && strlen(name) < size && is_supported_event(name)) {
+    strcpy(encoding, name);
+    return 0;
+  }
+  return -1;
+}
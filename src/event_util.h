@@ -0,0 +1,38 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __EVENT_UTIL__
+#define __EVENT_UTIL__
+
+#include <stddef.h>
+
+// Max number of core PMUs detected by libpfm, e.g., the model specific one and
+// the architectural one
+#define MAX_PMU_MODELS 8
+
+/*
+ * A catalog of the events whose encoding depends on the processor, under
+ * names that are the same on every machine, e.g., "llc_miss" or
+ * "numa_remote". Each of them has an encoding for some of the core PMU models
+ * libpfm can detect, e.g., "skx" or "amd64_fam19h_zen3", and may fall back to
+ * a generic perf event on the other models.
+ */
+
+// Detects the core PMUs of this machine with libpfm, which select the
+// encodings of the catalog
+void init_event_catalog(void);
+
+// Resolves an event of the configuration, which is either a name in the
+// catalog, or any event libpfm can encode, e.g., "cycles" or
+// "perf::CONTEXT-SWITCHES". Writes the encoding to use on this machine and
+// returns 0, or returns -1 if the event is not supported here.
+int resolve_event(const char* name, char* encoding, size_t size);
+
+#endif
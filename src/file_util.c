@@ -10,20 +10,49 @@
 
 #include "file_util.h"
 
+#include "format_util.h"
 #include "log_util.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-void read_file(char* filename, char* read_buffer, unsigned int buffer_size) {
-  FILE* fp = fopen(filename, "rb");
-  if (fp == NULL) {
+char* read_file(char* filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     logging(LOG_CODE_FATAL, "Error opening file %s.\n", filename);
   }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    logging(LOG_CODE_FATAL, "Cannot get the size of file %s.\n", filename);
+  }
 
-  fread(read_buffer, buffer_size, 1, fp);
-  fclose(fp);
+  size_t size = file_stat.st_size;
+  char* buffer = malloc(size + 1);
+  if (buffer == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t ret = read(fd, buffer + offset, size - offset);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      logging(LOG_CODE_FATAL,
+              "Cannot read file %s (%zu of %zu bytes read).\n", filename,
+              offset, size);
+    }
+    offset += ret;
+  }
+  buffer[size] = '\0';
+  close(fd);
+  return buffer;
 }
 
 void write_file(char* filename, char* write_buffer, unsigned int size,
@@ -47,41 +76,335 @@ void write_file(char* filename, char* write_buffer, unsigned int size,
   fclose(fp);
 }
 
-void write_all(char* filename, bool append, int num_of_cores,
-               int num_of_processes, int num_of_events,
-               long long irq_info[MAX_NUM_CORES],
-               unsigned long long network_info[8],
-               unsigned int frequency_info[MAX_NUM_CORES],
-               process_external_t* proc_info,
-               unsigned long long pmu_info[MAX_NUM_PROCESSES][MAX_EVENTS]) {
-  FILE* fp;
-  if (append == true) {
-    fp = fopen(filename, "a");
-  } else {
-    fp = fopen(filename, "w");
+void open_file_writer(file_writer_t* writer, char* filename, bool append,
+                      size_t capacity, unsigned long long max_age_ns,
+                      short fsync_policy) {
+  // Reading is needed to check the header when appending to an existing file
+  int flags = O_RDWR | O_CREAT | (append == true ? O_APPEND : O_TRUNC);
+  writer->fd = open(filename, flags, 0644);
+  if (writer->fd == -1) {
+    logging(LOG_CODE_FATAL, "Error openning file %s.\n", filename);
   }
 
-  if (fp == NULL) {
-    logging(LOG_CODE_FATAL, "Error openning file %s.\n", filename);
+  // Round the buffer up to whole pages
+  writer->capacity = (capacity + FILE_WRITER_ALIGNMENT - 1) &
+                     ~(size_t)(FILE_WRITER_ALIGNMENT - 1);
+  if (posix_memalign((void**)&writer->buffer, FILE_WRITER_ALIGNMENT,
+                     writer->capacity) != 0) {
+    logging(LOG_CODE_FATAL, "Cannot allocate a %zu bytes output buffer.\n",
+            writer->capacity);
+  }
+  writer->size = 0;
+  writer->oldest_ns = 0ULL;
+  writer->max_age_ns = max_age_ns;
+  writer->fsync_policy = fsync_policy;
+}
+
+// Writes out the whole chunk, retrying on partial writes and interrupts
+static void write_fully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      logging(LOG_CODE_FATAL, "Error writing to the output file: %s.\n",
+              strerror(errno));
+    }
+    data += ret;
+    size -= ret;
+  }
+}
+
+void flush_file_writer(file_writer_t* writer) {
+  if (writer->size == 0) {
+    return;
   }
 
-  /*
-   * Write the raw bytes to file in the following format:
-   *
-   * (1) irq_info        * num_of_cores
-   * (2) network_info    * num_of_cores
-   * (3) frequency_info  * num_of_cores
-   * (4) proc_info       * num_of_processes
-   * (5) pmu_info        * num_of_processes * num_events
-   */
-  fwrite(irq_info, sizeof(long long), num_of_cores, fp);
-  fwrite(network_info, sizeof(unsigned long long), 8, fp);
-  fwrite(frequency_info, sizeof(unsigned int), num_of_cores, fp);
-  fwrite(proc_info, sizeof(process_external_t), num_of_processes, fp);
+  write_fully(writer->fd, writer->buffer, writer->size);
+  writer->size = 0;
+
+  if (writer->fsync_policy == FSYNC_ON_FLUSH) {
+    fdatasync(writer->fd);
+  }
+}
+
+void append_file_writer(file_writer_t* writer, const void* data, size_t size) {
+  // Make room for the record
+  if (writer->size + size > writer->capacity) {
+    flush_file_writer(writer);
+  }
+
+  // Records larger than the whole buffer go straight to the file
+  if (size > writer->capacity) {
+    write_fully(writer->fd, data, size);
+    if (writer->fsync_policy == FSYNC_ON_FLUSH) {
+      fdatasync(writer->fd);
+    }
+    return;
+  }
+
+  if (writer->size == 0) {
+    writer->oldest_ns = get_time_ns(CLOCK_MONOTONIC);
+  }
+  memcpy(writer->buffer + writer->size, data, size);
+  writer->size += size;
+}
+
+void close_file_writer(file_writer_t* writer) {
+  flush_file_writer(writer);
+  if (writer->fsync_policy != FSYNC_NEVER) {
+    fsync(writer->fd);
+  }
+  close(writer->fd);
+  free(writer->buffer);
+  writer->buffer = NULL;
+  writer->fd = -1;
+}
+
+void write_file_header(file_writer_t* writer, int num_of_cores,
+                       int num_of_processes, int num_of_threads,
+                       int num_of_cgroups, int num_of_profile_entries,
+                       int num_of_events, short pmu_mode,
+                       const char* events[MAX_EVENTS],
+                       int num_of_derived_metrics,
+                       const derived_metric_t* derived_metrics,
+                       const char* profile_event) {
+  int num_of_profile_events = profile_event != NULL ? 1 : 0;
+  size_t header_size = sizeof(file_header_t) +
+                       process_schema_size * sizeof(field_schema_t) +
+                       thread_schema_size * sizeof(field_schema_t) +
+                       cgroup_schema_size * sizeof(field_schema_t) +
+                       profile_schema_size * sizeof(field_schema_t) +
+                       num_of_events * PMU_EVENTS_NAME_LENGTH +
+                       num_of_derived_metrics * PMU_EVENTS_NAME_LENGTH +
+                       NUM_OF_SYSTEM_STATS * SYSTEM_STAT_NAME_LENGTH +
+                       num_of_profile_events * PMU_EVENTS_NAME_LENGTH;
+  char* header_buffer = calloc(1, header_size);
+  if (header_buffer == NULL) {
+    logging(LOG_CODE_FATAL, "Cannot allocate the file header.\n");
+  }
+
+  file_header_t* header = (file_header_t*)header_buffer;
+  memcpy(header->magic, NERVE_FILE_MAGIC, sizeof(header->magic));
+  header->version = NERVE_FORMAT_VERSION;
+  header->endian_marker = NERVE_ENDIAN_MARKER;
+  header->header_size = header_size;
+  header->fixed_header_size = sizeof(file_header_t);
+  header->num_of_cores = num_of_cores;
+  header->num_of_processes = num_of_processes;
+  header->num_of_events = num_of_events;
+  header->pmu_mode = pmu_mode;
+  header->process_record_size = sizeof(process_external_t);
+  header->num_of_process_fields = process_schema_size;
+  header->event_name_length = PMU_EVENTS_NAME_LENGTH;
+  header->num_of_threads = num_of_threads;
+  header->thread_record_size = sizeof(thread_external_t);
+  header->num_of_thread_fields = thread_schema_size;
+  header->num_of_cgroups = num_of_cgroups;
+  header->cgroup_record_size = sizeof(cgroup_external_t);
+  header->num_of_cgroup_fields = cgroup_schema_size;
+  header->num_of_system_stats = NUM_OF_SYSTEM_STATS;
+  header->system_stat_name_length = SYSTEM_STAT_NAME_LENGTH;
+  header->num_of_profile_entries = num_of_profile_entries;
+  header->profile_record_size = sizeof(profile_external_t);
+  header->num_of_profile_fields = profile_schema_size;
+  header->num_of_profile_events = num_of_profile_events;
+  header->num_of_derived_metrics = num_of_derived_metrics;
+
+  char* schema = header_buffer + sizeof(file_header_t);
+  memcpy(schema, process_schema, process_schema_size * sizeof(field_schema_t));
+
+  char* thread_fields = schema + process_schema_size * sizeof(field_schema_t);
+  memcpy(thread_fields, thread_schema,
+         thread_schema_size * sizeof(field_schema_t));
+
+  char* cgroup_fields =
+      thread_fields + thread_schema_size * sizeof(field_schema_t);
+  memcpy(cgroup_fields, cgroup_schema,
+         cgroup_schema_size * sizeof(field_schema_t));
+
+  char* profile_fields =
+      cgroup_fields + cgroup_schema_size * sizeof(field_schema_t);
+  memcpy(profile_fields, profile_schema,
+         profile_schema_size * sizeof(field_schema_t));
+
+  char* event_names =
+      profile_fields + profile_schema_size * sizeof(field_schema_t);
   int i;
-  for (i = 0; i < num_of_processes; i++) {
-    fwrite(pmu_info[i], sizeof(unsigned long long), num_of_events, fp);
+  for (i = 0; i < num_of_events; i++) {
+    strncpy(event_names + i * PMU_EVENTS_NAME_LENGTH, events[i],
+            PMU_EVENTS_NAME_LENGTH - 1);
   }
 
-  fclose(fp);
+  char* derived_metric_names =
+      event_names + num_of_events * PMU_EVENTS_NAME_LENGTH;
+  for (i = 0; i < num_of_derived_metrics; i++) {
+    strncpy(derived_metric_names + i * PMU_EVENTS_NAME_LENGTH,
+            derived_metrics[i].name, PMU_EVENTS_NAME_LENGTH - 1);
+  }
+
+  char* system_stat_names_buffer =
+      derived_metric_names + num_of_derived_metrics * PMU_EVENTS_NAME_LENGTH;
+  for (i = 0; i < NUM_OF_SYSTEM_STATS; i++) {
+    strncpy(system_stat_names_buffer + i * SYSTEM_STAT_NAME_LENGTH,
+            system_stat_names[i], SYSTEM_STAT_NAME_LENGTH - 1);
+  }
+
+  char* profile_event_name =
+      system_stat_names_buffer + NUM_OF_SYSTEM_STATS * SYSTEM_STAT_NAME_LENGTH;
+  if (profile_event != NULL) {
+    strncpy(profile_event_name, profile_event, PMU_EVENTS_NAME_LENGTH - 1);
+  }
+
+  header->crc = crc32_update(0, header_buffer, header_size);
+
+  // Only a file written with the exact same layout can be appended to
+  struct stat file_stat;
+  if (fstat(writer->fd, &file_stat) == -1) {
+    logging(LOG_CODE_FATAL, "Cannot stat the output file.\n");
+  }
+  if (file_stat.st_size == 0) {
+    append_file_writer(writer, header_buffer, header_size);
+  } else {
+    char* existing_header = malloc(header_size);
+    if (existing_header == NULL ||
+        pread(writer->fd, existing_header, header_size, 0) !=
+            (ssize_t)header_size ||
+        memcmp(existing_header, header_buffer, header_size) != 0) {
+      logging(LOG_CODE_FATAL,
+              "The existing output file has a different layout.\n");
+    }
+    free(existing_header);
+  }
+
+  free(header_buffer);
+}
+
+void write_all(file_writer_t* writer,
+               unsigned long long timestamp_ns, unsigned long long window_ns,
+               int num_of_cores, int num_of_processes, int num_of_events,
+               int num_of_derived_metrics, long long* irq_info,
+               unsigned long long network_info[8],
+               unsigned int* frequency_info,
+               unsigned long long system_info[NUM_OF_SYSTEM_STATS],
+               process_external_t* proc_info, short pmu_mode,
+               unsigned long long pmu_info[][PMU_ROW_LENGTH],
+               unsigned long long pmu_core_info[][PMU_ROW_LENGTH],
+               int num_of_threads, thread_external_t* thread_info,
+               unsigned long long pmu_thread_info[][PMU_ROW_LENGTH],
+               int num_of_cgroups, cgroup_external_t* cgroup_info,
+               unsigned long long pmu_cgroup_info[][PMU_ROW_LENGTH],
+               int num_of_profile_entries, profile_external_t* profile_info) {
+  // All the pieces of the record payload, in the order described in
+  // format_util.h
+  struct {
+    const void* data;
+    size_t size;
+  } pieces[5];
+  int num_of_pieces = 0;
+  int i;
+
+  pieces[num_of_pieces].data = irq_info;
+  pieces[num_of_pieces++].size = sizeof(long long) * num_of_cores;
+  pieces[num_of_pieces].data = network_info;
+  pieces[num_of_pieces++].size = sizeof(unsigned long long) * 8;
+  pieces[num_of_pieces].data = frequency_info;
+  pieces[num_of_pieces++].size = sizeof(unsigned int) * num_of_cores;
+  pieces[num_of_pieces].data = system_info;
+  pieces[num_of_pieces++].size =
+      sizeof(unsigned long long) * NUM_OF_SYSTEM_STATS;
+  pieces[num_of_pieces].data = proc_info;
+  pieces[num_of_pieces++].size = sizeof(process_external_t) * num_of_processes;
+
+  // Followed by only the used events, derived metrics and fractions of time
+  // of every row of PMU events
+  unsigned long long (*pmu_rows)[PMU_ROW_LENGTH] = pmu_info;
+  int num_of_pmu_rows = num_of_processes;
+  if (pmu_mode == PMU_MODE_PER_CPU) {
+    pmu_rows = pmu_core_info;
+    num_of_pmu_rows = num_of_cores;
+  } else if (pmu_mode == PMU_MODE_PER_CGROUP) {
+    num_of_pmu_rows = 0;
+  }
+  size_t pmu_row_size = sizeof(unsigned long long) *
+                        (2 * num_of_events + num_of_derived_metrics);
+
+  // And then by the recorded threads, with their own rows of PMU events
+  size_t thread_info_size = sizeof(thread_external_t) * num_of_threads;
+  int num_of_pmu_thread_rows =
+      pmu_mode == PMU_MODE_PER_THREAD ? num_of_threads : 0;
+
+  // And then by the recorded cgroups, likewise
+  size_t cgroup_info_size = sizeof(cgroup_external_t) * num_of_cgroups;
+  int num_of_pmu_cgroup_rows =
+      pmu_mode == PMU_MODE_PER_CGROUP ? num_of_cgroups : 0;
+
+  // And last by the sampled stacks
+  size_t profile_info_size =
+      sizeof(profile_external_t) * num_of_profile_entries;
+
+  // Frame the payload with a timestamped, length-prefixed, CRC-checked header
+  record_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = NERVE_RECORD_MAGIC;
+  header.timestamp_ns = timestamp_ns;
+  header.window_ns = window_ns;
+  header.num_of_processes = num_of_processes;
+  header.num_of_threads = num_of_threads;
+  header.num_of_cgroups = num_of_cgroups;
+  header.num_of_profile_entries = num_of_profile_entries;
+  for (i = 0; i < num_of_pieces; i++) {
+    header.size += pieces[i].size;
+  }
+  header.size += num_of_pmu_rows * pmu_row_size;
+  header.size += thread_info_size + num_of_pmu_thread_rows * pmu_row_size;
+  header.size += cgroup_info_size + num_of_pmu_cgroup_rows * pmu_row_size;
+  header.size += profile_info_size;
+  uint32_t crc = crc32_update(0, &header, sizeof(header));
+  for (i = 0; i < num_of_pieces; i++) {
+    crc = crc32_update(crc, pieces[i].data, pieces[i].size);
+  }
+  for (i = 0; i < num_of_pmu_rows; i++) {
+    crc = crc32_update(crc, pmu_rows[i], pmu_row_size);
+  }
+  crc = crc32_update(crc, thread_info, thread_info_size);
+  for (i = 0; i < num_of_pmu_thread_rows; i++) {
+    crc = crc32_update(crc, pmu_thread_info[i], pmu_row_size);
+  }
+  crc = crc32_update(crc, cgroup_info, cgroup_info_size);
+  for (i = 0; i < num_of_pmu_cgroup_rows; i++) {
+    crc = crc32_update(crc, pmu_cgroup_info[i], pmu_row_size);
+  }
+  crc = crc32_update(crc, profile_info, profile_info_size);
+  header.crc = crc;
+
+  append_file_writer(writer, &header, sizeof(header));
+  for (i = 0; i < num_of_pieces; i++) {
+    append_file_writer(writer, pieces[i].data, pieces[i].size);
+  }
+  for (i = 0; i < num_of_pmu_rows; i++) {
+    append_file_writer(writer, pmu_rows[i], pmu_row_size);
+  }
+  if (thread_info_size > 0) {
+    append_file_writer(writer, thread_info, thread_info_size);
+  }
+  for (i = 0; i < num_of_pmu_thread_rows; i++) {
+    append_file_writer(writer, pmu_thread_info[i], pmu_row_size);
+  }
+  if (cgroup_info_size > 0) {
+    append_file_writer(writer, cgroup_info, cgroup_info_size);
+  }
+  for (i = 0; i < num_of_pmu_cgroup_rows; i++) {
+    append_file_writer(writer, pmu_cgroup_info[i], pmu_row_size);
+  }
+  if (profile_info_size > 0) {
+    append_file_writer(writer, profile_info, profile_info_size);
+  }
+
+  // Do not keep records around for too long, in case we crash
+  if (writer->size > 0 &&
+      get_time_ns(CLOCK_MONOTONIC) - writer->oldest_ns >= writer->max_age_ns) {
+    flush_file_writer(writer);
+  }
 }
@@ -11,22 +11,76 @@
 #ifndef __FILE_UTIL__
 #define __FILE_UTIL__
 
+#include "cgroup_sample.h"
 #include "pmu_sample.h"
 #include "proc_sample.h"
+#include "profile_sample.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
-void read_file(char* filename, char* read_buffer, unsigned int buffer_size);
+// Alignment of the output buffer
+#define FILE_WRITER_ALIGNMENT 4096
+
+// When the output file is synced to disk
+typedef enum {
+  FSYNC_NEVER = 0x00,
+  FSYNC_ON_FLUSH = 0x01,
+  FSYNC_ON_CLOSE = 0x02,
+} fsync_policy_t;
+
+// An output file that is kept open, with the records appended to a buffer
+// which is only written out when it is full, too old, or closed
+typedef struct file_writer {
+  int fd;
+  char* buffer;
+  size_t capacity;
+  size_t size;
+  // When the oldest buffered record was appended (CLOCK_MONOTONIC)
+  unsigned long long oldest_ns;
+  unsigned long long max_age_ns;
+  short fsync_policy;
+} file_writer_t;
+
+// Reads a whole file into a null-terminated buffer, which the caller frees
+char* read_file(char* filename);
 
 void write_file(char* filename, char* write_buffer, unsigned int size,
                 bool append);
 
-void write_all(char* filename, bool append, int num_of_cores,
-               int num_of_processes, int num_of_events,
-               long long irq_info[MAX_NUM_CORES],
+void open_file_writer(file_writer_t* writer, char* filename, bool append,
+                      size_t capacity, unsigned long long max_age_ns,
+                      short fsync_policy);
+
+void append_file_writer(file_writer_t* writer, const void* data, size_t size);
+
+void flush_file_writer(file_writer_t* writer);
+
+void close_file_writer(file_writer_t* writer);
+
+void write_file_header(file_writer_t* writer, int num_of_cores,
+                       int num_of_processes, int num_of_threads,
+                       int num_of_cgroups, int num_of_profile_entries,
+                       int num_of_events, short pmu_mode,
+                       const char* events[MAX_EVENTS],
+                       int num_of_derived_metrics,
+                       const derived_metric_t* derived_metrics,
+                       const char* profile_event);
+
+void write_all(file_writer_t* writer,
+               unsigned long long timestamp_ns, unsigned long long window_ns,
+               int num_of_cores, int num_of_processes, int num_of_events,
+               int num_of_derived_metrics, long long* irq_info,
                unsigned long long network_info[8],
-               unsigned int frequency_info[MAX_NUM_CORES],
-               process_external_t* proc_info,
-               unsigned long long pmu_info[MAX_NUM_PROCESSES][MAX_EVENTS]);
+               unsigned int* frequency_info,
+               unsigned long long system_info[NUM_OF_SYSTEM_STATS],
+               process_external_t* proc_info, short pmu_mode,
+               unsigned long long pmu_info[][PMU_ROW_LENGTH],
+               unsigned long long pmu_core_info[][PMU_ROW_LENGTH],
+               int num_of_threads, thread_external_t* thread_info,
+               unsigned long long pmu_thread_info[][PMU_ROW_LENGTH],
+               int num_of_cgroups, cgroup_external_t* cgroup_info,
+               unsigned long long pmu_cgroup_info[][PMU_ROW_LENGTH],
+               int num_of_profile_entries, profile_external_t* profile_info);
 
 #endif
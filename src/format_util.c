@@ -0,0 +1,124 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "format_util.h"
+
+#include "cgroup_sample.h"
+#include "proc_sample.h"
+#include "profile_sample.h"
+
+#define PROCESS_FIELD(field, type)                     \
+  { #field, type, offsetof(process_external_t, field), \
+    sizeof(((process_external_t*)0)->field) }
+
+const field_schema_t process_schema[] = {
+  PROCESS_FIELD(process_id, FIELD_TYPE_UINT32),
+  PROCESS_FIELD(cpu_affinity, FIELD_TYPE_UINT64),
+  PROCESS_FIELD(page_fault_rate, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(cpu_utilization, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(v_ctxt_switch_rate, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(nv_ctxt_switch_rate, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(io_read_rate, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(io_write_rate, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(virtual_mem_utilization, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(real_mem_utilization, FIELD_TYPE_FLOAT),
+  PROCESS_FIELD(cgroup_id, FIELD_TYPE_UINT64),
+  PROCESS_FIELD(cpu_time_ns, FIELD_TYPE_UINT64),
+  PROCESS_FIELD(run_delay_ns, FIELD_TYPE_UINT64),
+};
+
+const unsigned int process_schema_size =
+    sizeof(process_schema) / sizeof(process_schema[0]);
+
+#define THREAD_FIELD(field, type)                     \
+  { #field, type, offsetof(thread_external_t, field), \
+    sizeof(((thread_external_t*)0)->field) }
+
+const field_schema_t thread_schema[] = {
+  THREAD_FIELD(thread_id, FIELD_TYPE_UINT32),
+  THREAD_FIELD(process_id, FIELD_TYPE_UINT32),
+  THREAD_FIELD(processor, FIELD_TYPE_UINT32),
+  THREAD_FIELD(cpu_utilization, FIELD_TYPE_FLOAT),
+  THREAD_FIELD(v_ctxt_switch_rate, FIELD_TYPE_FLOAT),
+  THREAD_FIELD(nv_ctxt_switch_rate, FIELD_TYPE_FLOAT),
+};
+
+const unsigned int thread_schema_size =
+    sizeof(thread_schema) / sizeof(thread_schema[0]);
+
+#define CGROUP_FIELD(field, type)                     \
+  { #field, type, offsetof(cgroup_external_t, field), \
+    sizeof(((cgroup_external_t*)0)->field) }
+
+const field_schema_t cgroup_schema[] = {
+  CGROUP_FIELD(cgroup_id, FIELD_TYPE_UINT64),
+  CGROUP_FIELD(path, FIELD_TYPE_STRING),
+  CGROUP_FIELD(num_of_processes, FIELD_TYPE_UINT32),
+  CGROUP_FIELD(cpu_utilization, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_user_utilization, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_system_utilization, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_throttled_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_throttled_utilization, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_pressure_some, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(cpu_pressure_full, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(page_fault_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(major_page_fault_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(io_read_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(io_write_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(io_read_ops_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(io_write_ops_rate, FIELD_TYPE_FLOAT),
+  CGROUP_FIELD(memory_current, FIELD_TYPE_UINT64),
+  CGROUP_FIELD(memory_anon, FIELD_TYPE_UINT64),
+  CGROUP_FIELD(memory_file, FIELD_TYPE_UINT64),
+};
+
+const unsigned int cgroup_schema_size =
+    sizeof(cgroup_schema) / sizeof(cgroup_schema[0]);
+
+#define PROFILE_FIELD(field, type)                     \
+  { #field, type, offsetof(profile_external_t, field), \
+    sizeof(((profile_external_t*)0)->field) }
+
+const field_schema_t profile_schema[] = {
+  PROFILE_FIELD(process_id, FIELD_TYPE_UINT32),
+  PROFILE_FIELD(count, FIELD_TYPE_UINT32),
+  PROFILE_FIELD(depth, FIELD_TYPE_UINT32),
+  PROFILE_FIELD(ips, FIELD_TYPE_UINT64_ARRAY),
+};
+
+const unsigned int profile_schema_size =
+    sizeof(profile_schema) / sizeof(profile_schema[0]);
+
+// The standard (reflected, 0xEDB88320) CRC-32, as used by zlib
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size) {
+  static uint32_t crc_table[256];
+  static int crc_table_ready = 0;
+  const unsigned char* bytes = (const unsigned char*)data;
+  size_t i;
+
+  // Build the lookup table on the first call
+  if (!crc_table_ready) {
+    uint32_t n, k;
+    for (n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+      }
+      crc_table[n] = c;
+    }
+    crc_table_ready = 1;
+  }
+
+  crc = ~crc;
+  for (i = 0; i < size; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
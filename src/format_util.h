@@ -0,0 +1,173 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __FORMAT_UTIL__
+#define __FORMAT_UTIL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Layout of the binary output file:
+ *
+ * (1) file_header_t, of fixed_header_size bytes
+ * (2) field_schema_t   * num_of_process_fields   (layout of proc_info)
+ * (3) field_schema_t   * num_of_thread_fields    (layout of thread_info)
+ * (4) field_schema_t   * num_of_cgroup_fields    (layout of cgroup_info)
+ * (5) field_schema_t   * num_of_profile_fields   (layout of profile_info)
+ * (6) char[event_name_length] * num_of_events    (PMU event names)
+ * (7) char[event_name_length] * num_of_derived_metrics
+ *                                                (derived metric names)
+ * (8) char[system_stat_name_length] * num_of_system_stats
+ *                                                (system statistic names)
+ * (9) char[event_name_length] * num_of_profile_events
+ *                                                (sampling event name, if
+ *                                                 profiling)
+ * (10) records, each of which is a record_header_t followed by its payload:
+ *     (a) irq_info        long long          * num_of_cores
+ *     (b) network_info    unsigned long long * 8
+ *     (c) frequency_info  unsigned int       * num_of_cores
+ *     (d) system_info     unsigned long long * num_of_system_stats
+ *     (e) proc_info       process_record_size * num_of_processes
+ *     (f) pmu_info        pmu row * num_of_processes (per-thread mode), or
+ *         pmu_core_info   pmu row * num_of_cores (per-cpu mode), or nothing
+ *                         (per-cgroup mode)
+ *     (g) thread_info     thread_record_size * num_of_threads
+ *     (h) pmu_thread_info pmu row * num_of_threads (per-thread mode only)
+ *     (i) cgroup_info     cgroup_record_size * num_of_cgroups
+ *     (j) pmu_cgroup_info pmu row * num_of_cgroups (per-cgroup mode only)
+ *     (k) profile_info    profile_record_size * num_of_profile_entries
+ *
+ * A pmu row is unsigned long long * num_of_events (the counts), followed by
+ * double * num_of_derived_metrics (the metrics computed from them), and by
+ * double * num_of_events (the fraction of the time each event was enabled in
+ * which it was counted, time_running / time_enabled, or 0 if it was not
+ * enabled, e.g., because its set of events was not counting).
+ *
+ * All the values are in the byte order of the host that wrote the file, which
+ * can be told by endian_marker.
+ *
+ * New fields are only ever appended to file_header_t, and a file written
+ * before them has a shorter fixed header, whose missing fields are read as 0.
+ * The version only changes when the meaning of the fields or the layout of
+ * the records does, and a reader takes any version up to its own.
+ */
+
+#define NERVE_FILE_MAGIC "NERVEBIN"
+
+#define NERVE_FORMAT_VERSION 1
+
+#define NERVE_ENDIAN_MARKER 0x01020304
+
+// Values of pmu_mode in the header, which match pmu_mode_t
+#define FORMAT_PMU_MODE_PER_THREAD 0x00
+#define FORMAT_PMU_MODE_PER_CPU 0x01
+#define FORMAT_PMU_MODE_PER_CGROUP 0x02
+
+// Marks the start of every record, so that a reader can resynchronize
+#define NERVE_RECORD_MAGIC 0x5256524e
+
+// Max length of a field name in the schema
+#define FIELD_NAME_LENGTH 32
+
+// Types of the fields in the schema
+typedef enum {
+  FIELD_TYPE_UINT32 = 0x00,
+  FIELD_TYPE_UINT64 = 0x01,
+  FIELD_TYPE_FLOAT = 0x02,
+  FIELD_TYPE_DOUBLE = 0x03,
+  // Null-terminated unless it takes up the whole field
+  FIELD_TYPE_STRING = 0x04,
+  // As many values as fit in the field
+  FIELD_TYPE_UINT64_ARRAY = 0x05,
+} field_type_t;
+
+// The fields up to num_of_cores are the same in every version
+typedef struct file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian_marker;
+  // Size of the header, including the schema and the event names
+  uint32_t header_size;
+  // Size of this struct as written, after which the schema starts
+  uint32_t fixed_header_size;
+  // CRC-32 of the whole header, computed with this field set to 0
+  uint32_t crc;
+  uint32_t num_of_cores;
+  uint32_t num_of_processes;
+  uint32_t num_of_events;
+  uint32_t pmu_mode;
+  uint32_t process_record_size;
+  uint32_t num_of_process_fields;
+  uint32_t event_name_length;
+  // Max number of threads in a record
+  uint32_t num_of_threads;
+  uint32_t thread_record_size;
+  uint32_t num_of_thread_fields;
+  // Max number of cgroups in a record
+  uint32_t num_of_cgroups;
+  uint32_t cgroup_record_size;
+  uint32_t num_of_cgroup_fields;
+  // System-wide counters of every record, deltas over the sample window
+  uint32_t num_of_system_stats;
+  uint32_t system_stat_name_length;
+  // Max number of sampled stacks in a record
+  uint32_t num_of_profile_entries;
+  uint32_t profile_record_size;
+  uint32_t num_of_profile_fields;
+  // 1 if the stacks are sampled, or 0
+  uint32_t num_of_profile_events;
+  // Metrics computed from the PMU events of every row
+  uint32_t num_of_derived_metrics;
+} file_header_t;
+
+typedef struct field_schema {
+  char name[FIELD_NAME_LENGTH];
+  uint32_t type;
+  uint32_t offset;
+  uint32_t size;
+} field_schema_t;
+
+typedef struct record_header {
+  uint32_t magic;
+  // Size of the payload following this header
+  uint32_t size;
+  // Wall-clock time at the end of the sample window
+  uint64_t timestamp_ns;
+  // Measured length of the sample window
+  uint64_t window_ns;
+  uint32_t num_of_processes;
+  // CRC-32 of this header and the payload, computed with this field set to 0
+  uint32_t crc;
+  uint32_t num_of_threads;
+  uint32_t num_of_cgroups;
+  uint32_t num_of_profile_entries;
+  uint32_t reserved;
+} record_header_t;
+
+// The layout of process_external_t, which has to be kept in sync with it
+extern const field_schema_t process_schema[];
+extern const unsigned int process_schema_size;
+
+// The layout of thread_external_t, which has to be kept in sync with it
+extern const field_schema_t thread_schema[];
+extern const unsigned int thread_schema_size;
+
+// The layout of cgroup_external_t, which has to be kept in sync with it
+extern const field_schema_t cgroup_schema[];
+extern const unsigned int cgroup_schema_size;
+
+// The layout of profile_external_t, which has to be kept in sync with it
+extern const field_schema_t profile_schema[];
+extern const unsigned int profile_schema_size;
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size);
+
+#endif
@@ -0,0 +1,511 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "lifecycle_util.h"
+
+#include "log_util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+
+// Size of the buffer the requests to the kernel are built in
+#define LIFECYCLE_REQUEST_SIZE 256
+
+// First taskstats version with ac_tgid
+#define TASKSTATS_TGID_VERSION 12
+
+// Number of thread groups the list of partly exited ones starts with
+#define LIFECYCLE_INITIAL_GROUPS 64
+
+// Number of exits the list of the ones kept until the end of the batches
+// starts with
+#define LIFECYCLE_INITIAL_EXITS 64
+
+// Lets the sockets hold the events of a whole sample interval, beyond
+// rmem_max if we are allowed to
+static void set_socket_buffer(int fd) {
+  int size = LIFECYCLE_SOCKET_BUFFER_SIZE;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+}
+
+// Opens a netlink connector socket subscribed to the proc events
+static int open_connector(void) {
+  int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  set_socket_buffer(fd);
+
+  char buffer[LIFECYCLE_REQUEST_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  memset(buffer, 0, sizeof(buffer));
+  struct nlmsghdr* header = (struct nlmsghdr*)buffer;
+  header->nlmsg_len =
+      NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+  header->nlmsg_type = NLMSG_DONE;
+  struct cn_msg* message = (struct cn_msg*)NLMSG_DATA(header);
+  message->id.idx = CN_IDX_PROC;
+  message->id.val = CN_VAL_PROC;
+  message->len = sizeof(enum proc_cn_mcast_op);
+  *(enum proc_cn_mcast_op*)message->data = PROC_CN_MCAST_LISTEN;
+  if (send(fd, buffer, header->nlmsg_len, 0) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends a generic netlink request with a single attribute
+static int send_genl_request(int fd, int family, int flags, int command,
+                             int attr_type, const void* data, int size) {
+  char buffer[LIFECYCLE_REQUEST_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  if (NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + NLA_ALIGN(size)) >
+      sizeof(buffer)) {
+    return -1;
+  }
+  memset(buffer, 0, sizeof(buffer));
+  struct nlmsghdr* header = (struct nlmsghdr*)buffer;
+  header->nlmsg_type = family;
+  header->nlmsg_flags = NLM_F_REQUEST | flags;
+  struct genlmsghdr* genl = (struct genlmsghdr*)NLMSG_DATA(header);
+  genl->cmd = command;
+  genl->version = TASKSTATS_GENL_VERSION;
+  struct nlattr* attr = (struct nlattr*)((char*)genl + GENL_HDRLEN);
+  attr->nla_type = attr_type;
+  attr->nla_len = NLA_HDRLEN + size;
+  memcpy((char*)attr + NLA_HDRLEN, data, size);
+  header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(attr->nla_len));
+
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (sendto(fd, buffer, header->nlmsg_len, 0, (struct sockaddr*)&addr,
+             sizeof(addr)) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// Returns the first attribute of the given type among size bytes of
+// attributes, or NULL if there is none
+static struct nlattr* find_attr(void* attrs, int size, int type) {
+  struct nlattr* attr = (struct nlattr*)attrs;
+  while (size >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN &&
+         attr->nla_len <= size) {
+    if ((attr->nla_type & NLA_TYPE_MASK) == type) {
+      return attr;
+    }
+    size -= NLA_ALIGN(attr->nla_len);
+    attr = (struct nlattr*)((char*)attr + NLA_ALIGN(attr->nla_len));
+  }
+  return NULL;
+}
+
+// Looks up the ID of the taskstats generic netlink family
+static int get_taskstats_family(int fd) {
+  if (send_genl_request(fd, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY,
+                        CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME,
+                        sizeof(TASKSTATS_GENL_NAME)) == -1) {
+    return -1;
+  }
+  char buffer[LIFECYCLE_BUFFER_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+  struct nlmsghdr* header = (struct nlmsghdr*)buffer;
+  if (size <= 0 || !NLMSG_OK(header, size) ||
+      header->nlmsg_type != GENL_ID_CTRL) {
+    return -1;
+  }
+  struct nlattr* attr =
+      find_attr((char*)NLMSG_DATA(header) + GENL_HDRLEN,
+                header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                CTRL_ATTR_FAMILY_ID);
+  if (attr == NULL) {
+    return -1;
+  }
+  return *(__u16*)((char*)attr + NLA_HDRLEN);
+}
+
+// Opens a generic netlink socket that receives the taskstats of every task
+// exiting on any CPU
+static int open_taskstats(int* family) {
+  int fd = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  set_socket_buffer(fd);
+
+  *family = get_taskstats_family(fd);
+  if (*family == -1) {
+    close(fd);
+    return -1;
+  }
+
+  // Register for all the CPUs, and wait for the acknowledgement, ignoring
+  // the exits that may already come in before it
+  char cpumask[32];
+  snprintf(cpumask, sizeof(cpumask), "0-%ld",
+           sysconf(_SC_NPROCESSORS_CONF) - 1);
+  if (send_genl_request(fd, *family, NLM_F_ACK, TASKSTATS_CMD_GET,
+                        TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask,
+                        strlen(cpumask) + 1) == -1) {
+    close(fd);
+    return -1;
+  }
+  char buffer[LIFECYCLE_BUFFER_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  while (true) {
+    ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+    if (size == -1 && (errno == EINTR || errno == ENOBUFS)) {
+      continue;
+    }
+    if (size <= 0) {
+      close(fd);
+      return -1;
+    }
+    struct nlmsghdr* header;
+    for (header = (struct nlmsghdr*)buffer; NLMSG_OK(header, size);
+         header = NLMSG_NEXT(header, size)) {
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr* error = (struct nlmsgerr*)NLMSG_DATA(header);
+        if (error->error != 0) {
+          close(fd);
+          return -1;
+        }
+        return fd;
+      }
+    }
+  }
+}
+
+int init_lifecycle(lifecycle_t* lifecycle) {
+  lifecycle->taskstats_fd = -1;
+  lifecycle->groups = NULL;
+  lifecycle->num_of_groups = 0;
+  lifecycle->groups_capacity = 0;
+  lifecycle->exits = NULL;
+  lifecycle->num_of_exits = 0;
+  lifecycle->exits_capacity = 0;
+  lifecycle->connector_fd = open_connector();
+  if (lifecycle->connector_fd == -1) {
+    return -1;
+  }
+  lifecycle->taskstats_fd = open_taskstats(&lifecycle->taskstats_family);
+  if (lifecycle->taskstats_fd == -1) {
+    clean_lifecycle(lifecycle);
+    return -1;
+  }
+  return 0;
+}
+
+// Reports the process events of a batch of connector messages
+static void handle_connector_messages(char* buffer, ssize_t size,
+                                      lifecycle_handler_t handler,
+                                      void* arg) {
+  struct nlmsghdr* header;
+  for (header = (struct nlmsghdr*)buffer; NLMSG_OK(header, size);
+       header = NLMSG_NEXT(header, size)) {
+    if (header->nlmsg_type == NLMSG_ERROR ||
+        header->nlmsg_type == NLMSG_NOOP) {
+      continue;
+    }
+    struct cn_msg* message = (struct cn_msg*)NLMSG_DATA(header);
+    if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC) {
+      continue;
+    }
+    // The event is not aligned within the message
+    struct proc_event proc_event;
+    size_t proc_event_size = message->len;
+    if (proc_event_size > sizeof(proc_event)) {
+      proc_event_size = sizeof(proc_event);
+    }
+    memset(&proc_event, 0, sizeof(proc_event));
+    memcpy(&proc_event, message->data, proc_event_size);
+
+    // Only the processes are reported, not their other threads
+    lifecycle_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.pid = -1;
+    if (proc_event.what == PROC_EVENT_FORK &&
+        proc_event.event_data.fork.child_pid ==
+            proc_event.event_data.fork.child_tgid) {
+      event.type = LIFECYCLE_FORK;
+      event.pid = proc_event.event_data.fork.child_tgid;
+    } else if (proc_event.what == PROC_EVENT_EXEC) {
+      event.type = LIFECYCLE_EXEC;
+      event.pid = proc_event.event_data.exec.process_tgid;
+    } else if (proc_event.what == PROC_EVENT_EXIT &&
+               proc_event.event_data.exit.process_pid ==
+                   proc_event.event_data.exit.process_tgid) {
+      event.type = LIFECYCLE_EXIT;
+      event.pid = proc_event.event_data.exit.process_tgid;
+    }
+    if (event.pid != -1) {
+      handler(&event, arg);
+    }
+  }
+}
+
+// Returns the index of the thread group in the list, or -1 if none of its
+// threads has exited yet
+static int find_group(const lifecycle_t* lifecycle, int tgid) {
+  size_t i;
+  for (i = 0; i < lifecycle->num_of_groups; i++) {
+    if (lifecycle->groups[i].tgid == tgid) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Adds the counters of an exited thread to its thread group
+static void add_to_group(lifecycle_t* lifecycle, int index,
+                         const struct taskstats* stats) {
+  if (index == -1) {
+    if (lifecycle->num_of_groups == lifecycle->groups_capacity) {
+      lifecycle->groups_capacity = lifecycle->groups_capacity == 0
+                                       ? LIFECYCLE_INITIAL_GROUPS
+                                       : 2 * lifecycle->groups_capacity;
+      lifecycle->groups =
+          realloc(lifecycle->groups,
+                  lifecycle->groups_capacity * sizeof(lifecycle_group_t));
+      if (lifecycle->groups == NULL) {
+        logging(LOG_CODE_FATAL, "cannot allocate memory");
+      }
+    }
+    index = lifecycle->num_of_groups++;
+    memset(&lifecycle->groups[index], 0, sizeof(lifecycle_group_t));
+    lifecycle->groups[index].tgid = stats->ac_tgid;
+  }
+  lifecycle_group_t* group = &lifecycle->groups[index];
+  group->utime_us += stats->ac_utime;
+  group->stime_us += stats->ac_stime;
+  group->minflt += stats->ac_minflt;
+  group->majflt += stats->ac_majflt;
+}
+
+// Whether other threads of the process are still running, e.g., after its
+// main thread has exited. The links of /proc/<pid>/task/ count its threads.
+static bool has_other_threads(int tgid) {
+  char task_location[32];
+  snprintf(task_location, sizeof(task_location), "/proc/%d/task", tgid);
+  struct stat task_stat;
+  return stat(task_location, &task_stat) == 0 && task_stat.st_nlink > 3;
+}
+
+// Keeps the exit of a process until the pending messages have been received
+static void add_exit(lifecycle_t* lifecycle, const lifecycle_event_t* event) {
+  if (lifecycle->num_of_exits == lifecycle->exits_capacity) {
+    lifecycle->exits_capacity = lifecycle->exits_capacity == 0
+                                    ? LIFECYCLE_INITIAL_EXITS
+                                    : 2 * lifecycle->exits_capacity;
+    lifecycle->exits =
+        realloc(lifecycle->exits,
+                lifecycle->exits_capacity * sizeof(lifecycle_event_t));
+    if (lifecycle->exits == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+  }
+  lifecycle->exits[lifecycle->num_of_exits++] = *event;
+}
+
+// Adds the counters of the main thread of a process to the exit of its
+// group, if it has been kept
+static void add_main_thread(lifecycle_t* lifecycle, lifecycle_event_t* event) {
+  size_t i;
+  for (i = 0; i < lifecycle->num_of_exits; i++) {
+    lifecycle_event_t* main_thread = &lifecycle->exits[i];
+    if (main_thread->pid == event->pid) {
+      event->utime_us += main_thread->utime_us;
+      event->stime_us += main_thread->stime_us;
+      event->minflt += main_thread->minflt;
+      event->majflt += main_thread->majflt;
+      lifecycle->exits[i] = lifecycle->exits[--lifecycle->num_of_exits];
+      return;
+    }
+  }
+}
+
+// Reports the final counters of the processes in a batch of taskstats
+// messages. Every thread is reported on its own when it exits, and the last
+// one along with its thread group. The group only aggregates the delay
+// accounting, so the counters of the threads are summed here until then.
+//
+// Single-threaded processes are never reported as groups. The exit of a main
+// thread is taken for the exit of its process if no other threads are left
+// by now, in which case the message of its group has been sent already. It is
+// kept until the end of the batches in case the group follows.
+static void handle_taskstats_messages(lifecycle_t* lifecycle, char* buffer,
+                                      ssize_t size,
+                                      lifecycle_handler_t handler,
+                                      void* arg) {
+  struct nlmsghdr* header;
+  for (header = (struct nlmsghdr*)buffer; NLMSG_OK(header, size);
+       header = NLMSG_NEXT(header, size)) {
+    if (header->nlmsg_type != lifecycle->taskstats_family) {
+      continue;
+    }
+    struct genlmsghdr* genl = (struct genlmsghdr*)NLMSG_DATA(header);
+    if (genl->cmd != TASKSTATS_CMD_NEW) {
+      continue;
+    }
+    char* attrs = (char*)genl + GENL_HDRLEN;
+    int attrs_size = header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    struct nlattr* aggr = find_attr(attrs, attrs_size,
+                                    TASKSTATS_TYPE_AGGR_PID);
+    if (aggr == NULL) {
+      continue;
+    }
+    struct nlattr* attr = find_attr((char*)aggr + NLA_HDRLEN,
+                                    aggr->nla_len - NLA_HDRLEN,
+                                    TASKSTATS_TYPE_STATS);
+    if (attr == NULL) {
+      continue;
+    }
+
+    // The kernel may use a shorter or longer version of the struct
+    struct taskstats stats;
+    size_t stats_size = attr->nla_len - NLA_HDRLEN;
+    if (stats_size > sizeof(stats)) {
+      stats_size = sizeof(stats);
+    }
+    memset(&stats, 0, sizeof(stats));
+    memcpy(&stats, (char*)attr + NLA_HDRLEN, stats_size);
+    if (stats.version < TASKSTATS_TGID_VERSION) {
+      continue;
+    }
+
+    int index = find_group(lifecycle, stats.ac_tgid);
+    bool group_dead =
+        find_attr(attrs, attrs_size, TASKSTATS_TYPE_AGGR_TGID) != NULL;
+    bool main_thread = stats.ac_pid == stats.ac_tgid;
+    if (!group_dead &&
+        (!main_thread || index != -1 || has_other_threads(stats.ac_tgid))) {
+      add_to_group(lifecycle, index, &stats);
+      continue;
+    }
+
+    lifecycle_event_t event;
+    event.type = LIFECYCLE_EXIT;
+    event.pid = stats.ac_tgid;
+    event.has_counters = true;
+    event.utime_us = stats.ac_utime;
+    event.stime_us = stats.ac_stime;
+    event.minflt = stats.ac_minflt;
+    event.majflt = stats.ac_majflt;
+    if (index != -1) {
+      lifecycle_group_t* group = &lifecycle->groups[index];
+      event.utime_us += group->utime_us;
+      event.stime_us += group->stime_us;
+      event.minflt += group->minflt;
+      event.majflt += group->majflt;
+      lifecycle->groups[index] =
+          lifecycle->groups[--lifecycle->num_of_groups];
+    }
+    if (!group_dead) {
+      add_exit(lifecycle, &event);
+      continue;
+    }
+    if (!main_thread) {
+      add_main_thread(lifecycle, &event);
+    }
+    handler(&event, arg);
+  }
+}
+
+// Receives everything pending on a socket. Returns -1 if some messages have
+// been lost.
+static int drain_socket(lifecycle_t* lifecycle, int fd,
+                        lifecycle_handler_t handler, void* arg) {
+  char buffer[LIFECYCLE_BUFFER_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  int ret = 0;
+  while (true) {
+    ssize_t size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (size == -1) {
+      if (errno == ENOBUFS) {
+        ret = -1;
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return ret;
+    }
+    if (fd == lifecycle->connector_fd) {
+      handle_connector_messages(buffer, size, handler, arg);
+    } else {
+      handle_taskstats_messages(lifecycle, buffer, size, handler, arg);
+    }
+  }
+}
+
+int read_lifecycle(lifecycle_t* lifecycle, lifecycle_handler_t handler,
+                   void* arg) {
+  int ret = 0;
+  if (drain_socket(lifecycle, lifecycle->connector_fd, handler, arg) == -1) {
+    ret = -1;
+  }
+  if (drain_socket(lifecycle, lifecycle->taskstats_fd, handler, arg) == -1) {
+    // The sums of the threads may miss some of them, and the groups may
+    // never be reported as exited
+    lifecycle->num_of_groups = 0;
+    ret = -1;
+  }
+  size_t i;
+  for (i = 0; i < lifecycle->num_of_exits; i++) {
+    handler(&lifecycle->exits[i], arg);
+  }
+  lifecycle->num_of_exits = 0;
+  return ret;
+}
+
+void clean_lifecycle(lifecycle_t* lifecycle) {
+  if (lifecycle->connector_fd != -1) {
+    close(lifecycle->connector_fd);
+    lifecycle->connector_fd = -1;
+  }
+  if (lifecycle->taskstats_fd != -1) {
+    close(lifecycle->taskstats_fd);
+    lifecycle->taskstats_fd = -1;
+  }
+  free(lifecycle->groups);
+  lifecycle->groups = NULL;
+  lifecycle->num_of_groups = 0;
+  lifecycle->groups_capacity = 0;
+  free(lifecycle->exits);
+  lifecycle->exits = NULL;
+  lifecycle->num_of_exits = 0;
+  lifecycle->exits_capacity = 0;
+}
@@ -0,0 +1,95 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __LIFECYCLE_UTIL__
+#define __LIFECYCLE_UTIL__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of the buffer each batch of netlink messages is received into
+#define LIFECYCLE_BUFFER_SIZE (64 * 1024)
+
+// Receive buffer of each netlink socket, which has to hold all the events of
+// a sample interval
+#define LIFECYCLE_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+// What happened to a process
+typedef enum {
+  // A new process, not a thread, has been created
+  LIFECYCLE_FORK = 0x00,
+  // The process has replaced its program
+  LIFECYCLE_EXEC = 0x01,
+  // The process has exited. This is reported once without counters by the
+  // proc connector, and once more with the final counters of all its threads
+  // by taskstats, if the kernel tells threads and processes apart (taskstats
+  // version 12 and later).
+  LIFECYCLE_EXIT = 0x02,
+} lifecycle_type_t;
+
+typedef struct lifecycle_event {
+  short type;
+  int pid;
+  // Whether the counters below are set, which only exits may have
+  bool has_counters;
+  // In microseconds, which is finer than /proc/<pid>/stat
+  unsigned long long utime_us;
+  unsigned long long stime_us;
+  unsigned long long minflt;
+  unsigned long long majflt;
+} lifecycle_event_t;
+
+// Called for every event by read_lifecycle()
+typedef void (*lifecycle_handler_t)(const lifecycle_event_t* event,
+                                    void* arg);
+
+// Counters of the threads of a process that have exited, which are summed
+// until the whole thread group exits
+typedef struct lifecycle_group {
+  int tgid;
+  unsigned long long utime_us;
+  unsigned long long stime_us;
+  unsigned long long minflt;
+  unsigned long long majflt;
+} lifecycle_group_t;
+
+/*
+ * Listens to the fork, exec and exit events of all the processes through the
+ * proc connector, and to the final counters of the exiting tasks through
+ * taskstats. Both need CAP_NET_ADMIN.
+ */
+typedef struct lifecycle {
+  // Netlink connector socket subscribed to the proc events
+  int connector_fd;
+  // Generic netlink socket registered for the taskstats of all the CPUs
+  int taskstats_fd;
+  int taskstats_family;
+  // Processes some of whose threads have exited, but not all of them
+  lifecycle_group_t* groups;
+  size_t num_of_groups;
+  size_t groups_capacity;
+  // Processes whose main threads have exited without other threads left,
+  // which are reported once all the pending messages have been received
+  lifecycle_event_t* exits;
+  size_t num_of_exits;
+  size_t exits_capacity;
+} lifecycle_t;
+
+// Returns -1 if the events are not available, e.g., without CAP_NET_ADMIN
+int init_lifecycle(lifecycle_t* lifecycle);
+
+// Hands all the pending events over to the handler without blocking. Returns
+// -1 if some events have been lost because the socket buffers overflowed.
+int read_lifecycle(lifecycle_t* lifecycle, lifecycle_handler_t handler,
+                   void* arg);
+
+void clean_lifecycle(lifecycle_t* lifecycle);
+
+#endif
@@ -8,13 +8,17 @@
  *
  */
 
+#include <errno.h>
 #include <locale.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -24,15 +28,127 @@
 #include "log_util.h"
 #include "pmu_sample.h"
 #include "proc_sample.h"
+#include "profile_sample.h"
+#include "ring_util.h"
 
-// Buffer size allocated for the JSON fomatted config file
-#define JSON_BUFFER_SIZE 4 * 1024
+// Number of sample intervals that can be queued up for the writer thread
+#define SNAPSHOT_RING_SIZE 16
+
+// Everything the writer thread needs to record one sample interval. The
+// per-CPU values, the processes, the threads, the cgroups, their PMU events
+// and the sampled stacks are stored right after it, in the same ring slot,
+// and the arrays of hardware_info point there.
+typedef struct snapshot {
+  hardware_info_t hardware_info;
+  int num_of_processes;
+  process_external_t* processes_e;
+  int num_of_threads;
+  thread_external_t* threads_e;
+  int num_of_cgroups;
+  cgroup_external_t* cgroups_e;
+  int num_of_profile_entries;
+  profile_external_t* profile_entries_e;
+} snapshot_t;
+
+// The sampling (main) thread hands the snapshots over to the writer thread,
+// so that slow storage never delays the next sample interval
+ring_t snapshot_ring;
+sem_t snapshot_sem;
+
+// The output file, which is only accessed by the writer thread once sampling
+// has started
+file_writer_t output_writer;
+
+// Cleared by SIGINT to stop sampling after the current interval
+volatile sig_atomic_t running = 1;
 
 static void sig_handler(int n) {
-  clean_app_sample();
-  clean_pmu_sample();
+  running = 0;
+}
+
+// Waits for the next snapshot. Records that have been buffered for too long
+// are flushed meanwhile, rather than only with the next snapshot, which may
+// be far off with long sample intervals.
+static void wait_for_snapshot(void) {
+  while (true) {
+    if (output_writer.size == 0) {
+      if (sem_wait(&snapshot_sem) == 0) {
+        return;
+      }
+      continue;
+    }
+
+    unsigned long long now_ns = get_time_ns(CLOCK_MONOTONIC);
+    unsigned long long due_ns =
+        output_writer.oldest_ns + output_writer.max_age_ns;
+    if (now_ns >= due_ns) {
+      flush_file_writer(&output_writer);
+      continue;
+    }
+
+    // sem_timedwait() only takes a CLOCK_REALTIME deadline
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    unsigned long long deadline_ns = deadline.tv_nsec + (due_ns - now_ns);
+    deadline.tv_sec += deadline_ns / 1000000000ULL;
+    deadline.tv_nsec = deadline_ns % 1000000000ULL;
+    if (sem_timedwait(&snapshot_sem, &deadline) == 0) {
+      return;
+    }
+    if (errno == ETIMEDOUT) {
+      flush_file_writer(&output_writer);
+    }
+  }
+}
+
+static void* writer_thread(void* arg) {
+  while (true) {
+    // Each published snapshot posts once, plus one more post on shutdown
+    wait_for_snapshot();
+    snapshot_t* snapshot = (snapshot_t*)ring_acquire_read(&snapshot_ring);
+    if (snapshot == NULL) {
+      break;
+    }
+
+    // Record all the information
+    write_all(&output_writer, snapshot->hardware_info.timestamp_ns,
+              snapshot->hardware_info.window_ns,
+              snapshot->hardware_info.num_of_cores,
+              snapshot->num_of_processes,
+              snapshot->hardware_info.num_of_events,
+              snapshot->hardware_info.num_of_derived_metrics,
+              snapshot->hardware_info.irq_info,
+              snapshot->hardware_info.network_info,
+              snapshot->hardware_info.frequency_info,
+              snapshot->hardware_info.system_info, snapshot->processes_e,
+              snapshot->hardware_info.pmu_mode,
+              snapshot->hardware_info.pmu_info,
+              snapshot->hardware_info.pmu_core_info,
+              snapshot->num_of_threads, snapshot->threads_e,
+              snapshot->hardware_info.pmu_thread_info,
+              snapshot->num_of_cgroups, snapshot->cgroups_e,
+              snapshot->hardware_info.pmu_cgroup_info,
+              snapshot->num_of_profile_entries, snapshot->profile_entries_e);
+
+    ring_commit_read(&snapshot_ring);
+  }
 
-  exit(0);
+  return NULL;
+}
+
+// Moves the absolute deadline forward by one sample interval. If collecting
+// and recording took longer than that, the missed deadlines are skipped
+// rather than caught up with, and a warning is logged.
+static void next_deadline(unsigned long long* deadline_ns,
+                          unsigned long long interval_ns) {
+  *deadline_ns += interval_ns;
+
+  unsigned long long now_ns = get_time_ns(CLOCK_MONOTONIC);
+  if (now_ns >= *deadline_ns) {
+    unsigned long long missed = (now_ns - *deadline_ns) / interval_ns + 1;
+    *deadline_ns += missed * interval_ns;
+    logging(LOG_CODE_WARNING, "Missed %llu sample deadline(s).\n", missed);
+  }
 }
 
 static void usage(void) {
@@ -88,74 +204,261 @@ int main(int argc, char** argv) {
     usage();
     logging(LOG_CODE_FATAL, "Config JSON file is required.\n");
   }
-  char json_buffer[JSON_BUFFER_SIZE];
-  read_file(options.config_file, json_buffer, JSON_BUFFER_SIZE);
+  char* json_buffer = read_file(options.config_file);
 
   // Create an array so that we can keep reusing them
   process_list_t process_info_array[3];
   process_list_t* process_info_list = &process_info_array[0];
   process_list_t* prev_process_info_list = &process_info_array[1];
   process_list_t* filtered_process_info_list = &process_info_array[2];
+  int i;
+  for (i = 0; i < 3; i++) {
+    init_process_list(&process_info_array[i]);
+  }
+
+  // The recorded cgroups of the current sample interval
+  cgroup_list_t cgroup_info_list;
+
+  // The stacks sampled in the current sample interval
+  profile_list_t profile_info_list;
 
   // Create a struct for the hardware-related information
   hardware_info_t hardware_info;
 
   // Parse the JSON config file
   parse_config(json_buffer, &options, &hardware_info);
+  free(json_buffer);
 
-  signal(SIGINT, sig_handler);
+  // Initialize the cgroup sampling, which the process sampling maps the
+  // processes against
+  init_cgroup_sample(&options.cgroups);
+
+  // Initialize the process sampling
+  init_proc_sample(options.num_of_workers, &options.rank, &options.watch,
+                   options.proc_rescan_intervals, &options.threads,
+                   get_cgroup_root());
 
   // Initialize the application sampling
   init_app_sample(options.hostnames, options.ports,
                   options.num_of_applications);
-  init_pmu_sample(&hardware_info);
+  init_pmu_sample(&hardware_info, options.events, options.derived_metrics);
+
+  // Initialize the stack sampling, which uses libpfm set up by the PMU
+  // sampling
+  init_profile_sample(&options.profile);
+
+  // Start the writer thread, once the number of CPUs is known, with SIGINT
+  // blocked so that it is always delivered to the sampling thread
+  pthread_t writer;
+  sigset_t sigint_mask;
+  sigemptyset(&sigint_mask);
+  sigaddset(&sigint_mask, SIGINT);
+  open_file_writer(&output_writer, options.output_file, true,
+                   options.output_buffer_size,
+                   1000000ULL * options.output_flush_interval_ms,
+                   options.output_fsync_policy);
+  // Room for the per-CPU values, the top processes and the watched ones
+  int max_num_of_processes =
+      options.num_of_processes + options.watch.max_processes;
+  init_ring(&snapshot_ring,
+            sizeof(snapshot_t) +
+                hardware_info.num_of_cores *
+                    (sizeof(long long) + sizeof(unsigned int) +
+                     sizeof(unsigned long long[PMU_ROW_LENGTH])) +
+                max_num_of_processes *
+                    (sizeof(process_external_t) +
+                     sizeof(unsigned long long[PMU_ROW_LENGTH])) +
+                options.threads.max_threads *
+                    (sizeof(thread_external_t) +
+                     sizeof(unsigned long long[PMU_ROW_LENGTH])) +
+                options.cgroups.max_cgroups *
+                    (sizeof(cgroup_external_t) +
+                     sizeof(unsigned long long[PMU_ROW_LENGTH])) +
+                options.profile.max_entries * sizeof(profile_external_t),
+            SNAPSHOT_RING_SIZE);
+
+  // Describe the layout of the records at the beginning of the output file,
+  // before the writer thread takes it over
+  write_file_header(&output_writer, hardware_info.num_of_cores,
+                    max_num_of_processes, options.threads.max_threads,
+                    options.cgroups.max_cgroups, options.profile.max_entries,
+                    hardware_info.num_of_events, hardware_info.pmu_mode,
+                    options.event_names, options.num_of_derived_metrics,
+                    options.derived_metrics, get_profile_event());
+
+  sem_init(&snapshot_sem, 0, 0);
+  pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL);
+  if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+    logging(LOG_CODE_FATAL, "Cannot create the writer thread.\n");
+  }
+  pthread_sigmask(SIG_UNBLOCK, &sigint_mask, NULL);
+
+  signal(SIGINT, sig_handler);
 
   int nerve_pid = (int) getpid();
 
+  // The sample intervals are scheduled against absolute deadlines, starting
+  // from the initial snapshots taken by init_pmu_sample()
+  unsigned long long interval_ns = 1000ULL * options.interval_us;
+  unsigned long long deadline_ns = get_time_ns(CLOCK_MONOTONIC);
+  struct timespec deadline;
+
   /**
    * This is the main loop where all the monitoring happens. In each interation:
    *  1) find out the top cycle-consuming running processes
    *  2) collect OS-level statistics about the processes
    *  3) collect hardware PMUs statistics
    *  4) collect statistics reported by the applications
-   *  5) dump all the statistics to a file
+   *  5) hand all the statistics over to the writer thread
    */
-  while (true) {
+  while (running) {
     // Sample all the running processes, and calculate their utilization
     // information in the last sample interval
     get_process_info(process_info_list, prev_process_info_list, nerve_pid);
 
-    // Filter the list of processes by a list of thresholds
+    // Sum the processes up by cgroup, and read the busiest cgroups
+    get_cgroup_sample(process_info_list, &cgroup_info_list);
+
+    // Select the top processes, which may depend on their PMU events in the
+    // last sample interval
     filter_process_info(process_info_list, filtered_process_info_list,
-                        options.num_of_processes);
+                        options.num_of_processes,
+                        hardware_info.pmu_info != NULL
+                            ? hardware_info.pmu_info[0]
+                            : NULL,
+                        PMU_ROW_LENGTH);
 
     // Get more detailed statistics about running processes
     get_process_stats(filtered_process_info_list,
                       process_info_list,
                       prev_process_info_list);
 
+    // Sample the stacks of the same processes in this sample interval
+    set_profile_processes(filtered_process_info_list);
+
     // Profile all the PMU events of all the processes in the list,
-    // and sleep for the same time as sample interval
-    get_pmu_sample(filtered_process_info_list, options.events,
-                   options.interval_us, &hardware_info);
+    // and sleep until the end of the sample interval
+    next_deadline(&deadline_ns, interval_ns);
+    deadline.tv_sec = deadline_ns / 1000000000ULL;
+    deadline.tv_nsec = deadline_ns % 1000000000ULL;
+    get_pmu_sample(filtered_process_info_list, &cgroup_info_list, &deadline,
+                   &hardware_info);
+
+    // Collect the stacks sampled until the end of the sample interval
+    get_profile_sample(&profile_info_list);
 
     // Get performance statistics from the applications
     // get_app_sample();
 
-    // Record all the information
-    write_all(options.output_file, true, hardware_info.num_of_cores,
-              options.num_of_processes, hardware_info.num_of_events,
-              hardware_info.irq_info, hardware_info.network_info,
-              hardware_info.frequency_info,
-              filtered_process_info_list->processes_e,
-              hardware_info.pmu_info);
+    // Queue all the information up for the writer thread, or drop it if the
+    // writer has fallen behind
+    snapshot_t* snapshot = (snapshot_t*)ring_acquire_write(&snapshot_ring);
+    if (snapshot == NULL) {
+      logging(LOG_CODE_WARNING,
+              "Writer thread is falling behind, %llu sample(s) dropped.\n",
+              snapshot_ring.num_of_drops);
+    } else {
+      size_t num_of_processes = filtered_process_info_list->size;
+      size_t num_of_cores = hardware_info.num_of_cores;
+      memcpy(&snapshot->hardware_info, &hardware_info,
+             sizeof(hardware_info_t));
+      char* next = (char*)(snapshot + 1);
+      if (hardware_info.pmu_mode == PMU_MODE_PER_CPU) {
+        snapshot->hardware_info.pmu_core_info =
+            (unsigned long long(*)[PMU_ROW_LENGTH])next;
+        memcpy(snapshot->hardware_info.pmu_core_info,
+               hardware_info.pmu_core_info,
+               num_of_cores * sizeof(unsigned long long[PMU_ROW_LENGTH]));
+        next += num_of_cores * sizeof(unsigned long long[PMU_ROW_LENGTH]);
+      }
+      snapshot->hardware_info.irq_info = (long long*)next;
+      memcpy(snapshot->hardware_info.irq_info, hardware_info.irq_info,
+             num_of_cores * sizeof(long long));
+      next += num_of_cores * sizeof(long long);
+      snapshot->num_of_processes = num_of_processes;
+      snapshot->processes_e = (process_external_t*)next;
+      memcpy(snapshot->processes_e, filtered_process_info_list->processes_e,
+             num_of_processes * sizeof(process_external_t));
+      next = (char*)(snapshot->processes_e + num_of_processes);
+      if (hardware_info.pmu_mode == PMU_MODE_PER_THREAD) {
+        snapshot->hardware_info.pmu_info =
+            (unsigned long long(*)[PMU_ROW_LENGTH])next;
+        memcpy(snapshot->hardware_info.pmu_info, hardware_info.pmu_info,
+               num_of_processes * sizeof(unsigned long long[PMU_ROW_LENGTH]));
+        next += num_of_processes * sizeof(unsigned long long[PMU_ROW_LENGTH]);
+      }
+      size_t num_of_threads = filtered_process_info_list->num_of_threads;
+      snapshot->num_of_threads = num_of_threads;
+      snapshot->threads_e = (thread_external_t*)next;
+      if (num_of_threads > 0) {
+        memcpy(snapshot->threads_e, filtered_process_info_list->threads_e,
+               num_of_threads * sizeof(thread_external_t));
+      }
+      next += num_of_threads * sizeof(thread_external_t);
+      if (hardware_info.pmu_mode == PMU_MODE_PER_THREAD &&
+          num_of_threads > 0) {
+        snapshot->hardware_info.pmu_thread_info =
+            (unsigned long long(*)[PMU_ROW_LENGTH])next;
+        memcpy(snapshot->hardware_info.pmu_thread_info,
+               hardware_info.pmu_thread_info,
+               num_of_threads * sizeof(unsigned long long[PMU_ROW_LENGTH]));
+        next += num_of_threads * sizeof(unsigned long long[PMU_ROW_LENGTH]);
+      }
+      size_t num_of_cgroups = cgroup_info_list.size;
+      snapshot->num_of_cgroups = num_of_cgroups;
+      snapshot->cgroups_e = (cgroup_external_t*)next;
+      if (num_of_cgroups > 0) {
+        memcpy(snapshot->cgroups_e, cgroup_info_list.cgroups_e,
+               num_of_cgroups * sizeof(cgroup_external_t));
+      }
+      next += num_of_cgroups * sizeof(cgroup_external_t);
+      if (hardware_info.pmu_mode == PMU_MODE_PER_CGROUP &&
+          num_of_cgroups > 0) {
+        snapshot->hardware_info.pmu_cgroup_info =
+            (unsigned long long(*)[PMU_ROW_LENGTH])next;
+        memcpy(snapshot->hardware_info.pmu_cgroup_info,
+               hardware_info.pmu_cgroup_info,
+               num_of_cgroups * sizeof(unsigned long long[PMU_ROW_LENGTH]));
+        next += num_of_cgroups * sizeof(unsigned long long[PMU_ROW_LENGTH]);
+      }
+      size_t num_of_profile_entries = profile_info_list.size;
+      snapshot->num_of_profile_entries = num_of_profile_entries;
+      snapshot->profile_entries_e = (profile_external_t*)next;
+      if (num_of_profile_entries > 0) {
+        memcpy(snapshot->profile_entries_e, profile_info_list.entries_e,
+               num_of_profile_entries * sizeof(profile_external_t));
+      }
+      next += num_of_profile_entries * sizeof(profile_external_t);
+      // The only 4-byte values go last, so that nothing after them is
+      // misaligned
+      snapshot->hardware_info.frequency_info = (unsigned int*)next;
+      memcpy(snapshot->hardware_info.frequency_info,
+             hardware_info.frequency_info,
+             num_of_cores * sizeof(unsigned int));
+      ring_commit_write(&snapshot_ring);
+      sem_post(&snapshot_sem);
+    }
 
     swap_process_list(&process_info_list, &prev_process_info_list);
   }
 
+  // Let the writer thread drain the queued samples and stop, then write out
+  // whatever is still buffered
+  sem_post(&snapshot_sem);
+  pthread_join(writer, NULL);
+  close_file_writer(&output_writer);
+  clean_ring(&snapshot_ring);
+  sem_destroy(&snapshot_sem);
+
   // Clean up application sampling
   clean_app_sample();
+  clean_profile_sample();
   clean_pmu_sample();
+  clean_proc_sample();
+  clean_cgroup_sample();
+  for (i = 0; i < 3; i++) {
+    clean_process_list(&process_info_array[i]);
+  }
 
   return 0;
 }
@@ -0,0 +1,683 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log_util.h"
+#include "reader_util.h"
+#include "symbol_util.h"
+
+// Max number of columns in a row
+#define MAX_COLUMNS 256
+
+// Max length of the name of a column of the fraction of time an event was
+// counted, which is the name of the event followed by ".ratio"
+#define RATIO_NAME_LENGTH 160
+
+// Max number of PIDs to filter on
+#define MAX_PIDS 256
+
+// Max number of frames of a sampled stack
+#define MAX_FRAMES 128
+
+// Size of the stdout buffer
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+// Kinds of rows that can be dumped
+typedef enum {
+  ROW_TYPE_PROCESS = 0x00,
+  ROW_TYPE_CORE = 0x01,
+  ROW_TYPE_NETWORK = 0x02,
+  ROW_TYPE_THREAD = 0x03,
+  ROW_TYPE_CGROUP = 0x04,
+  ROW_TYPE_SYSTEM = 0x05,
+  ROW_TYPE_PROFILE = 0x06,
+} row_type_t;
+
+typedef enum {
+  OUTPUT_FORMAT_CSV = 0x00,
+  OUTPUT_FORMAT_JSONL = 0x01,
+} output_format_t;
+
+typedef enum {
+  COLUMN_TIMESTAMP = 0x00,
+  COLUMN_WINDOW = 0x01,
+  COLUMN_CORE = 0x02,
+  COLUMN_IRQ = 0x03,
+  COLUMN_FREQUENCY = 0x04,
+  COLUMN_NETWORK = 0x05,
+  COLUMN_FIELD = 0x06,
+  COLUMN_EVENT = 0x07,
+  COLUMN_THREAD_FIELD = 0x08,
+  COLUMN_THREAD_EVENT = 0x09,
+  COLUMN_CGROUP_FIELD = 0x0a,
+  COLUMN_CGROUP_EVENT = 0x0b,
+  COLUMN_SYSTEM = 0x0c,
+  COLUMN_PROFILE_FIELD = 0x0d,
+  COLUMN_DERIVED = 0x0e,
+  COLUMN_THREAD_DERIVED = 0x0f,
+  COLUMN_CGROUP_DERIVED = 0x10,
+  COLUMN_RATIO = 0x11,
+  COLUMN_THREAD_RATIO = 0x12,
+  COLUMN_CGROUP_RATIO = 0x13,
+} column_kind_t;
+
+typedef struct column {
+  const char* name;
+  short kind;
+  int index;
+} column_t;
+
+static const char* network_names[8] = {
+  "recv_bytes", "recv_packets", "recv_errs", "recv_drops",
+  "send_bytes", "send_packets", "send_errs", "send_drops",
+};
+
+static void usage(void) {
+  printf(
+      "usage: nerve-dump [-h] [-f csv] [-t process] [-s start_ns] [-e end_ns]\n"
+      "                  [-p pid,...] [-c column,...] [-E event,...] [-r] "
+      "[-S]\n                  input.bin\n"
+      "-h\t\tget help\n"
+      "-f csv\t\toutput format, csv or jsonl (default: csv)\n"
+      "-t process\trows to dump, process, thread, cgroup, core, network, "
+      "system or\n\t\tprofile (default: process)\n"
+      "-s start_ns\tonly dump records at or after this timestamp\n"
+      "-e end_ns\tonly dump records before this timestamp\n"
+      "-p pid,...\tonly dump these processes, or their threads or stacks\n"
+      "-c column,...\tonly dump these non-PMU columns\n"
+      "-E event,...\tonly dump these PMU events or derived metrics\n"
+      "-r\t\talso dump the fraction of time every PMU event was counted\n"
+      "-S\t\tsymbolize the sampled stacks against the running processes\n");
+}
+
+// Splits a comma-separated list in place
+static int split_list(char* list, char** items, int max_items) {
+  int num_of_items = 0;
+  char* item = strtok(list, ",");
+  while (item != NULL) {
+    if (num_of_items >= max_items) {
+      logging(LOG_CODE_FATAL, "Too many items in list (max is %d).\n",
+              max_items);
+    }
+    items[num_of_items++] = item;
+    item = strtok(NULL, ",");
+  }
+  return num_of_items;
+}
+
+static void add_column(column_t* columns, int* num_of_columns,
+                       const char* name, short kind, int index) {
+  if (*num_of_columns >= MAX_COLUMNS) {
+    logging(LOG_CODE_FATAL, "Too many columns (max is %d).\n", MAX_COLUMNS);
+  }
+  columns[*num_of_columns].name = name;
+  columns[*num_of_columns].kind = kind;
+  columns[*num_of_columns].index = index;
+  (*num_of_columns)++;
+}
+
+// Names of the columns of the fractions of time the events were counted
+static char ratio_names[MAX_COLUMNS][RATIO_NAME_LENGTH];
+static int num_of_ratio_names;
+
+// Adds the column of a PMU event, followed by the fraction of time it was
+// counted if asked for
+static void add_event_column(column_t* columns, int* num_of_columns,
+                             const reader_t* reader, int event_index,
+                             short event_kind, short ratio_kind,
+                             bool show_ratios) {
+  add_column(columns, num_of_columns, get_event_name(reader, event_index),
+             event_kind, event_index);
+  if (show_ratios) {
+    char* name = ratio_names[num_of_ratio_names++];
+    snprintf(name, RATIO_NAME_LENGTH, "%s.ratio",
+             get_event_name(reader, event_index));
+    add_column(columns, num_of_columns, name, ratio_kind, event_index);
+  }
+}
+
+// Lists all the non-PMU columns that are available for the type of rows
+static int get_available_columns(const reader_t* reader, short row_type,
+                                 column_t* columns) {
+  int num_of_columns = 0;
+  int i;
+
+  add_column(columns, &num_of_columns, "timestamp_ns", COLUMN_TIMESTAMP, 0);
+  add_column(columns, &num_of_columns, "window_ns", COLUMN_WINDOW, 0);
+  switch (row_type) {
+    case ROW_TYPE_PROCESS:
+      for (i = 0; i < reader->header->num_of_process_fields; i++) {
+        add_column(columns, &num_of_columns, reader->process_schema[i].name,
+                   COLUMN_FIELD, i);
+      }
+      break;
+    case ROW_TYPE_THREAD:
+      for (i = 0; i < reader->header->num_of_thread_fields; i++) {
+        add_column(columns, &num_of_columns, reader->thread_schema[i].name,
+                   COLUMN_THREAD_FIELD, i);
+      }
+      break;
+    case ROW_TYPE_CGROUP:
+      for (i = 0; i < reader->header->num_of_cgroup_fields; i++) {
+        add_column(columns, &num_of_columns, reader->cgroup_schema[i].name,
+                   COLUMN_CGROUP_FIELD, i);
+      }
+      break;
+    case ROW_TYPE_CORE:
+      add_column(columns, &num_of_columns, "core", COLUMN_CORE, 0);
+      add_column(columns, &num_of_columns, "irq", COLUMN_IRQ, 0);
+      add_column(columns, &num_of_columns, "frequency", COLUMN_FREQUENCY, 0);
+      break;
+    case ROW_TYPE_NETWORK:
+      for (i = 0; i < 8; i++) {
+        add_column(columns, &num_of_columns, network_names[i],
+                   COLUMN_NETWORK, i);
+      }
+      break;
+    case ROW_TYPE_SYSTEM:
+      for (i = 0; i < reader->header->num_of_system_stats; i++) {
+        add_column(columns, &num_of_columns, get_system_stat_name(reader, i),
+                   COLUMN_SYSTEM, i);
+      }
+      break;
+    case ROW_TYPE_PROFILE:
+      for (i = 0; i < reader->header->num_of_profile_fields; i++) {
+        add_column(columns, &num_of_columns, reader->profile_schema[i].name,
+                   COLUMN_PROFILE_FIELD, i);
+      }
+      break;
+  }
+
+  return num_of_columns;
+}
+
+static void print_name(const char* name, short format) {
+  if (format == OUTPUT_FORMAT_JSONL) {
+    putchar('"');
+    for (; *name != '\0'; name++) {
+      if (*name == '"' || *name == '\\') {
+        putchar('\\');
+      }
+      putchar(*name);
+    }
+    putchar('"');
+  } else if (strpbrk(name, ",\"") != NULL) {
+    putchar('"');
+    for (; *name != '\0'; name++) {
+      if (*name == '"') {
+        putchar('"');
+      }
+      putchar(*name);
+    }
+    putchar('"');
+  } else {
+    fputs(name, stdout);
+  }
+}
+
+// Prints the frames of a sampled stack, separated by semicolons, either as
+// addresses or symbolized if there is a symbolizer
+static void print_stack(const reader_t* reader, const record_t* record,
+                        int row, int field_index, symbolizer_t* symbolizer,
+                        short format) {
+  static char stack[MAX_FRAMES * (SYMBOL_LENGTH + 1)];
+  char symbol[SYMBOL_LENGTH];
+  unsigned long long frames[MAX_FRAMES];
+  int num_of_frames = get_profile_field_array(reader, record, row,
+                                              field_index, frames, MAX_FRAMES);
+  if (num_of_frames > MAX_FRAMES) {
+    num_of_frames = MAX_FRAMES;
+  }
+  int depth_field = find_profile_field(reader, "depth");
+  if (depth_field != -1) {
+    unsigned long long depth =
+        get_profile_field_integer(reader, record, row, depth_field);
+    if (depth < num_of_frames) {
+      num_of_frames = depth;
+    }
+  }
+  unsigned int pid = 0;
+  int pid_field = find_profile_field(reader, "process_id");
+  if (pid_field != -1) {
+    pid = get_profile_field_integer(reader, record, row, pid_field);
+  }
+
+  size_t length = 0;
+  int i;
+  stack[0] = '\0';
+  for (i = 0; i < num_of_frames; i++) {
+    if (symbolizer != NULL) {
+      symbolize(symbolizer, pid, frames[i], symbol, sizeof(symbol));
+    } else {
+      snprintf(symbol, sizeof(symbol), "0x%llx", frames[i]);
+    }
+    length += snprintf(stack + length, sizeof(stack) - length, "%s%s",
+                       i > 0 ? ";" : "", symbol);
+  }
+  print_name(stack, format);
+}
+
+// Prints one row, where row is the process, the thread, the cgroup, the
+// sampled stack or the core index
+static void print_row(const reader_t* reader, const record_t* record,
+                      int row, column_t* columns, int num_of_columns,
+                      symbolizer_t* symbolizer, short format) {
+  char buffer[256];
+  int i;
+
+  if (format == OUTPUT_FORMAT_JSONL) {
+    putchar('{');
+  }
+  for (i = 0; i < num_of_columns; i++) {
+    if (i > 0) {
+      putchar(',');
+    }
+    if (format == OUTPUT_FORMAT_JSONL) {
+      print_name(columns[i].name, format);
+      putchar(':');
+    }
+
+    switch (columns[i].kind) {
+      case COLUMN_TIMESTAMP:
+        printf("%llu", (unsigned long long)record->header.timestamp_ns);
+        break;
+      case COLUMN_WINDOW:
+        printf("%llu", (unsigned long long)record->header.window_ns);
+        break;
+      case COLUMN_CORE:
+        printf("%d", row);
+        break;
+      case COLUMN_IRQ:
+        printf("%lld", get_irq_info(record, row));
+        break;
+      case COLUMN_FREQUENCY:
+        printf("%u", get_frequency_info(record, row));
+        break;
+      case COLUMN_NETWORK:
+        printf("%llu", get_network_info(record, columns[i].index));
+        break;
+      case COLUMN_SYSTEM:
+        printf("%llu", get_system_info(record, columns[i].index));
+        break;
+      case COLUMN_FIELD:
+        if (is_integer_field(reader, columns[i].index)) {
+          printf("%llu", get_process_field_integer(reader, record, row,
+                                                   columns[i].index));
+        } else {
+          printf("%g", get_process_field(reader, record, row,
+                                         columns[i].index));
+        }
+        break;
+      case COLUMN_EVENT:
+        printf("%llu", get_pmu_info(reader, record, row, columns[i].index));
+        break;
+      case COLUMN_DERIVED:
+        printf("%g", get_derived_info(reader, record, row, columns[i].index));
+        break;
+      case COLUMN_RATIO:
+        printf("%g", get_pmu_ratio(reader, record, row, columns[i].index));
+        break;
+      case COLUMN_THREAD_FIELD:
+        if (is_integer_thread_field(reader, columns[i].index)) {
+          printf("%llu", get_thread_field_integer(reader, record, row,
+                                                  columns[i].index));
+        } else {
+          printf("%g", get_thread_field(reader, record, row,
+                                        columns[i].index));
+        }
+        break;
+      case COLUMN_THREAD_EVENT:
+        printf("%llu", get_pmu_thread_info(reader, record, row,
+                                           columns[i].index));
+        break;
+      case COLUMN_THREAD_DERIVED:
+        printf("%g", get_derived_thread_info(reader, record, row,
+                                             columns[i].index));
+        break;
+      case COLUMN_THREAD_RATIO:
+        printf("%g", get_pmu_thread_ratio(reader, record, row,
+                                          columns[i].index));
+        break;
+      case COLUMN_CGROUP_FIELD:
+        if (is_string_cgroup_field(reader, columns[i].index)) {
+          print_name(get_cgroup_field_string(reader, record, row,
+                                             columns[i].index, buffer,
+                                             sizeof(buffer)),
+                     format);
+        } else if (is_integer_cgroup_field(reader, columns[i].index)) {
+          printf("%llu", get_cgroup_field_integer(reader, record, row,
+                                                  columns[i].index));
+        } else {
+          printf("%g", get_cgroup_field(reader, record, row,
+                                        columns[i].index));
+        }
+        break;
+      case COLUMN_CGROUP_EVENT:
+        printf("%llu", get_pmu_cgroup_info(reader, record, row,
+                                           columns[i].index));
+        break;
+      case COLUMN_CGROUP_DERIVED:
+        printf("%g", get_derived_cgroup_info(reader, record, row,
+                                             columns[i].index));
+        break;
+      case COLUMN_CGROUP_RATIO:
+        printf("%g", get_pmu_cgroup_ratio(reader, record, row,
+                                          columns[i].index));
+        break;
+      case COLUMN_PROFILE_FIELD:
+        if (is_array_profile_field(reader, columns[i].index)) {
+          print_stack(reader, record, row, columns[i].index, symbolizer,
+                      format);
+        } else {
+          printf("%llu", get_profile_field_integer(reader, record, row,
+                                                   columns[i].index));
+        }
+        break;
+    }
+  }
+  if (format == OUTPUT_FORMAT_JSONL) {
+    putchar('}');
+  }
+  putchar('\n');
+}
+
+int main(int argc, char** argv) {
+  int c;
+  short format = OUTPUT_FORMAT_CSV;
+  short row_type = ROW_TYPE_PROCESS;
+  unsigned long long start_ns = 0ULL;
+  unsigned long long end_ns = ~0ULL;
+  char* pid_list = NULL;
+  char* column_list = NULL;
+  char* event_list = NULL;
+  bool symbolize_stacks = false;
+  bool show_ratios = false;
+
+  while ((c = getopt(argc, argv, "hf:t:s:e:p:c:E:rS")) != -1) {
+    switch (c) {
+      case 'h':
+        usage();
+        exit(0);
+      case 'f':
+        if (strcmp(optarg, "csv") == 0) {
+          format = OUTPUT_FORMAT_CSV;
+        } else if (strcmp(optarg, "jsonl") == 0) {
+          format = OUTPUT_FORMAT_JSONL;
+        } else {
+          logging(LOG_CODE_FATAL, "Unknown output format %s.\n", optarg);
+        }
+        break;
+      case 't':
+        if (strcmp(optarg, "process") == 0) {
+          row_type = ROW_TYPE_PROCESS;
+        } else if (strcmp(optarg, "thread") == 0) {
+          row_type = ROW_TYPE_THREAD;
+        } else if (strcmp(optarg, "cgroup") == 0) {
+          row_type = ROW_TYPE_CGROUP;
+        } else if (strcmp(optarg, "core") == 0) {
+          row_type = ROW_TYPE_CORE;
+        } else if (strcmp(optarg, "network") == 0) {
+          row_type = ROW_TYPE_NETWORK;
+        } else if (strcmp(optarg, "system") == 0) {
+          row_type = ROW_TYPE_SYSTEM;
+        } else if (strcmp(optarg, "profile") == 0) {
+          row_type = ROW_TYPE_PROFILE;
+        } else {
+          logging(LOG_CODE_FATAL, "Unknown row type %s.\n", optarg);
+        }
+        break;
+      case 's':
+        start_ns = strtoull(optarg, NULL, 10);
+        break;
+      case 'e':
+        end_ns = strtoull(optarg, NULL, 10);
+        break;
+      case 'p':
+        pid_list = optarg;
+        break;
+      case 'c':
+        column_list = optarg;
+        break;
+      case 'E':
+        event_list = optarg;
+        break;
+      case 'r':
+        show_ratios = true;
+        break;
+      case 'S':
+        symbolize_stacks = true;
+        break;
+      default:
+        usage();
+        exit(1);
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+    logging(LOG_CODE_FATAL, "Input file is required.\n");
+  }
+
+  reader_t reader;
+  if (open_reader(&reader, argv[optind]) != 0) {
+    exit(1);
+  }
+
+  // Resolve the projection once, so that only the selected columns are
+  // decoded for every row
+  column_t available_columns[MAX_COLUMNS];
+  int num_of_available_columns =
+      get_available_columns(&reader, row_type, available_columns);
+  column_t columns[MAX_COLUMNS];
+  int num_of_columns = 0;
+  int i, j;
+  if (column_list == NULL) {
+    for (i = 0; i < num_of_available_columns; i++) {
+      columns[num_of_columns++] = available_columns[i];
+    }
+  } else {
+    char* names[MAX_COLUMNS];
+    int num_of_names = split_list(column_list, names, MAX_COLUMNS);
+    for (i = 0; i < num_of_names; i++) {
+      for (j = 0; j < num_of_available_columns; j++) {
+        if (strcmp(names[i], available_columns[j].name) == 0) {
+          break;
+        }
+      }
+      if (j == num_of_available_columns) {
+        logging(LOG_CODE_FATAL, "Unknown column %s.\n", names[i]);
+      }
+      columns[num_of_columns++] = available_columns[j];
+    }
+  }
+
+  // The PMU events are recorded per process and thread, per core, or per
+  // cgroup, depending on the mode the file was written in
+  bool has_events =
+      ((row_type == ROW_TYPE_PROCESS || row_type == ROW_TYPE_THREAD) &&
+       reader.header->pmu_mode == FORMAT_PMU_MODE_PER_THREAD) ||
+      (row_type == ROW_TYPE_CORE &&
+       reader.header->pmu_mode == FORMAT_PMU_MODE_PER_CPU) ||
+      (row_type == ROW_TYPE_CGROUP &&
+       reader.header->pmu_mode == FORMAT_PMU_MODE_PER_CGROUP);
+  short event_kind = COLUMN_EVENT;
+  short derived_kind = COLUMN_DERIVED;
+  short ratio_kind = COLUMN_RATIO;
+  if (row_type == ROW_TYPE_THREAD) {
+    event_kind = COLUMN_THREAD_EVENT;
+    derived_kind = COLUMN_THREAD_DERIVED;
+    ratio_kind = COLUMN_THREAD_RATIO;
+  } else if (row_type == ROW_TYPE_CGROUP) {
+    event_kind = COLUMN_CGROUP_EVENT;
+    derived_kind = COLUMN_CGROUP_DERIVED;
+    ratio_kind = COLUMN_CGROUP_RATIO;
+  }
+  // Followed by the metrics derived from the events
+  if (event_list == NULL) {
+    for (i = 0; has_events && i < reader.header->num_of_events; i++) {
+      add_event_column(columns, &num_of_columns, &reader, i, event_kind,
+                       ratio_kind, show_ratios);
+    }
+    for (i = 0; has_events && i < reader.header->num_of_derived_metrics;
+         i++) {
+      add_column(columns, &num_of_columns, get_derived_metric_name(&reader, i),
+                 derived_kind, i);
+    }
+  } else {
+    char* names[MAX_COLUMNS];
+    int num_of_names = split_list(event_list, names, MAX_COLUMNS);
+    if (!has_events && num_of_names > 0) {
+      logging(LOG_CODE_FATAL, "PMU events are not recorded for these rows.\n");
+    }
+    for (i = 0; i < num_of_names; i++) {
+      int event_index = find_event(&reader, names[i]);
+      if (event_index != -1) {
+        add_event_column(columns, &num_of_columns, &reader, event_index,
+                         event_kind, ratio_kind, show_ratios);
+        continue;
+      }
+      int metric_index = find_derived_metric(&reader, names[i]);
+      if (metric_index == -1) {
+        logging(LOG_CODE_FATAL, "Unknown PMU event %s.\n", names[i]);
+      }
+      add_column(columns, &num_of_columns,
+                 get_derived_metric_name(&reader, metric_index), derived_kind,
+                 metric_index);
+    }
+  }
+
+  // PIDs to filter on
+  unsigned long long pids[MAX_PIDS];
+  int num_of_pids = 0;
+  int pid_field = find_process_field(&reader, "process_id");
+  int thread_pid_field = find_thread_field(&reader, "process_id");
+  int profile_pid_field = find_profile_field(&reader, "process_id");
+  if (pid_list != NULL) {
+    if (row_type != ROW_TYPE_PROCESS && row_type != ROW_TYPE_THREAD &&
+        row_type != ROW_TYPE_PROFILE) {
+      logging(LOG_CODE_FATAL,
+              "PIDs can only be filtered on process, thread or profile "
+              "rows.\n");
+    }
+    char* items[MAX_PIDS];
+    num_of_pids = split_list(pid_list, items, MAX_PIDS);
+    for (i = 0; i < num_of_pids; i++) {
+      pids[i] = strtoull(items[i], NULL, 10);
+    }
+  }
+
+  // The stacks are recorded as addresses, and only symbolized here
+  symbolizer_t symbolizer;
+  init_symbolizer(&symbolizer);
+  if (row_type == ROW_TYPE_PROFILE && reader.profile_event == NULL) {
+    logging(LOG_CODE_WARNING, "No stacks were sampled.\n");
+  }
+
+  static char output_buffer[OUTPUT_BUFFER_SIZE];
+  setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+  if (format == OUTPUT_FORMAT_CSV) {
+    for (i = 0; i < num_of_columns; i++) {
+      if (i > 0) {
+        putchar(',');
+      }
+      print_name(columns[i].name, format);
+    }
+    putchar('\n');
+  }
+
+  record_t record;
+  while (next_record(&reader, &record)) {
+    if (record.header.timestamp_ns < start_ns ||
+        record.header.timestamp_ns >= end_ns) {
+      continue;
+    }
+
+    switch (row_type) {
+      case ROW_TYPE_PROCESS:
+        for (i = 0; i < record.header.num_of_processes; i++) {
+          if (num_of_pids > 0) {
+            unsigned long long pid =
+                get_process_field_integer(&reader, &record, i, pid_field);
+            for (j = 0; j < num_of_pids && pids[j] != pid; j++) {
+            }
+            if (j == num_of_pids) {
+              continue;
+            }
+          }
+          print_row(&reader, &record, i, columns, num_of_columns, NULL,
+                    format);
+        }
+        break;
+      case ROW_TYPE_THREAD:
+        for (i = 0; i < record.header.num_of_threads; i++) {
+          if (num_of_pids > 0) {
+            unsigned long long pid = get_thread_field_integer(
+                &reader, &record, i, thread_pid_field);
+            for (j = 0; j < num_of_pids && pids[j] != pid; j++) {
+            }
+            if (j == num_of_pids) {
+              continue;
+            }
+          }
+          print_row(&reader, &record, i, columns, num_of_columns, NULL,
+                    format);
+        }
+        break;
+      case ROW_TYPE_CGROUP:
+        for (i = 0; i < record.header.num_of_cgroups; i++) {
+          print_row(&reader, &record, i, columns, num_of_columns, NULL,
+                    format);
+        }
+        break;
+      case ROW_TYPE_CORE:
+        for (i = 0; i < reader.header->num_of_cores; i++) {
+          print_row(&reader, &record, i, columns, num_of_columns, NULL,
+                    format);
+        }
+        break;
+      case ROW_TYPE_PROFILE:
+        for (i = 0; i < record.header.num_of_profile_entries; i++) {
+          if (num_of_pids > 0) {
+            unsigned long long pid = get_profile_field_integer(
+                &reader, &record, i, profile_pid_field);
+            for (j = 0; j < num_of_pids && pids[j] != pid; j++) {
+            }
+            if (j == num_of_pids) {
+              continue;
+            }
+          }
+          print_row(&reader, &record, i, columns, num_of_columns,
+                    symbolize_stacks ? &symbolizer : NULL, format);
+        }
+        break;
+      case ROW_TYPE_NETWORK:
+      case ROW_TYPE_SYSTEM:
+        print_row(&reader, &record, 0, columns, num_of_columns, NULL,
+                  format);
+        break;
+    }
+  }
+
+  fflush(stdout);
+  if (reader.num_of_corrupted_bytes > 0) {
+    logging(LOG_CODE_WARNING, "Skipped %llu corrupted bytes.\n",
+            reader.num_of_corrupted_bytes);
+  }
+  clean_symbolizer(&symbolizer);
+  close_reader(&reader);
+
+  return 0;
+}
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
+#include <sys/mman.h>
 
 #include <perfmon/pfmlib_perf_event.h>
 #include "perf_util.h"
@@ -238,6 +239,111 @@ int perf_read_buffer(perf_event_desc_t *hw, void *buf, size_t sz) {
   return 0;
 }
 
+/*
+ * maps only the first page of the event, i.e., struct perf_event_mmap_page
+ * without a sampling buffer, which is enough to read the count in userspace
+ */
+int perf_mmap_user_page(perf_event_desc_t *hw) {
+  void *page;
+
+  page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, hw->fd, 0);
+  if (page == MAP_FAILED) return -1;
+
+  hw->buf = page;
+  hw->pgmsk = 0;
+  return 0;
+}
+
+void perf_munmap_user_page(perf_event_desc_t *hw) {
+  if (hw->buf) munmap(hw->buf, sysconf(_SC_PAGESIZE));
+  hw->buf = NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t perf_rdpmc(unsigned int counter) {
+  uint32_t low, high;
+
+  __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+  return low | ((uint64_t)high) << 32;
+}
+
+static inline uint64_t perf_rdtsc(void) {
+  uint32_t low, high;
+
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return low | ((uint64_t)high) << 32;
+}
+#endif
+
+/*
+ * reads the count of an event with rdpmc, following the seqlock protocol
+ * documented in linux/perf_event.h. The counter can only be read while the
+ * event is active on the calling CPU, e.g., a per-cpu event read from its own
+ * cpu, so -1 is returned whenever it is not, or the kernel does not allow
+ * rdpmc, and the caller should fall back to read()
+ *
+ * values[0] = raw count
+ * values[1] = TIME_ENABLED
+ * values[2] = TIME_RUNNING
+ */
+int perf_read_user_page(perf_event_desc_t *hw, uint64_t *values) {
+#if defined(__x86_64__) || defined(__i386__)
+  volatile struct perf_event_mmap_page *pc = hw->buf;
+  uint64_t count, enabled, running, cyc, time_offset;
+  uint32_t seq, idx, time_mult;
+  uint16_t time_shift, width;
+
+  if (!pc) return -1;
+
+  do {
+    seq = pc->lock;
+    __sync_synchronize();
+
+    idx = pc->index;
+    if (!pc->cap_user_rdpmc || !idx) return -1;
+
+    enabled = pc->time_enabled;
+    running = pc->time_running;
+    cyc = 0;
+    time_offset = 0;
+    time_mult = 0;
+    time_shift = 0;
+    if (pc->cap_user_time) {
+      cyc = perf_rdtsc();
+      time_offset = pc->time_offset;
+      time_mult = pc->time_mult;
+      time_shift = pc->time_shift;
+    }
+
+    /* sign extend the counter to 64 bits, then add the kernel's part */
+    width = pc->pmc_width;
+    count = perf_rdpmc(idx - 1);
+    count <<= 64 - width;
+    count = (uint64_t)((int64_t)count >> (64 - width));
+    count += pc->offset;
+
+    __sync_synchronize();
+  } while (pc->lock != seq);
+
+  /* the event is running, so both times go on until now */
+  if (cyc) {
+    uint64_t quot = cyc >> time_shift;
+    uint64_t rem = cyc & (((uint64_t)1 << time_shift) - 1);
+    uint64_t delta =
+        time_offset + quot * time_mult + ((rem * time_mult) >> time_shift);
+    enabled += delta;
+    running += delta;
+  }
+
+  values[0] = count;
+  values[1] = enabled;
+  values[2] = running;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 void perf_skip_buffer(perf_event_desc_t *hw, size_t sz) {
   struct perf_event_mmap_page *hdr = hw->buf;
 
@@ -307,7 +413,7 @@ static int perf_display_branch_stack(perf_event_desc_t *desc, FILE *fp) {
     if (ret) errx(1, "cannot read branch stack entry");
 
     fprintf(fp, "\tFROM:0x%016" PRIx64 " TO:0x%016" PRIx64 " MISPRED:%c\n",
-            b.from, b.to,
+            (uint64_t)b.from, (uint64_t)b.to,
             !(b.mispred || b.predicted) ? '-' : (b.mispred ? 'Y' : 'N'));
   }
   return (int)(n * sizeof(b) + sizeof(n));
@@ -58,6 +58,9 @@ extern int perf_setup_list_events(const char *events, perf_event_desc_t **fd,
 extern int perf_read_buffer(perf_event_desc_t *hw, void *buf, size_t sz);
 extern void perf_free_fds(perf_event_desc_t *fds, int num_fds);
 extern void perf_skip_buffer(perf_event_desc_t *hw, size_t sz);
+extern int perf_mmap_user_page(perf_event_desc_t *hw);
+extern void perf_munmap_user_page(perf_event_desc_t *hw);
+extern int perf_read_user_page(perf_event_desc_t *hw, uint64_t *values);
 
 static inline int perf_read_buffer_32(perf_event_desc_t *hw, void *buf) {
   return perf_read_buffer(hw, buf, sizeof(uint32_t));
@@ -11,43 +11,134 @@
 #include "pmu_sample.h"
 
 #include "log_util.h"
+#include "pool_util.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 
-#define MAX_LENGTH_PER_LINE 256
-
 #define MICROSECONDS 1000000
 
+#define NANOSECONDS 1000000000ULL
+
 #define CPU_CLK_UNHALTED_CORE 0x030a
 #define CPU_CLK_UNHALTED_REF 0x030b
 
-// Timestamp to correct the sampling interval
-struct timeval si_tvs;
-int sleep_offset;
+// Timestamp of the end of the last sample window (CLOCK_MONOTONIC)
+unsigned long long window_end_ns;
 
-// Total number of cores we need to monitor
+// Total number of cores we need to monitor, and their IDs, which may have
+// gaps when some of the CPUs are offline. All the per-CPU arrays are indexed
+// by the position of a CPU in the list rather than by its ID.
 int num_of_cores;
+int* core_ids;
 
-// Data structures that we need to monitor CPU frequency related events
+// Data structures that we need to monitor CPU frequency related events. They
+// are read from the MSRs, without which the frequencies are left at 0.
+bool msr_enabled;
 struct timeval tvs[2];
 unsigned long long cycles[2];
-unsigned long long cpu_clk_unhalted_core[2][MAX_NUM_CORES];
-unsigned long long cpu_clk_unhalted_ref[2][MAX_NUM_CORES];
-
-// Data structures that we need to monitor PMU events
-perf_event_desc_t* pmu_fds[MAX_NUM_PROCESSES];
-
-// Data structures that we need to monitor interrupt handling
-long long prev_interrupt_per_core[MAX_NUM_CORES];
-long long interrupt_per_core[MAX_NUM_CORES];
-
-// Data structures that we need to monitor network traffic
+unsigned long long* cpu_clk_unhalted_core[2];
+unsigned long long* cpu_clk_unhalted_ref[2];
+unsigned int* frequency_info_values;
+
+// Data structures that we need to monitor PMU events. The descriptors are
+// cached by thread ID so that they only need to be opened when a thread enters
+// the filtered process list, and closed when it leaves.
+pmu_thread_t* pmu_cache;
+unsigned int pmu_cache_size;
+unsigned int pmu_cache_count;
+unsigned int pmu_generation;
+
+// The PMU events of each filtered process, and of each of their recorded
+// threads, in the current interval
+unsigned long long (*pmu_info_rows)[PMU_ROW_LENGTH];
+size_t pmu_info_capacity;
+unsigned long long (*pmu_thread_info_rows)[PMU_ROW_LENGTH];
+size_t pmu_thread_info_capacity;
+
+// The PMU descriptors of the recorded cgroups, and their events in the
+// current interval. There are only a few of them, so they are looked up by
+// a linear search.
+pmu_cgroup_t* pmu_cgroups;
+size_t num_of_pmu_cgroups;
+size_t pmu_cgroups_capacity;
+unsigned long long (*pmu_cgroup_info_rows)[PMU_ROW_LENGTH];
+size_t pmu_cgroup_info_capacity;
+
+// Whether the PMU events are counted per thread, per CPU or per cgroup
+short pmu_mode;
+
+// The metrics computed from the counts of every row, which are stored after
+// the counts
+int pmu_num_of_events;
+const derived_metric_t* pmu_derived_metrics;
+int pmu_num_of_derived_metrics;
+
+// Where the time each event was running, and then the fraction of time it was
+// counted, is kept in every row, followed by the time it was enabled
+int pmu_ratio_offset;
+int pmu_enabled_offset;
+
+// The sets of events that fit in the counters, which take turns counting,
+// one set per interval. The groups of events never span two sets, and only
+// the group leaders of the counting set are enabled.
+bool pmu_rotation;
+int pmu_event_sets[MAX_EVENTS];
+int num_of_pmu_sets;
+int pmu_active_set;
+
+// The events encoded by libpfm once at startup, which are copied every time a
+// thread or a CPU is set up
+perf_event_desc_t* pmu_template;
+int pmu_template_num_fds;
+// Whether the kernel has refused to open an event, which is only logged once
+bool pmu_open_failed[MAX_EVENTS];
+
+// Descriptor arrays released by the threads that have left, which are reused
+// for new threads. They are chained through the unused buf field of the
+// first descriptor.
+perf_event_desc_t* pmu_free_fds;
+
+// Data structures that we need to monitor PMU events per CPU, which are opened
+// once and kept open for the whole run
+perf_event_desc_t** pmu_core_fds;
+int* pmu_core_num_fds;
+unsigned long long (*pmu_core_info_rows)[PMU_ROW_LENGTH];
+
+// Whether the per-CPU events are read from their mmap pages with rdpmc, which
+// only works on the CPU that counts them. A reader thread is pinned to each
+// CPU once, as worker 1 + its position in core_ids, and they all read their
+// own CPUs at once. A reader that could not be pinned falls back to read().
+bool pmu_fast_read;
+pool_t pmu_read_pool;
+bool* pmu_reader_pinned;
+
+// Data structures that we need to monitor interrupt handling. The lines of
+// /proc/interrupts grow with the number of CPUs, so it is read into a buffer
+// that grows as needed, and is kept open along with it.
+long long* prev_interrupt_per_core;
+long long* interrupt_per_core;
+long long* irq_info_values;
+long long* line_interrupt_per_core;
+int interrupts_fd;
+char* interrupts_buffer;
+size_t interrupts_buffer_size;
+
+// Data structures that we need to monitor network traffic, from /proc/net/dev
+// which is kept open likewise
+int network_fd;
+char* network_buffer;
+size_t network_buffer_size;
 unsigned long long network_recv_bytes, prev_network_recv_bytes;
 unsigned long long network_recv_packets, prev_network_recv_packets;
 unsigned long long network_recv_errs, prev_network_recv_errs;
@@ -57,6 +148,21 @@ unsigned long long network_send_packets, prev_network_send_packets;
 unsigned long long network_send_errs, prev_network_send_errs;
 unsigned long long network_send_drops, prev_network_send_drops;
 
+// Data structures that we need to monitor pressure stalls and memory
+// management
+system_files_t system_files;
+unsigned long long system_stats[NUM_OF_SYSTEM_STATS];
+unsigned long long prev_system_stats[NUM_OF_SYSTEM_STATS];
+
+static int get_pmu_counters(void);
+static void setup_pmu_template(const char* events[MAX_EVENTS], int set_size);
+
+static void open_pmu_events(pid_t pid, int cpu, unsigned long flags,
+                            perf_event_desc_t** fds, int* num_fds);
+static void close_pmu_events(perf_event_desc_t* fds, int num_fds);
+static void resize_pmu_cache(unsigned int size);
+static void setup_pmu_fast_read(void);
+
 // This function reads the raw cycle count on a core, which depends on the
 // core that this process is running on. Depending on the underlying
 // architecture, the implementation varies:
@@ -96,60 +202,78 @@ __inline__ unsigned long long rdtsc(void) {
 }
 #endif
 
-void get_irq_stats(long long interrupt_per_core[MAX_NUM_CORES]) {
-  FILE* fp;
-  char line[MAX_LENGTH_PER_LINE];
-  long long local_interrupt_per_core[MAX_NUM_CORES];
+unsigned long long get_time_ns(clockid_t clock_id) {
+  struct timespec ts;
+  clock_gettime(clock_id, &ts);
+  return (unsigned long long)ts.tv_sec * NANOSECONDS + ts.tv_nsec;
+}
+
+// Allocates an array of one zeroed value per online CPU
+static void* alloc_per_core(size_t size) {
+  void* values = calloc(num_of_cores, size);
+  if (values == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  return values;
+}
+
+// Skips the blanks within a line
+static char* skip_blanks(char* line) {
+  while (*line == ' ' || *line == '\t') line++;
+  return line;
+}
 
+// Skips a column of a line
+static char* skip_column(char* line) {
+  while (*line != '\0' && !isspace(*line)) line++;
+  return line;
+}
+
+void get_irq_stats(long long* interrupt_per_core) {
   // Reset the counters
   int c;
   for (c = 0; c < num_of_cores; c++) {
     interrupt_per_core[c] = 0;
   }
 
-  fp = fopen("/proc/interrupts", "r");
-  if (fp == NULL) {
+  if (read_whole_file(interrupts_fd, &interrupts_buffer,
+                      &interrupts_buffer_size) == -1) {
     logging(LOG_CODE_FATAL, "Unable to read /proc/interrupts.\n");
   }
 
-  // Skip the first line
-  fgets(line, MAX_LENGTH_PER_LINE, fp);
-  while (fgets(line, MAX_LENGTH_PER_LINE, fp) != NULL) {
+  // Skip the first line, which has one column per online CPU, in the same
+  // order as core_ids
+  char* line = strchr(interrupts_buffer, '\n');
+  while (line != NULL && *++line != '\0') {
     // Check if the first column starts with numbers
-    int i = 0;
-    while (isspace(line[i])) i++;
-    if (line[i] < '0' || line[i] > '9') {
+    line = skip_blanks(line);
+    if (*line < '0' || *line > '9') {
       break;
     }
-    while (!isspace(line[i])) i++;
+    line = skip_column(line);
 
     int j;
     for (j = 0; j < num_of_cores; j++) {
-      int k = 0;
-      char int_buffer[16];
-      while (isspace(line[i])) i++;
-      while (!isspace(line[i])) int_buffer[k++] = line[i++];
-      int_buffer[k] = '\0';
-      local_interrupt_per_core[j] = atoll(int_buffer);
+      line = skip_blanks(line);
+      line_interrupt_per_core[j] =
+          isdigit(*line) ? strtoll(line, &line, 10) : 0;
     }
 
     // Skip the second last column
-    while (isspace(line[i])) i++;
-    while (!isspace(line[i])) i++;
-    while (isspace(line[i])) i++;
+    line = skip_column(skip_blanks(line));
+    line = skip_blanks(line);
 
     // Check if the last column starts with "eth"
-    if (line[i] == 'e' && line[i + 1] == 't' && line[i + 2] == 'h') {
+    if (strncmp(line, "eth", 3) == 0) {
       for (j = 0; j < num_of_cores; j++) {
-        interrupt_per_core[j] += local_interrupt_per_core[j];
+        interrupt_per_core[j] += line_interrupt_per_core[j];
       }
     }
+    line = strchr(line, '\n');
   }
-
-  fclose(fp);
 }
 
-void estimate_irq(long long irq_info[MAX_NUM_CORES]) {
+void estimate_irq(long long* irq_info) {
   int i;
   for (i = 0; i < num_of_cores; i++) {
     irq_info[i] = interrupt_per_core[i] - prev_interrupt_per_core[i];
@@ -174,18 +298,17 @@ void get_network_stats(unsigned long long* network_recv_bytes,
   *network_send_errs = 0ULL;
   *network_send_drops = 0ULL;
 
-  FILE* fp;
-  char line[MAX_LENGTH_PER_LINE];
-
-  fp = fopen("/proc/net/dev", "r");
-  if (fp == NULL) {
+  if (read_whole_file(network_fd, &network_buffer, &network_buffer_size) ==
+      -1) {
     logging(LOG_CODE_FATAL, "Unable to read /proc/net/dev.\n");
   }
 
   // Skip the first 2 lines
-  fgets(line, MAX_LENGTH_PER_LINE, fp);
-  fgets(line, MAX_LENGTH_PER_LINE, fp);
-  while (fgets(line,MAX_LENGTH_PER_LINE, fp) != NULL) {
+  char* line = strchr(network_buffer, '\n');
+  if (line != NULL) {
+    line = strchr(line + 1, '\n');
+  }
+  while (line != NULL && *++line != '\0') {
     /*
      * We probably do not care about loop back, but all the other ethernet
      * cards might be interesting. So maybe just sum them up.
@@ -202,14 +325,15 @@ void get_network_stats(unsigned long long* network_recv_bytes,
      * (12) send_errs
      * (13) send_drop
      */
-    char interface[8];
+    char interface[32];
     unsigned long long recv_bytes, recv_packets, recv_errs, recv_drops;
     unsigned long long send_bytes, send_packets, send_errs, send_drops;
-    sscanf(line,
-           "%s %llu %llu %llu %llu %*u %*u %*u %*u %llu %llu %llu %llu",
-           interface, &recv_bytes, &recv_packets, &recv_errs, &recv_drops,
-           &send_bytes, &send_packets, &send_errs, &send_drops);
-    if (strncmp(interface, "eth", 3) == 0) {
+    if (sscanf(line,
+               "%31s %llu %llu %llu %llu %*u %*u %*u %*u %llu %llu %llu %llu",
+               interface, &recv_bytes, &recv_packets, &recv_errs,
+               &recv_drops, &send_bytes, &send_packets, &send_errs,
+               &send_drops) == 9 &&
+        strncmp(interface, "eth", 3) == 0) {
       *network_recv_bytes += recv_bytes;
       *network_recv_packets += recv_packets;
       *network_recv_errs += recv_errs;
@@ -219,9 +343,8 @@ void get_network_stats(unsigned long long* network_recv_bytes,
       *network_send_errs += send_errs;
       *network_send_drops += send_drops;
     }
+    line = strchr(line, '\n');
   }
-
-  fclose(fp);
 }
 
 void estimate_network(unsigned long long network_info[8]) {
@@ -235,6 +358,13 @@ void estimate_network(unsigned long long network_info[8]) {
   network_info[7] = network_send_drops - prev_network_send_drops;
 }
 
+void estimate_system(unsigned long long system_info[NUM_OF_SYSTEM_STATS]) {
+  int i;
+  for (i = 0; i < NUM_OF_SYSTEM_STATS; i++) {
+    system_info[i] = system_stats[i] - prev_system_stats[i];
+  }
+}
+
 uint64_t read_msr(int cpu, uint32_t reg, unsigned int highbit,
                   unsigned int lowbit) {
   uint64_t data;
@@ -282,12 +412,14 @@ void get_cpu_cycles(unsigned long long* cycles, struct timeval* tvs,
   *cycles = rdtsc();
 
   for (i = 0; i < num_of_cores; i++) {
-    cpu_clk_unhalted_core[i] = read_msr(i, CPU_CLK_UNHALTED_CORE, 63, 0);
-    cpu_clk_unhalted_ref[i] = read_msr(i, CPU_CLK_UNHALTED_REF, 63, 0);
+    cpu_clk_unhalted_core[i] =
+        read_msr(core_ids[i], CPU_CLK_UNHALTED_CORE, 63, 0);
+    cpu_clk_unhalted_ref[i] =
+        read_msr(core_ids[i], CPU_CLK_UNHALTED_REF, 63, 0);
   }
 }
 
-void estimate_frequency(unsigned int frequency_info[MAX_NUM_CORES]) {
+void estimate_frequency(unsigned int* frequency_info) {
   int i;
 
   unsigned int microseconds =
@@ -335,7 +467,8 @@ void estimate_frequency(unsigned int frequency_info[MAX_NUM_CORES]) {
     }
   }
 
-  unsigned int avg_frequency = total_freq / total_cores;
+  unsigned int avg_frequency =
+      total_cores > 0 ? total_freq / total_cores : 0;
   for (i = 0; i < num_of_cores; i++) {
     if (frequency_info[i] == 0) {
       frequency_info[i] = avg_frequency;
@@ -343,10 +476,47 @@ void estimate_frequency(unsigned int frequency_info[MAX_NUM_CORES]) {
   }
 }
 
-void init_pmu_sample(hardware_info_t* hardware_info) {
-  // Get the total number of cores available
-  num_of_cores = sysconf(_SC_NPROCESSORS_ONLN);
+// Whether the derived metric uses events of more than one set, which never
+// count in the same interval
+static bool spans_pmu_sets(const derived_metric_t* metric, int set_size) {
+  int set = -1;
+  int i;
+  for (i = 0; i < metric->num_of_ops; i++) {
+    if (metric->ops[i].code != DERIVED_OP_EVENT) {
+      continue;
+    }
+    if (set != -1 && metric->ops[i].event / set_size != set) {
+      return true;
+    }
+    set = metric->ops[i].event / set_size;
+  }
+  return false;
+}
+
+void init_pmu_sample(hardware_info_t* hardware_info,
+                     const char* events[MAX_EVENTS],
+                     const derived_metric_t* derived_metrics) {
+  // Get the cores available, and make room for their values
+  num_of_cores = read_online_cpus(&core_ids);
   hardware_info->num_of_cores = num_of_cores;
+  irq_info_values = alloc_per_core(sizeof(long long));
+  frequency_info_values = alloc_per_core(sizeof(unsigned int));
+  hardware_info->irq_info = irq_info_values;
+  hardware_info->frequency_info = frequency_info_values;
+  prev_interrupt_per_core = alloc_per_core(sizeof(long long));
+  interrupt_per_core = alloc_per_core(sizeof(long long));
+  line_interrupt_per_core = alloc_per_core(sizeof(long long));
+  int i;
+  for (i = 0; i < 2; i++) {
+    cpu_clk_unhalted_core[i] = alloc_per_core(sizeof(unsigned long long));
+    cpu_clk_unhalted_ref[i] = alloc_per_core(sizeof(unsigned long long));
+  }
+  pmu_num_of_events = hardware_info->num_of_events;
+  memset(pmu_open_failed, 0, sizeof(pmu_open_failed));
+  pmu_derived_metrics = derived_metrics;
+  pmu_num_of_derived_metrics = hardware_info->num_of_derived_metrics;
+  pmu_ratio_offset = pmu_num_of_events + pmu_num_of_derived_metrics;
+  pmu_enabled_offset = pmu_ratio_offset + pmu_num_of_events;
 
   // Initialize libpfm
   int ret = pfm_initialize();
@@ -354,171 +524,1020 @@ void init_pmu_sample(hardware_info_t* hardware_info) {
     logging(LOG_CODE_FATAL, "Cannot initialize library: %s", pfm_strerror(ret));
   }
 
-  // Initialize the sample interval timestamp
-  gettimeofday(&si_tvs, NULL);
-  sleep_offset = 9000;
+  // Split the events into sets of as many as there are counters, unless the
+  // kernel multiplexes them
+  int set_size = MAX_EVENTS;
+  pmu_rotation = hardware_info->pmu_rotation;
+  if (pmu_rotation) {
+    set_size = hardware_info->pmu_counters > 0 ? hardware_info->pmu_counters
+                                               : get_pmu_counters();
+    if (set_size <= 0) {
+      logging(LOG_CODE_WARNING,
+              "Cannot tell the number of PMU counters, letting the kernel "
+              "multiplex the events.\n");
+      set_size = MAX_EVENTS;
+      pmu_rotation = false;
+    }
+  }
+  // A derived metric can only be computed from events counted together
+  for (i = 0; pmu_rotation && i < pmu_num_of_derived_metrics; i++) {
+    if (spans_pmu_sets(&derived_metrics[i], set_size)) {
+      logging(LOG_CODE_WARNING,
+              "The events of the derived metric %s do not fit in one set of "
+              "%d, letting the kernel multiplex the events.\n",
+              derived_metrics[i].name, set_size);
+      set_size = MAX_EVENTS;
+      pmu_rotation = false;
+    }
+  }
+
+  // Encode the events once, so that setting up a thread or a CPU only needs
+  // to copy them
+  setup_pmu_template(events, set_size);
+  pmu_active_set = 0;
+  if (pmu_rotation && num_of_pmu_sets == 1) {
+    pmu_rotation = false;
+  }
+  if (pmu_rotation) {
+    logging(LOG_CODE_INFO,
+            "Rotating %d sets of at most %d PMU events, one per interval.\n",
+            num_of_pmu_sets, set_size);
+  }
+  hardware_info->pmu_rotation = pmu_rotation;
+
+  // The cache of per-thread descriptors grows with the number of threads
+  resize_pmu_cache(PMU_CACHE_INITIAL_SIZE);
+  hardware_info->pmu_info = NULL;
+  hardware_info->pmu_thread_info = NULL;
+  hardware_info->pmu_cgroup_info = NULL;
+  hardware_info->pmu_core_info = NULL;
+  pmu_cgroups = NULL;
+  num_of_pmu_cgroups = 0;
+  pmu_cgroups_capacity = 0;
+
+  // Open one set of PMU events for each CPU, counting all the tasks on it
+  pmu_mode = hardware_info->pmu_mode;
+  if (pmu_mode == PMU_MODE_PER_CPU) {
+    pmu_core_info_rows =
+        alloc_per_core(sizeof(unsigned long long[PMU_ROW_LENGTH]));
+    hardware_info->pmu_core_info = pmu_core_info_rows;
+    pmu_core_fds = alloc_per_core(sizeof(perf_event_desc_t*));
+    pmu_core_num_fds = alloc_per_core(sizeof(int));
+    int cpu;
+    for (cpu = 0; cpu < num_of_cores; cpu++) {
+      open_pmu_events(-1, core_ids[cpu], 0, &pmu_core_fds[cpu],
+                      &pmu_core_num_fds[cpu]);
+      if (pmu_core_fds[cpu][0].fd == -1) {
+        logging(LOG_CODE_WARNING,
+                "Cannot open PMU events on CPU %d (root permission or "
+                "kernel.perf_event_paranoid <= 0 required).\n",
+                core_ids[cpu]);
+      }
+    }
+  }
+  pmu_fast_read = pmu_mode == PMU_MODE_PER_CPU && hardware_info->pmu_fast_read;
+  if (pmu_fast_read) {
+    setup_pmu_fast_read();
+  }
+  hardware_info->pmu_fast_read = pmu_fast_read;
+
+  // Take the initial snapshots, so that the first sample window starts here.
+  // The files are kept open, so that no interval has to allocate anything.
+  interrupts_fd = open("/proc/interrupts", O_RDONLY | O_CLOEXEC);
+  network_fd = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+  get_irq_stats(prev_interrupt_per_core);
+  char msr_file_name[64];
+  sprintf(msr_file_name, "/dev/cpu/%d/msr", core_ids[0]);
+  msr_enabled = access(msr_file_name, R_OK) == 0;
+  if (msr_enabled) {
+    get_cpu_cycles(&cycles[0], &tvs[0], cpu_clk_unhalted_core[0],
+                   cpu_clk_unhalted_ref[0]);
+  } else {
+    logging(LOG_CODE_WARNING,
+            "Cannot read MSR files (root permission and the msr module "
+            "required), not recording the CPU frequencies.\n");
+  }
+  get_network_stats(&prev_network_recv_bytes, &prev_network_recv_packets,
+                    &prev_network_recv_errs, &prev_network_recv_drops,
+                    &prev_network_send_bytes, &prev_network_send_packets,
+                    &prev_network_send_errs, &prev_network_send_drops);
+  if (open_system_files(&system_files) == -1) {
+    logging(LOG_CODE_WARNING,
+            "No pressure stall information (CONFIG_PSI required).\n");
+  }
+  read_system_stats(&system_files, prev_system_stats);
+  window_end_ns = get_time_ns(CLOCK_MONOTONIC);
+}
+
+// The number of generic counters of the core PMU detected by libpfm, or 0 if
+// there is none. With several of them, e.g., on hybrid processors, the
+// smallest one is used so that a set fits in any of them.
+static int get_pmu_counters(void) {
+  int num_of_counters = 0;
+  pfm_pmu_t pmu;
+  pfm_for_all_pmus(pmu) {
+    pfm_pmu_info_t pmu_info;
+    memset(&pmu_info, 0, sizeof(pmu_info));
+    pmu_info.size = sizeof(pmu_info);
+    if (pfm_get_pmu_info(pmu, &pmu_info) != PFM_SUCCESS ||
+        !pmu_info.is_present || pmu_info.type != PFM_PMU_TYPE_CORE ||
+        pmu_info.num_cntrs <= 0) {
+      continue;
+    }
+    if (num_of_counters == 0 || pmu_info.num_cntrs < num_of_counters) {
+      num_of_counters = pmu_info.num_cntrs;
+    }
+  }
+  return num_of_counters;
+}
+
+// Encodes the events with libpfm, in groups of at most PMU_EVENTS_PER_GROUP,
+// and in sets of set_size events, in their order in the configuration. The
+// first event of every call to perf_setup_argv_events() becomes the group
+// leader.
+static void setup_pmu_template(const char* events[MAX_EVENTS], int set_size) {
+  pmu_template = NULL;
+  pmu_template_num_fds = 0;
+  num_of_pmu_sets = 0;
+
+  const char* group_events[PMU_EVENTS_PER_GROUP + 1];
+  int events_index = 0;
+  while (events_index < MAX_EVENTS && events[events_index] != NULL) {
+    int group_size = 0;
+    int set = events_index / set_size;
+    while (group_size < PMU_EVENTS_PER_GROUP &&
+           events_index < MAX_EVENTS && events[events_index] != NULL &&
+           events_index / set_size == set) {
+      pmu_event_sets[events_index] = set;
+      group_events[group_size++] = events[events_index++];
+    }
+    num_of_pmu_sets = set + 1;
+    group_events[group_size] = NULL;
+
+    int ret = perf_setup_argv_events(group_events, &pmu_template,
+                                     &pmu_template_num_fds);
+    if (ret || !pmu_template_num_fds) {
+      logging(LOG_CODE_FATAL, "cannot setup events");
+    }
+  }
+
+  int fds_index;
+  for (fds_index = 0; fds_index < pmu_template_num_fds; fds_index++) {
+    perf_event_desc_t* fd = &pmu_template[fds_index];
+    /*
+     * request timing information necessary for scaling, and read the whole
+     * group at once. Group reads do not work with inherited counters, which
+     * is fine since all the threads are monitored individually anyway, and
+     * per-CPU counters count every task on the CPU.
+     */
+    fd->hw.read_format =
+        PERF_FORMAT_SCALE | PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+    fd->hw.inherit = 0;
+    /* start counting right away, the first delta is taken against zero */
+    fd->hw.disabled = 0;
+    fd->fd = -1;
+    fd->id = -1;
+  }
+}
+
+// Opens the PMU events of either a thread (pid, cpu = -1), all the tasks on
+// a CPU (pid = -1, cpu), or the tasks of a cgroup on a CPU (the descriptor of
+// its directory, cpu, PERF_FLAG_PID_CGROUP). The descriptors are copied from
+// the template, and share its name and fstr strings, so they must be released
+// with close_pmu_events() rather than perf_free_fds().
+static void open_pmu_events(pid_t pid, int cpu, unsigned long flags,
+                            perf_event_desc_t** fds, int* num_fds) {
+  if (pmu_free_fds != NULL) {
+    *fds = pmu_free_fds;
+    pmu_free_fds = pmu_free_fds[0].buf;
+  } else {
+    *fds = malloc(pmu_template_num_fds * sizeof(perf_event_desc_t));
+    if (*fds == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+  }
+  memcpy(*fds, pmu_template,
+         pmu_template_num_fds * sizeof(perf_event_desc_t));
+  *num_fds = pmu_template_num_fds;
+
+  int fds_index;
+  for (fds_index = 0; fds_index < *num_fds; fds_index++) {
+    perf_event_desc_t* fd = &(*fds)[fds_index];
+    int group_fd = -1;
+    if (!perf_is_group_leader(*fds, fds_index)) {
+      group_fd = (*fds)[fd->group_leader].fd;
+      // Without its leader, the event would count on its own, out of the
+      // rotation, and never be read
+      if (group_fd == -1) {
+        fd->fd = -1;
+        continue;
+      }
+    }
+
+    // Only the groups of the counting set start enabled
+    fd->hw.disabled = pmu_rotation &&
+                      perf_is_group_leader(*fds, fds_index) &&
+                      pmu_event_sets[fds_index] != pmu_active_set;
+    fd->fd = perf_event_open(&fd->hw, pid, cpu, group_fd, flags);
+    if (fd->fd == -1) {
+      // The thread may simply have gone, otherwise the event is not
+      // supported in this mode, or the counters are taken
+      if (errno != ESRCH && !pmu_open_failed[fds_index]) {
+        pmu_open_failed[fds_index] = true;
+        logging(LOG_CODE_WARNING, "Cannot open PMU event %s: %s.\n",
+                fd->name, strerror(errno));
+      }
+      continue;
+    }
+    // Get the kernel ID of the event to match the values of a group read
+    ioctl(fd->fd, PERF_EVENT_IOC_ID, &fd->id);
+  }
+}
+
+static void close_pmu_events(perf_event_desc_t* fds, int num_fds) {
+  int fds_index;
+  for (fds_index = 0; fds_index < num_fds; fds_index++) {
+    perf_munmap_user_page(&fds[fds_index]);
+    if (fds[fds_index].fd != -1) {
+      close(fds[fds_index].fd);
+    }
+  }
+
+  // Keep the array around for the next thread
+  fds[0].buf = pmu_free_fds;
+  pmu_free_fds = fds;
+}
+
+// Pins a reader thread to its CPU
+static void pin_pmu_reader(int worker, void* arg) {
+  if (worker == 0) {
+    return;
+  }
+  int cpu = worker - 1;
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(core_ids[cpu], &mask);
+  pmu_reader_pinned[cpu] =
+      pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+}
+
+// Maps the first page of every per-CPU event, through which it can be read
+// with rdpmc, and starts the reader threads. Falls back to read() if the
+// kernel does not allow rdpmc, e.g., with
+// /sys/bus/event_source/devices/cpu/rdpmc set to 0.
+static void setup_pmu_fast_read(void) {
+  int cpu;
+  int fds_index;
+  for (cpu = 0; cpu < num_of_cores && pmu_fast_read; cpu++) {
+    for (fds_index = 0; fds_index < pmu_core_num_fds[cpu]; fds_index++) {
+      perf_event_desc_t* fd = &pmu_core_fds[cpu][fds_index];
+      if (fd->fd == -1) {
+        continue;
+      }
+      if (perf_mmap_user_page(fd) == -1 ||
+          !((struct perf_event_mmap_page*)fd->buf)->cap_user_rdpmc) {
+        pmu_fast_read = false;
+        break;
+      }
+    }
+  }
+
+  if (!pmu_fast_read) {
+    logging(LOG_CODE_WARNING,
+            "Cannot read the PMU events with rdpmc, using read() instead.\n");
+    for (cpu = 0; cpu < num_of_cores; cpu++) {
+      for (fds_index = 0; fds_index < pmu_core_num_fds[cpu]; fds_index++) {
+        perf_munmap_user_page(&pmu_core_fds[cpu][fds_index]);
+      }
+    }
+    return;
+  }
+
+  pmu_reader_pinned = alloc_per_core(sizeof(bool));
+  init_pool(&pmu_read_pool, num_of_cores + 1);
+  run_pool(&pmu_read_pool, pin_pmu_reader, NULL);
+  for (cpu = 0; cpu < num_of_cores; cpu++) {
+    if (!pmu_reader_pinned[cpu]) {
+      logging(LOG_CODE_WARNING,
+              "Cannot pin a PMU reader thread to CPU %d, using read() "
+              "instead.\n",
+              core_ids[cpu]);
+    }
+  }
+}
+
+static unsigned int pmu_cache_hash(pid_t tid) {
+  // Multiplicative hashing, since thread IDs are mostly sequential
+  return ((unsigned int)tid * 2654435761U) & (pmu_cache_size - 1);
+}
+
+// Moves all the cached threads to a new table of the given size
+static void resize_pmu_cache(unsigned int size) {
+  pmu_thread_t* old_cache = pmu_cache;
+  unsigned int old_size = pmu_cache_size;
+
+  pmu_cache = calloc(size, sizeof(pmu_thread_t));
+  if (pmu_cache == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  pmu_cache_size = size;
+
+  unsigned int old_slot;
+  for (old_slot = 0; old_slot < old_size; old_slot++) {
+    if (old_cache[old_slot].tid != 0) {
+      unsigned int slot = pmu_cache_hash(old_cache[old_slot].tid);
+      while (pmu_cache[slot].tid != 0) {
+        slot = (slot + 1) & (pmu_cache_size - 1);
+      }
+      pmu_cache[slot] = old_cache[old_slot];
+    }
+  }
+  free(old_cache);
+}
+
+// Returns the slot of the thread in the cache, or -1 if it is not cached
+static int pmu_cache_lookup(pid_t tid) {
+  unsigned int slot = pmu_cache_hash(tid);
+  while (pmu_cache[slot].tid != 0) {
+    if (pmu_cache[slot].tid == tid) {
+      return slot;
+    }
+    slot = (slot + 1) & (pmu_cache_size - 1);
+  }
+  return -1;
+}
+
+// Opens the PMU descriptors for a new thread and inserts it to the cache
+static int pmu_cache_insert(pid_t tid) {
+  // Keep the cache at most half full
+  if (2 * (pmu_cache_count + 1) > pmu_cache_size) {
+    resize_pmu_cache(2 * pmu_cache_size);
+  }
+  pmu_cache_count++;
+
+  unsigned int slot = pmu_cache_hash(tid);
+  while (pmu_cache[slot].tid != 0) {
+    slot = (slot + 1) & (pmu_cache_size - 1);
+  }
+
+  pmu_thread_t* thread = &pmu_cache[slot];
+  thread->tid = tid;
+  open_pmu_events(tid, -1, 0, &thread->fds, &thread->num_fds);
+
+  return slot;
+}
+
+// Closes the PMU descriptors of a thread and removes it from the cache. The
+// following entries of the probe sequence are shifted backwards so that no
+// tombstones are needed.
+static void pmu_cache_remove(unsigned int slot) {
+  close_pmu_events(pmu_cache[slot].fds, pmu_cache[slot].num_fds);
+  pmu_cache_count--;
+
+  unsigned int hole = slot;
+  unsigned int next = (slot + 1) & (pmu_cache_size - 1);
+  while (pmu_cache[next].tid != 0) {
+    unsigned int home = pmu_cache_hash(pmu_cache[next].tid);
+    // Only move the entry if the hole is between its home slot and itself
+    if (((next - home) & (pmu_cache_size - 1)) >=
+        ((next - hole) & (pmu_cache_size - 1))) {
+      pmu_cache[hole] = pmu_cache[next];
+      hole = next;
+    }
+    next = (next + 1) & (pmu_cache_size - 1);
+  }
+  pmu_cache[hole].tid = 0;
+  pmu_cache[hole].fds = NULL;
+  pmu_cache[hole].num_fds = 0;
+}
+
+// Closes the descriptors of all the threads that are not in the filtered
+// process list of the current interval
+static void pmu_cache_evict(void) {
+  unsigned int slot = 0;
+  while (slot < pmu_cache_size) {
+    if (pmu_cache[slot].tid != 0 &&
+        pmu_cache[slot].generation != pmu_generation) {
+      // Another entry may have been shifted into this slot, check it again
+      pmu_cache_remove(slot);
+    } else {
+      slot++;
+    }
+  }
+}
+
+// Opens the descriptors for the threads that have just entered the filtered
+// process list, and closes the ones of the threads that have left
+static void update_pmu_cache(process_list_t* process_info_list) {
+  int proc_index;
+  int i;
+
+  // Mark all the threads that are still in the filtered process list
+  pmu_generation++;
+  for (proc_index = 0; proc_index < process_info_list->size; proc_index++) {
+    for (i = 0;
+         i < process_info_list->processes_i[proc_index].child_thread_ids_size;
+         i++) {
+      int slot = pmu_cache_lookup(
+          process_info_list->processes_i[proc_index].child_thread_ids[i]);
+      if (slot != -1) {
+        pmu_cache[slot].generation = pmu_generation;
+      }
+    }
+  }
+  pmu_cache_evict();
+
+  // Record which process each of the threads belongs to in this interval
+  for (proc_index = 0; proc_index < process_info_list->size; proc_index++) {
+    for (i = 0;
+         i < process_info_list->processes_i[proc_index].child_thread_ids_size;
+         i++) {
+      pid_t tid =
+          process_info_list->processes_i[proc_index].child_thread_ids[i];
+      int slot = pmu_cache_lookup(tid);
+      if (slot == -1) {
+        slot = pmu_cache_insert(tid);
+      }
+      pmu_cache[slot].generation = pmu_generation;
+      pmu_cache[slot].proc_index = proc_index;
+      pmu_cache[slot].thread_index = -1;
+    }
+  }
+
+  // And which of them are recorded on their own
+  for (i = 0; i < process_info_list->num_of_threads; i++) {
+    int slot = pmu_cache_lookup(process_info_list->threads_e[i].thread_id);
+    if (slot != -1) {
+      pmu_cache[slot].thread_index = i;
+    }
+  }
+}
+
+// Closes the descriptors of a cgroup on all the CPUs
+static void close_pmu_cgroup(pmu_cgroup_t* cgroup) {
+  int cpu;
+  for (cpu = 0; cpu < num_of_cores; cpu++) {
+    close_pmu_events(cgroup->fds[cpu], cgroup->num_fds[cpu]);
+  }
+  free(cgroup->fds);
+  free(cgroup->num_fds);
+}
+
+// Opens the descriptors for the cgroups that have just been recorded, and
+// closes the ones of the cgroups that are not anymore
+static void update_pmu_cgroups(cgroup_list_t* cgroup_info_list) {
+  size_t cgroup_index;
+  size_t i;
+  int cpu;
+
+  pmu_generation++;
+  for (cgroup_index = 0; cgroup_index < cgroup_info_list->size;
+       cgroup_index++) {
+    unsigned long long cgroup_id =
+        cgroup_info_list->cgroups_e[cgroup_index].cgroup_id;
+    for (i = 0; i < num_of_pmu_cgroups; i++) {
+      if (pmu_cgroups[i].cgroup_id == cgroup_id) {
+        break;
+      }
+    }
+    if (i == num_of_pmu_cgroups) {
+      if (num_of_pmu_cgroups == pmu_cgroups_capacity) {
+        pmu_cgroups_capacity =
+            pmu_cgroups_capacity == 0 ? 16 : 2 * pmu_cgroups_capacity;
+        pmu_cgroups = realloc(pmu_cgroups,
+                              pmu_cgroups_capacity * sizeof(pmu_cgroup_t));
+        if (pmu_cgroups == NULL) {
+          logging(LOG_CODE_FATAL, "cannot allocate memory");
+        }
+      }
+      pmu_cgroups[i].cgroup_id = cgroup_id;
+      pmu_cgroups[i].num_fds = alloc_per_core(sizeof(int));
+      pmu_cgroups[i].fds = alloc_per_core(sizeof(perf_event_desc_t*));
+      for (cpu = 0; cpu < num_of_cores; cpu++) {
+        open_pmu_events(cgroup_info_list->dir_fds[cgroup_index],
+                        core_ids[cpu], PERF_FLAG_PID_CGROUP,
+                        &pmu_cgroups[i].fds[cpu],
+                        &pmu_cgroups[i].num_fds[cpu]);
+      }
+      if (pmu_cgroups[i].fds[0][0].fd == -1) {
+        logging(LOG_CODE_WARNING, "Cannot open PMU events for cgroup %s.\n",
+                cgroup_info_list->cgroups_e[cgroup_index].path);
+      }
+      num_of_pmu_cgroups++;
+    }
+    pmu_cgroups[i].cgroup_index = cgroup_index;
+    pmu_cgroups[i].generation = pmu_generation;
+  }
+
+  // Close the cgroups that are not recorded anymore
+  i = 0;
+  while (i < num_of_pmu_cgroups) {
+    if (pmu_cgroups[i].generation == pmu_generation) {
+      i++;
+      continue;
+    }
+    close_pmu_cgroup(&pmu_cgroups[i]);
+    pmu_cgroups[i] = pmu_cgroups[--num_of_pmu_cgroups];
+  }
 }
 
 void clean_pmu_sample() {
+  close_system_files(&system_files);
+
+  // Close all the cached PMU descriptors
+  pmu_generation++;
+  pmu_cache_evict();
+  free(pmu_cache);
+  pmu_cache = NULL;
+  pmu_cache_size = 0;
+  free(pmu_info_rows);
+  pmu_info_rows = NULL;
+  pmu_info_capacity = 0;
+  free(pmu_thread_info_rows);
+  pmu_thread_info_rows = NULL;
+  pmu_thread_info_capacity = 0;
+
+  // Close all the per-cgroup PMU descriptors
+  size_t i;
+  int cpu;
+  for (i = 0; i < num_of_pmu_cgroups; i++) {
+    close_pmu_cgroup(&pmu_cgroups[i]);
+  }
+  free(pmu_cgroups);
+  pmu_cgroups = NULL;
+  num_of_pmu_cgroups = 0;
+  pmu_cgroups_capacity = 0;
+  free(pmu_cgroup_info_rows);
+  pmu_cgroup_info_rows = NULL;
+  pmu_cgroup_info_capacity = 0;
+
+  // Stop the reader threads, and close all the per-CPU PMU descriptors
+  if (pmu_fast_read) {
+    clean_pool(&pmu_read_pool);
+    free(pmu_reader_pinned);
+    pmu_reader_pinned = NULL;
+    pmu_fast_read = false;
+  }
+  if (pmu_mode == PMU_MODE_PER_CPU) {
+    for (cpu = 0; cpu < num_of_cores; cpu++) {
+      close_pmu_events(pmu_core_fds[cpu], pmu_core_num_fds[cpu]);
+    }
+    free(pmu_core_fds);
+    pmu_core_fds = NULL;
+    free(pmu_core_num_fds);
+    pmu_core_num_fds = NULL;
+    free(pmu_core_info_rows);
+    pmu_core_info_rows = NULL;
+  }
+
+  // Release the per-CPU snapshots
+  free(prev_interrupt_per_core);
+  free(interrupt_per_core);
+  free(line_interrupt_per_core);
+  free(irq_info_values);
+  free(frequency_info_values);
+  if (interrupts_fd != -1) {
+    close(interrupts_fd);
+  }
+  free(interrupts_buffer);
+  interrupts_buffer = NULL;
+  interrupts_buffer_size = 0;
+  if (network_fd != -1) {
+    close(network_fd);
+  }
+  free(network_buffer);
+  network_buffer = NULL;
+  network_buffer_size = 0;
+  for (cpu = 0; cpu < 2; cpu++) {
+    free(cpu_clk_unhalted_core[cpu]);
+    free(cpu_clk_unhalted_ref[cpu]);
+  }
+  free(core_ids);
+  core_ids = NULL;
+
+  // Release the recycled descriptor arrays and the template
+  while (pmu_free_fds != NULL) {
+    perf_event_desc_t* next = pmu_free_fds[0].buf;
+    free(pmu_free_fds);
+    pmu_free_fds = next;
+  }
+  perf_free_fds(pmu_template, pmu_template_num_fds);
+  pmu_template = NULL;
+  pmu_template_num_fds = 0;
+
   /* free libpfm resources cleanly */
   pfm_terminate();
 }
 
-void record_pmu_sample(
-         perf_event_desc_t** fds, int num_fds, int num_pmus,
-         unsigned long long pmu_info[MAX_NUM_PROCESSES][MAX_EVENTS],
-         int child_thread_mapping[MAX_NUM_PROCESSES * MAX_NUM_THREADS]) {
-  uint64_t val;
-  uint64_t values[3];
-  int fds_index, pmu_index;
-  ssize_t ret;
+/*
+ * Reads all the events of a group with a single read, in the format of:
+ *
+ * { u64 nr;
+ *   u64 time_enabled;
+ *   u64 time_running;
+ *   { u64 value;
+ *     u64 id;
+ *   } cntr[nr];
+ * }
+ *
+ * The values of every event are stored in the same format as a non-group
+ * read, so that they can be scaled with perf_scale_delta(). An event whose
+ * value cannot be read keeps its previous values, i.e., a zero delta.
+ */
+void read_pmu_group(perf_event_desc_t* fds, int num_fds, int leader) {
+  uint64_t buffer[3 + 2 * PMU_EVENTS_PER_GROUP];
+  int i;
 
-  // Reset the values
-  memset(pmu_info, 0, MAX_NUM_PROCESSES * MAX_NUM_THREADS * sizeof(int));
+  if (fds[leader].fd == -1) {
+    return;
+  }
 
-  /*
-   * now read the results. We use pfp_event_count because
-   * libpfm guarantees that counters for the events always
-   * come first.
-   */
-  for (pmu_index = 0; pmu_index < num_pmus; pmu_index++) {
-    memset(values, 0, sizeof(values));
-
-    for (fds_index = 0; fds_index < num_fds; fds_index++) {
-      ret = read(fds[pmu_index][fds_index].fd, values, sizeof(values));
-      if (ret < (ssize_t)sizeof(values)) {
-        if (ret == -1) {
-          // FIXME: the corresponding process has already gone
-          // logging(LOG_CODE_WARNING, "cannot read results: %s", "strerror(errno)");
-          val = 0;
-        } else {
-          logging(LOG_CODE_WARNING, "could not read event %d", fds_index);
-        }
-      } else {
-        /*
-         * scaling is systematic because we may be sharing the PMU and
-         * thus may be multiplexed
-         */
-        val = perf_scale(values);
-      }
+  ssize_t ret = read(fds[leader].fd, buffer, sizeof(buffer));
+  if (ret < (ssize_t)(3 * sizeof(uint64_t))) {
+    if (ret == -1) {
+      // FIXME: the corresponding thread has already gone
+      // logging(LOG_CODE_WARNING, "cannot read results: %s", "strerror(errno)");
+    } else {
+      logging(LOG_CODE_WARNING, "could not read group %d", leader);
+    }
+    return;
+  }
 
-      pmu_info[child_thread_mapping[pmu_index]][fds_index] += val;
+  uint64_t nr = buffer[0];
+  if (ret < (ssize_t)((3 + 2 * nr) * sizeof(uint64_t))) {
+    logging(LOG_CODE_WARNING, "could not read group %d", leader);
+    return;
+  }
+
+  for (i = 0; i < nr; i++) {
+    int e = perf_id2event(fds, num_fds, buffer[3 + 2 * i + 1]);
+    if (e == -1) {
+      continue;
     }
+    fds[e].values[0] = buffer[3 + 2 * i];
+    fds[e].values[1] = buffer[1];
+    fds[e].values[2] = buffer[2];
   }
 }
 
-void get_pmu_sample(process_list_t* process_info_list,
-                    const char* events[MAX_EVENTS],
-                    unsigned int sample_interval,
-                    hardware_info_t* hardware_info) {
-  int pmu_index, num_pmus;
-  int fds_index, num_fds;
+// Adds the deltas of all the events since the last read to pmu_info
+static void add_pmu_deltas(perf_event_desc_t* fds, int num_fds,
+                           unsigned long long pmu_info[PMU_ROW_LENGTH]) {
+  int fds_index;
+  for (fds_index = 0; fds_index < num_fds; fds_index++) {
+    /*
+     * scaling is systematic because we may be sharing the PMU and
+     * thus may be multiplexed
+     */
+    pmu_info[fds_index] +=
+        perf_scale_delta(fds[fds_index].values, fds[fds_index].prev_values);
+    // Along with how long the event was counted out of the time it was
+    // enabled, for the fraction of time it was counted
+    pmu_info[pmu_ratio_offset + fds_index] +=
+        fds[fds_index].values[2] - fds[fds_index].prev_values[2];
+    pmu_info[pmu_enabled_offset + fds_index] +=
+        fds[fds_index].values[1] - fds[fds_index].prev_values[1];
+    memcpy(fds[fds_index].prev_values, fds[fds_index].values,
+           sizeof(fds[fds_index].values));
+  }
+}
+
+// Reads all the events of a group from their mmap pages with rdpmc, which has
+// to be done on the CPU they count. Falls back to a group read if any of them
+// is not active there, e.g., because it has been multiplexed out or disabled.
+static void read_pmu_group_user_pages(perf_event_desc_t* fds, int num_fds,
+                                      int leader) {
+  int num_of_group_fds = perf_get_group_nevents(fds, num_fds, leader);
+  int i;
+  for (i = leader; i < leader + num_of_group_fds; i++) {
+    if (fds[i].fd == -1 ||
+        perf_read_user_page(&fds[i], fds[i].values) == -1) {
+      read_pmu_group(fds, num_fds, leader);
+      return;
+    }
+  }
+}
+
+// Reads all the events of a thread or a CPU, and adds the deltas since the last
+// read to pmu_info
+void read_pmu_events(perf_event_desc_t* fds, int num_fds,
+                     unsigned long long pmu_info[PMU_ROW_LENGTH]) {
+  int fds_index;
+
+  // One read per group gets the values of all the events in it
+  for (fds_index = 0; fds_index < num_fds; fds_index++) {
+    if (perf_is_group_leader(fds, fds_index)) {
+      read_pmu_group(fds, num_fds, fds_index);
+    }
+  }
+  add_pmu_deltas(fds, num_fds, pmu_info);
+}
+
+void record_pmu_sample(
+         process_list_t* process_info_list,
+         unsigned long long pmu_info[][PMU_ROW_LENGTH],
+         unsigned long long pmu_thread_info[][PMU_ROW_LENGTH]) {
   int proc_index;
-  int ret;
-  int child_thread_mapping[MAX_NUM_PROCESSES * MAX_NUM_THREADS];
+  int event_index;
+
+  // Reset the values
+  memset(pmu_info, 0,
+         process_info_list->size * PMU_ROW_LENGTH * sizeof(unsigned long long));
+  memset(pmu_thread_info, 0,
+         process_info_list->num_of_threads * PMU_ROW_LENGTH *
+             sizeof(unsigned long long));
 
   /*
-   * Initialize pfm library (required before we can use it)
+   * now read the results. We use pfp_event_count because
+   * libpfm guarantees that counters for the events always
+   * come first.
    */
-  pmu_index = 0;
   for (proc_index = 0; proc_index < process_info_list->size; proc_index++) {
-    // Handle all the threads, including parent and child
     int i;
     for (i = 0;
          i < process_info_list->processes_i[proc_index].child_thread_ids_size;
          i++) {
-      pmu_fds[pmu_index] = NULL;
-      ret = perf_setup_argv_events(events, &pmu_fds[pmu_index], &num_fds);
-      if (ret || !num_fds) {
-        logging(LOG_CODE_FATAL, "cannot setup events");
+      int slot = pmu_cache_lookup(
+          process_info_list->processes_i[proc_index].child_thread_ids[i]);
+      if (slot == -1) {
+        continue;
       }
-
-      pmu_fds[pmu_index][0].fd = -1;
-
-      for (fds_index = 0; fds_index < num_fds; fds_index++) {
-        /* request timing information necessary for scaling */
-        pmu_fds[pmu_index][fds_index].hw.read_format = PERF_FORMAT_SCALE;
-        pmu_fds[pmu_index][fds_index].hw.inherit = 1;
-        pmu_fds[pmu_index][fds_index].hw.disabled = 1; /* do no start now */
-        /* each event is in an independent group (multiplexing likely) */
-        pmu_fds[pmu_index][fds_index].fd = perf_event_open(
-            &pmu_fds[pmu_index][fds_index].hw,
-            process_info_list->processes_i[proc_index].child_thread_ids[i],
-            -1, -1, 0);
-        // TODO: The corresponding process has already gone
-        if (pmu_fds[pmu_index][fds_index].fd == -1) {
-          // logging(LOG_CODE_WARNING, "cannot open event %d, errno: %s\n", fds_index, strerror(errno));
-        }
+      pmu_thread_t* thread = &pmu_cache[slot];
+      if (thread->thread_index == -1) {
+        read_pmu_events(thread->fds, thread->num_fds,
+                        pmu_info[thread->proc_index]);
+        continue;
+      }
+      // A recorded thread keeps its own events, which are also added to
+      // its process
+      read_pmu_events(thread->fds, thread->num_fds,
+                      pmu_thread_info[thread->thread_index]);
+      for (event_index = 0; event_index < thread->num_fds; event_index++) {
+        pmu_info[thread->proc_index][event_index] +=
+            pmu_thread_info[thread->thread_index][event_index];
+        pmu_info[thread->proc_index][pmu_ratio_offset + event_index] +=
+            pmu_thread_info[thread->thread_index]
+                           [pmu_ratio_offset + event_index];
+        pmu_info[thread->proc_index][pmu_enabled_offset + event_index] +=
+            pmu_thread_info[thread->thread_index]
+                           [pmu_enabled_offset + event_index];
       }
-      // Record the parent thread
-      child_thread_mapping[pmu_index] = proc_index;
-      // Increment the PMU index for each child thread
-      pmu_index++;
     }
   }
+}
 
-  // Total number of PMUs
-  num_pmus = pmu_index;
+// Reads the events of the CPU a reader thread is pinned to, with rdpmc
+static void read_pmu_core(int worker, void* arg) {
+  if (worker == 0) {
+    return;
+  }
+  int cpu = worker - 1;
+  unsigned long long(*pmu_core_info)[PMU_ROW_LENGTH] = arg;
+  perf_event_desc_t* fds = pmu_core_fds[cpu];
+  int num_fds = pmu_core_num_fds[cpu];
+  if (!pmu_reader_pinned[cpu] || sched_getcpu() != core_ids[cpu]) {
+    read_pmu_events(fds, num_fds, pmu_core_info[cpu]);
+    return;
+  }
 
-  /*
-   * enable all counters attached to this thread and created by it
-   */
-  ret = prctl(PR_TASK_PERF_EVENTS_ENABLE);
-  if (ret) {
-    logging(LOG_CODE_FATAL, "prctl(enable) failed");
+  int fds_index;
+  for (fds_index = 0; fds_index < num_fds; fds_index++) {
+    if (perf_is_group_leader(fds, fds_index)) {
+      read_pmu_group_user_pages(fds, num_fds, fds_index);
+    }
   }
+  add_pmu_deltas(fds, num_fds, pmu_core_info[cpu]);
+}
 
-  // Network interrupt handling
-  get_irq_stats(prev_interrupt_per_core);
-  // CPU frequency
-  get_cpu_cycles(&cycles[0], &tvs[0], cpu_clk_unhalted_core[0],
-                 cpu_clk_unhalted_ref[0]);
-  // Network
-  get_network_stats(&prev_network_recv_bytes, &prev_network_recv_packets,
-                    &prev_network_recv_errs, &prev_network_recv_drops,
-                    &prev_network_send_bytes, &prev_network_send_packets,
-                    &prev_network_send_errs, &prev_network_send_drops);
+void record_pmu_core_sample(
+         unsigned long long pmu_core_info[][PMU_ROW_LENGTH]) {
+  int cpu;
+
+  // Reset the values
+  memset(pmu_core_info, 0,
+         num_of_cores * PMU_ROW_LENGTH * sizeof(unsigned long long));
+
+  if (pmu_fast_read) {
+    run_pool(&pmu_read_pool, read_pmu_core, pmu_core_info);
+    return;
+  }
+  for (cpu = 0; cpu < num_of_cores; cpu++) {
+    read_pmu_events(pmu_core_fds[cpu], pmu_core_num_fds[cpu],
+                    pmu_core_info[cpu]);
+  }
+}
 
-  // Sample interval controller
-  // usleep(sample_interval - sleep_offset);
-  usleep(sample_interval);
+void record_pmu_cgroup_sample(
+         cgroup_list_t* cgroup_info_list,
+         unsigned long long pmu_cgroup_info[][PMU_ROW_LENGTH]) {
+  size_t i;
+  int cpu;
 
-  // Correct the amount of time we need to sleep
-  struct timeval curr_tvs;
-  gettimeofday(&curr_tvs, NULL);
-  // sleep_offset = (curr_tvs.tv_sec - si_tvs.tv_sec) * MICROSECONDS +
-  //     (curr_tvs.tv_usec - si_tvs.tv_usec) - sample_interval;
-  si_tvs = curr_tvs;
+  // Reset the values
+  memset(pmu_cgroup_info, 0,
+         cgroup_info_list->size * PMU_ROW_LENGTH * sizeof(unsigned long long));
+
+  // The events of a cgroup on all the CPUs add up
+  for (i = 0; i < num_of_pmu_cgroups; i++) {
+    for (cpu = 0; cpu < num_of_cores; cpu++) {
+      read_pmu_events(pmu_cgroups[i].fds[cpu], pmu_cgroups[i].num_fds[cpu],
+                      pmu_cgroup_info[pmu_cgroups[i].cgroup_index]);
+    }
+  }
+}
 
-  // logging(LOG_CODE_INFO, "offset: %d\n", sleep_offset);
+// Turns the time every event was running in every row into the fraction of
+// the time it was enabled, which is 0 if it was not enabled at all
+void record_pmu_ratios(unsigned long long pmu_rows[][PMU_ROW_LENGTH],
+                       size_t num_of_rows) {
+  size_t row;
+  int event_index;
+  for (row = 0; row < num_of_rows; row++) {
+    for (event_index = 0; event_index < pmu_num_of_events; event_index++) {
+      unsigned long long running =
+          pmu_rows[row][pmu_ratio_offset + event_index];
+      unsigned long long enabled =
+          pmu_rows[row][pmu_enabled_offset + event_index];
+      double ratio = enabled != 0 ? (double)running / enabled : 0.0;
+      memcpy(&pmu_rows[row][pmu_ratio_offset + event_index], &ratio,
+             sizeof(ratio));
+    }
+  }
+}
+
+// Computes the derived metrics of every row from its counts, and stores them
+// after the counts
+void record_derived_metrics(unsigned long long pmu_rows[][PMU_ROW_LENGTH],
+                            size_t num_of_rows) {
+  size_t row;
+  int metric_index;
+  for (row = 0; row < num_of_rows; row++) {
+    for (metric_index = 0; metric_index < pmu_num_of_derived_metrics;
+         metric_index++) {
+      double value = evaluate_derived_metric(
+          &pmu_derived_metrics[metric_index], pmu_rows[row]);
+      memcpy(&pmu_rows[row][pmu_num_of_events + metric_index], &value,
+             sizeof(value));
+    }
+  }
+}
+
+// Fills in the fractions of time and the derived metrics of the rows
+static void finish_pmu_rows(unsigned long long pmu_rows[][PMU_ROW_LENGTH],
+                            size_t num_of_rows) {
+  record_pmu_ratios(pmu_rows, num_of_rows);
+  record_derived_metrics(pmu_rows, num_of_rows);
+}
+
+// Enables or disables the groups of events of a set
+static void toggle_pmu_events(perf_event_desc_t* fds, int num_fds, int set,
+                              int request) {
+  int fds_index;
+  for (fds_index = 0; fds_index < num_fds; fds_index++) {
+    if (fds[fds_index].fd != -1 && perf_is_group_leader(fds, fds_index) &&
+        pmu_event_sets[fds_index] == set) {
+      ioctl(fds[fds_index].fd, request, 0);
+    }
+  }
+}
+
+// The same as above, for all the open descriptors
+static void toggle_pmu_set(int set, int request) {
+  unsigned int slot;
+  size_t i;
+  int cpu;
+  if (pmu_mode == PMU_MODE_PER_THREAD) {
+    for (slot = 0; slot < pmu_cache_size; slot++) {
+      if (pmu_cache[slot].tid != 0) {
+        toggle_pmu_events(pmu_cache[slot].fds, pmu_cache[slot].num_fds, set,
+                          request);
+      }
+    }
+  } else if (pmu_mode == PMU_MODE_PER_CGROUP) {
+    for (i = 0; i < num_of_pmu_cgroups; i++) {
+      for (cpu = 0; cpu < num_of_cores; cpu++) {
+        toggle_pmu_events(pmu_cgroups[i].fds[cpu],
+                          pmu_cgroups[i].num_fds[cpu], set, request);
+      }
+    }
+  } else {
+    for (cpu = 0; cpu < num_of_cores; cpu++) {
+      toggle_pmu_events(pmu_core_fds[cpu], pmu_core_num_fds[cpu], set,
+                        request);
+    }
+  }
+}
+
+// Makes room for at least the given number of rows of PMU events
+static void reserve_pmu_rows(unsigned long long (**rows)[PMU_ROW_LENGTH],
+                             size_t* capacity, size_t size) {
+  if (size <= *capacity) {
+    return;
+  }
+  *capacity = size;
+  *rows = realloc(*rows, *capacity * sizeof(**rows));
+  if (*rows == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+}
+
+void get_pmu_sample(process_list_t* process_info_list,
+                    cgroup_list_t* cgroup_info_list,
+                    const struct timespec* deadline,
+                    hardware_info_t* hardware_info) {
+  // The per-CPU counters do not depend on the filtered process list
+  if (pmu_mode == PMU_MODE_PER_THREAD) {
+    update_pmu_cache(process_info_list);
+  } else if (pmu_mode == PMU_MODE_PER_CGROUP) {
+    update_pmu_cgroups(cgroup_info_list);
+  }
+
+  // Sleep until the end of the sample interval. The deadline is absolute, so
+  // the time spent on collecting and recording does not add up as drift.
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) ==
+         EINTR) {
+  }
+
+  // Measure the actual length of the sample window
+  unsigned long long curr_window_end_ns = get_time_ns(CLOCK_MONOTONIC);
+  hardware_info->timestamp_ns = get_time_ns(CLOCK_REALTIME);
+  hardware_info->window_ns = curr_window_end_ns - window_end_ns;
+  window_end_ns = curr_window_end_ns;
+
+  // All the statistics below are taken against the snapshots at the end of
+  // the last sample window, so that no time is left uncovered
 
   // Network interrupt handling
   get_irq_stats(interrupt_per_core);
   estimate_irq(hardware_info->irq_info);
+  memcpy(prev_interrupt_per_core, interrupt_per_core,
+         num_of_cores * sizeof(long long));
   // CPU frequency
-  get_cpu_cycles(&cycles[1], &tvs[1], cpu_clk_unhalted_core[1],
-                 cpu_clk_unhalted_ref[1]);
-  estimate_frequency(hardware_info->frequency_info);
+  if (msr_enabled) {
+    get_cpu_cycles(&cycles[1], &tvs[1], cpu_clk_unhalted_core[1],
+                   cpu_clk_unhalted_ref[1]);
+    estimate_frequency(hardware_info->frequency_info);
+    cycles[0] = cycles[1];
+    tvs[0] = tvs[1];
+    memcpy(cpu_clk_unhalted_core[0], cpu_clk_unhalted_core[1],
+           num_of_cores * sizeof(unsigned long long));
+    memcpy(cpu_clk_unhalted_ref[0], cpu_clk_unhalted_ref[1],
+           num_of_cores * sizeof(unsigned long long));
+  }
   // Network
   get_network_stats(&network_recv_bytes, &network_recv_packets,
                     &network_recv_errs, &network_recv_drops,
                     &network_send_bytes, &network_send_packets,
                     &network_send_errs, &network_send_drops);
   estimate_network(hardware_info->network_info);
+  prev_network_recv_bytes = network_recv_bytes;
+  prev_network_recv_packets = network_recv_packets;
+  prev_network_recv_errs = network_recv_errs;
+  prev_network_recv_drops = network_recv_drops;
+  prev_network_send_bytes = network_send_bytes;
+  prev_network_send_packets = network_send_packets;
+  prev_network_send_errs = network_send_errs;
+  prev_network_send_drops = network_send_drops;
+  // Pressure stalls and memory management
+  read_system_stats(&system_files, system_stats);
+  estimate_system(hardware_info->system_info);
+  memcpy(prev_system_stats, system_stats, sizeof(system_stats));
+
+  // The set of events that has been counting stops before being read, so
+  // that nothing is counted between reading it and the next time it counts
+  if (pmu_rotation) {
+    toggle_pmu_set(pmu_active_set, PERF_EVENT_IOC_DISABLE);
+  }
 
-  record_pmu_sample(pmu_fds, num_fds, num_pmus,
-                    hardware_info->pmu_info, child_thread_mapping);
-
-  /*
-   * disable all counters attached to this thread
-   */
-  ret = prctl(PR_TASK_PERF_EVENTS_DISABLE);
-  if (ret) logging(LOG_CODE_FATAL, "prctl(disable) failed");
+  // The counters keep running across intervals, so this records the deltas
+  // since the last read
+  if (pmu_mode == PMU_MODE_PER_THREAD) {
+    reserve_pmu_rows(&pmu_info_rows, &pmu_info_capacity,
+                     process_info_list->size);
+    reserve_pmu_rows(&pmu_thread_info_rows, &pmu_thread_info_capacity,
+                     process_info_list->num_of_threads);
+    hardware_info->pmu_info = pmu_info_rows;
+    hardware_info->pmu_thread_info = pmu_thread_info_rows;
+    record_pmu_sample(process_info_list, hardware_info->pmu_info,
+                      hardware_info->pmu_thread_info);
+    finish_pmu_rows(hardware_info->pmu_info, process_info_list->size);
+    finish_pmu_rows(hardware_info->pmu_thread_info,
+                    process_info_list->num_of_threads);
+  } else if (pmu_mode == PMU_MODE_PER_CGROUP) {
+    reserve_pmu_rows(&pmu_cgroup_info_rows, &pmu_cgroup_info_capacity,
+                     cgroup_info_list->size);
+    hardware_info->pmu_cgroup_info = pmu_cgroup_info_rows;
+    record_pmu_cgroup_sample(cgroup_info_list,
+                             hardware_info->pmu_cgroup_info);
+    finish_pmu_rows(hardware_info->pmu_cgroup_info, cgroup_info_list->size);
+  } else {
+    record_pmu_core_sample(hardware_info->pmu_core_info);
+    finish_pmu_rows(hardware_info->pmu_core_info, num_of_cores);
+  }
 
-  for (pmu_index = 0; pmu_index < num_pmus; pmu_index++) {
-    for (fds_index = 0; fds_index < num_fds; fds_index++) {
-      close(pmu_fds[pmu_index][fds_index].fd);
-    }
-    perf_free_fds(pmu_fds[pmu_index], num_fds);
+  // And the next set counts in the next interval
+  if (pmu_rotation) {
+    pmu_active_set = (pmu_active_set + 1) % num_of_pmu_sets;
+    toggle_pmu_set(pmu_active_set, PERF_EVENT_IOC_ENABLE);
   }
 }
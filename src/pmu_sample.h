@@ -11,15 +11,26 @@
 #ifndef __PMU_SAMPLE_H__
 #define __PMU_SAMPLE_H__
 
+#include "cgroup_sample.h"
 #include "proc_sample.h"
 
+#include "derived_util.h"
 #include "perf_util.h"
+#include "system_util.h"
 
 #include <perfmon/pfmlib_perf_event.h>
 
+#include <stdbool.h>
+#include <time.h>
+
 #define MAX_EVENTS 32
 
-#define MAX_NUM_CORES 40
+// Number of values in a row of PMU events, see hardware_info_t
+#define PMU_ROW_LENGTH (3 * MAX_EVENTS + MAX_DERIVED_METRICS)
+
+// Number of slots the per-thread PMU descriptor cache starts with. It has to be
+// a power of 2, and the cache doubles whenever it is more than half full.
+#define PMU_CACHE_INITIAL_SIZE 1024
 
 // Max number of PMU events that can be used in each group
 #define PMU_EVENTS_PER_GROUP 5
@@ -27,35 +38,120 @@
 // Max length of each event list
 #define PMU_EVENTS_NAME_LENGTH 128
 
-// PMU for NUMA local accesses
-#define PMU_NUMA_LMA \
-  "OFFCORE_RESPONSE_1:DMND_DATA_RD:LLC_MISS_LOCAL:SNP_MISS:SNP_NO_FWD"
-
-// PMU for NUMA remote accesses
-#define PMU_NUMA_RMA \
-  "OFFCORE_RESPONSE_0:DMND_DATA_RD:LLC_MISS_REMOTE:SNP_MISS:SNP_NO_FWD"
-
+// Ways of attributing the PMU events
+// Recorded in the output file header, see FORMAT_PMU_MODE_* in format_util.h
+typedef enum {
+  // Per thread of the filtered processes, summed up for each process
+  PMU_MODE_PER_THREAD = 0x00,
+  // Per CPU, counting every task running on it
+  PMU_MODE_PER_CPU = 0x01,
+  // Per recorded cgroup, with one set of events per CPU for each of them
+  PMU_MODE_PER_CGROUP = 0x02,
+} pmu_mode_t;
+
+// Every row of PMU events holds the counts of the events, followed by the
+// values of the derived metrics, and then by the fraction of time each of the
+// events was counted (time_running / time_enabled), which are doubles stored
+// in place with memcpy(). While the events are being read, the fractions hold
+// the time the events were running, and the time they were enabled follows.
 typedef struct hardware_info {
+  // Number of online CPUs, which all the per-CPU values below have one entry
+  // for
   int num_of_cores;
   int num_of_events;
-  long long irq_info[MAX_NUM_CORES];
+  int num_of_derived_metrics;
+  short pmu_mode;
+  // Whether the events are split into sets that fit in the counters, which
+  // take turns counting, one set per interval, rather than being multiplexed
+  // by the kernel
+  bool pmu_rotation;
+  // Number of counters each set can use, or 0 to ask libpfm
+  int pmu_counters;
+  // Whether the per-CPU events are read in userspace with rdpmc, by a reader
+  // thread pinned to each CPU, rather than with a read() per group
+  bool pmu_fast_read;
+  // Wall-clock time at the end of the sample window
+  unsigned long long timestamp_ns;
+  // Measured length of the sample window
+  unsigned long long window_ns;
+  long long* irq_info;
   unsigned long long network_info[8];
-  unsigned int frequency_info[MAX_NUM_CORES];
-  unsigned long long pmu_info[MAX_NUM_PROCESSES][MAX_EVENTS];
+  unsigned int* frequency_info;
+  // Pressure stalls and memory management counters of the whole system, see
+  // system_stat_t
+  unsigned long long system_info[NUM_OF_SYSTEM_STATS];
+  // One row per filtered process, which grows along with the list
+  unsigned long long (*pmu_info)[PMU_ROW_LENGTH];
+  // One row per recorded thread of the filtered processes
+  unsigned long long (*pmu_thread_info)[PMU_ROW_LENGTH];
+  // One row per recorded cgroup
+  unsigned long long (*pmu_cgroup_info)[PMU_ROW_LENGTH];
+  // One row per online CPU in the per-CPU mode
+  unsigned long long (*pmu_core_info)[PMU_ROW_LENGTH];
 } hardware_info_t;
 
-void init_pmu_sample(hardware_info_t* hardware_info);
+// The PMU descriptors of a monitored thread, which stay open for as long as
+// the thread remains in the filtered process list
+typedef struct pmu_thread {
+  pid_t tid;
+  // Index of the owner process in the current filtered process list
+  int proc_index;
+  // Index of the thread among the recorded threads of the list, or -1 if it
+  // is not recorded on its own
+  int thread_index;
+  // Last interval in which the thread was seen in the filtered list
+  unsigned int generation;
+  int num_fds;
+  perf_event_desc_t* fds;
+} pmu_thread_t;
+
+// The PMU descriptors of a recorded cgroup on every online CPU, which stay
+// open for as long as the cgroup is recorded
+typedef struct pmu_cgroup {
+  unsigned long long cgroup_id;
+  // Index of the cgroup in the current cgroup list
+  int cgroup_index;
+  // Last interval in which the cgroup was recorded
+  unsigned int generation;
+  // One entry per online CPU
+  int* num_fds;
+  perf_event_desc_t** fds;
+} pmu_cgroup_t;
+
+void init_pmu_sample(hardware_info_t* hardware_info,
+                     const char* events[MAX_EVENTS],
+                     const derived_metric_t* derived_metrics);
+
+unsigned long long get_time_ns(clockid_t clock_id);
 
 void get_pmu_sample(process_list_t* process_info_list,
-                    const char* events[MAX_EVENTS],
-                    unsigned int sample_interval,
+                    cgroup_list_t* cgroup_info_list,
+                    const struct timespec* deadline,
                     hardware_info_t* hardware_info);
 
 void clean_pmu_sample();
 
+void read_pmu_group(perf_event_desc_t* fds, int num_fds, int leader);
+
+void read_pmu_events(perf_event_desc_t* fds, int num_fds,
+                     unsigned long long pmu_info[PMU_ROW_LENGTH]);
+
 void record_pmu_sample(
-         perf_event_desc_t** fds, int num_fds, int num_pmus,
-         unsigned long long pmu_info[MAX_NUM_PROCESSES][MAX_EVENTS],
-         int child_thread_mapping[MAX_NUM_PROCESSES * MAX_NUM_THREADS]);
+         process_list_t* process_info_list,
+         unsigned long long pmu_info[][PMU_ROW_LENGTH],
+         unsigned long long pmu_thread_info[][PMU_ROW_LENGTH]);
+
+void record_pmu_core_sample(
+         unsigned long long pmu_core_info[][PMU_ROW_LENGTH]);
+
+void record_pmu_cgroup_sample(
+         cgroup_list_t* cgroup_info_list,
+         unsigned long long pmu_cgroup_info[][PMU_ROW_LENGTH]);
+
+void record_pmu_ratios(unsigned long long pmu_rows[][PMU_ROW_LENGTH],
+                       size_t num_of_rows);
+
+void record_derived_metrics(unsigned long long pmu_rows[][PMU_ROW_LENGTH],
+                            size_t num_of_rows);
 
 #endif
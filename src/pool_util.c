@@ -0,0 +1,115 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "pool_util.h"
+
+#include "log_util.h"
+
+#include <signal.h>
+#include <stdlib.h>
+
+static void* pool_thread(void* arg) {
+  pool_worker_t* worker = (pool_worker_t*)arg;
+  pool_t* pool = worker->pool;
+  unsigned long round = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->round == round && !pool->stopping) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    round = pool->round;
+    pool_task_t task = pool->task;
+    void* task_arg = pool->arg;
+    pthread_mutex_unlock(&pool->lock);
+
+    task(worker->index, task_arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->num_of_running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+void init_pool(pool_t* pool, int num_of_workers) {
+  pool->num_of_workers = num_of_workers;
+  pool->round = 0;
+  pool->num_of_running = 0;
+  pool->stopping = false;
+  pool->task = NULL;
+  pool->arg = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  pool->threads = calloc(num_of_workers, sizeof(pthread_t));
+  pool->workers = calloc(num_of_workers, sizeof(pool_worker_t));
+  if (pool->threads == NULL || pool->workers == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+
+  // The workers leave all the signals to the main thread
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  int i;
+  for (i = 1; i < num_of_workers; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    if (pthread_create(&pool->threads[i], NULL, pool_thread,
+                       &pool->workers[i]) != 0) {
+      logging(LOG_CODE_FATAL, "Cannot create worker thread %d.\n", i);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+void run_pool(pool_t* pool, pool_task_t task, void* arg) {
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->arg = arg;
+  pool->num_of_running = pool->num_of_workers - 1;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  task(0, arg);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->num_of_running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void clean_pool(pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  int i;
+  for (i = 1; i < pool->num_of_workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  free(pool->threads);
+  free(pool->workers);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+}
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __POOL_UTIL__
+#define __POOL_UTIL__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Work run by every worker, which is told its index in the pool
+typedef void (*pool_task_t)(int worker, void* arg);
+
+struct pool;
+
+typedef struct pool_worker {
+  struct pool* pool;
+  int index;
+} pool_worker_t;
+
+/*
+ * A fixed set of worker threads that all run the same task at once. The
+ * thread calling run_pool() takes part as worker 0, so a pool of 1 worker
+ * starts no threads at all.
+ */
+typedef struct pool {
+  int num_of_workers;
+  pthread_t* threads;
+  pool_worker_t* workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  // Incremented every time a task is handed out
+  unsigned long round;
+  int num_of_running;
+  bool stopping;
+  pool_task_t task;
+  void* arg;
+} pool_t;
+
+void init_pool(pool_t* pool, int num_of_workers);
+
+// Runs the task on all the workers, and returns when all of them are done
+void run_pool(pool_t* pool, pool_task_t task, void* arg);
+
+void clean_pool(pool_t* pool);
+
+#endif
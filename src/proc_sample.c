@@ -10,21 +10,756 @@
 
 #include "proc_sample.h"
 
+#include "cgroup_util.h"
+#include "lifecycle_util.h"
 #include "log_util.h"
+#include "pool_util.h"
+#include "procfs_util.h"
 
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+// Memory size of the machine, which does not change while we are running
+long phys_pages;
+long page_size;
+long clock_ticks;
+
+// Everything a worker needs to sample its share of the processes
+typedef struct proc_worker {
+  // The processes the worker has sampled in the current interval
+  process_list_t process_list;
+  // The stat files of the processes that belong to the worker
+  procfs_t procfs;
+  // CPU affinity of the filtered processes, as seen from the threads read by
+  // the worker
+  unsigned long long* cpu_affinity;
+} proc_worker_t;
+
+// The PIDs to be sampled by the workers in get_process_info()
+typedef struct proc_scan {
+  process_list_t* process_list;
+  process_list_t* prev_process_list;
+  int* pids;
+  size_t num_of_pids;
+  size_t pids_capacity;
+} proc_scan_t;
+
+// The filtered processes to be read by the workers in get_process_stats()
+typedef struct proc_stats {
+  process_list_t* filtered_process_list;
+  process_list_t* process_list;
+  // Index of each filtered process in process_list, or -1 if it has gone
+  int* process_list_idx;
+  // Number of threads of all the filtered processes
+  size_t num_of_threads;
+} proc_stats_t;
+
+// A process in the bounded heap of filter_process_info()
+typedef struct ranked_process {
+  float score;
+  int index;
+} ranked_process_t;
+
+// How the top processes are ranked, and whether that needs the I/O of all the
+// processes
+rank_t proc_rank;
+bool proc_rank_io;
+
+// Processes that are always monitored, with the compiled command line patterns
+watch_t proc_watch;
+regex_t proc_watch_regexes[MAX_WATCH_PATTERNS];
+bool proc_watch_full_logged;
+
+// Flags kept with the stat file of a process, so that it is matched against
+// the always-watch list only once
+#define PROC_FLAG_MATCHED 0x01
+#define PROC_FLAG_WATCHED 0x02
+
+// Lifecycle events of the processes, which keep the PIDs up to date between
+// the full scans of /proc/ every proc_rescan_intervals intervals
+lifecycle_t proc_lifecycle;
+bool proc_lifecycle_enabled;
+int proc_rescan_intervals;
+int proc_intervals_since_rescan;
+
+// PIDs of the processes created since the last interval
+int* proc_forks;
+size_t num_of_proc_forks;
+size_t proc_forks_capacity;
+
+// Processes that have exited since the last interval, with their final
+// counters
+lifecycle_event_t* proc_exits;
+size_t num_of_proc_exits;
+size_t proc_exits_capacity;
+
+// Which threads of the filtered processes are recorded
+thread_filter_t proc_thread_filter;
+
+// Whether the kernel keeps scheduler statistics, i.e., /proc/<pid>/schedstat
+bool proc_schedstat_enabled;
+
+// Where the cgroup2 hierarchy is mounted, or NULL if the processes are not
+// mapped to their cgroups
+const char* proc_cgroup_root;
+
+// Workers that read /proc/ in parallel
+pool_t proc_pool;
+proc_worker_t* proc_workers;
+int num_of_proc_workers;
+
+static unsigned int pid_index_hash(int pid, size_t pid_index_size) {
+  // Multiplicative hashing, since PIDs are mostly sequential
+  return ((unsigned int)pid * 2654435761U) & (pid_index_size - 1);
+}
+
+// Records that the process at the given index of the list has the given PID
+static void index_process(process_list_t* process_list, int pid, int index) {
+  unsigned int slot = pid_index_hash(pid, process_list->pid_index_size);
+  while (process_list->pid_index[slot] != 0) {
+    slot = (slot + 1) & (process_list->pid_index_size - 1);
+  }
+  process_list->pid_index[slot] = index + 1;
+}
+
+// Makes room for at least the given number of processes in the list
+static void reserve_process_list(process_list_t* process_list,
+                                 size_t capacity) {
+  if (capacity <= process_list->capacity) {
+    return;
+  }
+
+  process_list->processes_i = arena_grow(
+      &process_list->arena, process_list->processes_i,
+      process_list->capacity * sizeof(process_intermediate_t),
+      capacity * sizeof(process_intermediate_t));
+  process_list->processes_e = arena_grow(
+      &process_list->arena, process_list->processes_e,
+      process_list->capacity * sizeof(process_external_t),
+      capacity * sizeof(process_external_t));
+  process_list->capacity = capacity;
+
+  // Rebuild the PID index for the new capacity
+  process_list->pid_index_size = 1;
+  while (process_list->pid_index_size < 2 * capacity) {
+    process_list->pid_index_size <<= 1;
+  }
+  process_list->pid_index =
+      arena_alloc(&process_list->arena,
+                  process_list->pid_index_size * sizeof(unsigned int));
+  memset(process_list->pid_index, 0,
+         process_list->pid_index_size * sizeof(unsigned int));
+  int i;
+  for (i = 0; i < process_list->size; i++) {
+    index_process(process_list, process_list->processes_e[i].process_id, i);
+  }
+}
+
+// Empties the list and releases everything allocated for it, keeping room for
+// the given number of processes
+static void reset_process_list(process_list_t* process_list,
+                               size_t capacity) {
+  reset_arena(&process_list->arena);
+  process_list->processes_i = NULL;
+  process_list->processes_e = NULL;
+  process_list->capacity = 0;
+  process_list->size = 0;
+  process_list->pid_index = NULL;
+  process_list->pid_index_size = 0;
+  process_list->threads_e = NULL;
+  process_list->num_of_threads = 0;
+  reserve_process_list(process_list, capacity);
+}
+
+void init_process_list(process_list_t* process_list) {
+  init_arena(&process_list->arena);
+  process_list->cpu_total_time = 0;
+  process_list->processes_i = NULL;
+  process_list->processes_e = NULL;
+  process_list->capacity = 0;
+  process_list->size = 0;
+  process_list->pid_index = NULL;
+  process_list->pid_index_size = 0;
+  process_list->threads_e = NULL;
+  process_list->num_of_threads = 0;
+  reserve_process_list(process_list, PROCESS_LIST_INITIAL_CAPACITY);
+}
+
+void clean_process_list(process_list_t* process_list) {
+  clean_arena(&process_list->arena);
+  process_list->processes_i = NULL;
+  process_list->processes_e = NULL;
+  process_list->capacity = 0;
+  process_list->size = 0;
+  process_list->pid_index = NULL;
+  process_list->pid_index_size = 0;
+  process_list->threads_e = NULL;
+  process_list->num_of_threads = 0;
+}
+
+int find_process(const process_list_t* process_list, int pid) {
+  unsigned int slot = pid_index_hash(pid, process_list->pid_index_size);
+  while (process_list->pid_index[slot] != 0) {
+    int index = process_list->pid_index[slot] - 1;
+    if (process_list->processes_e[index].process_id == pid) {
+      return index;
+    }
+    slot = (slot + 1) & (process_list->pid_index_size - 1);
+  }
+  return -1;
+}
+
+void init_proc_sample(int num_of_workers, const rank_t* rank,
+                      const watch_t* watch, int rescan_intervals,
+                      const thread_filter_t* thread_filter,
+                      const char* cgroup_root) {
+  phys_pages = sysconf(_SC_PHYS_PAGES);
+  page_size = sysconf(_SC_PAGESIZE);
+  clock_ticks = sysconf(_SC_CLK_TCK);
+
+  proc_rank = *rank;
+  proc_rank_io = false;
+  int i;
+  for (i = 0; i < rank->num_of_keys; i++) {
+    if (rank->keys[i] == RANK_KEY_IO) {
+      proc_rank_io = true;
+    }
+  }
+
+  proc_thread_filter = *thread_filter;
+  proc_cgroup_root = cgroup_root;
+  proc_schedstat_enabled = access("/proc/self/schedstat", R_OK) == 0;
+  if (!proc_schedstat_enabled) {
+    logging(LOG_CODE_WARNING,
+            "No scheduler statistics, the run delay is not recorded.\n");
+  }
+  proc_watch = *watch;
+  proc_watch_full_logged = false;
+  for (i = 0; i < watch->num_of_cmdlines; i++) {
+    int ret = regcomp(&proc_watch_regexes[i], watch->cmdlines[i],
+                      REG_EXTENDED | REG_NOSUB);
+    if (ret != 0) {
+      char error[256];
+      regerror(ret, &proc_watch_regexes[i], error, sizeof(error));
+      logging(LOG_CODE_FATAL, "Invalid command line pattern %s: %s\n",
+              watch->cmdlines[i], error);
+    }
+  }
+
+  num_of_proc_workers = num_of_workers;
+  proc_workers = calloc(num_of_workers, sizeof(proc_worker_t));
+  if (proc_workers == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  for (i = 0; i < num_of_workers; i++) {
+    init_process_list(&proc_workers[i].process_list);
+    init_procfs(&proc_workers[i].procfs, num_of_workers);
+  }
+  init_pool(&proc_pool, num_of_workers);
+
+  // The first interval always scans /proc/
+  proc_rescan_intervals = rescan_intervals;
+  proc_intervals_since_rescan = rescan_intervals;
+  proc_lifecycle_enabled = false;
+  if (rescan_intervals > 1) {
+    if (init_lifecycle(&proc_lifecycle) == 0) {
+      proc_lifecycle_enabled = true;
+    } else {
+      logging(LOG_CODE_WARNING,
+              "Cannot listen to the process lifecycle events, scanning "
+              "/proc/ every interval instead.\n");
+    }
+  }
+  proc_forks = NULL;
+  num_of_proc_forks = 0;
+  proc_forks_capacity = 0;
+  proc_exits = NULL;
+  num_of_proc_exits = 0;
+  proc_exits_capacity = 0;
+}
+
+void clean_proc_sample(void) {
+  if (proc_lifecycle_enabled) {
+    clean_lifecycle(&proc_lifecycle);
+    proc_lifecycle_enabled = false;
+  }
+  free(proc_forks);
+  proc_forks = NULL;
+  free(proc_exits);
+  proc_exits = NULL;
+  clean_pool(&proc_pool);
+  int i;
+  for (i = 0; i < num_of_proc_workers; i++) {
+    clean_process_list(&proc_workers[i].process_list);
+    clean_procfs(&proc_workers[i].procfs);
+  }
+  free(proc_workers);
+  proc_workers = NULL;
+  num_of_proc_workers = 0;
+  for (i = 0; i < proc_watch.num_of_cmdlines; i++) {
+    regfree(&proc_watch_regexes[i]);
+  }
+  proc_watch.num_of_cmdlines = 0;
+}
+
+// Reads /proc/*/status or /proc/*/task/*/status for information about:
+// - context switches
+// file format: http://man7.org/linux/man-pages/man5/proc.5.html
+// ...
+// voluntary_ctxt_switches:        150
+// nonvoluntary_ctxt_switches:     545
+static int read_ctxt_switches(const char* status_location,
+                              unsigned long long* voluntary_ctxt_switches,
+                              unsigned long long* nonvoluntary_ctxt_switches) {
+  FILE* fp = fopen(status_location, "r");
+  if (fp == NULL) {
+    // This means the process has gone shortly after we list the directory
+    return -1;
+  }
+
+  char line_buffer[3][256];
+  char* prev_line = line_buffer[0];
+  char* curr_line = line_buffer[1];
+  char* next_line = line_buffer[2];
+  while (fgets(next_line, 256, fp) != NULL) {
+    // Rotate the pointers
+    char* tmp_ptr = prev_line;
+    prev_line = curr_line;
+    curr_line = next_line;
+    next_line = tmp_ptr;
+  }
+  fclose(fp);
+
+  // We should expect prev_line, curr_line contain the last 2 lines
+  int j = 0;
+  while (!isspace(prev_line[j])) j++;
+  *voluntary_ctxt_switches = atoll(&prev_line[j]);
+  j = 0;
+  while (!isspace(curr_line[j])) j++;
+  *nonvoluntary_ctxt_switches = atoll(&curr_line[j]);
+
+  return 0;
+}
+
+static int read_process_status(int pid, process_intermediate_t* process_i) {
+  char pid_status_location[32];
+  sprintf(pid_status_location, "/proc/%d/status", pid);
+  return read_ctxt_switches(pid_status_location,
+                            &process_i->voluntary_ctxt_switches,
+                            &process_i->nonvoluntary_ctxt_switches);
+}
+
+// Reads /proc/*/io for information about
+// - I/O
+// file format: http://man7.org/linux/man-pages/man5/proc.5.html
+// ...
+// read_bytes: 0
+// write_bytes: 323932160
+// cancelled_write_bytes: 0
+static int read_process_io(int pid, process_intermediate_t* process_i) {
+  char pid_io_location[32];
+  sprintf(pid_io_location, "/proc/%d/io", pid);
+  FILE* fp = fopen(pid_io_location, "r");
+  if (fp == NULL) {
+    // This means the process has gone shortly after we list the directory
+    return -1;
+  }
+
+  char line_buffer[4][256];
+  char* prev_prev_line = line_buffer[0];
+  char* prev_line = line_buffer[1];
+  char* curr_line = line_buffer[2];
+  char* next_line = line_buffer[3];
+  while (fgets(next_line, 256, fp) != NULL) {
+    // Rotate the pointers
+    char* tmp_ptr = prev_prev_line;
+    prev_prev_line = prev_line;
+    prev_line = curr_line;
+    curr_line = next_line;
+    next_line = tmp_ptr;
+  }
+  fclose(fp);
+
+  // We should expect prev_prev_line, prev_line, curr_line contain the last
+  // 3 lines
+  int j = 0;
+  while (!isspace(prev_prev_line[j])) j++;
+  process_i->read_bytes = atoll(&prev_prev_line[j]);
+  j = 0;
+  while (!isspace(prev_line[j])) j++;
+  process_i->write_bytes = atoll(&prev_line[j]);
+
+  return 0;
+}
+
+// Returns whether a process is in the always-watch list by its command name
+// or by its command line
+static bool match_watch(int pid, const proc_stat_t* stat) {
+  int i;
+  for (i = 0; i < proc_watch.num_of_comms; i++) {
+    if (strcmp(stat->comm, proc_watch.comms[i]) == 0) {
+      return true;
+    }
+  }
+  if (proc_watch.num_of_cmdlines == 0) {
+    return false;
+  }
+
+  // The arguments are separated by null bytes, and kernel threads have none
+  char cmdline_location[32];
+  sprintf(cmdline_location, "/proc/%d/cmdline", pid);
+  int fd = open(cmdline_location, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  char cmdline[PROCFS_BUFFER_SIZE];
+  ssize_t size = read(fd, cmdline, sizeof(cmdline) - 1);
+  close(fd);
+  if (size <= 0) {
+    return false;
+  }
+  while (size > 0 && cmdline[size - 1] == '\0') {
+    size--;
+  }
+  for (i = 0; i < size; i++) {
+    if (cmdline[i] == '\0') {
+      cmdline[i] = ' ';
+    }
+  }
+  cmdline[size] = '\0';
+
+  for (i = 0; i < proc_watch.num_of_cmdlines; i++) {
+    if (regexec(&proc_watch_regexes[i], cmdline, 0, NULL, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns whether a process is in the always-watch list. The result is kept
+// with the stat file of the process, so it is only matched again once the
+// PID is reused, or every interval for the processes whose stat files cannot
+// be kept open.
+static bool is_watched(procfs_t* procfs, int pid, const proc_stat_t* stat) {
+  if (proc_watch.num_of_comms == 0 && proc_watch.num_of_cmdlines == 0) {
+    return false;
+  }
+  procfs_file_t* file = get_procfs_file(procfs, pid);
+  if (file != NULL && (file->flags & PROC_FLAG_MATCHED)) {
+    return file->flags & PROC_FLAG_WATCHED;
+  }
+
+  bool watched = match_watch(pid, stat);
+  if (file != NULL) {
+    file->flags = PROC_FLAG_MATCHED | (watched ? PROC_FLAG_WATCHED : 0);
+  }
+  return watched;
+}
+
+// Returns the cgroup of a process, which is kept with its stat file the same
+// way as above. A process that moves to another cgroup without replacing its
+// program keeps being counted in the old one until its PID is reused.
+static unsigned long long lookup_cgroup_id(procfs_t* procfs, int pid) {
+  if (proc_cgroup_root == NULL) {
+    return 0ULL;
+  }
+  procfs_file_t* file = get_procfs_file(procfs, pid);
+  if (file != NULL && file->cgroup_id != 0) {
+    return file->cgroup_id;
+  }
+
+  char path[PROCFS_BUFFER_SIZE];
+  unsigned long long cgroup_id = 0ULL;
+  if (read_proc_cgroup(pid, path, sizeof(path)) == 0) {
+    cgroup_id = get_cgroup_id(proc_cgroup_root, path);
+  }
+  if (file != NULL) {
+    file->cgroup_id = cgroup_id;
+  }
+  return cgroup_id;
+}
+
+// Reads the PID in a pidfile, or returns -1 if there is none
+static int read_pidfile(const char* pidfile) {
+  FILE* fp = fopen(pidfile, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  int pid;
+  if (fscanf(fp, "%d", &pid) != 1 || pid <= 0) {
+    pid = -1;
+  }
+  fclose(fp);
+  return pid;
+}
+
+// Samples the PIDs of the current interval that belong to a worker, into the
+// process list of the worker
+static void scan_processes(int worker_index, void* arg) {
+  proc_scan_t* scan = (proc_scan_t*)arg;
+  proc_worker_t* worker = &proc_workers[worker_index];
+  process_list_t* process_list = &worker->process_list;
+  process_list_t* prev_process_list = scan->prev_process_list;
+  size_t pid_index;
+  int i;
+
+  reset_process_list(process_list, process_list->capacity);
+  process_list->cpu_total_time = scan->process_list->cpu_total_time;
+
+  for (pid_index = 0; pid_index < scan->num_of_pids; pid_index++) {
+    // A PID always goes to the same worker, which keeps its stat file open
+    int temp_pid = scan->pids[pid_index];
+    if (temp_pid % num_of_proc_workers != worker_index) {
+      continue;
+    }
+
+    if (process_list->size == process_list->capacity) {
+      reserve_process_list(process_list, 2 * process_list->capacity);
+    }
+
+    // Read /proc/*/stat for information about CPU, memory and page faults
+    proc_stat_t stat;
+    if (read_proc_stat(&worker->procfs, temp_pid, &stat) == -1) {
+      // This means the process has gone shortly after we list the directory
+      continue;
+    }
+
+    if (stat.state != 'Z') {
+      // PID
+      process_list->processes_e[process_list->size].process_id = temp_pid;
+      // Threads, which are only listed for the filtered processes
+      process_list->processes_i[process_list->size].child_thread_ids = NULL;
+      process_list->processes_i[process_list->size].child_threads = NULL;
+      process_list->processes_i[process_list->size].child_thread_ids_size =
+          0;
+      // Always-watch list
+      process_list->processes_i[process_list->size].watched =
+          is_watched(&worker->procfs, temp_pid, &stat);
+      // Cgroup
+      process_list->processes_e[process_list->size].cgroup_id =
+          lookup_cgroup_id(&worker->procfs, temp_pid);
+      // Page faults
+      process_list->processes_i[process_list->size].minflt = stat.minflt;
+      process_list->processes_i[process_list->size].cminflt = stat.cminflt;
+      process_list->processes_i[process_list->size].majflt = stat.majflt;
+      process_list->processes_i[process_list->size].cmajflt = stat.cmajflt;
+      process_list->processes_i[process_list->size].tflt =
+          stat.minflt + stat.cminflt + stat.majflt + stat.cmajflt;
+      // CPU utilization
+      process_list->processes_i[process_list->size].utime = stat.utime;
+      process_list->processes_i[process_list->size].stime = stat.stime;
+      process_list->processes_i[process_list->size].cutime = stat.cutime;
+      process_list->processes_i[process_list->size].cstime = stat.cstime;
+      process_list->processes_i[process_list->size].ttime =
+          stat.utime + stat.stime + stat.cutime + stat.cstime;
+      // Memory usage
+      process_list->processes_e[process_list->size].virtual_mem_utilization =
+          (float)stat.vsize / (phys_pages * page_size);
+      process_list->processes_e[process_list->size].real_mem_utilization =
+          (float)stat.rss / phys_pages;
+      // Context switches and I/O, which are only read for the filtered
+      // processes, unless the processes are ranked by I/O
+      process_list->processes_i[process_list->size].voluntary_ctxt_switches =
+          0ULL;
+      process_list->processes_i[process_list->size]
+          .nonvoluntary_ctxt_switches = 0ULL;
+      process_list->processes_i[process_list->size].read_bytes = 0ULL;
+      process_list->processes_i[process_list->size].write_bytes = 0ULL;
+      process_list->processes_e[process_list->size].v_ctxt_switch_rate = 0.0;
+      process_list->processes_e[process_list->size].nv_ctxt_switch_rate = 0.0;
+      process_list->processes_e[process_list->size].io_read_rate = 0.0;
+      process_list->processes_e[process_list->size].io_write_rate = 0.0;
+      process_list->processes_e[process_list->size].cpu_affinity = 0ULL;
+      // Scheduler statistics, which are only read for the filtered processes
+      process_list->processes_e[process_list->size].cpu_time_ns = 0ULL;
+      process_list->processes_e[process_list->size].run_delay_ns = 0ULL;
+
+      // Try to find the PID in the previous list, which does not depend on
+      // the order readdir() returns the PIDs in
+      i = find_process(prev_process_list, temp_pid);
+      // The PID is not in the original list
+      if (i == -1) {
+        // Page fault rate
+        process_list->processes_e[process_list->size].page_fault_rate =
+            (float)process_list->processes_i[process_list->size].tflt /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+        // CPU utilization
+        process_list->processes_e[process_list->size].cpu_utilization =
+            (float)process_list->processes_i[process_list->size].ttime /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+      // The PID is in the original list
+      } else {
+        // Page fault rate
+        process_list->processes_e[process_list->size].page_fault_rate =
+            (float)(process_list->processes_i[process_list->size].tflt -
+                    prev_process_list->processes_i[i].tflt) /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+        // CPU utilization
+        process_list->processes_e[process_list->size].cpu_utilization =
+            (float)(process_list->processes_i[process_list->size].ttime -
+                    prev_process_list->processes_i[i].ttime) /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+      }
+      if (proc_rank_io &&
+          read_process_io(temp_pid,
+                          &process_list->processes_i[process_list->size]) ==
+              0) {
+        unsigned long long prev_read_bytes = 0ULL;
+        unsigned long long prev_write_bytes = 0ULL;
+        if (i != -1) {
+          prev_read_bytes = prev_process_list->processes_i[i].read_bytes;
+          prev_write_bytes = prev_process_list->processes_i[i].write_bytes;
+        }
+        process_list->processes_e[process_list->size].io_read_rate =
+            (float)(process_list->processes_i[process_list->size].read_bytes -
+                    prev_read_bytes) /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+        process_list->processes_e[process_list->size].io_write_rate =
+            (float)(process_list->processes_i[process_list->size]
+                        .write_bytes -
+                    prev_write_bytes) /
+            (process_list->cpu_total_time -
+             prev_process_list->cpu_total_time);
+      }
+      process_list->size++;
+    }
+  }
+
+  // Close the stat files of the processes that have gone
+  evict_procfs(&worker->procfs);
+}
+
+// Keeps track of the processes created and exited since the last interval,
+// and of the ones that have replaced their programs
+static void handle_lifecycle_event(const lifecycle_event_t* event,
+                                   void* arg) {
+  if (event->type == LIFECYCLE_FORK) {
+    if (num_of_proc_forks == proc_forks_capacity) {
+      proc_forks_capacity = proc_forks_capacity == 0
+                                ? PROCESS_LIST_INITIAL_CAPACITY
+                                : 2 * proc_forks_capacity;
+      proc_forks = realloc(proc_forks, proc_forks_capacity * sizeof(int));
+      if (proc_forks == NULL) {
+        logging(LOG_CODE_FATAL, "cannot allocate memory");
+      }
+    }
+    proc_forks[num_of_proc_forks++] = event->pid;
+  } else if (event->type == LIFECYCLE_EXEC) {
+    // The new program has to be matched against the always-watch list
+    // again, and may have been started in another cgroup
+    procfs_file_t* file = get_procfs_file(
+        &proc_workers[event->pid % num_of_proc_workers].procfs, event->pid);
+    if (file != NULL) {
+      file->flags = 0;
+      file->cgroup_id = 0ULL;
+    }
+  } else if (event->has_counters) {
+    if (num_of_proc_exits == proc_exits_capacity) {
+      proc_exits_capacity = proc_exits_capacity == 0
+                                ? PROCESS_LIST_INITIAL_CAPACITY
+                                : 2 * proc_exits_capacity;
+      proc_exits = realloc(proc_exits,
+                           proc_exits_capacity * sizeof(lifecycle_event_t));
+      if (proc_exits == NULL) {
+        logging(LOG_CODE_FATAL, "cannot allocate memory");
+      }
+    }
+    proc_exits[num_of_proc_exits++] = *event;
+  }
+}
+
+static int compare_pids(const void* a, const void* b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+static void add_scan_pid(proc_scan_t* scan, int pid) {
+  if (scan->num_of_pids == scan->pids_capacity) {
+    scan->pids = arena_grow(&scan->process_list->arena, scan->pids,
+                            scan->pids_capacity * sizeof(int),
+                            2 * scan->pids_capacity * sizeof(int));
+    scan->pids_capacity *= 2;
+  }
+  scan->pids[scan->num_of_pids++] = pid;
+}
+
+// Lists all the PIDs in /proc/
+static void list_proc_pids(proc_scan_t* scan, int nerve_pid) {
+  struct dirent* curr_dir_ptr;
+  DIR* dir_ptr = opendir("/proc/");
+  if (dir_ptr == NULL) {
+    logging(LOG_CODE_FATAL, "Cound not open directory /proc/.");
+  }
+
+  while ((curr_dir_ptr = readdir(dir_ptr)) != NULL) {
+    if (curr_dir_ptr->d_name[0] >= '0' && curr_dir_ptr->d_name[0] <= '9') {
+      int temp_pid = atoi(curr_dir_ptr->d_name);
+      if (temp_pid == nerve_pid) {
+        continue;
+      }
+      add_scan_pid(scan, temp_pid);
+    }
+  }
+
+  (void)closedir(dir_ptr);
+}
+
+// Adds a process that has exited to the list, with its final counters. Only
+// the part of them since the last interval is used for its rates.
+static void add_exited_process(process_list_t* process_list,
+                               process_list_t* prev_process_list,
+                               const lifecycle_event_t* exit) {
+  process_intermediate_t* process_i =
+      &process_list->processes_i[process_list->size];
+  process_external_t* process_e =
+      &process_list->processes_e[process_list->size];
+  memset(process_i, 0, sizeof(process_intermediate_t));
+  memset(process_e, 0, sizeof(process_external_t));
+  process_e->process_id = exit->pid;
+
+  // The counters are converted to clock ticks, keeping the fractions of the
+  // processes that lived shorter than a tick for the rates
+  double ttime = (double)(exit->utime_us + exit->stime_us) * clock_ticks /
+                 1000000;
+  process_i->utime = exit->utime_us * clock_ticks / 1000000;
+  process_i->stime = exit->stime_us * clock_ticks / 1000000;
+  process_i->ttime = process_i->utime + process_i->stime;
+  process_i->minflt = exit->minflt;
+  process_i->majflt = exit->majflt;
+  process_i->tflt = process_i->minflt + process_i->majflt;
+  double tflt = process_i->tflt;
+
+  // The final counters leave the children out, so they may fall behind the
+  // ones in the last interval
+  int i = find_process(prev_process_list, exit->pid);
+  if (i != -1) {
+    process_e->cgroup_id = prev_process_list->processes_e[i].cgroup_id;
+    ttime -= prev_process_list->processes_i[i].ttime;
+    tflt -= prev_process_list->processes_i[i].tflt;
+  }
+  unsigned long cpu_time =
+      process_list->cpu_total_time - prev_process_list->cpu_total_time;
+  process_e->cpu_utilization = ttime > 0.0 ? ttime / cpu_time : 0.0;
+  process_e->page_fault_rate = tflt > 0.0 ? tflt / cpu_time : 0.0;
+
+  index_process(process_list, exit->pid, process_list->size);
+  process_list->size++;
+}
+
 void get_process_info(process_list_t* process_list,
                       process_list_t* prev_process_list,
                       int nerve_pid) {
-  struct dirent* curr_dir_ptr;
-
   // Read /proc/stat for total CPU time spent by far
   // cpu %user %nice %system %idle %iowait %irq %softirq
   char pid_stat_location[32] = "/proc/stat";
@@ -43,8 +778,8 @@ void get_process_info(process_list_t* process_list,
          &temp_cpu_total_time[4], &temp_cpu_total_time[5],
          &temp_cpu_total_time[6]);
   fclose(fp);
-  // Reset the size of the process list to 0
-  process_list->size = 0;
+  // Reset the process list, keeping room for as many processes as last time
+  reset_process_list(process_list, process_list->capacity);
   // Sum all fields up to get total CPU time
   process_list->cpu_total_time = 0;
   int i;
@@ -52,302 +787,508 @@ void get_process_info(process_list_t* process_list,
     process_list->cpu_total_time += temp_cpu_total_time[i];
   }
 
-  // Read /proc/*/stat to get CPU utilization for specific
-  // processes
-  DIR* dir_ptr = opendir("/proc/");
-  if (dir_ptr == NULL) {
-    logging(LOG_CODE_FATAL, "Cound not open directory /proc/.");
+  // Catch up with the processes created and exited since the last interval,
+  // and scan /proc/ again every once in a while, or if some of the events
+  // have been lost
+  num_of_proc_forks = 0;
+  num_of_proc_exits = 0;
+  bool rescan = true;
+  if (proc_lifecycle_enabled) {
+    proc_intervals_since_rescan++;
+    if (read_lifecycle(&proc_lifecycle, handle_lifecycle_event, NULL) ==
+        -1) {
+      logging(LOG_CODE_WARNING,
+              "Lost process lifecycle events, scanning /proc/ again.\n");
+    } else if (proc_intervals_since_rescan < proc_rescan_intervals) {
+      rescan = false;
+    }
   }
 
-  int temp_pid;
-  i = 0;
-  while ((curr_dir_ptr = readdir(dir_ptr)) != NULL) {
-    if (curr_dir_ptr->d_name[0] >= '0' && curr_dir_ptr->d_name[0] <= '9') {
-      if (process_list->size >= MAX_NUM_PROCESSES) {
-        logging(LOG_CODE_FATAL, "Too many processes (max: %d).",
-                MAX_NUM_PROCESSES);
+  // List the PIDs, which are then read by the workers
+  proc_scan_t scan;
+  scan.process_list = process_list;
+  scan.prev_process_list = prev_process_list;
+  scan.pids_capacity = process_list->capacity;
+  scan.pids = arena_alloc(&process_list->arena,
+                          scan.pids_capacity * sizeof(int));
+  scan.num_of_pids = 0;
+  if (rescan) {
+    proc_intervals_since_rescan = 0;
+    list_proc_pids(&scan, nerve_pid);
+  } else {
+    // The processes of the last interval, which are skipped if they have
+    // gone, and the ones created since. A PID may have been reused, and
+    // created more than once.
+    for (i = 0; i < prev_process_list->size; i++) {
+      add_scan_pid(&scan, prev_process_list->processes_e[i].process_id);
+    }
+    qsort(proc_forks, num_of_proc_forks, sizeof(int), compare_pids);
+    size_t fork_index;
+    for (fork_index = 0; fork_index < num_of_proc_forks; fork_index++) {
+      int temp_pid = proc_forks[fork_index];
+      if (temp_pid != nerve_pid &&
+          (fork_index == 0 || temp_pid != proc_forks[fork_index - 1]) &&
+          find_process(prev_process_list, temp_pid) == -1) {
+        add_scan_pid(&scan, temp_pid);
       }
-      sprintf(pid_stat_location, "/proc/%s/stat", curr_dir_ptr->d_name);
-      temp_pid = atoi(curr_dir_ptr->d_name);
+    }
+  }
 
-      if (temp_pid == nerve_pid) {
+  // Read /proc/*/stat to get CPU utilization for specific processes, with
+  // every worker sampling its share of the PIDs into its own list
+  run_pool(&proc_pool, scan_processes, &scan);
+
+  // Merge the lists of the workers
+  size_t num_of_processes = 0;
+  for (i = 0; i < num_of_proc_workers; i++) {
+    num_of_processes += proc_workers[i].process_list.size;
+  }
+  reserve_process_list(process_list, num_of_processes);
+  for (i = 0; i < num_of_proc_workers; i++) {
+    process_list_t* worker_list = &proc_workers[i].process_list;
+    memcpy(&process_list->processes_i[process_list->size],
+           worker_list->processes_i,
+           worker_list->size * sizeof(process_intermediate_t));
+    memcpy(&process_list->processes_e[process_list->size],
+           worker_list->processes_e,
+           worker_list->size * sizeof(process_external_t));
+    size_t j;
+    for (j = 0; j < worker_list->size; j++) {
+      index_process(process_list,
+                    process_list->processes_e[process_list->size].process_id,
+                    process_list->size);
+      process_list->size++;
+    }
+  }
+
+  // Add the processes that have exited since the last interval, so that
+  // neither their last moments nor the processes that lived shorter than an
+  // interval go unaccounted for
+  reserve_process_list(process_list, process_list->size + num_of_proc_exits);
+  size_t exit_index;
+  for (exit_index = 0; exit_index < num_of_proc_exits; exit_index++) {
+    if (proc_exits[exit_index].pid != nerve_pid &&
+        find_process(process_list, proc_exits[exit_index].pid) == -1) {
+      add_exited_process(process_list, prev_process_list,
+                         &proc_exits[exit_index]);
+    }
+  }
+}
+
+// Restores the min-heap order from the given slot downwards
+static void sift_down(ranked_process_t* heap, int size, int slot) {
+  while (true) {
+    int smallest = slot;
+    int left = 2 * slot + 1;
+    int right = 2 * slot + 2;
+    if (left < size && heap[left].score < heap[smallest].score) {
+      smallest = left;
+    }
+    if (right < size && heap[right].score < heap[smallest].score) {
+      smallest = right;
+    }
+    if (smallest == slot) {
+      return;
+    }
+    ranked_process_t temp = heap[slot];
+    heap[slot] = heap[smallest];
+    heap[smallest] = temp;
+    slot = smallest;
+  }
+}
+
+// Restores the min-heap order from the given slot upwards
+static void sift_up(ranked_process_t* heap, int slot) {
+  while (slot > 0) {
+    int parent = (slot - 1) / 2;
+    if (heap[parent].score <= heap[slot].score) {
+      return;
+    }
+    ranked_process_t temp = heap[slot];
+    heap[slot] = heap[parent];
+    heap[parent] = temp;
+    slot = parent;
+  }
+}
+
+// Reads the detailed statistics of the filtered processes that belong to a
+// worker, and the CPU affinity of its share of all their threads
+static void scan_process_stats(int worker_index, void* arg) {
+  proc_stats_t* stats = (proc_stats_t*)arg;
+  proc_worker_t* worker = &proc_workers[worker_index];
+  process_list_t* filtered_process_list = stats->filtered_process_list;
+  process_list_t* process_list = stats->process_list;
+  int proc_index;
+
+  for (proc_index = worker_index;
+       proc_index < filtered_process_list->size;
+       proc_index += num_of_proc_workers) {
+    int process_list_idx = stats->process_list_idx[proc_index];
+    if (process_list_idx == -1) {
+      continue;
+    }
+    int curr_pid = process_list->processes_e[process_list_idx].process_id;
+    if (read_process_status(
+            curr_pid, &process_list->processes_i[process_list_idx]) == -1 ||
+        read_process_io(
+            curr_pid, &process_list->processes_i[process_list_idx]) == -1) {
+      stats->process_list_idx[proc_index] = -1;
+    }
+  }
+
+  // The threads of all the filtered processes are split evenly among the
+  // workers, and every worker keeps its own affinity masks
+  worker->cpu_affinity =
+      arena_alloc(&worker->process_list.arena,
+                  filtered_process_list->size * sizeof(unsigned long long));
+  memset(worker->cpu_affinity, 0,
+         filtered_process_list->size * sizeof(unsigned long long));
+  size_t first_thread =
+      stats->num_of_threads * worker_index / num_of_proc_workers;
+  size_t last_thread =
+      stats->num_of_threads * (worker_index + 1) / num_of_proc_workers;
+  size_t thread_offset = 0;
+  for (proc_index = 0;
+       proc_index < filtered_process_list->size &&
+       thread_offset < last_thread;
+       proc_index++) {
+    process_intermediate_t* process_i =
+        &filtered_process_list->processes_i[proc_index];
+    int curr_pid = filtered_process_list->processes_e[proc_index].process_id;
+    unsigned int i;
+    for (i = 0; i < process_i->child_thread_ids_size; i++, thread_offset++) {
+      if (thread_offset < first_thread || thread_offset >= last_thread) {
         continue;
       }
-
-      fp = fopen(pid_stat_location, "r");
-      if (fp == NULL) {
-        // This means the process has gone shortly after we list the directory
+      // Check the affinity information, i.e., the CPU the thread last ran on
+      proc_stat_t stat;
+      if (read_task_stat(curr_pid, process_i->child_thread_ids[i], &stat) ==
+          -1) {
+        // This means the it has gone shortly after we list the directory
         continue;
       }
+      // Keep a mask for CPU affinity
+      worker->cpu_affinity[proc_index] |= (1ULL << stat.processor);
 
-      // Read /proc/*/stat for information about:
-      // - CPU, memory, page faults
-      // file format: http://man7.org/linux/man-pages/man5/proc.5.html
-      // ...
-      // (3)  state   %c  : indicates process state
-      // ...
-      // (10) minflt  %lu : minor page faults
-      // (11) cminflt %lu : minor page faults by children
-      // (12) majflt  %lu : major page faults
-      // (13) cmajflt %lu : major page faults by children
-      // (14) utime   %lu : time spent in user mode
-      // (15) stime   %lu : time spent in kernel mode
-      // (16) cutime  %ld : time spent waiting for children in user mode
-      // (17) cstime  %ld : time spent waiting for children in kernel mode
-      // ...
-      // (23) vsize   %lu : virtual memory size in bytes
-      // (24) rss     %ld : number of pages that the process has in main memory
-      // ...
-      char process_state;
-      unsigned long minflt, cminflt, majflt, cmajflt;
-      unsigned long utime_ticks, stime_ticks, vsize_bytes;
-      long cutime_ticks, cstime_ticks, rss_pages;
-      fscanf(fp,
-             "%*d %*s %c %*d %*d %*d %*d %*d %*u %lu %lu %lu %lu " // 1-13
-             "%lu %lu %ld %ld %*d %*d %*d %*d %*u %lu %ld", // 14-24
-             &process_state, &minflt, &cminflt, &majflt, &cmajflt,
-             &utime_ticks, &stime_ticks, &cutime_ticks, &cstime_ticks,
-             &vsize_bytes, &rss_pages);
-      fclose(fp);
-
-      if (process_state != 'Z') {
-        // PID
-        process_list->processes_e[process_list->size].process_id = temp_pid;
-        // Page faults
-        process_list->processes_i[process_list->size].minflt = minflt;
-        process_list->processes_i[process_list->size].cminflt = cminflt;
-        process_list->processes_i[process_list->size].majflt = majflt;
-        process_list->processes_i[process_list->size].cmajflt = cmajflt;
-        process_list->processes_i[process_list->size].tflt =
-            minflt + cminflt + majflt + cmajflt;
-        // CPU utilization
-        process_list->processes_i[process_list->size].utime = utime_ticks;
-        process_list->processes_i[process_list->size].stime = stime_ticks;
-        process_list->processes_i[process_list->size].cutime = cutime_ticks;
-        process_list->processes_i[process_list->size].cstime = cstime_ticks;
-        process_list->processes_i[process_list->size].ttime =
-            utime_ticks + stime_ticks + cutime_ticks + cstime_ticks;
-        // Memory usage
-        process_list->processes_e[process_list->size].virtual_mem_utilization =
-            (float)vsize_bytes / (sysconf(_SC_PHYS_PAGES) *
-                                  sysconf(_SC_PAGESIZE));
-        process_list->processes_e[process_list->size].real_mem_utilization =
-            (float)rss_pages / sysconf(_SC_PHYS_PAGES);
-
-        // Try to find the PID in the previous list
-        while (i < prev_process_list->size &&
-               prev_process_list->processes_e[i].process_id < temp_pid) {
-          i++;
+      // Keep the statistics of the thread, and only read its context
+      // switches if the threads are recorded
+      thread_intermediate_t* thread_i = &process_i->child_threads[i];
+      thread_i->ttime = stat.utime + stat.stime;
+      thread_i->voluntary_ctxt_switches = 0ULL;
+      thread_i->nonvoluntary_ctxt_switches = 0ULL;
+      thread_i->run_time_ns = 0ULL;
+      thread_i->run_delay_ns = 0ULL;
+      if (proc_schedstat_enabled) {
+        proc_schedstat_t schedstat;
+        if (read_task_schedstat(curr_pid, process_i->child_thread_ids[i],
+                                &schedstat) == -1) {
+          continue;
         }
-        // The PID is not in the original list
-        if (i == prev_process_list->size ||
-            prev_process_list->processes_e[i].process_id != temp_pid) {
-          // Page fault rate
-          process_list->processes_e[process_list->size].page_fault_rate =
-              (float)process_list->processes_i[process_list->size].tflt /
-              (process_list->cpu_total_time -
-               prev_process_list->cpu_total_time);
-          // CPU utilization
-          process_list->processes_e[process_list->size].cpu_utilization =
-              (float)process_list->processes_i[process_list->size].ttime /
-              (process_list->cpu_total_time -
-               prev_process_list->cpu_total_time);
-        // The PID is in the original list
-        } else {
-          // Page fault rate
-          process_list->processes_e[process_list->size].page_fault_rate =
-              (float)(process_list->processes_i[process_list->size].tflt -
-                      prev_process_list->processes_i[i].tflt) /
-              (process_list->cpu_total_time -
-               prev_process_list->cpu_total_time);
-          // CPU utilization
-          process_list->processes_e[process_list->size].cpu_utilization =
-              (float)(process_list->processes_i[process_list->size].ttime -
-                      prev_process_list->processes_i[i].ttime) /
-              (process_list->cpu_total_time -
-               prev_process_list->cpu_total_time);
+        thread_i->run_time_ns = schedstat.run_time_ns;
+        thread_i->run_delay_ns = schedstat.run_delay_ns;
+      }
+      if (proc_thread_filter.max_threads > 0) {
+        char status_location[64];
+        sprintf(status_location, "/proc/%d/task/%u/status", curr_pid,
+                process_i->child_thread_ids[i]);
+        if (read_ctxt_switches(status_location,
+                               &thread_i->voluntary_ctxt_switches,
+                               &thread_i->nonvoluntary_ctxt_switches) == -1) {
+          continue;
         }
-        process_list->size++;
       }
+      thread_i->processor = stat.processor;
     }
   }
+}
+
+static int compare_thread_ids(const void* a, const void* b) {
+  unsigned int tid_a = *(const unsigned int*)a;
+  unsigned int tid_b = *(const unsigned int*)b;
+  return tid_a < tid_b ? -1 : tid_a > tid_b;
+}
+
+// Sums up the time the threads of a filtered process have spent on a CPU and
+// waiting for one since the last interval. The threads created in between
+// count from their start, while the last slice of the ones that have exited
+// is missed. Returns -1 if the threads were not read in the last interval.
+static int sum_thread_schedstat(const process_intermediate_t* process_i,
+                                const process_intermediate_t* prev_process_i,
+                                unsigned long long* cpu_time_ns,
+                                unsigned long long* run_delay_ns) {
+  *cpu_time_ns = 0ULL;
+  *run_delay_ns = 0ULL;
+  if (process_i->child_threads == NULL ||
+      prev_process_i->child_threads == NULL) {
+    return -1;
+  }
 
-  (void)closedir(dir_ptr);
+  unsigned int i;
+  for (i = 0; i < process_i->child_thread_ids_size; i++) {
+    const thread_intermediate_t* thread_i = &process_i->child_threads[i];
+    if (thread_i->processor == -1) {
+      continue;
+    }
+    unsigned long long prev_run_time_ns = 0ULL;
+    unsigned long long prev_run_delay_ns = 0ULL;
+    unsigned int* prev_tid = bsearch(
+        &process_i->child_thread_ids[i], prev_process_i->child_thread_ids,
+        prev_process_i->child_thread_ids_size, sizeof(unsigned int),
+        compare_thread_ids);
+    if (prev_tid != NULL) {
+      const thread_intermediate_t* prev_thread_i =
+          &prev_process_i
+               ->child_threads[prev_tid - prev_process_i->child_thread_ids];
+      // A thread that was not read then is left out, rather than counted
+      // from its start
+      if (prev_thread_i->processor == -1) {
+        continue;
+      }
+      prev_run_time_ns = prev_thread_i->run_time_ns;
+      prev_run_delay_ns = prev_thread_i->run_delay_ns;
+    }
+    if (thread_i->run_time_ns >= prev_run_time_ns) {
+      *cpu_time_ns += thread_i->run_time_ns - prev_run_time_ns;
+    }
+    if (thread_i->run_delay_ns >= prev_run_delay_ns) {
+      *run_delay_ns += thread_i->run_delay_ns - prev_run_delay_ns;
+    }
+  }
+  return 0;
+}
+
+// Selects the busiest threads of the filtered processes into the filtered
+// list. A thread is only recorded from its second interval in the filtered
+// list on, since how busy it has been before is unknown.
+static void select_threads(process_list_t* filtered_process_list,
+                           process_list_t* prev_process_list) {
+  int max_threads = proc_thread_filter.max_threads;
+  unsigned long cpu_time = filtered_process_list->cpu_total_time -
+                           prev_process_list->cpu_total_time;
+  int proc_index;
+  int i;
+
+  // Keep the busiest threads seen so far in a min-heap, the same way as the
+  // top processes, with their records in the slots the heap refers to
+  thread_external_t* candidates =
+      arena_alloc(&filtered_process_list->arena,
+                  max_threads * sizeof(thread_external_t));
+  ranked_process_t* heap =
+      arena_alloc(&filtered_process_list->arena,
+                  max_threads * sizeof(ranked_process_t));
+  int heap_size = 0;
+  for (proc_index = 0; proc_index < filtered_process_list->size;
+       proc_index++) {
+    process_intermediate_t* process_i =
+        &filtered_process_list->processes_i[proc_index];
+    int pid = filtered_process_list->processes_e[proc_index].process_id;
+    int prev_index = find_process(prev_process_list, pid);
+    if (process_i->child_threads == NULL || prev_index == -1 ||
+        prev_process_list->processes_i[prev_index].child_threads == NULL) {
+      continue;
+    }
+    process_intermediate_t* prev_process_i =
+        &prev_process_list->processes_i[prev_index];
+
+    for (i = 0; i < process_i->child_thread_ids_size; i++) {
+      thread_intermediate_t* thread_i = &process_i->child_threads[i];
+      unsigned int* prev_tid = bsearch(
+          &process_i->child_thread_ids[i], prev_process_i->child_thread_ids,
+          prev_process_i->child_thread_ids_size, sizeof(unsigned int),
+          compare_thread_ids);
+      if (thread_i->processor == -1 || prev_tid == NULL) {
+        continue;
+      }
+      thread_intermediate_t* prev_thread_i =
+          &prev_process_i
+               ->child_threads[prev_tid - prev_process_i->child_thread_ids];
+      if (prev_thread_i->processor == -1 ||
+          thread_i->ttime < prev_thread_i->ttime) {
+        continue;
+      }
+      float cpu_utilization =
+          (float)(thread_i->ttime - prev_thread_i->ttime) / cpu_time;
+      if (cpu_utilization < proc_thread_filter.min_cpu_utilization) {
+        continue;
+      }
+
+      int slot;
+      if (heap_size < max_threads) {
+        slot = heap_size;
+        heap[heap_size].score = cpu_utilization;
+        heap[heap_size].index = slot;
+        sift_up(heap, heap_size);
+        heap_size++;
+      } else if (cpu_utilization > heap[0].score) {
+        slot = heap[0].index;
+        heap[0].score = cpu_utilization;
+        sift_down(heap, heap_size, 0);
+      } else {
+        continue;
+      }
+      candidates[slot].thread_id = process_i->child_thread_ids[i];
+      candidates[slot].process_id = pid;
+      candidates[slot].processor = thread_i->processor;
+      candidates[slot].cpu_utilization = cpu_utilization;
+      candidates[slot].v_ctxt_switch_rate =
+          (float)(thread_i->voluntary_ctxt_switches -
+                  prev_thread_i->voluntary_ctxt_switches) /
+          cpu_time;
+      candidates[slot].nv_ctxt_switch_rate =
+          (float)(thread_i->nonvoluntary_ctxt_switches -
+                  prev_thread_i->nonvoluntary_ctxt_switches) /
+          cpu_time;
+    }
+  }
+
+  // Copy the busiest threads to the filtered list, from the busiest down
+  filtered_process_list->threads_e =
+      arena_alloc(&filtered_process_list->arena,
+                  heap_size * sizeof(thread_external_t));
+  filtered_process_list->num_of_threads = heap_size;
+  for (i = heap_size - 1; i >= 0; i--) {
+    int index = heap[0].index;
+    heap[0] = heap[i];
+    sift_down(heap, i, 0);
+    filtered_process_list->threads_e[i] = candidates[index];
+  }
 }
 
 void get_process_stats(process_list_t* filtered_process_list,
                        process_list_t* process_list,
                        process_list_t* prev_process_list) {
   int proc_index;
-  char pid_io_location[32];
-  char pid_status_location[32];
-  FILE *fp;
+  int i;
+
+  proc_stats_t stats;
+  stats.filtered_process_list = filtered_process_list;
+  stats.process_list = process_list;
+  stats.process_list_idx =
+      arena_alloc(&filtered_process_list->arena,
+                  filtered_process_list->size * sizeof(int));
+  stats.num_of_threads = 0;
 
-  // Iterate through the filtered process list and get more detailed statistics
-  // about the filtered processes.
+  // List the threads of all the filtered processes
   for (proc_index = 0;
        proc_index < filtered_process_list->size;
        proc_index++) {
     int curr_pid =
         filtered_process_list->processes_e[proc_index].process_id;
+    filtered_process_list->processes_i[proc_index].child_thread_ids = NULL;
+    filtered_process_list->processes_i[proc_index].child_threads = NULL;
+    filtered_process_list->processes_i[proc_index].child_thread_ids_size = 0;
 
-    // Find the index of this process in prev_process_list. If it already
-    // exists, set prev_process_list_idx to the index. Otherwise, it remains
-    // invalid (-1).
-    int i = 0;
-    int prev_process_list_idx = -1;
-    for (i = 0; i < prev_process_list->size; i++) {
-      if (curr_pid == prev_process_list->processes_e[i].process_id) {
-        prev_process_list_idx = i;
-        break;
-      }
-    }
-
-    // Find the index of this process in process_list. If it already
-    // exists, set process_list_idx to the index. Otherwise, it remains invalid
-    // (-1).
-    int process_list_idx = -1;
-    for (i = 0; i < process_list->size; i++) {
-      if (curr_pid == process_list->processes_e[i].process_id) {
-        process_list_idx = i;
-        break;
-      }
-    }
-
-    sprintf(pid_status_location, "/proc/%d/status", curr_pid);
-    fp = fopen(pid_status_location, "r");
-    if (fp == NULL) {
-      // This means the process has gone shortly after we list the directory
-      continue;
-    }
-
-    // Read /proc/*/status for information about:
-    // - context switches
-    // file format: http://man7.org/linux/man-pages/man5/proc.5.html
-    // ...
-    // voluntary_ctxt_switches:        150
-    // nonvoluntary_ctxt_switches:     545
-    unsigned long long voluntary_ctxt_switches, nonvoluntary_ctxt_switches;
-    char line_buffer[4][256];
-    char* prev_line = line_buffer[0];
-    char* curr_line = line_buffer[1];
-    char* next_line = line_buffer[2];
-    while (fgets(next_line, 256, fp) != NULL) {
-      // Rotate the pointers
-      char* tmp_ptr = prev_line;
-      prev_line = curr_line;
-      curr_line = next_line;
-      next_line = tmp_ptr;
-    }
-    fclose(fp);
-
-    // We should expect prev_line, curr_line contain the last 2 lines
-    int j = 0;
-    while (!isspace(prev_line[j])) j++;
-    voluntary_ctxt_switches = atoll(&prev_line[j]);
-    j = 0;
-    while (!isspace(curr_line[j])) j++;
-    nonvoluntary_ctxt_switches = atoll(&curr_line[j]);
-
-    sprintf(pid_io_location, "/proc/%d/io", curr_pid);
-    fp = fopen(pid_io_location, "r");
-    if (fp == NULL) {
-      // This means the process has gone shortly after we list the directory
+    // Find the index of this process in process_list, where the filtered
+    // processes always come from
+    int process_list_idx = find_process(process_list, curr_pid);
+    stats.process_list_idx[proc_index] = process_list_idx;
+    if (process_list_idx == -1) {
       continue;
     }
 
-    // Read /proc/*/io for information about
-    // - I/O
-    // file format: http://man7.org/linux/man-pages/man5/proc.5.html
-    // ...
-    // read_bytes: 0
-    // write_bytes: 323932160
-    // cancelled_write_bytes: 0
-    unsigned long long read_bytes, write_bytes;
-    char* prev_prev_line = line_buffer[3];
-    while (fgets(next_line, 256, fp) != NULL) {
-      // Rotate the pointers
-      char* tmp_ptr = prev_prev_line;
-      prev_prev_line = prev_line;
-      prev_line = curr_line;
-      curr_line = next_line;
-      next_line = tmp_ptr;
-    }
-    fclose(fp);
-
-    // We should expect prev_prev_line, prev_line, curr_line contain the last
-    // 3 lines
-    j = 0;
-    while (!isspace(prev_prev_line[j])) j++;
-    read_bytes = atoll(&prev_prev_line[j]);
-    j = 0;
-    while (!isspace(prev_line[j])) j++;
-    write_bytes = atoll(&prev_line[j]);
-
-    // Context switches
-    process_list->processes_i[process_list_idx].voluntary_ctxt_switches =
-        voluntary_ctxt_switches;
-    process_list->processes_i[process_list_idx]
-        .nonvoluntary_ctxt_switches = nonvoluntary_ctxt_switches;
-    // I/O
-    process_list->processes_i[process_list_idx].read_bytes = read_bytes;
-    process_list->processes_i[process_list_idx].write_bytes = write_bytes;
-
-    // Get the CPU affinity information of all child processes/threads
-    process_list->processes_e[process_list_idx].cpu_affinity = 0ULL;
     char child_dir_location[64];
-    // Reset the threads count
-    process_list->processes_i[process_list_idx].child_thread_ids_size = 0;
     // The chile processes/threads are located in /proc/*/task/
     sprintf(child_dir_location, "/proc/%d/task/", curr_pid);
     DIR* child_dir_ptr = opendir(child_dir_location);
     struct dirent* curr_child_dir_ptr;
+    if (child_dir_ptr == NULL) {
+      // This means the process has gone shortly after we list the directory
+      stats.process_list_idx[proc_index] = -1;
+      continue;
+    }
+    // Reset the threads, which are allocated along with the process list
+    unsigned int child_thread_ids_capacity = THREAD_IDS_INITIAL_CAPACITY;
+    process_intermediate_t* process_i =
+        &process_list->processes_i[process_list_idx];
+    process_i->child_thread_ids =
+        arena_alloc(&process_list->arena,
+                    child_thread_ids_capacity * sizeof(unsigned int));
+    process_i->child_thread_ids_size = 0;
 
     while ((curr_child_dir_ptr = readdir(child_dir_ptr)) != NULL) {
       if (curr_child_dir_ptr->d_name[0] >= '0' &&
           curr_child_dir_ptr->d_name[0] <= '9') {
         // Add the thread ID to the list
-        if (process_list->processes_i[process_list_idx]
-                .child_thread_ids_size >= MAX_NUM_THREADS) {
-          logging(LOG_CODE_FATAL,
-                  "Process %d has too many threads (max is %d).\n",
-                  curr_pid, MAX_NUM_THREADS);
+        if (process_i->child_thread_ids_size == child_thread_ids_capacity) {
+          process_i->child_thread_ids =
+              arena_grow(&process_list->arena, process_i->child_thread_ids,
+                         child_thread_ids_capacity * sizeof(unsigned int),
+                         2 * child_thread_ids_capacity *
+                             sizeof(unsigned int));
+          child_thread_ids_capacity *= 2;
         }
-        process_list->processes_i[process_list_idx]
-            .child_thread_ids[process_list->processes_i[process_list_idx]
-                              .child_thread_ids_size] =
+        process_i->child_thread_ids[process_i->child_thread_ids_size++] =
             atoi(curr_child_dir_ptr->d_name);
-        process_list->processes_i[process_list_idx].child_thread_ids_size++;
-        // Check the affinity information
-        char child_stat_location[64];
-        sprintf(child_stat_location, "/proc/%d/task/%s/stat",
-                curr_pid, curr_child_dir_ptr->d_name);
-        FILE* child_fp = fopen(child_stat_location, "r");
-        if (child_fp == NULL) {
-          // This means the it has gone shortly after we list the directory
-          continue;
-        }
-        // Read /proc/*/task/*/stat for the CPU affinity information
-        // file format: http://man7.org/linux/man-pages/man5/proc.5.html
-        // ...
-        // (24) processor  %d : CPU number last executed on
-        // ...
-        int processor;
-        fscanf(child_fp,
-               "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u " // 1 - 12
-               "%*u %*u %*u %*d %*d %*d %*d %*d %*d %*u %*u %*d " // 13 - 24
-               "%*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*u " // 25 - 36
-               "%*u %*d %d", // 37 - 39
-               &processor);
-        fclose(child_fp);
-        // Keep a mask for CPU affinity
-        process_list->processes_e[process_list_idx].cpu_affinity |=
-            (1ULL << processor);
       }
     }
     // Close the directory
     (void)closedir(child_dir_ptr);
 
+    // Sorted, so that the threads can be found in the last interval
+    qsort(process_i->child_thread_ids, process_i->child_thread_ids_size,
+          sizeof(unsigned int), compare_thread_ids);
+    process_i->child_threads =
+        arena_alloc(&process_list->arena, process_i->child_thread_ids_size *
+                                              sizeof(thread_intermediate_t));
+    unsigned int thread_index;
+    for (thread_index = 0; thread_index < process_i->child_thread_ids_size;
+         thread_index++) {
+      process_i->child_threads[thread_index].processor = -1;
+    }
+
+    filtered_process_list->processes_i[proc_index].child_thread_ids =
+        process_i->child_thread_ids;
+    filtered_process_list->processes_i[proc_index].child_threads =
+        process_i->child_threads;
+    filtered_process_list->processes_i[proc_index].child_thread_ids_size =
+        process_i->child_thread_ids_size;
+    stats.num_of_threads += process_i->child_thread_ids_size;
+  }
+
+  // Read the statistics of the processes and their threads in parallel
+  run_pool(&proc_pool, scan_process_stats, &stats);
+
+  // Iterate through the filtered process list and derive more detailed
+  // statistics about the filtered processes.
+  for (proc_index = 0;
+       proc_index < filtered_process_list->size;
+       proc_index++) {
+    int curr_pid =
+        filtered_process_list->processes_e[proc_index].process_id;
+    int process_list_idx = stats.process_list_idx[proc_index];
+    if (process_list_idx == -1) {
+      continue;
+    }
+
+    // Find the index of this process in prev_process_list. If it already
+    // exists, set prev_process_list_idx to the index. Otherwise, it is
+    // invalid (-1).
+    int prev_process_list_idx = find_process(prev_process_list, curr_pid);
+
+    // Merge the CPU affinity seen by all the workers
+    process_list->processes_e[process_list_idx].cpu_affinity = 0ULL;
+    for (i = 0; i < num_of_proc_workers; i++) {
+      process_list->processes_e[process_list_idx].cpu_affinity |=
+          proc_workers[i].cpu_affinity[proc_index];
+    }
+
+    // The scheduler statistics are in nanoseconds, so they replace the CPU
+    // utilization from the clock ticks whenever they are known. Unlike the
+    // latter, they leave out the children that have been waited for.
+    process_external_t* process_e =
+        &process_list->processes_e[process_list_idx];
+    if (proc_schedstat_enabled && prev_process_list_idx != -1 &&
+        sum_thread_schedstat(
+            &process_list->processes_i[process_list_idx],
+            &prev_process_list->processes_i[prev_process_list_idx],
+            &process_e->cpu_time_ns, &process_e->run_delay_ns) == 0) {
+      process_e->cpu_utilization =
+          (double)process_e->cpu_time_ns * clock_ticks /
+          ((double)(process_list->cpu_total_time -
+                    prev_process_list->cpu_total_time) *
+           1000000000.0);
+    }
+
     // The PID does not exist in the original list
     if (prev_process_list_idx == -1) {
       // Context switch rate
@@ -403,6 +1344,8 @@ void get_process_stats(process_list_t* filtered_process_list,
     }
 
     // Fill the numbers to the filtered list
+    filtered_process_list->processes_e[proc_index].cpu_affinity =
+        process_list->processes_e[process_list_idx].cpu_affinity;
     filtered_process_list->processes_e[proc_index].v_ctxt_switch_rate =
         process_list->processes_e[process_list_idx].v_ctxt_switch_rate;
     filtered_process_list->processes_e[proc_index].nv_ctxt_switch_rate =
@@ -411,47 +1354,169 @@ void get_process_stats(process_list_t* filtered_process_list,
         process_list->processes_e[process_list_idx].io_read_rate;
     filtered_process_list->processes_e[proc_index].io_write_rate =
         process_list->processes_e[process_list_idx].io_write_rate;
+    filtered_process_list->processes_e[proc_index].cpu_utilization =
+        process_list->processes_e[process_list_idx].cpu_utilization;
+    filtered_process_list->processes_e[proc_index].cpu_time_ns =
+        process_list->processes_e[process_list_idx].cpu_time_ns;
+    filtered_process_list->processes_e[proc_index].run_delay_ns =
+        process_list->processes_e[process_list_idx].run_delay_ns;
+  }
+
+  // Select the threads to be recorded on their own
+  if (proc_thread_filter.max_threads > 0) {
+    select_threads(filtered_process_list, prev_process_list);
+  }
+}
+
+// Returns the value of a ranking key of a process, before normalization
+static float get_rank_value(process_list_t* process_list,
+                            process_list_t* filtered_process_list,
+                            int index, int key_index,
+                            const unsigned long long* pmu_info,
+                            int pmu_info_stride) {
+  process_external_t* process_e = &process_list->processes_e[index];
+  switch (proc_rank.keys[key_index]) {
+    case RANK_KEY_CPU:
+      return process_e->cpu_utilization;
+    case RANK_KEY_RSS:
+      return process_e->real_mem_utilization;
+    case RANK_KEY_PAGE_FAULTS:
+      return process_e->page_fault_rate;
+    case RANK_KEY_IO:
+      return process_e->io_read_rate + process_e->io_write_rate;
+    case RANK_KEY_PMU:
+      if (pmu_info != NULL) {
+        int filtered_index =
+            find_process(filtered_process_list, process_e->process_id);
+        if (filtered_index != -1) {
+          return pmu_info[filtered_index * pmu_info_stride +
+                          proc_rank.events[key_index]];
+        }
+      }
+      return 0.0;
+  }
+  return 0.0;
+}
+
+// Appends a watched process to the filtered list, unless it is already there
+// or there are too many watched processes
+static void add_watched_process(process_list_t* process_list,
+                                process_list_t* filtered_process_list,
+                                int index, int num_of_top_processes) {
+  int pid = process_list->processes_e[index].process_id;
+  if (find_process(filtered_process_list, pid) != -1) {
+    return;
+  }
+  if (filtered_process_list->size - num_of_top_processes >=
+      proc_watch.max_processes) {
+    if (!proc_watch_full_logged) {
+      logging(LOG_CODE_WARNING,
+              "More than %d watched processes, the rest are ignored.\n",
+              proc_watch.max_processes);
+      proc_watch_full_logged = true;
+    }
+    return;
   }
+
+  int slot = filtered_process_list->size++;
+  filtered_process_list->processes_e[slot] = process_list->processes_e[index];
+  filtered_process_list->processes_i[slot] = process_list->processes_i[index];
+  index_process(filtered_process_list, pid, slot);
 }
 
 void filter_process_info(process_list_t* process_list,
                          process_list_t* filtered_process_list,
-                         int num_of_processes) {
-  // Create a temporary index array to avoid modification on the original array
-  int temp_index_list[MAX_NUM_PROCESSES];
+                         int num_of_processes,
+                         const unsigned long long* pmu_info,
+                         int pmu_info_stride) {
+  int num_of_keys = proc_rank.num_of_keys;
   int i, j;
+
+  // Get the values of all the keys first, since the PMU events refer to the
+  // filtered list of the previous interval
+  float* values = arena_alloc(&process_list->arena,
+                              process_list->size * num_of_keys *
+                                  sizeof(float));
+  float max_values[MAX_RANK_KEYS];
+  for (j = 0; j < num_of_keys; j++) {
+    max_values[j] = 0.0;
+  }
   for (i = 0; i < process_list->size; i++) {
-    temp_index_list[i] = i;
-  }
-
-  // Find the k largest elements based on CPU utilization
-  for (i = 0; i < num_of_processes; i++) {
-    int max_index = i;
-    float max_value =
-        process_list->processes_e[temp_index_list[i]].cpu_utilization;
-    for (j = i + 1; j < process_list->size; j++) {
-      if (process_list->processes_e[temp_index_list[j]].cpu_utilization >
-          max_value) {
-        max_index = j;
-        max_value =
-            process_list->processes_e[temp_index_list[j]].cpu_utilization;
+    for (j = 0; j < num_of_keys; j++) {
+      float value = get_rank_value(process_list, filtered_process_list, i, j,
+                                   pmu_info, pmu_info_stride);
+      values[i * num_of_keys + j] = value;
+      if (value > max_values[j]) {
+        max_values[j] = value;
       }
     }
-    // Swap
-    int temp = temp_index_list[i];
-    temp_index_list[i] = temp_index_list[max_index];
-    temp_index_list[max_index] = temp;
   }
 
-  // Copy the k largest elemented to the filtered list
+  // Reset the filtered list, which also backs the heap. There may be fewer
+  // processes than we are asked for.
+  reset_process_list(filtered_process_list,
+                     num_of_processes + proc_watch.max_processes);
+  if (num_of_processes > process_list->size) {
+    num_of_processes = process_list->size;
+  }
+
+  // Keep the k highest scores seen so far in a min-heap, so that the lowest
+  // of them is at the top and can be replaced in O(log k)
+  ranked_process_t* heap =
+      arena_alloc(&filtered_process_list->arena,
+                  num_of_processes * sizeof(ranked_process_t));
+  int heap_size = 0;
+  for (i = 0; i < process_list->size && num_of_processes > 0; i++) {
+    float score = 0.0;
+    for (j = 0; j < num_of_keys; j++) {
+      if (max_values[j] > 0.0) {
+        score += proc_rank.weights[j] * values[i * num_of_keys + j] /
+                 max_values[j];
+      }
+    }
+
+    if (heap_size < num_of_processes) {
+      heap[heap_size].score = score;
+      heap[heap_size].index = i;
+      sift_up(heap, heap_size);
+      heap_size++;
+    } else if (score > heap[0].score) {
+      heap[0].score = score;
+      heap[0].index = i;
+      sift_down(heap, heap_size, 0);
+    }
+  }
+
+  // Copy the k highest scoring processes to the filtered list, from the
+  // highest to the lowest score
   filtered_process_list->cpu_total_time =
       process_list->cpu_total_time;
-  filtered_process_list->size = num_of_processes;
-  for (i = 0; i < num_of_processes; i++) {
-    filtered_process_list->processes_e[i] =
-        process_list->processes_e[temp_index_list[i]];
-    filtered_process_list->processes_i[i] =
-        process_list->processes_i[temp_index_list[i]];
+  filtered_process_list->size = heap_size;
+  for (i = heap_size - 1; i >= 0; i--) {
+    int index = heap[0].index;
+    heap[0] = heap[i];
+    sift_down(heap, i, 0);
+
+    filtered_process_list->processes_e[i] = process_list->processes_e[index];
+    filtered_process_list->processes_i[i] = process_list->processes_i[index];
+    index_process(filtered_process_list,
+                  filtered_process_list->processes_e[i].process_id, i);
+  }
+
+  // Then add the watched processes that are not among the top ones
+  for (i = 0; i < process_list->size; i++) {
+    if (process_list->processes_i[i].watched) {
+      add_watched_process(process_list, filtered_process_list, i,
+                          heap_size);
+    }
+  }
+  for (i = 0; i < proc_watch.num_of_pidfiles; i++) {
+    int pid = read_pidfile(proc_watch.pidfiles[i]);
+    int index = pid == -1 ? -1 : find_process(process_list, pid);
+    if (index != -1) {
+      add_watched_process(process_list, filtered_process_list, index,
+                          heap_size);
+    }
   }
 }
 
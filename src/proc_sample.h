@@ -11,13 +11,76 @@
 #ifndef __PROC_SAMPLE_H__
 #define __PROC_SAMPLE_H__
 
+#include "arena_util.h"
+
+#include <stdbool.h>
 #include <sys/types.h>
 
-// Max number of processes presented in the OS
-#define MAX_NUM_PROCESSES 512
+// Number of processes a process list starts with, which grows as needed
+#define PROCESS_LIST_INITIAL_CAPACITY 512
+
+// Number of thread IDs a process starts with, which grows as needed
+#define THREAD_IDS_INITIAL_CAPACITY 16
+
+// Max number of keys the processes can be ranked by at once
+#define MAX_RANK_KEYS 8
+
+// Keys the processes can be ranked by
+typedef enum {
+  RANK_KEY_CPU = 0x00,
+  RANK_KEY_RSS = 0x01,
+  RANK_KEY_PAGE_FAULTS = 0x02,
+  RANK_KEY_IO = 0x03,
+  // A PMU event of the previous interval, which is 0 for the processes that
+  // were not monitored then
+  RANK_KEY_PMU = 0x04,
+} rank_key_t;
+
+// How the top processes are selected. Every key is normalized by its largest
+// value among all the processes, and the score of a process is the weighted
+// sum of its normalized keys.
+typedef struct rank {
+  int num_of_keys;
+  short keys[MAX_RANK_KEYS];
+  float weights[MAX_RANK_KEYS];
+  // Index of the PMU event of each RANK_KEY_PMU key
+  int events[MAX_RANK_KEYS];
+} rank_t;
+
+// Max number of patterns of each kind in the always-watch list
+#define MAX_WATCH_PATTERNS 16
 
-// Max number of threads for each process
-#define MAX_NUM_THREADS 64
+// Max length of each pattern in the always-watch list
+#define MAX_WATCH_PATTERN_LENGTH 256
+
+// Default max number of watched processes monitored on top of the top ones
+#define DEFAULT_MAX_WATCHED_PROCESSES 16
+
+// Processes that are always monitored, on top of the top ones. A process is
+// matched by its command name and line once, when it is first seen.
+typedef struct watch {
+  // Exact command names, as in /proc/<pid>/comm
+  int num_of_comms;
+  char comms[MAX_WATCH_PATTERNS][MAX_WATCH_PATTERN_LENGTH];
+  // Extended regular expressions, matched against /proc/<pid>/cmdline with
+  // the arguments separated by spaces
+  int num_of_cmdlines;
+  char cmdlines[MAX_WATCH_PATTERNS][MAX_WATCH_PATTERN_LENGTH];
+  // Files holding the PID of a process, which are read every interval
+  int num_of_pidfiles;
+  char pidfiles[MAX_WATCH_PATTERNS][MAX_WATCH_PATTERN_LENGTH];
+  // Max number of watched processes, so that the records stay bounded
+  int max_processes;
+} watch_t;
+
+// Which threads of the filtered processes are recorded on their own. Only the
+// busiest threads are kept, so that the records stay bounded.
+typedef struct thread_filter {
+  // Max number of threads recorded per interval, or 0 to record none
+  int max_threads;
+  // Min CPU utilization of a recorded thread
+  float min_cpu_utilization;
+} thread_filter_t;
 
 /*
  * There are 2 types of information here:
@@ -29,6 +92,17 @@
  */
 
 // intermediate:
+typedef struct thread_intermediate {
+  unsigned long ttime;
+  unsigned long long voluntary_ctxt_switches;
+  unsigned long long nonvoluntary_ctxt_switches;
+  // From the scheduler statistics, or 0 if the kernel keeps none
+  unsigned long long run_time_ns;
+  unsigned long long run_delay_ns;
+  // CPU the thread last ran on, or -1 if it has gone
+  int processor;
+} thread_intermediate_t;
+
 typedef struct process_intermediate {
   unsigned long minflt;
   unsigned long cminflt;
@@ -44,8 +118,13 @@ typedef struct process_intermediate {
   unsigned long long nonvoluntary_ctxt_switches;
   unsigned long long read_bytes;
   unsigned long long write_bytes;
-  unsigned int child_thread_ids[MAX_NUM_THREADS];
+  // Allocated from the arena of the process list that is being sampled, in
+  // ascending order, with the statistics of each thread alongside
+  unsigned int* child_thread_ids;
+  thread_intermediate_t* child_threads;
   unsigned int child_thread_ids_size;
+  // Whether the command name or line is in the always-watch list
+  bool watched;
 } process_intermediate_t;
 
 // external:
@@ -60,26 +139,87 @@ typedef struct process_external {
   float io_write_rate;
   float virtual_mem_utilization;
   float real_mem_utilization;
+  // ID of the cgroup2 cgroup the process is in, or 0 if it is not known
+  unsigned long long cgroup_id;
+  // Time the threads spent on a CPU, and runnable but waiting for one, in the
+  // sample interval. They are only known for the filtered processes from
+  // their second interval in the list on, and are 0 otherwise.
+  unsigned long long cpu_time_ns;
+  unsigned long long run_delay_ns;
 } process_external_t;
 
+typedef struct thread_external {
+  unsigned int thread_id;
+  unsigned int process_id;
+  // CPU the thread last ran on
+  unsigned int processor;
+  float cpu_utilization;
+  float v_ctxt_switch_rate;
+  float nv_ctxt_switch_rate;
+} thread_external_t;
+
 typedef struct process_list {
-  process_intermediate_t processes_i[MAX_NUM_PROCESSES];
-  process_external_t processes_e[MAX_NUM_PROCESSES];
+  process_intermediate_t* processes_i;
+  process_external_t* processes_e;
+  // Number of processes the arrays above can hold
+  size_t capacity;
   unsigned long cpu_total_time;
   size_t size;
+  // Open addressing table from PID to the index of the process in the list,
+  // plus 1 so that 0 marks an empty slot. The size is a power of 2, and at
+  // least twice the capacity to keep the probe sequences short.
+  unsigned int* pid_index;
+  size_t pid_index_size;
+  // The busiest threads of the processes, from the busiest down, which are
+  // only selected for the filtered list
+  thread_external_t* threads_e;
+  size_t num_of_threads;
+  // Backs all the arrays above, which are reallocated every time the list is
+  // refilled
+  arena_t arena;
 } process_list_t;
 
+void init_process_list(process_list_t* process_list);
+
+void clean_process_list(process_list_t* process_list);
+
+// Returns the index of the process in the list, or -1 if it is not there
+int find_process(const process_list_t* process_list, int pid);
+
+// Sets up the given number of workers, which read /proc/ in parallel, how the
+// top processes are ranked, which processes are always monitored, and which
+// of their threads are recorded. /proc/ is scanned every rescan_intervals
+// intervals, and the processes created in between are found through their
+// lifecycle events. The processes are mapped to their cgroups if the cgroup2
+// mount is given.
+void init_proc_sample(int num_of_workers, const rank_t* rank,
+                      const watch_t* watch, int rescan_intervals,
+                      const thread_filter_t* thread_filter,
+                      const char* cgroup_root);
+
+void clean_proc_sample(void);
+
+// Samples all the running processes, along with the ones that have exited
+// since the last interval if their final counters are known
 void get_process_info(process_list_t* process_info_list,
                       process_list_t* prev_process_info_list,
                       int nerve_pid);
 
+// Gets more detailed statistics about the filtered processes, and selects
+// their busiest threads
 void get_process_stats(process_list_t* filtered_process_info_list,
                        process_list_t* process_info_list,
                        process_list_t* prev_process_info_list);
 
+// Selects the top processes into the filtered list, followed by the watched
+// ones that are not among them. The filtered list still holds the processes
+// of the previous interval when called. pmu_info has the PMU events of those
+// processes, one row of pmu_info_stride events each, or is NULL.
 void filter_process_info(process_list_t* process_info_list,
                          process_list_t* filtered_process_info_list,
-                         int num_of_processes);
+                         int num_of_processes,
+                         const unsigned long long* pmu_info,
+                         int pmu_info_stride);
 
 void swap_process_list(process_list_t** process_list_a,
                        process_list_t** process_list_b);
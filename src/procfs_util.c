@@ -0,0 +1,314 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "procfs_util.h"
+
+#include "log_util.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Last field of the stat file we use
+#define PROC_STAT_LAST_FIELD 39
+
+static unsigned int procfs_cache_hash(const procfs_t* procfs, int pid) {
+  // Multiplicative hashing, since PIDs are mostly sequential
+  return ((unsigned int)pid * 2654435761U) & (procfs->cache_size - 1);
+}
+
+// Moves all the open files to a new table of the given size
+static void resize_procfs_cache(procfs_t* procfs, unsigned int size) {
+  procfs_file_t* old_cache = procfs->cache;
+  unsigned int old_size = procfs->cache_size;
+
+  procfs->cache = calloc(size, sizeof(procfs_file_t));
+  if (procfs->cache == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  procfs->cache_size = size;
+
+  unsigned int old_slot;
+  for (old_slot = 0; old_slot < old_size; old_slot++) {
+    if (old_cache[old_slot].pid != 0) {
+      unsigned int slot = procfs_cache_hash(procfs, old_cache[old_slot].pid);
+      while (procfs->cache[slot].pid != 0) {
+        slot = (slot + 1) & (procfs->cache_size - 1);
+      }
+      procfs->cache[slot] = old_cache[old_slot];
+    }
+  }
+  free(old_cache);
+}
+
+// Returns the slot of the process in the cache, or -1 if it is not cached
+static int procfs_cache_lookup(const procfs_t* procfs, int pid) {
+  unsigned int slot = procfs_cache_hash(procfs, pid);
+  while (procfs->cache[slot].pid != 0) {
+    if (procfs->cache[slot].pid == pid) {
+      return slot;
+    }
+    slot = (slot + 1) & (procfs->cache_size - 1);
+  }
+  return -1;
+}
+
+static void procfs_cache_insert(procfs_t* procfs, int pid, int fd) {
+  // Keep the cache at most half full
+  if (2 * (procfs->cache_count + 1) > procfs->cache_size) {
+    resize_procfs_cache(procfs, 2 * procfs->cache_size);
+  }
+  procfs->cache_count++;
+
+  unsigned int slot = procfs_cache_hash(procfs, pid);
+  while (procfs->cache[slot].pid != 0) {
+    slot = (slot + 1) & (procfs->cache_size - 1);
+  }
+  procfs->cache[slot].pid = pid;
+  procfs->cache[slot].fd = fd;
+  procfs->cache[slot].generation = procfs->generation;
+  procfs->cache[slot].flags = 0;
+  procfs->cache[slot].cgroup_id = 0;
+}
+
+// Closes the file of a process and removes it from the cache. The following
+// entries of the probe sequence are shifted backwards so that no tombstones
+// are needed.
+static void procfs_cache_remove(procfs_t* procfs, unsigned int slot) {
+  close(procfs->cache[slot].fd);
+  procfs->cache_count--;
+
+  unsigned int hole = slot;
+  unsigned int next = (slot + 1) & (procfs->cache_size - 1);
+  while (procfs->cache[next].pid != 0) {
+    unsigned int home = procfs_cache_hash(procfs, procfs->cache[next].pid);
+    // Only move the entry if the hole is between its home slot and itself
+    if (((next - home) & (procfs->cache_size - 1)) >=
+        ((next - hole) & (procfs->cache_size - 1))) {
+      procfs->cache[hole] = procfs->cache[next];
+      hole = next;
+    }
+    next = (next + 1) & (procfs->cache_size - 1);
+  }
+  procfs->cache[hole].pid = 0;
+  procfs->cache[hole].fd = -1;
+}
+
+// Reads a whole stat file from the beginning and parses it
+static int read_stat_fd(int fd, proc_stat_t* stat) {
+  char buffer[PROCFS_BUFFER_SIZE];
+  ssize_t size = pread(fd, buffer, sizeof(buffer), 0);
+  if (size <= 0) {
+    return -1;
+  }
+  return parse_proc_stat(buffer, size, stat);
+}
+
+void init_procfs(procfs_t* procfs, int num_of_readers) {
+  procfs->cache = NULL;
+  procfs->cache_size = 0;
+  procfs->cache_count = 0;
+  procfs->generation = 0;
+  resize_procfs_cache(procfs, PROCFS_CACHE_INITIAL_SIZE);
+
+  // All the readers together use at most half of the descriptors we are
+  // allowed to open
+  struct rlimit limit;
+  procfs->max_open_files = 512 / num_of_readers;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY) {
+    procfs->max_open_files = limit.rlim_cur / 2 / num_of_readers;
+  }
+}
+
+int read_proc_stat(procfs_t* procfs, int pid, proc_stat_t* stat) {
+  // The file stays valid for as long as the process lives. If the PID has
+  // been reused since, reading the old file fails and a new one is opened.
+  int slot = procfs_cache_lookup(procfs, pid);
+  if (slot != -1) {
+    procfs->cache[slot].generation = procfs->generation;
+    if (read_stat_fd(procfs->cache[slot].fd, stat) == 0) {
+      return 0;
+    }
+    procfs_cache_remove(procfs, slot);
+  }
+
+  char stat_location[32];
+  sprintf(stat_location, "/proc/%d/stat", pid);
+  int fd = open(stat_location, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    // This means the process has gone shortly after we list the directory
+    return -1;
+  }
+  int ret = read_stat_fd(fd, stat);
+  if (ret == 0 && procfs->cache_count < procfs->max_open_files) {
+    procfs_cache_insert(procfs, pid, fd);
+  } else {
+    close(fd);
+  }
+  return ret;
+}
+
+procfs_file_t* get_procfs_file(procfs_t* procfs, int pid) {
+  int slot = procfs_cache_lookup(procfs, pid);
+  if (slot == -1) {
+    return NULL;
+  }
+  return &procfs->cache[slot];
+}
+
+int read_task_stat(int pid, int tid, proc_stat_t* stat) {
+  char stat_location[64];
+  sprintf(stat_location, "/proc/%d/task/%d/stat", pid, tid);
+  int fd = open(stat_location, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    // This means the thread has gone shortly after we list the directory
+    return -1;
+  }
+  int ret = read_stat_fd(fd, stat);
+  close(fd);
+  return ret;
+}
+
+int read_task_schedstat(int pid, int tid, proc_schedstat_t* schedstat) {
+  char schedstat_location[64];
+  sprintf(schedstat_location, "/proc/%d/task/%d/schedstat", pid, tid);
+  int fd = open(schedstat_location, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    // This means the thread has gone shortly after we list the directory
+    return -1;
+  }
+
+  // The file is a single line: run_time_ns run_delay_ns timeslices
+  char buffer[128];
+  ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+  close(fd);
+  if (size <= 0) {
+    return -1;
+  }
+  buffer[size] = '\0';
+  if (sscanf(buffer, "%llu %llu %llu", &schedstat->run_time_ns,
+             &schedstat->run_delay_ns, &schedstat->timeslices) != 3) {
+    return -1;
+  }
+  return 0;
+}
+
+void evict_procfs(procfs_t* procfs) {
+  unsigned int slot = 0;
+  while (slot < procfs->cache_size) {
+    if (procfs->cache[slot].pid != 0 &&
+        procfs->cache[slot].generation != procfs->generation) {
+      // Another entry may have been shifted into this slot, check it again
+      procfs_cache_remove(procfs, slot);
+    } else {
+      slot++;
+    }
+  }
+  procfs->generation++;
+}
+
+void clean_procfs(procfs_t* procfs) {
+  procfs->generation++;
+  evict_procfs(procfs);
+  free(procfs->cache);
+  procfs->cache = NULL;
+  procfs->cache_size = 0;
+}
+
+/*
+ * Parses the content of a stat file
+ * file format: http://man7.org/linux/man-pages/man5/proc.5.html
+ * (1)  pid     %d  : process ID
+ * (2)  comm    %s  : command name in parentheses
+ * (3)  state   %c  : indicates process state
+ * ...
+ * (10) minflt  %lu : minor page faults
+ * (11) cminflt %lu : minor page faults by children
+ * (12) majflt  %lu : major page faults
+ * (13) cmajflt %lu : major page faults by children
+ * (14) utime   %lu : time spent in user mode
+ * (15) stime   %lu : time spent in kernel mode
+ * (16) cutime  %ld : time spent waiting for children in user mode
+ * (17) cstime  %ld : time spent waiting for children in kernel mode
+ * ...
+ * (23) vsize   %lu : virtual memory size in bytes
+ * (24) rss     %ld : number of pages that the process has in main memory
+ * ...
+ * (39) processor %d : CPU number last executed on
+ * ...
+ * The command name may contain spaces and parentheses itself, so it ends at
+ * the last ')' of the line, where the fields after it start.
+ */
+int parse_proc_stat(const char* buffer, size_t size, proc_stat_t* stat) {
+  const char* comm = memchr(buffer, '(', size);
+  const char* cursor = memrchr(buffer, ')', size);
+  if (comm == NULL || cursor == NULL || cursor < comm) {
+    return -1;
+  }
+  size_t comm_length = cursor - comm - 1;
+  if (comm_length >= PROCFS_COMM_LENGTH) {
+    comm_length = PROCFS_COMM_LENGTH - 1;
+  }
+  memcpy(stat->comm, comm + 1, comm_length);
+  stat->comm[comm_length] = '\0';
+  const char* end = buffer + size;
+  cursor++;
+
+  int field;
+  for (field = 3; field <= PROC_STAT_LAST_FIELD; field++) {
+    while (cursor < end && *cursor == ' ') {
+      cursor++;
+    }
+    if (cursor == end) {
+      return -1;
+    }
+
+    if (field == 3) {
+      stat->state = *cursor;
+    } else {
+      bool negative = *cursor == '-';
+      if (negative) {
+        cursor++;
+      }
+      unsigned long value = 0;
+      while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        value = value * 10 + (*cursor - '0');
+        cursor++;
+      }
+      long signed_value = negative ? -(long)value : (long)value;
+
+      switch (field) {
+        case 10: stat->minflt = value; break;
+        case 11: stat->cminflt = value; break;
+        case 12: stat->majflt = value; break;
+        case 13: stat->cmajflt = value; break;
+        case 14: stat->utime = value; break;
+        case 15: stat->stime = value; break;
+        case 16: stat->cutime = signed_value; break;
+        case 17: stat->cstime = signed_value; break;
+        case 23: stat->vsize = value; break;
+        case 24: stat->rss = signed_value; break;
+        case 39: stat->processor = signed_value; break;
+      }
+    }
+
+    // Skip the rest of the field
+    while (cursor < end && *cursor != ' ' && *cursor != '\n') {
+      cursor++;
+    }
+  }
+
+  return 0;
+}
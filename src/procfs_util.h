@@ -0,0 +1,106 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __PROCFS_UTIL__
+#define __PROCFS_UTIL__
+
+#include <stddef.h>
+
+// Size of the buffer a stat file is read into. The command name is at most
+// 16 characters long, so the whole line always fits.
+#define PROCFS_BUFFER_SIZE 4096
+
+// Number of slots the cache of open stat files starts with. It has to be a
+// power of 2, and the cache doubles whenever it is more than half full.
+#define PROCFS_CACHE_INITIAL_SIZE 1024
+
+// Size of the command name of a process, including the terminating null byte
+#define PROCFS_COMM_LENGTH 16
+
+// The fields of /proc/<pid>/stat and /proc/<pid>/task/<tid>/stat we use
+typedef struct proc_stat {
+  char comm[PROCFS_COMM_LENGTH];
+  char state;
+  unsigned long minflt;
+  unsigned long cminflt;
+  unsigned long majflt;
+  unsigned long cmajflt;
+  unsigned long utime;
+  unsigned long stime;
+  long cutime;
+  long cstime;
+  unsigned long vsize;
+  long rss;
+  int processor;
+} proc_stat_t;
+
+// The fields of /proc/<pid>/task/<tid>/schedstat, which are only there if the
+// kernel keeps scheduler statistics
+typedef struct proc_schedstat {
+  // Time spent on a CPU, in nanoseconds
+  unsigned long long run_time_ns;
+  // Time spent runnable but waiting for a CPU, in nanoseconds
+  unsigned long long run_delay_ns;
+  // Number of times the thread has been scheduled in
+  unsigned long long timeslices;
+} proc_schedstat_t;
+
+// A stat file that is kept open across intervals
+typedef struct procfs_file {
+  int pid;
+  int fd;
+  // Last interval in which the process was read
+  unsigned int generation;
+  // Free for the caller to remember something about the process, which is
+  // cleared whenever the PID is reused
+  short flags;
+  unsigned long long cgroup_id;
+} procfs_file_t;
+
+// The open stat files, hashed by PID. Every thread that reads stat files
+// needs its own.
+typedef struct procfs {
+  procfs_file_t* cache;
+  unsigned int cache_size;
+  unsigned int cache_count;
+  unsigned int generation;
+  // Max number of stat files kept open, so that enough descriptors are left
+  // for the PMU events. Processes beyond that are read without caching.
+  unsigned int max_open_files;
+} procfs_t;
+
+// Sets up one of the given number of readers, which share the descriptors
+// we are allowed to keep open
+void init_procfs(procfs_t* procfs, int num_of_readers);
+
+// Reads /proc/<pid>/stat, and keeps it open so that the next interval only
+// needs a pread(). Returns -1 if the process has gone.
+int read_proc_stat(procfs_t* procfs, int pid, proc_stat_t* stat);
+
+// Returns the stat file of a process if it is kept open, or NULL if it is not
+procfs_file_t* get_procfs_file(procfs_t* procfs, int pid);
+
+// Reads /proc/<pid>/task/<tid>/stat without keeping it open. Returns -1 if
+// the thread has gone.
+int read_task_stat(int pid, int tid, proc_stat_t* stat);
+
+// Reads /proc/<pid>/task/<tid>/schedstat without keeping it open. Returns -1
+// if the thread has gone.
+int read_task_schedstat(int pid, int tid, proc_schedstat_t* schedstat);
+
+// Closes the stat files of the processes that have not been read since the
+// last call
+void evict_procfs(procfs_t* procfs);
+
+void clean_procfs(procfs_t* procfs);
+
+int parse_proc_stat(const char* buffer, size_t size, proc_stat_t* stat);
+
+#endif
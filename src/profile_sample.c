@@ -0,0 +1,464 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "profile_sample.h"
+
+#include "log_util.h"
+#include "perf_util.h"
+#include "system_util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+// A stack in an aggregation table, which is empty if its count is 0
+typedef struct profile_slot {
+  unsigned long long hash;
+  profile_external_t entry;
+} profile_slot_t;
+
+// Whether anything is profiled at all
+bool profile_enabled;
+int max_profile_entries;
+bool profile_callchain;
+char profile_event[PROFILE_EVENT_NAME_LENGTH];
+
+// One sampling event per online CPU, each with its own ring buffer mapped at
+// buf. The pollfds are the same descriptors, plus an eventfd to stop the drain
+// thread.
+int* profile_core_ids;
+perf_event_desc_t* profile_fds;
+int profile_num_of_cores;
+struct pollfd* profile_pollfds;
+int profile_stop_fd;
+size_t profile_mmap_size;
+pthread_t profile_thread;
+
+// Everything below is shared with the drain thread, under the lock
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The samples are aggregated into the active table, while the other one
+// holds the stacks of the last interval
+profile_slot_t* profile_tables[2];
+unsigned int profile_table_count[2];
+int profile_active_table;
+
+// The monitored processes, sorted by PID
+pid_t* profile_pids;
+size_t num_of_profile_pids;
+size_t profile_pids_capacity;
+
+// Samples of the monitored processes dropped because the active table was
+// full, and samples of any process lost because a ring buffer was full
+unsigned long long profile_dropped;
+unsigned long long profile_lost;
+
+// The recorded stacks of the last interval, sorted by count
+unsigned int* profile_order;
+profile_external_t* profile_entries_e;
+
+static void* profile_drain_thread(void* arg);
+
+void init_profile_sample(profile_config_t* profile_config) {
+  profile_enabled = false;
+  profile_core_ids = NULL;
+  profile_fds = NULL;
+  profile_num_of_cores = 0;
+  if (profile_config->max_entries == 0) {
+    return;
+  }
+  max_profile_entries = profile_config->max_entries;
+  profile_callchain = profile_config->callchain;
+  strcpy(profile_event, profile_config->event);
+
+  // Encode the event with libpfm, which has been initialized along with the
+  // PMU events
+  const char* events[2] = {profile_event, NULL};
+  int num_fds = 0;
+  perf_event_desc_t* template = NULL;
+  if (perf_setup_argv_events(events, &template, &num_fds) || num_fds != 1) {
+    logging(LOG_CODE_FATAL, "Cannot setup the sampling event %s.\n",
+            profile_event);
+  }
+  template->hw.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID;
+  if (profile_callchain) {
+    template->hw.sample_type |= PERF_SAMPLE_CALLCHAIN;
+  }
+  if (profile_config->frequency > 0) {
+    template->hw.freq = 1;
+    template->hw.sample_freq = profile_config->frequency;
+  } else {
+    template->hw.freq = 0;
+    template->hw.sample_period = profile_config->period;
+  }
+  template->hw.read_format = 0;
+  template->hw.inherit = 0;
+  template->hw.disabled = 0;
+  // Wake the drain thread up once a buffer is half full
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  template->hw.watermark = 1;
+  template->hw.wakeup_watermark = PROFILE_BUFFER_PAGES * page_size / 2;
+
+  // Sample every task on every CPU, and only keep the monitored ones, so
+  // that no events have to be opened for the threads that come and go
+  profile_num_of_cores = read_online_cpus(&profile_core_ids);
+  profile_mmap_size = (1 + PROFILE_BUFFER_PAGES) * page_size;
+  profile_fds = calloc(profile_num_of_cores, sizeof(perf_event_desc_t));
+  profile_pollfds = calloc(profile_num_of_cores + 1, sizeof(struct pollfd));
+  if (profile_fds == NULL || profile_pollfds == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  int num_of_opened = 0;
+  int core;
+  for (core = 0; core < profile_num_of_cores; core++) {
+    int cpu = profile_core_ids[core];
+    perf_event_desc_t* fd = &profile_fds[core];
+    memcpy(fd, template, sizeof(perf_event_desc_t));
+    fd->buf = NULL;
+    fd->fd = perf_event_open(&fd->hw, -1, cpu, -1, 0);
+    profile_pollfds[core].fd = fd->fd;
+    profile_pollfds[core].events = POLLIN;
+    if (fd->fd == -1) {
+      logging(LOG_CODE_WARNING,
+              "Cannot open the sampling event on CPU %d (root permission or "
+              "kernel.perf_event_paranoid <= 0 required).\n", cpu);
+      continue;
+    }
+    fd->buf = mmap(NULL, profile_mmap_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd->fd, 0);
+    if (fd->buf == MAP_FAILED) {
+      logging(LOG_CODE_FATAL,
+              "Cannot map the sampling buffer of CPU %d.\n", cpu);
+    }
+    fd->pgmsk = PROFILE_BUFFER_PAGES * page_size - 1;
+    num_of_opened++;
+  }
+  free(template->name);
+  free(template->fstr);
+  free(template);
+  if (num_of_opened == 0) {
+    logging(LOG_CODE_WARNING, "Cannot sample %s, not profiling.\n",
+            profile_event);
+    clean_profile_sample();
+    return;
+  }
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    profile_tables[i] = calloc(PROFILE_TABLE_SIZE, sizeof(profile_slot_t));
+    if (profile_tables[i] == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+    profile_table_count[i] = 0;
+  }
+  profile_active_table = 0;
+  profile_order = malloc(PROFILE_TABLE_SIZE * sizeof(unsigned int));
+  profile_entries_e = malloc(max_profile_entries * sizeof(profile_external_t));
+  if (profile_order == NULL || profile_entries_e == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  profile_pids = NULL;
+  num_of_profile_pids = 0;
+  profile_pids_capacity = 0;
+  profile_dropped = 0;
+  profile_lost = 0;
+
+  // The drain thread never handles any signals, which are left to the
+  // sampling thread
+  profile_stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (profile_stop_fd == -1) {
+    logging(LOG_CODE_FATAL, "Cannot create the profiling eventfd.\n");
+  }
+  profile_pollfds[profile_num_of_cores].fd = profile_stop_fd;
+  profile_pollfds[profile_num_of_cores].events = POLLIN;
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  if (pthread_create(&profile_thread, NULL, profile_drain_thread, NULL) != 0) {
+    logging(LOG_CODE_FATAL, "Cannot create the profiling thread.\n");
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  profile_enabled = true;
+  logging(LOG_CODE_INFO, "Profiling with %s on %d CPU(s).\n", profile_event,
+          num_of_opened);
+}
+
+const char* get_profile_event(void) {
+  return profile_enabled ? profile_event : NULL;
+}
+
+static int compare_pids(const void* a, const void* b) {
+  pid_t pid_a = *(const pid_t*)a;
+  pid_t pid_b = *(const pid_t*)b;
+  return pid_a < pid_b ? -1 : pid_a > pid_b ? 1 : 0;
+}
+
+void set_profile_processes(process_list_t* process_list) {
+  if (!profile_enabled) {
+    return;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+  if (process_list->size > profile_pids_capacity) {
+    profile_pids_capacity = 2 * process_list->size;
+    profile_pids = realloc(profile_pids, profile_pids_capacity * sizeof(pid_t));
+    if (profile_pids == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+  }
+  size_t i;
+  for (i = 0; i < process_list->size; i++) {
+    profile_pids[i] = process_list->processes_e[i].process_id;
+  }
+  num_of_profile_pids = process_list->size;
+  qsort(profile_pids, num_of_profile_pids, sizeof(pid_t), compare_pids);
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// FNV-1a over the process and its stack
+static unsigned long long hash_profile_stack(pid_t pid,
+                                             const unsigned long long* ips,
+                                             unsigned int depth) {
+  unsigned long long hash = 14695981039346656037ULL;
+  hash = (hash ^ (unsigned int)pid) * 1099511628211ULL;
+  unsigned int i;
+  for (i = 0; i < depth; i++) {
+    hash = (hash ^ ips[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Counts one sample in the active table. Must be called with the lock held.
+static void add_profile_sample(pid_t pid, const unsigned long long* ips,
+                               unsigned int depth) {
+  profile_slot_t* table = profile_tables[profile_active_table];
+  unsigned long long hash = hash_profile_stack(pid, ips, depth);
+  unsigned int slot = hash & (PROFILE_TABLE_SIZE - 1);
+
+  // Linear probing, where the table is never full
+  while (table[slot].entry.count > 0) {
+    profile_external_t* entry = &table[slot].entry;
+    if (table[slot].hash == hash && entry->process_id == (unsigned int)pid &&
+        entry->depth == depth &&
+        memcmp(entry->ips, ips, depth * sizeof(unsigned long long)) == 0) {
+      entry->count++;
+      return;
+    }
+    slot = (slot + 1) & (PROFILE_TABLE_SIZE - 1);
+  }
+
+  if (profile_table_count[profile_active_table] >=
+      PROFILE_TABLE_SIZE / 4 * 3) {
+    profile_dropped++;
+    return;
+  }
+  profile_table_count[profile_active_table]++;
+  table[slot].hash = hash;
+  table[slot].entry.process_id = pid;
+  table[slot].entry.count = 1;
+  table[slot].entry.depth = depth;
+  table[slot].entry.reserved = 0;
+  memcpy(table[slot].entry.ips, ips, depth * sizeof(unsigned long long));
+}
+
+/*
+ * Consumes all the records in the ring buffer of a CPU. A sample is laid out
+ * in the order of the sample_type bits:
+ * { u64 ip; u32 pid, tid; u64 nr; u64 ips[nr]; }
+ * where the callchain is only there if it is sampled, and may start with or
+ * contain PERF_CONTEXT_* markers rather than addresses.
+ * Must be called with the lock held.
+ */
+static void drain_profile_buffer(perf_event_desc_t* fd) {
+  struct perf_event_mmap_page* page = fd->buf;
+  uint64_t head = page->data_head;
+  // Read the records only after data_head, as perf_event_open(2) requires
+  __sync_synchronize();
+
+  while (page->data_tail < head) {
+    struct perf_event_header header;
+    if (perf_read_buffer(fd, &header, sizeof(header)) == -1) {
+      break;
+    }
+    size_t remaining = header.size - sizeof(header);
+
+    if (header.type == PERF_RECORD_SAMPLE) {
+      uint64_t ip;
+      uint32_t pid_tid[2];
+      perf_read_buffer_64(fd, &ip);
+      perf_read_buffer(fd, pid_tid, sizeof(pid_tid));
+      remaining -= sizeof(ip) + sizeof(pid_tid);
+      pid_t pid = pid_tid[0];
+      if (bsearch(&pid, profile_pids, num_of_profile_pids, sizeof(pid_t),
+                  compare_pids) != NULL) {
+        unsigned long long ips[PROFILE_MAX_DEPTH];
+        unsigned int depth = 0;
+        if (profile_callchain) {
+          uint64_t nr;
+          perf_read_buffer_64(fd, &nr);
+          remaining -= sizeof(nr);
+          for (; nr > 0 && depth < PROFILE_MAX_DEPTH; nr--) {
+            uint64_t frame;
+            perf_read_buffer_64(fd, &frame);
+            remaining -= sizeof(frame);
+            if (frame < PERF_CONTEXT_MAX) {
+              ips[depth++] = frame;
+            }
+          }
+        }
+        // The IP is the only frame without callchains, or if all of them
+        // were markers
+        if (depth == 0) {
+          ips[depth++] = ip;
+        }
+        add_profile_sample(pid, ips, depth);
+      }
+    } else if (header.type == PERF_RECORD_LOST) {
+      uint64_t id_lost[2];
+      perf_read_buffer(fd, id_lost, sizeof(id_lost));
+      remaining -= sizeof(id_lost);
+      profile_lost += id_lost[1];
+    }
+
+    perf_skip_buffer(fd, remaining);
+  }
+}
+
+static void drain_profile_buffers(void) {
+  int core;
+  for (core = 0; core < profile_num_of_cores; core++) {
+    if (profile_fds[core].fd != -1) {
+      drain_profile_buffer(&profile_fds[core]);
+    }
+  }
+}
+
+// Drains the buffers whenever one of them is half full, and at least every
+// PROFILE_DRAIN_INTERVAL_MS, until the eventfd is signaled
+static void* profile_drain_thread(void* arg) {
+  while (true) {
+    int ret = poll(profile_pollfds, profile_num_of_cores + 1,
+                   PROFILE_DRAIN_INTERVAL_MS);
+    if (ret == -1 && errno != EINTR) {
+      logging(LOG_CODE_FATAL, "Cannot poll the sampling buffers.\n");
+    }
+    if (profile_pollfds[profile_num_of_cores].revents & POLLIN) {
+      break;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    drain_profile_buffers();
+    pthread_mutex_unlock(&profile_lock);
+  }
+
+  return NULL;
+}
+
+static int compare_profile_slots(const void* a, const void* b) {
+  const profile_slot_t* table = profile_tables[profile_active_table ^ 1];
+  unsigned int count_a = table[*(const unsigned int*)a].entry.count;
+  unsigned int count_b = table[*(const unsigned int*)b].entry.count;
+  return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+void get_profile_sample(profile_list_t* profile_list) {
+  profile_list->entries_e = profile_entries_e;
+  profile_list->size = 0;
+  if (!profile_enabled) {
+    return;
+  }
+
+  // Count everything sampled until now in this interval, and start counting
+  // into the other table
+  pthread_mutex_lock(&profile_lock);
+  drain_profile_buffers();
+  profile_active_table ^= 1;
+  unsigned long long dropped = profile_dropped;
+  unsigned long long lost = profile_lost;
+  profile_dropped = 0;
+  profile_lost = 0;
+  pthread_mutex_unlock(&profile_lock);
+
+  if (dropped > 0 || lost > 0) {
+    logging(LOG_CODE_WARNING,
+            "%llu profile sample(s) dropped and %llu lost.\n", dropped, lost);
+  }
+
+  // Record the most sampled stacks, and clear the table for the next swap
+  int table_index = profile_active_table ^ 1;
+  profile_slot_t* table = profile_tables[table_index];
+  unsigned int num_of_slots = 0;
+  unsigned int slot;
+  for (slot = 0; slot < PROFILE_TABLE_SIZE; slot++) {
+    if (table[slot].entry.count > 0) {
+      profile_order[num_of_slots++] = slot;
+    }
+  }
+  qsort(profile_order, num_of_slots, sizeof(unsigned int),
+        compare_profile_slots);
+  if (num_of_slots > max_profile_entries) {
+    num_of_slots = max_profile_entries;
+  }
+  for (slot = 0; slot < num_of_slots; slot++) {
+    memcpy(&profile_entries_e[slot], &table[profile_order[slot]].entry,
+           sizeof(profile_external_t));
+  }
+  profile_list->size = num_of_slots;
+
+  memset(table, 0, PROFILE_TABLE_SIZE * sizeof(profile_slot_t));
+  profile_table_count[table_index] = 0;
+}
+
+void clean_profile_sample(void) {
+  if (profile_enabled) {
+    uint64_t stop = 1;
+    if (write(profile_stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+      logging(LOG_CODE_WARNING, "Cannot stop the profiling thread.\n");
+    }
+    pthread_join(profile_thread, NULL);
+    close(profile_stop_fd);
+  }
+
+  int core;
+  for (core = 0; core < profile_num_of_cores; core++) {
+    if (profile_fds[core].buf != NULL) {
+      munmap(profile_fds[core].buf, profile_mmap_size);
+    }
+    if (profile_fds[core].fd != -1) {
+      close(profile_fds[core].fd);
+    }
+  }
+  free(profile_core_ids);
+  free(profile_fds);
+  free(profile_pollfds);
+  profile_core_ids = NULL;
+  profile_fds = NULL;
+  profile_pollfds = NULL;
+  profile_num_of_cores = 0;
+
+  if (profile_enabled) {
+    free(profile_tables[0]);
+    free(profile_tables[1]);
+    free(profile_order);
+    free(profile_entries_e);
+    free(profile_pids);
+    profile_entries_e = NULL;
+    profile_pids = NULL;
+  }
+  profile_enabled = false;
+}
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __PROFILE_SAMPLE_H__
+#define __PROFILE_SAMPLE_H__
+
+#include "proc_sample.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Max number of frames kept of each sampled stack
+#define PROFILE_MAX_DEPTH 32
+
+// Max length of the name of the sampling event
+#define PROFILE_EVENT_NAME_LENGTH 128
+
+// Number of data pages of the sampling buffer of each CPU, which has to be a
+// power of 2
+#define PROFILE_BUFFER_PAGES 16
+
+// Number of slots of each aggregation table, which has to be a power of 2.
+// The tables never grow, since the drain thread fills them, so new stacks
+// are dropped once a table is 3/4 full.
+#define PROFILE_TABLE_SIZE 4096
+
+// How long the drain thread waits for a buffer to fill up halfway before
+// draining all of them anyway
+#define PROFILE_DRAIN_INTERVAL_MS 100
+
+// Default number of samples per second on each CPU
+#define DEFAULT_PROFILE_FREQUENCY 99
+
+// How the monitored processes are profiled, e.g., every 100000 cycles, or 99
+// times per second, and whether whole callchains are sampled
+typedef struct profile_config {
+  // Max number of stacks recorded per interval, or 0 to profile nothing
+  int max_entries;
+  char event[PROFILE_EVENT_NAME_LENGTH];
+  // Either the number of samples per second, or the number of events between
+  // samples if frequency is 0
+  unsigned long long frequency;
+  unsigned long long period;
+  bool callchain;
+} profile_config_t;
+
+// The number of samples of a process with the same stack in an interval. The
+// addresses are recorded as they are, and only symbolized by the reader.
+typedef struct profile_external {
+  unsigned int process_id;
+  unsigned int count;
+  // Number of frames in ips, the innermost first, which is 1 unless the
+  // callchains are sampled
+  unsigned int depth;
+  unsigned int reserved;
+  unsigned long long ips[PROFILE_MAX_DEPTH];
+} profile_external_t;
+
+// The stacks sampled in an interval, from the most sampled down
+typedef struct profile_list {
+  profile_external_t* entries_e;
+  size_t size;
+} profile_list_t;
+
+void init_profile_sample(profile_config_t* profile_config);
+
+// The name of the sampling event, or NULL if nothing is profiled
+const char* get_profile_event(void);
+
+// Only keeps the samples of the processes in the list from now on
+void set_profile_processes(process_list_t* process_list);
+
+// Collects the stacks sampled since the last call. The list points to memory
+// owned by this module, which stays valid until the next call.
+void get_profile_sample(profile_list_t* profile_list);
+
+void clean_profile_sample(void);
+
+#endif
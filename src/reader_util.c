@@ -0,0 +1,601 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "reader_util.h"
+
+#include "log_util.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Size of the fields of the header that are the same in every version
+#define FIXED_HEADER_PREFIX_SIZE offsetof(file_header_t, num_of_cores)
+
+int open_reader(reader_t* reader, const char* filename) {
+  memset(reader, 0, sizeof(reader_t));
+
+  reader->fd = open(filename, O_RDONLY);
+  if (reader->fd == -1) {
+    logging(LOG_CODE_WARNING, "Error opening file %s.\n", filename);
+    return -1;
+  }
+
+  struct stat file_stat;
+  if (fstat(reader->fd, &file_stat) == -1 ||
+      file_stat.st_size < (off_t)FIXED_HEADER_PREFIX_SIZE) {
+    logging(LOG_CODE_WARNING, "File %s is too short.\n", filename);
+    close(reader->fd);
+    return -1;
+  }
+  reader->map_size = file_stat.st_size;
+
+  reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_PRIVATE,
+                     reader->fd, 0);
+  if (reader->map == MAP_FAILED) {
+    logging(LOG_CODE_WARNING, "Cannot map file %s.\n", filename);
+    close(reader->fd);
+    return -1;
+  }
+  madvise((void*)reader->map, reader->map_size, MADV_SEQUENTIAL);
+
+  // Check the fields that are the same in every version
+  file_header_t* header = &reader->header_fields;
+  reader->header = header;
+  memcpy(header, reader->map, FIXED_HEADER_PREFIX_SIZE);
+  if (memcmp(header->magic, NERVE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+    logging(LOG_CODE_WARNING, "File %s is not a Nerve output file.\n",
+            filename);
+    close_reader(reader);
+    return -1;
+  }
+  if (header->endian_marker != NERVE_ENDIAN_MARKER) {
+    logging(LOG_CODE_WARNING,
+            "File %s was written with a different byte order.\n", filename);
+    close_reader(reader);
+    return -1;
+  }
+  if (header->version == 0 || header->version > NERVE_FORMAT_VERSION) {
+    logging(LOG_CODE_WARNING, "File %s has an unsupported version %u.\n",
+            filename, header->version);
+    close_reader(reader);
+    return -1;
+  }
+  if (header->fixed_header_size < FIXED_HEADER_PREFIX_SIZE ||
+      header->fixed_header_size > header->header_size ||
+      header->header_size > reader->map_size) {
+    logging(LOG_CODE_WARNING, "File %s has a corrupted header.\n", filename);
+    close_reader(reader);
+    return -1;
+  }
+
+  // The fields an older writer did not know of are left at 0
+  size_t fixed_header_size = header->fixed_header_size;
+  memcpy(header, reader->map,
+         fixed_header_size < sizeof(file_header_t) ? fixed_header_size
+                                                   : sizeof(file_header_t));
+  if (header->header_size != fixed_header_size +
+          header->num_of_process_fields * sizeof(field_schema_t) +
+          header->num_of_thread_fields * sizeof(field_schema_t) +
+          header->num_of_cgroup_fields * sizeof(field_schema_t) +
+          header->num_of_profile_fields * sizeof(field_schema_t) +
+          header->num_of_events * header->event_name_length +
+          header->num_of_derived_metrics * header->event_name_length +
+          header->num_of_system_stats * header->system_stat_name_length +
+          header->num_of_profile_events * header->event_name_length) {
+    logging(LOG_CODE_WARNING, "File %s has a corrupted header.\n", filename);
+    close_reader(reader);
+    return -1;
+  }
+
+  // The CRC is computed with the CRC field itself set to 0
+  uint32_t zero = 0;
+  size_t crc_offset = offsetof(file_header_t, crc);
+  uint32_t crc = crc32_update(0, reader->map, crc_offset);
+  crc = crc32_update(crc, &zero, sizeof(zero));
+  crc = crc32_update(crc, reader->map + crc_offset + sizeof(zero),
+                     header->header_size - crc_offset - sizeof(zero));
+  if (crc != header->crc) {
+    logging(LOG_CODE_WARNING, "File %s has a corrupted header.\n", filename);
+    close_reader(reader);
+    return -1;
+  }
+
+  reader->process_schema =
+      (const field_schema_t*)(reader->map + fixed_header_size);
+  reader->thread_schema =
+      reader->process_schema + header->num_of_process_fields;
+  reader->cgroup_schema =
+      reader->thread_schema + header->num_of_thread_fields;
+  reader->profile_schema =
+      reader->cgroup_schema + header->num_of_cgroup_fields;
+  reader->event_names = (const char*)(reader->profile_schema +
+                                      header->num_of_profile_fields);
+  reader->derived_metric_names =
+      reader->event_names +
+      header->num_of_events * header->event_name_length;
+  reader->system_stat_names =
+      reader->derived_metric_names +
+      header->num_of_derived_metrics * header->event_name_length;
+  reader->profile_event = NULL;
+  if (header->num_of_profile_events > 0) {
+    reader->profile_event =
+        reader->system_stat_names +
+        header->num_of_system_stats * header->system_stat_name_length;
+  }
+  reader->offset = header->header_size;
+
+  return 0;
+}
+
+// Size of a row of PMU events, which holds the counts of the events followed
+// by the derived metrics and the fractions of time the events were counted
+static size_t get_pmu_row_size(const file_header_t* header) {
+  return (2 * header->num_of_events + header->num_of_derived_metrics) *
+         sizeof(unsigned long long);
+}
+
+// Checks whether a valid record starts at the offset, and fills it in if so
+static int parse_record(reader_t* reader, size_t offset, record_t* record) {
+  const file_header_t* header = reader->header;
+
+  if (offset + sizeof(record_header_t) > reader->map_size) {
+    return 0;
+  }
+  memcpy(&record->header, reader->map + offset, sizeof(record_header_t));
+  if (record->header.magic != NERVE_RECORD_MAGIC ||
+      record->header.num_of_processes > header->num_of_processes ||
+      record->header.num_of_threads > header->num_of_threads ||
+      record->header.num_of_cgroups > header->num_of_cgroups ||
+      record->header.num_of_profile_entries >
+          header->num_of_profile_entries ||
+      offset + sizeof(record_header_t) + record->header.size >
+          reader->map_size) {
+    return 0;
+  }
+
+  // The payload has to add up to the layout described by the header
+  record->num_of_pmu_rows = record->header.num_of_processes;
+  if (header->pmu_mode == FORMAT_PMU_MODE_PER_CPU) {
+    record->num_of_pmu_rows = header->num_of_cores;
+  } else if (header->pmu_mode == FORMAT_PMU_MODE_PER_CGROUP) {
+    record->num_of_pmu_rows = 0;
+  }
+  size_t size = header->num_of_cores * sizeof(long long) +
+                8 * sizeof(unsigned long long) +
+                header->num_of_cores * sizeof(unsigned int) +
+                header->num_of_system_stats * sizeof(unsigned long long) +
+                record->header.num_of_processes * header->process_record_size +
+                record->num_of_pmu_rows * get_pmu_row_size(header) +
+                record->header.num_of_threads * header->thread_record_size +
+                record->header.num_of_cgroups * header->cgroup_record_size +
+                record->header.num_of_profile_entries *
+                    header->profile_record_size;
+  if (header->pmu_mode == FORMAT_PMU_MODE_PER_THREAD) {
+    size += record->header.num_of_threads * get_pmu_row_size(header);
+  } else if (header->pmu_mode == FORMAT_PMU_MODE_PER_CGROUP) {
+    size += record->header.num_of_cgroups * get_pmu_row_size(header);
+  }
+  if (size != record->header.size) {
+    return 0;
+  }
+
+  // The CRC is computed with the CRC field itself set to 0
+  record_header_t header_copy = record->header;
+  header_copy.crc = 0;
+  uint32_t crc = crc32_update(0, &header_copy, sizeof(header_copy));
+  crc = crc32_update(crc, reader->map + offset + sizeof(record_header_t),
+                     record->header.size);
+  if (crc != record->header.crc) {
+    return 0;
+  }
+
+  record->irq_info = reader->map + offset + sizeof(record_header_t);
+  record->network_info =
+      record->irq_info + header->num_of_cores * sizeof(long long);
+  record->frequency_info =
+      record->network_info + 8 * sizeof(unsigned long long);
+  record->system_info =
+      record->frequency_info + header->num_of_cores * sizeof(unsigned int);
+  record->proc_info = record->system_info +
+      header->num_of_system_stats * sizeof(unsigned long long);
+  record->pmu_info = record->proc_info +
+      record->header.num_of_processes * header->process_record_size;
+  record->thread_info =
+      record->pmu_info + record->num_of_pmu_rows * get_pmu_row_size(header);
+  record->pmu_thread_info = NULL;
+  record->cgroup_info = record->thread_info +
+      record->header.num_of_threads * header->thread_record_size;
+  if (header->pmu_mode == FORMAT_PMU_MODE_PER_THREAD) {
+    record->pmu_thread_info = record->cgroup_info;
+    record->cgroup_info +=
+        record->header.num_of_threads * get_pmu_row_size(header);
+  }
+  record->pmu_cgroup_info = NULL;
+  record->profile_info = record->cgroup_info +
+      record->header.num_of_cgroups * header->cgroup_record_size;
+  if (header->pmu_mode == FORMAT_PMU_MODE_PER_CGROUP) {
+    record->pmu_cgroup_info = record->profile_info;
+    record->profile_info +=
+        record->header.num_of_cgroups * get_pmu_row_size(header);
+  }
+
+  return 1;
+}
+
+int next_record(reader_t* reader, record_t* record) {
+  // Release the pages that have been consumed
+  if (reader->offset - reader->released >= READER_WINDOW_SIZE) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t released = reader->offset & ~(page_size - 1);
+    madvise((void*)(reader->map + reader->released),
+            released - reader->released, MADV_DONTNEED);
+    reader->released = released;
+  }
+
+  while (reader->offset + sizeof(record_header_t) <= reader->map_size) {
+    if (parse_record(reader, reader->offset, record)) {
+      reader->offset += sizeof(record_header_t) + record->header.size;
+      return 1;
+    }
+
+    // Look for the next record magic
+    uint32_t magic = NERVE_RECORD_MAGIC;
+    const char* next = memmem(reader->map + reader->offset + 1,
+                              reader->map_size - reader->offset - 1,
+                              &magic, sizeof(magic));
+    size_t next_offset = next == NULL ? reader->map_size :
+                                        (size_t)(next - reader->map);
+    // A truncated record at the end is not counted as corrupted
+    if (next != NULL ||
+        reader->offset + sizeof(record_header_t) + record->header.size <=
+            reader->map_size) {
+      reader->num_of_corrupted_bytes += next_offset - reader->offset;
+    }
+    reader->offset = next_offset;
+  }
+
+  return 0;
+}
+
+void close_reader(reader_t* reader) {
+  if (reader->map != NULL && reader->map != MAP_FAILED) {
+    munmap((void*)reader->map, reader->map_size);
+  }
+  reader->map = NULL;
+  if (reader->fd != -1) {
+    close(reader->fd);
+  }
+  reader->fd = -1;
+}
+
+static int find_field(const field_schema_t* schema, int num_of_fields,
+                      const char* name) {
+  int i;
+  for (i = 0; i < num_of_fields; i++) {
+    if (strncmp(schema[i].name, name, FIELD_NAME_LENGTH) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int find_process_field(const reader_t* reader, const char* name) {
+  return find_field(reader->process_schema,
+                    reader->header->num_of_process_fields, name);
+}
+
+int find_thread_field(const reader_t* reader, const char* name) {
+  return find_field(reader->thread_schema,
+                    reader->header->num_of_thread_fields, name);
+}
+
+int find_cgroup_field(const reader_t* reader, const char* name) {
+  return find_field(reader->cgroup_schema,
+                    reader->header->num_of_cgroup_fields, name);
+}
+
+int find_profile_field(const reader_t* reader, const char* name) {
+  return find_field(reader->profile_schema,
+                    reader->header->num_of_profile_fields, name);
+}
+
+int find_event(const reader_t* reader, const char* name) {
+  int i;
+  for (i = 0; i < reader->header->num_of_events; i++) {
+    if (strncmp(get_event_name(reader, i), name,
+                reader->header->event_name_length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char* get_event_name(const reader_t* reader, int event_index) {
+  return reader->event_names + event_index * reader->header->event_name_length;
+}
+
+int find_derived_metric(const reader_t* reader, const char* name) {
+  int i;
+  for (i = 0; i < reader->header->num_of_derived_metrics; i++) {
+    if (strncmp(get_derived_metric_name(reader, i), name,
+                reader->header->event_name_length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char* get_derived_metric_name(const reader_t* reader, int metric_index) {
+  return reader->derived_metric_names +
+         metric_index * reader->header->event_name_length;
+}
+
+// The count of an event, or the value of a derived metric, in a row of the
+// given section of PMU events
+static unsigned long long get_pmu_count(const reader_t* reader,
+                                        const char* rows, int row,
+                                        int event_index) {
+  unsigned long long value;
+  memcpy(&value,
+         rows + row * get_pmu_row_size(reader->header) +
+             event_index * sizeof(value),
+         sizeof(value));
+  return value;
+}
+
+static double get_pmu_derived(const reader_t* reader, const char* rows,
+                              int row, int metric_index) {
+  double value;
+  memcpy(&value,
+         rows + row * get_pmu_row_size(reader->header) +
+             (reader->header->num_of_events + metric_index) * sizeof(value),
+         sizeof(value));
+  return value;
+}
+
+static double get_pmu_running(const reader_t* reader, const char* rows,
+                              int row, int event_index) {
+  return get_pmu_derived(reader, rows, row,
+                         reader->header->num_of_derived_metrics + event_index);
+}
+
+long long get_irq_info(const record_t* record, int core) {
+  long long value;
+  memcpy(&value, record->irq_info + core * sizeof(value), sizeof(value));
+  return value;
+}
+
+unsigned long long get_network_info(const record_t* record, int index) {
+  unsigned long long value;
+  memcpy(&value, record->network_info + index * sizeof(value), sizeof(value));
+  return value;
+}
+
+unsigned int get_frequency_info(const record_t* record, int core) {
+  unsigned int value;
+  memcpy(&value, record->frequency_info + core * sizeof(value), sizeof(value));
+  return value;
+}
+
+const char* get_system_stat_name(const reader_t* reader, int stat_index) {
+  return reader->system_stat_names +
+         stat_index * reader->header->system_stat_name_length;
+}
+
+unsigned long long get_system_info(const record_t* record, int stat_index) {
+  unsigned long long value;
+  memcpy(&value, record->system_info + stat_index * sizeof(value),
+         sizeof(value));
+  return value;
+}
+
+// Decodes a field of any type, where data points to the start of its record
+static double decode_field(const field_schema_t* field, const char* data) {
+  data += field->offset;
+  switch (field->type) {
+    case FIELD_TYPE_UINT32: {
+      uint32_t value;
+      memcpy(&value, data, sizeof(value));
+      return value;
+    }
+    case FIELD_TYPE_UINT64: {
+      uint64_t value;
+      memcpy(&value, data, sizeof(value));
+      return value;
+    }
+    case FIELD_TYPE_FLOAT: {
+      float value;
+      memcpy(&value, data, sizeof(value));
+      return value;
+    }
+    case FIELD_TYPE_DOUBLE: {
+      double value;
+      memcpy(&value, data, sizeof(value));
+      return value;
+    }
+    default:
+      return 0.0;
+  }
+}
+
+// Decodes an integer field without losing precision
+static unsigned long long decode_field_integer(const field_schema_t* field,
+                                               const char* data) {
+  if (field->type == FIELD_TYPE_UINT32) {
+    uint32_t value;
+    memcpy(&value, data + field->offset, sizeof(value));
+    return value;
+  } else if (field->type == FIELD_TYPE_UINT64) {
+    uint64_t value;
+    memcpy(&value, data + field->offset, sizeof(value));
+    return value;
+  }
+  return (unsigned long long)decode_field(field, data);
+}
+
+double get_process_field(const reader_t* reader, const record_t* record,
+                         int proc_index, int field_index) {
+  return decode_field(&reader->process_schema[field_index],
+                      record->proc_info +
+                          proc_index * reader->header->process_record_size);
+}
+
+unsigned long long get_process_field_integer(const reader_t* reader,
+                                             const record_t* record,
+                                             int proc_index, int field_index) {
+  return decode_field_integer(
+      &reader->process_schema[field_index],
+      record->proc_info + proc_index * reader->header->process_record_size);
+}
+
+int is_integer_field(const reader_t* reader, int field_index) {
+  return reader->process_schema[field_index].type == FIELD_TYPE_UINT32 ||
+         reader->process_schema[field_index].type == FIELD_TYPE_UINT64;
+}
+
+unsigned long long get_pmu_info(const reader_t* reader, const record_t* record,
+                                int row, int event_index) {
+  return get_pmu_count(reader, record->pmu_info, row, event_index);
+}
+
+double get_derived_info(const reader_t* reader, const record_t* record,
+                        int row, int metric_index) {
+  return get_pmu_derived(reader, record->pmu_info, row, metric_index);
+}
+
+double get_pmu_ratio(const reader_t* reader, const record_t* record, int row,
+                     int event_index) {
+  return get_pmu_running(reader, record->pmu_info, row, event_index);
+}
+
+double get_thread_field(const reader_t* reader, const record_t* record,
+                        int thread_index, int field_index) {
+  return decode_field(&reader->thread_schema[field_index],
+                      record->thread_info +
+                          thread_index * reader->header->thread_record_size);
+}
+
+unsigned long long get_thread_field_integer(const reader_t* reader,
+                                            const record_t* record,
+                                            int thread_index, int field_index) {
+  return decode_field_integer(
+      &reader->thread_schema[field_index],
+      record->thread_info + thread_index * reader->header->thread_record_size);
+}
+
+int is_integer_thread_field(const reader_t* reader, int field_index) {
+  return reader->thread_schema[field_index].type == FIELD_TYPE_UINT32 ||
+         reader->thread_schema[field_index].type == FIELD_TYPE_UINT64;
+}
+
+unsigned long long get_pmu_thread_info(const reader_t* reader,
+                                       const record_t* record,
+                                       int thread_index, int event_index) {
+  return get_pmu_count(reader, record->pmu_thread_info, thread_index,
+                       event_index);
+}
+
+double get_derived_thread_info(const reader_t* reader, const record_t* record,
+                               int thread_index, int metric_index) {
+  return get_pmu_derived(reader, record->pmu_thread_info, thread_index,
+                         metric_index);
+}
+
+double get_pmu_thread_ratio(const reader_t* reader, const record_t* record,
+                            int thread_index, int event_index) {
+  return get_pmu_running(reader, record->pmu_thread_info, thread_index,
+                         event_index);
+}
+
+double get_cgroup_field(const reader_t* reader, const record_t* record,
+                        int cgroup_index, int field_index) {
+  return decode_field(&reader->cgroup_schema[field_index],
+                      record->cgroup_info +
+                          cgroup_index * reader->header->cgroup_record_size);
+}
+
+unsigned long long get_cgroup_field_integer(const reader_t* reader,
+                                            const record_t* record,
+                                            int cgroup_index, int field_index) {
+  return decode_field_integer(
+      &reader->cgroup_schema[field_index],
+      record->cgroup_info + cgroup_index * reader->header->cgroup_record_size);
+}
+
+int is_integer_cgroup_field(const reader_t* reader, int field_index) {
+  return reader->cgroup_schema[field_index].type == FIELD_TYPE_UINT32 ||
+         reader->cgroup_schema[field_index].type == FIELD_TYPE_UINT64;
+}
+
+int is_string_cgroup_field(const reader_t* reader, int field_index) {
+  return reader->cgroup_schema[field_index].type == FIELD_TYPE_STRING;
+}
+
+char* get_cgroup_field_string(const reader_t* reader, const record_t* record,
+                              int cgroup_index, int field_index, char* buffer,
+                              size_t size) {
+  const field_schema_t* field = &reader->cgroup_schema[field_index];
+  size_t length = field->size < size ? field->size : size - 1;
+  memcpy(buffer,
+         record->cgroup_info +
+             cgroup_index * reader->header->cgroup_record_size + field->offset,
+         length);
+  buffer[length] = '\0';
+  return buffer;
+}
+
+unsigned long long get_pmu_cgroup_info(const reader_t* reader,
+                                       const record_t* record,
+                                       int cgroup_index, int event_index) {
+  return get_pmu_count(reader, record->pmu_cgroup_info, cgroup_index,
+                       event_index);
+}
+
+double get_derived_cgroup_info(const reader_t* reader, const record_t* record,
+                               int cgroup_index, int metric_index) {
+  return get_pmu_derived(reader, record->pmu_cgroup_info, cgroup_index,
+                         metric_index);
+}
+
+double get_pmu_cgroup_ratio(const reader_t* reader, const record_t* record,
+                            int cgroup_index, int event_index) {
+  return get_pmu_running(reader, record->pmu_cgroup_info, cgroup_index,
+                         event_index);
+}
+
+unsigned long long get_profile_field_integer(const reader_t* reader,
+                                             const record_t* record,
+                                             int entry_index,
+                                             int field_index) {
+  return decode_field_integer(
+      &reader->profile_schema[field_index],
+      record->profile_info + entry_index * reader->header->profile_record_size);
+}
+
+int is_array_profile_field(const reader_t* reader, int field_index) {
+  return reader->profile_schema[field_index].type == FIELD_TYPE_UINT64_ARRAY;
+}
+
+int get_profile_field_array(const reader_t* reader, const record_t* record,
+                            int entry_index, int field_index,
+                            unsigned long long* values, int max_values) {
+  const field_schema_t* field = &reader->profile_schema[field_index];
+  int num_of_values = field->size / sizeof(unsigned long long);
+  memcpy(values,
+         record->profile_info +
+             entry_index * reader->header->profile_record_size + field->offset,
+         (num_of_values < max_values ? num_of_values : max_values) *
+             sizeof(unsigned long long));
+  return num_of_values;
+}
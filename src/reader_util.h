@@ -0,0 +1,195 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __READER_UTIL__
+#define __READER_UTIL__
+
+#include "format_util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// How much of the file is read before the pages behind are dropped, which
+// bounds the memory used to stream a file regardless of its size
+#define READER_WINDOW_SIZE (64 * 1024 * 1024)
+
+/*
+ * A reader that streams the records of a binary output file. The file is
+ * mapped rather than loaded, and the pages that have been consumed are
+ * released as the reader moves on. Corrupted records are skipped by looking
+ * for the next record magic, and a truncated record at the end of the file
+ * is treated as the end of the file.
+ */
+typedef struct reader {
+  int fd;
+  const char* map;
+  size_t map_size;
+  size_t offset;
+  // Everything before this offset has been released
+  size_t released;
+  // The fixed header, with the fields the file predates set to 0
+  file_header_t header_fields;
+  const file_header_t* header;
+  const field_schema_t* process_schema;
+  const field_schema_t* thread_schema;
+  const field_schema_t* cgroup_schema;
+  const field_schema_t* profile_schema;
+  const char* event_names;
+  const char* derived_metric_names;
+  const char* system_stat_names;
+  // The name of the sampling event, or NULL if the stacks are not sampled
+  const char* profile_event;
+  // Number of bytes skipped because of corrupted records
+  unsigned long long num_of_corrupted_bytes;
+} reader_t;
+
+// A record in the file, whose sections point directly into the mapping and
+// may not be aligned, so they are accessed with the functions below
+typedef struct record {
+  record_header_t header;
+  const char* irq_info;
+  const char* network_info;
+  const char* frequency_info;
+  const char* system_info;
+  const char* proc_info;
+  const char* pmu_info;
+  // Number of rows in pmu_info, i.e., processes or cores, or 0 in per-cgroup
+  // mode
+  unsigned int num_of_pmu_rows;
+  const char* thread_info;
+  // One row per thread, or NULL unless in per-thread mode
+  const char* pmu_thread_info;
+  const char* cgroup_info;
+  // One row per cgroup, or NULL unless in per-cgroup mode
+  const char* pmu_cgroup_info;
+  const char* profile_info;
+} record_t;
+
+// Returns 0 on success, or -1 with a message logged
+int open_reader(reader_t* reader, const char* filename);
+
+// Returns 1 if a record is read, or 0 at the end of the file
+int next_record(reader_t* reader, record_t* record);
+
+void close_reader(reader_t* reader);
+
+// Index of the process field, the thread field, the cgroup field, the profile
+// field or the PMU event by name, or -1 if not found
+int find_process_field(const reader_t* reader, const char* name);
+
+int find_thread_field(const reader_t* reader, const char* name);
+
+int find_cgroup_field(const reader_t* reader, const char* name);
+
+int find_profile_field(const reader_t* reader, const char* name);
+
+int find_event(const reader_t* reader, const char* name);
+
+const char* get_event_name(const reader_t* reader, int event_index);
+
+// Index of the derived metric by name, or -1 if not found
+int find_derived_metric(const reader_t* reader, const char* name);
+
+const char* get_derived_metric_name(const reader_t* reader, int metric_index);
+
+long long get_irq_info(const record_t* record, int core);
+
+unsigned long long get_network_info(const record_t* record, int index);
+
+unsigned int get_frequency_info(const record_t* record, int core);
+
+const char* get_system_stat_name(const reader_t* reader, int stat_index);
+
+unsigned long long get_system_info(const record_t* record, int stat_index);
+
+// The value of a process field, converted to double
+double get_process_field(const reader_t* reader, const record_t* record,
+                         int proc_index, int field_index);
+
+// The value of an integer process field, without losing precision
+unsigned long long get_process_field_integer(const reader_t* reader,
+                                             const record_t* record,
+                                             int proc_index, int field_index);
+
+int is_integer_field(const reader_t* reader, int field_index);
+
+unsigned long long get_pmu_info(const reader_t* reader, const record_t* record,
+                                int row, int event_index);
+
+double get_derived_info(const reader_t* reader, const record_t* record,
+                        int row, int metric_index);
+
+// The fraction of the time the event was enabled in which it was counted, or 0
+// if it was not enabled
+double get_pmu_ratio(const reader_t* reader, const record_t* record, int row,
+                     int event_index);
+
+// The same as above, for the threads
+double get_thread_field(const reader_t* reader, const record_t* record,
+                        int thread_index, int field_index);
+
+unsigned long long get_thread_field_integer(const reader_t* reader,
+                                            const record_t* record,
+                                            int thread_index, int field_index);
+
+int is_integer_thread_field(const reader_t* reader, int field_index);
+
+unsigned long long get_pmu_thread_info(const reader_t* reader,
+                                       const record_t* record,
+                                       int thread_index, int event_index);
+
+double get_derived_thread_info(const reader_t* reader, const record_t* record,
+                               int thread_index, int metric_index);
+
+double get_pmu_thread_ratio(const reader_t* reader, const record_t* record,
+                            int thread_index, int event_index);
+
+// The same as above, for the cgroups
+double get_cgroup_field(const reader_t* reader, const record_t* record,
+                        int cgroup_index, int field_index);
+
+unsigned long long get_cgroup_field_integer(const reader_t* reader,
+                                            const record_t* record,
+                                            int cgroup_index, int field_index);
+
+int is_integer_cgroup_field(const reader_t* reader, int field_index);
+
+int is_string_cgroup_field(const reader_t* reader, int field_index);
+
+// Copies a string cgroup field into the buffer, which is always
+// null-terminated, and returns the buffer
+char* get_cgroup_field_string(const reader_t* reader, const record_t* record,
+                              int cgroup_index, int field_index, char* buffer,
+                              size_t size);
+
+unsigned long long get_pmu_cgroup_info(const reader_t* reader,
+                                       const record_t* record,
+                                       int cgroup_index, int event_index);
+
+double get_derived_cgroup_info(const reader_t* reader, const record_t* record,
+                               int cgroup_index, int metric_index);
+
+double get_pmu_cgroup_ratio(const reader_t* reader, const record_t* record,
+                            int cgroup_index, int event_index);
+
+// The same as above, for the sampled stacks
+unsigned long long get_profile_field_integer(const reader_t* reader,
+                                             const record_t* record,
+                                             int entry_index, int field_index);
+
+int is_array_profile_field(const reader_t* reader, int field_index);
+
+// Copies up to max_values of an array profile field, and returns the number of
+// values in the field
+int get_profile_field_array(const reader_t* reader, const record_t* record,
+                            int entry_index, int field_index,
+                            unsigned long long* values, int max_values);
+
+#endif
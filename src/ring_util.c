@@ -0,0 +1,72 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "ring_util.h"
+
+#include "log_util.h"
+
+#include <stdlib.h>
+
+void init_ring(ring_t* ring, size_t slot_size, unsigned long num_slots) {
+  // Round the slots up to whole cache lines, so that the slot being written
+  // and the slot being read never share one
+  ring->slot_size = (slot_size + RING_CACHE_LINE_SIZE - 1) &
+                    ~(size_t)(RING_CACHE_LINE_SIZE - 1);
+  ring->num_slots = num_slots;
+  ring->num_of_drops = 0ULL;
+  atomic_init(&ring->head, 0UL);
+  atomic_init(&ring->tail, 0UL);
+
+  if (posix_memalign((void**)&ring->slots, RING_CACHE_LINE_SIZE,
+                     ring->slot_size * num_slots) != 0) {
+    logging(LOG_CODE_FATAL, "Cannot allocate %lu ring slots of %zu bytes.\n",
+            num_slots, ring->slot_size);
+  }
+}
+
+void* ring_acquire_write(ring_t* ring) {
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  // The consumer has not caught up yet
+  if (head - tail == ring->num_slots) {
+    ring->num_of_drops++;
+    return NULL;
+  }
+
+  return ring->slots + (head % ring->num_slots) * ring->slot_size;
+}
+
+void ring_commit_write(ring_t* ring) {
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void* ring_acquire_read(ring_t* ring) {
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  // Nothing has been published yet
+  if (head == tail) {
+    return NULL;
+  }
+
+  return ring->slots + (tail % ring->num_slots) * ring->slot_size;
+}
+
+void ring_commit_read(ring_t* ring) {
+  unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void clean_ring(ring_t* ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
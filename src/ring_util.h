@@ -0,0 +1,51 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __RING_UTIL__
+#define __RING_UTIL__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Size of a cache line, used to keep the producer and the consumer indices
+// from sharing one
+#define RING_CACHE_LINE_SIZE 64
+
+/*
+ * A single-producer/single-consumer lock-free ring of preallocated slots.
+ * The producer fills the slot returned by ring_acquire_write() and publishes
+ * it with ring_commit_write(), while the consumer does the same with
+ * ring_acquire_read() and ring_commit_read(). When the ring is full, the
+ * producer does not wait but counts a drop instead.
+ */
+typedef struct ring {
+  char* slots;
+  size_t slot_size;
+  unsigned long num_slots;
+  unsigned long long num_of_drops;
+  // Next slot to be written, only moved by the producer
+  _Alignas(RING_CACHE_LINE_SIZE) atomic_ulong head;
+  // Next slot to be read, only moved by the consumer
+  _Alignas(RING_CACHE_LINE_SIZE) atomic_ulong tail;
+} ring_t;
+
+void init_ring(ring_t* ring, size_t slot_size, unsigned long num_slots);
+
+void* ring_acquire_write(ring_t* ring);
+
+void ring_commit_write(ring_t* ring);
+
+void* ring_acquire_read(ring_t* ring);
+
+void ring_commit_read(ring_t* ring);
+
+void clean_ring(ring_t* ring);
+
+#endif
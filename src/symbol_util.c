@@ -0,0 +1,151 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "symbol_util.h"
+
+#include "log_util.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void init_symbolizer(symbolizer_t* symbolizer) {
+  symbolizer->processes = NULL;
+  symbolizer->num_of_processes = 0;
+  symbolizer->capacity = 0;
+}
+
+/*
+ * file format:
+ * /proc/[pid]/maps: 7f2c4a200000-7f2c4a3c5000 r-xp 00028000 08:01 1234
+ *                   /usr/lib/libc.so.6
+ * (all in one line). Only the executable mappings of files are kept, which
+ * come in address order.
+ */
+static void read_mappings(symbol_process_t* process) {
+  char filename[64];
+  char line[PATH_MAX + 128];
+  size_t capacity = 0;
+
+  process->mappings = NULL;
+  process->num_of_mappings = 0;
+
+  snprintf(filename, sizeof(filename), "/proc/%u/maps", process->pid);
+  FILE* fp = fopen(filename, "r");
+  if (fp == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned long long start, end, offset;
+    char permissions[8];
+    int path_start = 0;
+    if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end,
+               permissions, &offset, &path_start) != 4 ||
+        path_start == 0 || permissions[2] != 'x' || line[path_start] != '/') {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+
+    if (process->num_of_mappings == capacity) {
+      capacity = capacity == 0 ? 16 : 2 * capacity;
+      process->mappings =
+          realloc(process->mappings, capacity * sizeof(symbol_mapping_t));
+      if (process->mappings == NULL) {
+        logging(LOG_CODE_FATAL, "cannot allocate memory");
+      }
+    }
+    symbol_mapping_t* mapping = &process->mappings[process->num_of_mappings];
+    mapping->start = start;
+    mapping->end = end;
+    mapping->offset = offset;
+    mapping->path = strdup(line + path_start);
+    if (mapping->path == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+    process->num_of_mappings++;
+  }
+  fclose(fp);
+}
+
+// Finds the process, and reads its mappings the first time it is seen. The
+// processes are kept sorted by PID.
+static symbol_process_t* find_process(symbolizer_t* symbolizer,
+                                      unsigned int pid) {
+  size_t low = 0;
+  size_t high = symbolizer->num_of_processes;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (symbolizer->processes[middle].pid < pid) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low < symbolizer->num_of_processes &&
+      symbolizer->processes[low].pid == pid) {
+    return &symbolizer->processes[low];
+  }
+
+  if (symbolizer->num_of_processes == symbolizer->capacity) {
+    symbolizer->capacity =
+        symbolizer->capacity == 0 ? 16 : 2 * symbolizer->capacity;
+    symbolizer->processes =
+        realloc(symbolizer->processes,
+                symbolizer->capacity * sizeof(symbol_process_t));
+    if (symbolizer->processes == NULL) {
+      logging(LOG_CODE_FATAL, "cannot allocate memory");
+    }
+  }
+  memmove(&symbolizer->processes[low + 1], &symbolizer->processes[low],
+          (symbolizer->num_of_processes - low) * sizeof(symbol_process_t));
+  symbolizer->num_of_processes++;
+  symbolizer->processes[low].pid = pid;
+  read_mappings(&symbolizer->processes[low]);
+  return &symbolizer->processes[low];
+}
+
+char* symbolize(symbolizer_t* symbolizer, unsigned int pid,
+                unsigned long long address, char* buffer, size_t size) {
+  symbol_process_t* process = find_process(symbolizer, pid);
+
+  // The last mapping that starts at or before the address
+  size_t low = 0;
+  size_t high = process->num_of_mappings;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (process->mappings[middle].start <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low > 0 && address < process->mappings[low - 1].end) {
+    symbol_mapping_t* mapping = &process->mappings[low - 1];
+    snprintf(buffer, size, "%s+0x%llx", mapping->path,
+             address - mapping->start + mapping->offset);
+  } else {
+    snprintf(buffer, size, "0x%llx", address);
+  }
+  return buffer;
+}
+
+void clean_symbolizer(symbolizer_t* symbolizer) {
+  size_t i, j;
+  for (i = 0; i < symbolizer->num_of_processes; i++) {
+    symbol_process_t* process = &symbolizer->processes[i];
+    for (j = 0; j < process->num_of_mappings; j++) {
+      free(process->mappings[j].path);
+    }
+    free(process->mappings);
+  }
+  free(symbolizer->processes);
+  init_symbolizer(symbolizer);
+}
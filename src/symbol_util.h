@@ -0,0 +1,58 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __SYMBOL_UTIL__
+#define __SYMBOL_UTIL__
+
+#include <stddef.h>
+
+// Max length of a symbolized address
+#define SYMBOL_LENGTH 512
+
+// A file mapping of a process, from /proc/<pid>/maps
+typedef struct symbol_mapping {
+  unsigned long long start;
+  unsigned long long end;
+  // Offset of the start of the mapping in the file
+  unsigned long long offset;
+  char* path;
+} symbol_mapping_t;
+
+// The file mappings of a process, sorted by address, which are empty if the
+// process has gone
+typedef struct symbol_process {
+  unsigned int pid;
+  symbol_mapping_t* mappings;
+  size_t num_of_mappings;
+} symbol_process_t;
+
+/*
+ * Turns the sampled addresses into the files they were executed from and the
+ * offsets in them, e.g., /usr/lib/libc.so.6+0x2a1c0, which can be resolved to
+ * functions offline, e.g., with addr2line. The mappings are read from /proc/
+ * once per process, so this only works while the processes are running, and
+ * before they map anything else at the same addresses.
+ */
+typedef struct symbolizer {
+  symbol_process_t* processes;
+  size_t num_of_processes;
+  size_t capacity;
+} symbolizer_t;
+
+void init_symbolizer(symbolizer_t* symbolizer);
+
+// Writes the symbolized address into the buffer, or the address in hex if it
+// is not in a file mapping of the process, and returns the buffer
+char* symbolize(symbolizer_t* symbolizer, unsigned int pid,
+                unsigned long long address, char* buffer, size_t size);
+
+void clean_symbolizer(symbolizer_t* symbolizer);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include "system_util.h"
+
+#include "log_util.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const char* system_stat_names[NUM_OF_SYSTEM_STATS] = {
+  "cpu_some_usec", "cpu_full_usec", "memory_some_usec", "memory_full_usec",
+  "io_some_usec", "io_full_usec", "pgscan_kswapd", "pgscan_direct",
+  "pgsteal_kswapd", "pgsteal_direct", "compact_stall", "numa_hint_faults",
+  "numa_pages_migrated", "thp_fault_alloc",
+};
+
+static const char* pressure_locations[NUM_OF_PRESSURE_FILES] = {
+  "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io",
+};
+
+static const char* online_cpus_location = "/sys/devices/system/cpu/online";
+
+int open_system_files(system_files_t* files) {
+  int ret = -1;
+  int i;
+  for (i = 0; i < NUM_OF_PRESSURE_FILES; i++) {
+    files->pressure_fds[i] = open(pressure_locations[i], O_RDONLY | O_CLOEXEC);
+    if (files->pressure_fds[i] != -1) {
+      ret = 0;
+    }
+  }
+  files->vmstat_fd = open("/proc/vmstat", O_RDONLY | O_CLOEXEC);
+  return ret;
+}
+
+// Reads a whole file from the beginning, returning an empty string if it is
+// missing
+static void read_system_file(int fd, char buffer[SYSTEM_BUFFER_SIZE]) {
+  ssize_t size = fd == -1 ? -1 : pread(fd, buffer, SYSTEM_BUFFER_SIZE - 1, 0);
+  buffer[size > 0 ? size : 0] = '\0';
+}
+
+/*
+ * file formats:
+ * /proc/pressure/...: some avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+ *                     full avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+ * /proc/vmstat:       pgscan_kswapd 1234
+ */
+void read_system_stats(const system_files_t* files,
+                       unsigned long long stats[NUM_OF_SYSTEM_STATS]) {
+  char buffer[SYSTEM_BUFFER_SIZE];
+  const char* line;
+  int i;
+
+  memset(stats, 0, NUM_OF_SYSTEM_STATS * sizeof(unsigned long long));
+
+  // The some and full totals of each resource are next to each other. There
+  // is no full line for the CPU before Linux 5.13.
+  for (i = 0; i < NUM_OF_PRESSURE_FILES; i++) {
+    read_system_file(files->pressure_fds[i], buffer);
+    for (line = buffer; *line != '\0'; line++) {
+      unsigned long long total;
+      if (sscanf(line, "some avg10=%*f avg60=%*f avg300=%*f total=%llu",
+                 &total) == 1) {
+        stats[SYSTEM_STAT_CPU_SOME_USEC + 2 * i] = total;
+      } else if (sscanf(line,
+                        "full avg10=%*f avg60=%*f avg300=%*f total=%llu",
+                        &total) == 1) {
+        stats[SYSTEM_STAT_CPU_FULL_USEC + 2 * i] = total;
+      }
+      line = strchr(line, '\n');
+      if (line == NULL) {
+        break;
+      }
+    }
+  }
+
+  // The vmstat counters are named the same as the statistics
+  read_system_file(files->vmstat_fd, buffer);
+  for (line = buffer; *line != '\0'; line++) {
+    char name[SYSTEM_STAT_NAME_LENGTH];
+    unsigned long long value;
+    if (sscanf(line, "%31s %llu", name, &value) == 2) {
+      for (i = SYSTEM_STAT_PGSCAN_KSWAPD; i < NUM_OF_SYSTEM_STATS; i++) {
+        if (strcmp(name, system_stat_names[i]) == 0) {
+          stats[i] = value;
+          break;
+        }
+      }
+    }
+    line = strchr(line, '\n');
+    if (line == NULL) {
+      break;
+    }
+  }
+}
+
+void close_system_files(system_files_t* files) {
+  int i;
+  for (i = 0; i < NUM_OF_PRESSURE_FILES; i++) {
+    if (files->pressure_fds[i] != -1) {
+      close(files->pressure_fds[i]);
+    }
+    files->pressure_fds[i] = -1;
+  }
+  if (files->vmstat_fd != -1) {
+    close(files->vmstat_fd);
+  }
+  files->vmstat_fd = -1;
+}
+
+ssize_t read_whole_file(int fd, char** buffer, size_t* capacity) {
+  if (fd == -1) {
+    return -1;
+  }
+  size_t size = 0;
+  while (true) {
+    // Leave room for the terminating null byte
+    if (size + 1 >= *capacity) {
+      *capacity = *capacity == 0 ? SYSTEM_BUFFER_SIZE : 2 * *capacity;
+      *buffer = realloc(*buffer, *capacity);
+      if (*buffer == NULL) {
+        logging(LOG_CODE_FATAL, "cannot allocate memory");
+      }
+    }
+    ssize_t ret = pread(fd, *buffer + size, *capacity - 1 - size, size);
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    size += ret;
+  }
+  (*buffer)[size] = '\0';
+  return size;
+}
+
+// Walks a list of CPU ranges, e.g., "0-3,6", storing the IDs into cpus unless
+// it is NULL, and returns the number of them
+static int parse_cpu_list(const char* list, int* cpus) {
+  int num_of_cpus = 0;
+  const char* next = list;
+  while (isdigit((unsigned char)*next)) {
+    char* end;
+    long first = strtol(next, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    long cpu;
+    for (cpu = first; cpu <= last; cpu++) {
+      if (cpus != NULL) {
+        cpus[num_of_cpus] = cpu;
+      }
+      num_of_cpus++;
+    }
+    next = *end == ',' ? end + 1 : end;
+  }
+  return num_of_cpus;
+}
+
+int read_online_cpus(int** cpus) {
+  char buffer[SYSTEM_BUFFER_SIZE];
+  int fd = open(online_cpus_location, O_RDONLY | O_CLOEXEC);
+  read_system_file(fd, buffer);
+  if (fd != -1) {
+    close(fd);
+  }
+
+  // Count them first, and fall back to as many CPUs from 0 as there are
+  // online if the file is missing
+  int num_of_cpus = parse_cpu_list(buffer, NULL);
+  bool fallback = num_of_cpus == 0;
+  if (fallback) {
+    num_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  *cpus = malloc(num_of_cpus * sizeof(int));
+  if (*cpus == NULL) {
+    logging(LOG_CODE_FATAL, "cannot allocate memory");
+  }
+  if (fallback) {
+    int cpu;
+    for (cpu = 0; cpu < num_of_cpus; cpu++) {
+      (*cpus)[cpu] = cpu;
+    }
+  } else {
+    parse_cpu_list(buffer, *cpus);
+  }
+  return num_of_cpus;
+}
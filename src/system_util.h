@@ -0,0 +1,78 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef __SYSTEM_UTIL__
+#define __SYSTEM_UTIL__
+
+#include <sys/types.h>
+
+// Size of the buffer /proc/vmstat is read into, which has a couple hundred
+// lines on recent kernels
+#define SYSTEM_BUFFER_SIZE (16 * 1024)
+
+// Number of resources in /proc/pressure/, i.e., cpu, memory and io
+#define NUM_OF_PRESSURE_FILES 3
+
+// Max length of the name of a system statistic
+#define SYSTEM_STAT_NAME_LENGTH 32
+
+// The system-wide counters we record, which all keep growing, so that their
+// deltas are taken every interval. The order has to match system_stat_names.
+typedef enum {
+  // /proc/pressure/*, total stall time in microseconds
+  SYSTEM_STAT_CPU_SOME_USEC = 0x00,
+  SYSTEM_STAT_CPU_FULL_USEC = 0x01,
+  SYSTEM_STAT_MEMORY_SOME_USEC = 0x02,
+  SYSTEM_STAT_MEMORY_FULL_USEC = 0x03,
+  SYSTEM_STAT_IO_SOME_USEC = 0x04,
+  SYSTEM_STAT_IO_FULL_USEC = 0x05,
+  // /proc/vmstat
+  SYSTEM_STAT_PGSCAN_KSWAPD = 0x06,
+  SYSTEM_STAT_PGSCAN_DIRECT = 0x07,
+  SYSTEM_STAT_PGSTEAL_KSWAPD = 0x08,
+  SYSTEM_STAT_PGSTEAL_DIRECT = 0x09,
+  SYSTEM_STAT_COMPACT_STALL = 0x0a,
+  SYSTEM_STAT_NUMA_HINT_FAULTS = 0x0b,
+  SYSTEM_STAT_NUMA_PAGES_MIGRATED = 0x0c,
+  SYSTEM_STAT_THP_FAULT_ALLOC = 0x0d,
+  NUM_OF_SYSTEM_STATS = 0x0e,
+} system_stat_t;
+
+// Names of the statistics, as recorded in the output file header
+extern const char* system_stat_names[NUM_OF_SYSTEM_STATS];
+
+// The pressure files and /proc/vmstat, which are kept open. A file that is
+// missing is -1, e.g., /proc/pressure/ without CONFIG_PSI.
+typedef struct system_files {
+  int pressure_fds[NUM_OF_PRESSURE_FILES];
+  int vmstat_fd;
+} system_files_t;
+
+// Returns -1 if none of the pressure files is there
+int open_system_files(system_files_t* files);
+
+// Reads the current values of all the counters, where the ones that the
+// kernel does not keep are 0
+void read_system_stats(const system_files_t* files,
+                       unsigned long long stats[NUM_OF_SYSTEM_STATS]);
+
+void close_system_files(system_files_t* files);
+
+// Reads a whole file from the beginning into a buffer that grows as needed,
+// which is kept across calls, so that rereading the file only allocates when
+// it has grown. The content is null terminated. Returns its size, or -1.
+ssize_t read_whole_file(int fd, char** buffer, size_t* capacity);
+
+// Reads the IDs of the online CPUs into a new array, which may have gaps when
+// some of the CPUs are offline, e.g., "0-3,6" in
+// /sys/devices/system/cpu/online. Returns the number of them.
+int read_online_cpus(int** cpus);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/*
+ * Checks that the steady-state sampling loop does no heap allocations. The
+ * allocation functions are interposed with counters, and get_pmu_sample() is
+ * run for a few intervals to warm up, i.e., to open the descriptors and grow
+ * the buffers, and then for more intervals while counting, which must not
+ * allocate anything. Every PMU mode is checked with the events rotating, and
+ * with a derived metric, against software events that any machine has. The
+ * per-CPU mode is checked once more with the events read by the reader
+ * threads, which fall back to read() where rdpmc is not available.
+ *
+ * The per-thread mode runs unprivileged, without the MSRs. The per-CPU and
+ * per-cgroup modes need root or kernel.perf_event_paranoid <= 0, and are
+ * skipped otherwise. If no mode can be run at all, it exits with
+ * SKIPPED_EXIT_CODE.
+ */
+
+#include "cgroup_util.h"
+#include "pmu_sample.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of intervals to warm up with, and to count the allocations in
+#define WARM_UP_INTERVALS 3
+#define TEST_INTERVALS 20
+
+// Length of each interval
+#define INTERVAL_NS 5000000ULL
+
+// Exit code of a test that could not be run, as in Automake
+#define SKIPPED_EXIT_CODE 77
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t num, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static volatile bool counting;
+static unsigned long num_of_allocations;
+
+void* malloc(size_t size) {
+  if (counting) {
+    num_of_allocations++;
+  }
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) {
+  if (counting) {
+    num_of_allocations++;
+  }
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  if (counting) {
+    num_of_allocations++;
+  }
+  return __libc_realloc(ptr, size);
+}
+
+char* strdup(const char* s) {
+  size_t size = strlen(s) + 1;
+  char* copy = malloc(size);
+  if (copy != NULL) {
+    memcpy(copy, s, size);
+  }
+  return copy;
+}
+
+// The derived metric uses the first set of two events, which count together.
+// The events only count in user mode, which kernel.perf_event_paranoid = 2
+// allows without any privileges.
+static const char* events[MAX_EVENTS] = {
+  "perf::TASK-CLOCK:u", "perf::CONTEXT-SWITCHES:u", "perf::CPU-CLOCK:u",
+  "perf::PAGE-FAULTS:u", NULL,
+};
+
+static const char* mode_names[] = {"per-thread", "per-cpu", "per-cgroup"};
+
+// Opens the directory of the cgroup2 cgroup of this process, or returns -1
+static int open_own_cgroup(void) {
+  char root[PATH_MAX];
+  char path[PATH_MAX];
+  char dir[2 * PATH_MAX];
+  if (find_cgroup_root(root, sizeof(root)) == -1 ||
+      read_proc_cgroup(getpid(), path, sizeof(path)) == -1) {
+    return -1;
+  }
+  snprintf(dir, sizeof(dir), "%s%s", root, path);
+  return open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Whether the software events can be counted in user mode for this thread
+// (per_cpu is false), or for a whole CPU (per_cpu is true)
+static bool can_open_events(bool per_cpu) {
+  int* cpus;
+  read_online_cpus(&cpus);
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = per_cpu ? perf_event_open(&attr, -1, cpus[0], -1, 0)
+                   : perf_event_open(&attr, 0, -1, -1, 0);
+  free(cpus);
+  if (fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Runs one mode, and returns whether it did not allocate anything in the
+// steady state
+static bool test_mode(short pmu_mode, bool fast_read) {
+  derived_metric_t derived_metrics[1];
+  char error[256];
+  if (compile_derived_metric("switches_per_ms",
+                             "1000000*{perf::CONTEXT-SWITCHES:u}/"
+                             "{perf::TASK-CLOCK:u}",
+                             events, NULL, 4, &derived_metrics[0], error,
+                             sizeof(error)) == -1) {
+    printf("cannot compile the derived metric: %s\n", error);
+    return false;
+  }
+
+  hardware_info_t hardware_info;
+  memset(&hardware_info, 0, sizeof(hardware_info));
+  hardware_info.num_of_events = 4;
+  hardware_info.num_of_derived_metrics = 1;
+  hardware_info.pmu_mode = pmu_mode;
+  hardware_info.pmu_rotation = true;
+  hardware_info.pmu_counters = 2;
+  hardware_info.pmu_fast_read = fast_read;
+  init_pmu_sample(&hardware_info, events, derived_metrics);
+
+  // This process, with this thread, is the only filtered process
+  unsigned int thread_id = gettid();
+  process_intermediate_t process_i;
+  process_external_t process_e;
+  memset(&process_i, 0, sizeof(process_i));
+  memset(&process_e, 0, sizeof(process_e));
+  process_i.child_thread_ids = &thread_id;
+  process_i.child_thread_ids_size = 1;
+  process_e.process_id = getpid();
+  process_list_t process_list;
+  memset(&process_list, 0, sizeof(process_list));
+  process_list.processes_i = &process_i;
+  process_list.processes_e = &process_e;
+  process_list.capacity = 1;
+  process_list.size = 1;
+
+  // And its cgroup is the only recorded cgroup
+  cgroup_external_t cgroup_e;
+  memset(&cgroup_e, 0, sizeof(cgroup_e));
+  int dir_fd = open_own_cgroup();
+  cgroup_list_t cgroup_list;
+  cgroup_list.cgroups_e = &cgroup_e;
+  cgroup_list.dir_fds = &dir_fd;
+  cgroup_list.size = pmu_mode == PMU_MODE_PER_CGROUP ? 1 : 0;
+
+  unsigned long long task_clock = 0;
+  unsigned long long deadline_ns = get_time_ns(CLOCK_MONOTONIC);
+  int interval;
+  for (interval = 0; interval < WARM_UP_INTERVALS + TEST_INTERVALS;
+       interval++) {
+    counting = interval >= WARM_UP_INTERVALS;
+    deadline_ns += INTERVAL_NS;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000ULL;
+    deadline.tv_nsec = deadline_ns % 1000000000ULL;
+    get_pmu_sample(&process_list, &cgroup_list, &deadline, &hardware_info);
+    counting = false;
+
+    unsigned long long* row =
+        pmu_mode == PMU_MODE_PER_THREAD ? hardware_info.pmu_info[0] :
+        pmu_mode == PMU_MODE_PER_CPU    ? hardware_info.pmu_core_info[0] :
+                                          hardware_info.pmu_cgroup_info[0];
+    task_clock += row[0];
+  }
+  clean_pmu_sample();
+  if (dir_fd != -1) {
+    close(dir_fd);
+  }
+
+  printf("%-10s: %lu allocations in %d intervals, task clock %llu ns%s\n",
+         mode_names[pmu_mode], num_of_allocations, TEST_INTERVALS,
+         task_clock, fast_read ? ", fast read" : "");
+  // The events must have been counted, or nothing has been tested
+  bool passed = num_of_allocations == 0 && task_clock > 0;
+  num_of_allocations = 0;
+  return passed;
+}
+
+int main(void) {
+  if (!can_open_events(false)) {
+    printf("skipped: cannot open any perf events\n");
+    return SKIPPED_EXIT_CODE;
+  }
+
+  bool passed = test_mode(PMU_MODE_PER_THREAD, false);
+  if (!can_open_events(true)) {
+    printf("per-cpu   : skipped, root or kernel.perf_event_paranoid <= 0 "
+           "required\n");
+    printf("per-cgroup: skipped, root or kernel.perf_event_paranoid <= 0 "
+           "required\n");
+  } else {
+    passed = test_mode(PMU_MODE_PER_CPU, false) && passed;
+    passed = test_mode(PMU_MODE_PER_CPU, true) && passed;
+    int dir_fd = open_own_cgroup();
+    if (dir_fd == -1) {
+      printf("per-cgroup: skipped, no cgroup2 hierarchy\n");
+    } else {
+      close(dir_fd);
+      passed = test_mode(PMU_MODE_PER_CGROUP, false) && passed;
+    }
+  }
+  printf("%s\n", passed ? "passed" : "FAILED");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/*
+ * Times the PID index of the process lists on a synthetic table of 50k
+ * processes. Two intervals are made up, the second with some of the processes
+ * gone and as many new ones, both in a random order like readdir() may give.
+ * It times filling the current list, find_process() on its own, and the
+ * matching of every process with its previous interval, against the linear
+ * scan the index replaced.
+ *
+ * The index is static to proc_sample.c, which is therefore included here.
+ */
+
+#include "../proc_sample.c"
+
+#include <time.h>
+
+#define NUM_OF_PIDS 50000
+
+// Share of the processes that are replaced in the second interval, in percent
+#define CHURN_PERCENT 5
+
+// Largest PID, which is the default pid_max on 64-bit machines
+#define MAX_PID 4194304
+
+#define REPEATS 20
+
+// Number of lookups of the linear scan, which is too slow for all of them
+#define LINEAR_LOOKUPS 2000
+
+static volatile double sink;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void shuffle(int* pids, int size) {
+  int i;
+  for (i = size - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    int temp = pids[i];
+    pids[i] = pids[j];
+    pids[j] = temp;
+  }
+}
+
+// Fills the list with the given PIDs, in their order
+static void fill_process_list(process_list_t* process_list, const int* pids,
+                              int size, unsigned long cpu_total_time) {
+  reset_process_list(process_list, size);
+  process_list->cpu_total_time = cpu_total_time;
+  int i;
+  for (i = 0; i < size; i++) {
+    memset(&process_list->processes_i[i], 0, sizeof(process_intermediate_t));
+    memset(&process_list->processes_e[i], 0, sizeof(process_external_t));
+    process_list->processes_e[i].process_id = pids[i];
+    process_list->processes_i[i].ttime = pids[i] % 1000 + cpu_total_time;
+    index_process(process_list, pids[i], i);
+    process_list->size++;
+  }
+}
+
+// Matches the processes with their previous interval, like scan_processes()
+static double match_processes(const process_list_t* process_list,
+                              const process_list_t* prev_process_list,
+                              bool linear, int num_of_lookups) {
+  double total = 0.0;
+  int i;
+  for (i = 0; i < num_of_lookups; i++) {
+    int pid = process_list->processes_e[i].process_id;
+    int prev_index = -1;
+    if (linear) {
+      int j;
+      for (j = 0; j < prev_process_list->size; j++) {
+        if (prev_process_list->processes_e[j].process_id == pid) {
+          prev_index = j;
+          break;
+        }
+      }
+    } else {
+      prev_index = find_process(prev_process_list, pid);
+    }
+    if (prev_index != -1) {
+      total += (double)(process_list->processes_i[i].ttime -
+                        prev_process_list->processes_i[prev_index].ttime) /
+               (process_list->cpu_total_time -
+                prev_process_list->cpu_total_time);
+    }
+  }
+  return total;
+}
+
+int main(void) {
+  srand(1);
+
+  // Distinct PIDs for both intervals, the last ones only in the second
+  int num_of_new = NUM_OF_PIDS * CHURN_PERCENT / 100;
+  int num_of_all = NUM_OF_PIDS + num_of_new;
+  char* used = calloc(MAX_PID, 1);
+  int* all_pids = malloc(num_of_all * sizeof(int));
+  int i;
+  for (i = 0; i < num_of_all; i++) {
+    int pid;
+    do {
+      pid = 1 + rand() % (MAX_PID - 1);
+    } while (used[pid]);
+    used[pid] = 1;
+    all_pids[i] = pid;
+  }
+  free(used);
+
+  int* prev_pids = malloc(NUM_OF_PIDS * sizeof(int));
+  int* pids = malloc(NUM_OF_PIDS * sizeof(int));
+  memcpy(prev_pids, all_pids, NUM_OF_PIDS * sizeof(int));
+  memcpy(pids, all_pids + num_of_new, NUM_OF_PIDS * sizeof(int));
+  shuffle(prev_pids, NUM_OF_PIDS);
+  shuffle(pids, NUM_OF_PIDS);
+
+  process_list_t prev_process_list;
+  process_list_t process_list;
+  init_process_list(&prev_process_list);
+  init_process_list(&process_list);
+  fill_process_list(&prev_process_list, prev_pids, NUM_OF_PIDS, 1000);
+
+  // Filling the list, which includes indexing it
+  unsigned long long fill_ns = ~0ULL;
+  int repeat;
+  for (repeat = 0; repeat < REPEATS; repeat++) {
+    unsigned long long start_ns = now_ns();
+    fill_process_list(&process_list, pids, NUM_OF_PIDS, 2000);
+    unsigned long long elapsed_ns = now_ns() - start_ns;
+    fill_ns = elapsed_ns < fill_ns ? elapsed_ns : fill_ns;
+  }
+
+  // find_process() on its own, with as many misses as there are new PIDs
+  unsigned long long find_ns = ~0ULL;
+  int num_of_found = 0;
+  for (repeat = 0; repeat < REPEATS; repeat++) {
+    num_of_found = 0;
+    unsigned long long start_ns = now_ns();
+    for (i = 0; i < NUM_OF_PIDS; i++) {
+      num_of_found += find_process(&prev_process_list, pids[i]) != -1;
+    }
+    unsigned long long elapsed_ns = now_ns() - start_ns;
+    find_ns = elapsed_ns < find_ns ? elapsed_ns : find_ns;
+  }
+  if (num_of_found != NUM_OF_PIDS - num_of_new) {
+    printf("FAILED: found %d of the %d previous processes\n", num_of_found,
+           NUM_OF_PIDS - num_of_new);
+    return 1;
+  }
+
+  // Matching with the previous interval, with the index and without
+  unsigned long long match_ns = ~0ULL;
+  for (repeat = 0; repeat < REPEATS; repeat++) {
+    unsigned long long start_ns = now_ns();
+    sink = match_processes(&process_list, &prev_process_list, false,
+                           NUM_OF_PIDS);
+    unsigned long long elapsed_ns = now_ns() - start_ns;
+    match_ns = elapsed_ns < match_ns ? elapsed_ns : match_ns;
+  }
+  unsigned long long start_ns = now_ns();
+  sink = match_processes(&process_list, &prev_process_list, true,
+                         LINEAR_LOOKUPS);
+  unsigned long long linear_ns = now_ns() - start_ns;
+
+  printf("%d processes, %d%% replaced, index of %zu slots\n", NUM_OF_PIDS,
+         CHURN_PERCENT, process_list.pid_index_size);
+  printf("fill and index:        %8.1f us, %6.1f ns per process\n",
+         fill_ns / 1000.0, (double)fill_ns / NUM_OF_PIDS);
+  printf("find_process:          %8.1f us, %6.1f ns per lookup\n",
+         find_ns / 1000.0, (double)find_ns / NUM_OF_PIDS);
+  printf("match, indexed:        %8.1f us, %6.1f ns per process\n",
+         match_ns / 1000.0, (double)match_ns / NUM_OF_PIDS);
+  printf("match, linear scan:    %8.1f us, %6.1f ns per process "
+         "(estimated from %d)\n",
+         (double)linear_ns * NUM_OF_PIDS / LINEAR_LOOKUPS / 1000.0,
+         (double)linear_ns / LINEAR_LOOKUPS, LINEAR_LOOKUPS);
+
+  clean_process_list(&prev_process_list);
+  clean_process_list(&process_list);
+  free(all_pids);
+  free(prev_pids);
+  free(pids);
+  return 0;
+}
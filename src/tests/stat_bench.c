@@ -0,0 +1,304 @@
+/*
+ *  Copyright (c) 2015, University of Michigan.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+/*
+ * Compares reading /proc/<pid>/stat through procfs_util with the fopen() and
+ * fscanf() path it replaced, over every process of the machine.
+ *
+ * It first checks the parser on command names with spaces and parentheses:
+ * on made up stat lines with known fields, and on child processes that are
+ * given such names with prctl(), whose virtual memory sizes must agree with
+ * their statm files. It fails if any of them is parsed wrongly.
+ */
+
+#include "procfs_util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define ROUNDS 200
+
+#define PARSE_ROUNDS 100000
+
+#define MAX_PIDS 65536
+
+// Number of fields of the made up stat lines
+#define NUM_OF_FIELDS 52
+
+// Command names that break a scanner which splits the line at blanks, or
+// ends the name at the first ')'
+static const char* comms[] = {
+  "nerve", "a b", "a) (b", "x) R 1 2 3", "((", ")", "", "123456789012345",
+};
+
+#define NUM_OF_COMMS (sizeof(comms) / sizeof(comms[0]))
+
+static volatile unsigned long sink;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Value of a numeric field of the made up stat lines
+static long field_value(int field) {
+  return field == 16 ? -16 : field * 1001L;
+}
+
+// The old path, which reads the same fields as parse_proc_stat() but the
+// command name and the processor
+static int scan_old(FILE* fp, proc_stat_t* stat) {
+  int ret = fscanf(fp,
+                   "%*d %*s %c %*d %*d %*d %*d %*d %*u %lu %lu %lu %lu "
+                   "%lu %lu %ld %ld %*d %*d %*d %*d %*u %lu %ld",
+                   &stat->state, &stat->minflt, &stat->cminflt,
+                   &stat->majflt, &stat->cmajflt, &stat->utime, &stat->stime,
+                   &stat->cutime, &stat->cstime, &stat->vsize, &stat->rss);
+  return ret == 11 ? 0 : -1;
+}
+
+static int read_old(int pid, proc_stat_t* stat) {
+  char stat_location[32];
+  sprintf(stat_location, "/proc/%d/stat", pid);
+  FILE* fp = fopen(stat_location, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  int ret = scan_old(fp, stat);
+  fclose(fp);
+  return ret;
+}
+
+// Checks the parsers on made up stat lines. Returns whether the new one got
+// every field right, and counts the lines the old one got wrong.
+static bool test_made_up_lines(int* num_of_old_errors) {
+  bool passed = true;
+  *num_of_old_errors = 0;
+  size_t i;
+  for (i = 0; i < NUM_OF_COMMS; i++) {
+    char line[PROCFS_BUFFER_SIZE];
+    int size = snprintf(line, sizeof(line), "4242 (%s) S", comms[i]);
+    int field;
+    for (field = 4; field <= NUM_OF_FIELDS; field++) {
+      size += snprintf(line + size, sizeof(line) - size, " %ld",
+                       field_value(field));
+    }
+    size += snprintf(line + size, sizeof(line) - size, "\n");
+
+    proc_stat_t stat;
+    memset(&stat, 0, sizeof(stat));
+    if (parse_proc_stat(line, size, &stat) == -1 ||
+        strcmp(stat.comm, comms[i]) != 0 || stat.state != 'S' ||
+        stat.minflt != field_value(10) || stat.cminflt != field_value(11) ||
+        stat.majflt != field_value(12) || stat.cmajflt != field_value(13) ||
+        stat.utime != field_value(14) || stat.stime != field_value(15) ||
+        stat.cutime != field_value(16) || stat.cstime != field_value(17) ||
+        stat.vsize != field_value(23) || stat.rss != field_value(24) ||
+        stat.processor != field_value(39)) {
+      printf("FAILED: misparsed \"%s\"\n", line);
+      passed = false;
+    }
+
+    memset(&stat, 0, sizeof(stat));
+    FILE* fp = fmemopen(line, size, "r");
+    if (scan_old(fp, &stat) == -1 || stat.state != 'S' ||
+        stat.utime != field_value(14) || stat.rss != field_value(24)) {
+      (*num_of_old_errors)++;
+    }
+    fclose(fp);
+  }
+  return passed;
+}
+
+// Checks the parser on child processes named with prctl(). Their virtual
+// memory sizes must agree with their statm files, which have no command name
+// to trip over. The resident sizes are counted per CPU, and may not agree.
+static bool test_named_processes(void) {
+  pid_t pids[NUM_OF_COMMS];
+  int ready[2];
+  if (pipe(ready) == -1) {
+    perror("pipe");
+    return false;
+  }
+  size_t i;
+  for (i = 0; i < NUM_OF_COMMS; i++) {
+    pids[i] = fork();
+    if (pids[i] == 0) {
+      prctl(PR_SET_NAME, comms[i], 0, 0, 0);
+      if (write(ready[1], "", 1) != 1) {
+        _exit(1);
+      }
+      pause();
+      _exit(0);
+    }
+  }
+  for (i = 0; i < NUM_OF_COMMS; i++) {
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+      perror("read");
+    }
+  }
+  close(ready[0]);
+  close(ready[1]);
+
+  bool passed = true;
+  long page_size = sysconf(_SC_PAGESIZE);
+  procfs_t procfs;
+  init_procfs(&procfs, 1);
+  for (i = 0; i < NUM_OF_COMMS; i++) {
+    proc_stat_t stat;
+    char statm_location[32];
+    unsigned long size_pages = 0;
+    sprintf(statm_location, "/proc/%d/statm", pids[i]);
+    FILE* fp = fopen(statm_location, "r");
+    if (fp != NULL) {
+      if (fscanf(fp, "%lu", &size_pages) != 1) {
+        size_pages = 0;
+      }
+      fclose(fp);
+    }
+    if (read_proc_stat(&procfs, pids[i], &stat) == -1 ||
+        strcmp(stat.comm, comms[i]) != 0 || stat.state != 'S' ||
+        stat.vsize != size_pages * page_size) {
+      printf("FAILED: misparsed the stat file of a process named \"%s\"\n",
+             comms[i]);
+      passed = false;
+    }
+  }
+  clean_procfs(&procfs);
+
+  for (i = 0; i < NUM_OF_COMMS; i++) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], NULL, 0);
+  }
+  return passed;
+}
+
+static int list_pids(int* pids) {
+  int num_of_pids = 0;
+  DIR* dir_ptr = opendir("/proc/");
+  struct dirent* dir_entry;
+  while ((dir_entry = readdir(dir_ptr)) != NULL && num_of_pids < MAX_PIDS) {
+    int pid = atoi(dir_entry->d_name);
+    if (pid > 0) {
+      pids[num_of_pids++] = pid;
+    }
+  }
+  closedir(dir_ptr);
+  return num_of_pids;
+}
+
+// Times the parsers alone, on the stat file of this process
+static void bench_parse(void) {
+  char buffer[PROCFS_BUFFER_SIZE];
+  int fd = open("/proc/self/stat", O_RDONLY);
+  ssize_t size = read(fd, buffer, sizeof(buffer));
+  close(fd);
+
+  proc_stat_t stat;
+  int round;
+  unsigned long long start_ns = now_ns();
+  for (round = 0; round < PARSE_ROUNDS; round++) {
+    parse_proc_stat(buffer, size, &stat);
+    sink += stat.utime;
+  }
+  unsigned long long new_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (round = 0; round < PARSE_ROUNDS; round++) {
+    FILE* fp = fmemopen(buffer, size, "r");
+    scan_old(fp, &stat);
+    fclose(fp);
+    sink += stat.utime;
+  }
+  unsigned long long old_ns = now_ns() - start_ns;
+
+  printf("parse only, hand-rolled scanner:   %7.3f us per line\n",
+         new_ns / 1000.0 / PARSE_ROUNDS);
+  printf("parse only, fmemopen and fscanf:   %7.3f us per line\n",
+         old_ns / 1000.0 / PARSE_ROUNDS);
+}
+
+int main(void) {
+  int num_of_old_errors;
+  bool passed = test_made_up_lines(&num_of_old_errors);
+  passed = test_named_processes() && passed;
+  printf("parser: %s, the old scanner misparsed %d of %zu lines\n",
+         passed ? "passed" : "FAILED", num_of_old_errors, NUM_OF_COMMS);
+  if (!passed) {
+    return 1;
+  }
+
+  int* pids = malloc(MAX_PIDS * sizeof(int));
+  int num_of_pids = list_pids(pids);
+  proc_stat_t stat;
+  int round;
+  int i;
+
+  unsigned long long start_ns = now_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < num_of_pids; i++) {
+      if (read_old(pids[i], &stat) == 0) {
+        sink += stat.utime;
+      }
+    }
+  }
+  unsigned long long old_ns = now_ns() - start_ns;
+
+  start_ns = now_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < num_of_pids; i++) {
+      if (read_task_stat(pids[i], pids[i], &stat) == 0) {
+        sink += stat.utime;
+      }
+    }
+  }
+  unsigned long long uncached_ns = now_ns() - start_ns;
+
+  // The first round opens the files, like the first interval does
+  procfs_t procfs;
+  init_procfs(&procfs, 1);
+  for (i = 0; i < num_of_pids; i++) {
+    read_proc_stat(&procfs, pids[i], &stat);
+  }
+  start_ns = now_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < num_of_pids; i++) {
+      if (read_proc_stat(&procfs, pids[i], &stat) == 0) {
+        sink += stat.utime;
+      }
+    }
+    evict_procfs(&procfs);
+  }
+  unsigned long long cached_ns = now_ns() - start_ns;
+  clean_procfs(&procfs);
+
+  double reads = (double)num_of_pids * ROUNDS;
+  printf("%d processes, %d rounds\n", num_of_pids, ROUNDS);
+  printf("fopen, fscanf and fclose:          %7.3f us per process\n",
+         old_ns / 1000.0 / reads);
+  printf("open, pread and close:             %7.3f us per process\n",
+         uncached_ns / 1000.0 / reads);
+  printf("pread on a kept descriptor:        %7.3f us per process\n",
+         cached_ns / 1000.0 / reads);
+  bench_parse();
+  free(pids);
+  return 0;
+}